@@ -543,6 +543,9 @@ extern int mem_prealloc;
 #define TLB_NOTDIRTY    (1 << 4)
 /* Set if TLB entry is an IO callback.  */
 #define TLB_MMIO        (1 << 5)
+/* PANDA: set if a memory callback watch covers the page, so that accesses
+   leave the fast path for the _mmu_panda helpers.  Otherwise plain RAM.  */
+#define TLB_PANDA_WATCH (1 << 6)
 
 #define VGA_DIRTY_FLAG       0x01
 #define CODE_DIRTY_FLAG      0x02
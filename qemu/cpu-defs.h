@@ -221,6 +221,8 @@ typedef struct CPUWatchpoint {
     int kvm_vcpu_dirty;                                                 \
     /* record and replay */                                             \
     uint64_t rr_guest_instr_count;                                      \
+    /* instructions chained TBs may still run during replay */          \
+    int32_t rr_chain_budget;                                            \
     uint64_t rr_guest_pc;                                               \
     uint64_t panda_guest_pc;
 
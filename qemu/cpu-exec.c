@@ -48,6 +48,10 @@ int execute_llvm = 0;
 // running more than once
 bool bb_invalidate_done = false;
 
+// -llvm-trace: after_block_exec already ran for the block a trace stopped
+// after (see cpu_llvm_trace_step)
+static bool trace_after_block_done = false;
+
 #ifdef CONFIG_SOFTMMU
 // TRL 0810 record replay stuff 
 #include "rr_log.h"
@@ -177,14 +181,19 @@ static TranslationBlock *tb_find_slow(CPUState *env,
  not_found:
    /* if no translated code available, then translate it now */
 
-    for(plist = panda_cbs[PANDA_CB_BEFORE_BLOCK_TRANSLATE]; plist != NULL; plist = panda_cb_list_next(plist)) {
-        plist->entry.before_block_translate(env, pc);
+    // PANDA: blocks out of the instrumentation scope get no callbacks
+    if (!(flags & PANDA_TB_SCOPE_MASK)) {
+        for(plist = panda_cbs[PANDA_CB_BEFORE_BLOCK_TRANSLATE]; plist != NULL; plist = panda_cb_list_next(plist)) {
+            plist->entry.before_block_translate(env, pc);
+        }
     }
 
     tb = tb_gen_code(env, pc, cs_base, flags, 0);
 
-    for(plist = panda_cbs[PANDA_CB_AFTER_BLOCK_TRANSLATE]; plist != NULL; plist = panda_cb_list_next(plist)) {
-        plist->entry.after_block_translate(env, tb);
+    if (panda_tb_instrumented(tb)) {
+        for(plist = panda_cbs[PANDA_CB_AFTER_BLOCK_TRANSLATE]; plist != NULL; plist = panda_cb_list_next(plist)) {
+            plist->entry.after_block_translate(env, tb);
+        }
     }
 
  found:
@@ -204,19 +213,38 @@ static inline TranslationBlock *tb_find_fast(CPUState *env)
     TranslationBlock *tb;
     target_ulong cs_base, pc;
     int flags;
+    uint64_t tb_flags;
 
     /* we record a subset of the CPU state. It will
        always be the same before a given translated block
        is executed. */
     cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+    /* PANDA: plus whether the block is in the instrumentation scope (see
+       tb_gen_code) */
+    tb_flags = (uint32_t)flags | panda_tb_scope(env, pc);
     tb = env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
     if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base ||
-                 tb->flags != flags)) {
-        tb = tb_find_slow(env, pc, cs_base, flags);
+                 tb->flags != tb_flags)) {
+        tb = tb_find_slow(env, pc, cs_base, tb_flags);
     }
     return tb;
 }
 
+// PANDA: only chain TBs on the same side of the instrumentation scope, so
+// that uninstrumented code never runs straight into instrumented code.
+static inline bool panda_tb_same_scope(unsigned long next_tb, TranslationBlock *tb)
+{
+    TranslationBlock *prev = (TranslationBlock *)(next_tb & ~3);
+#if defined(CONFIG_LLVM)
+    // The TCG code of a block that runs in LLVM (or will, with
+    // -llvm-tiered) must only be entered from here
+    if (execute_llvm && panda_tb_instrumented(tb)) {
+        return false;
+    }
+#endif
+    return ((prev->flags ^ tb->flags) & PANDA_TB_SCOPE_MASK) == 0;
+}
+
 static CPUDebugExcpHandler *debug_excp_handler;
 
 CPUDebugExcpHandler *cpu_set_debug_excp_handler(CPUDebugExcpHandler *handler)
@@ -260,13 +288,125 @@ void rr_quit_cpu_loop(void) {
     }
 }
 
+void rr_chain_break(void) {
+    if (cpu_single_env) {
+        cpu_single_env->rr_chain_budget = 0;
+    }
+}
+
+//mz TBs chained during replay bypass the top of the cpu_exec loop, so only
+//mz chain when no plugin needs to see every block.
+static bool rr_replay_chained = false;
+
+static bool rr_replay_chain_ok(void) {
+    return rr_replay_chaining && panda_tb_chaining &&
+        panda_cbs[PANDA_CB_BEFORE_BLOCK_EXEC] == NULL &&
+        panda_cbs[PANDA_CB_AFTER_BLOCK_EXEC] == NULL &&
+        panda_cbs[PANDA_CB_BEFORE_BLOCK_EXEC_INVALIDATE_OPT] == NULL;
+}
+
+//mz how many instructions chained TBs may run, starting with tb, before
+//mz coming back here: up to the next log entry that has to be handled at
+//mz the top of the loop, or the next checkpoint or -replay-until.  tb itself
+//mz always gets to run; the retranslation in cpu_exec already keeps it from
+//mz running into the next interrupt.
+static void rr_set_chain_budget(CPUState *env, TranslationBlock *tb) {
+    uint64_t count = env->rr_guest_instr_count;
+    uint64_t budget = rr_num_instr_before_next_interrupt;
+
+    if (rr_next_checkpoint - count < budget) {
+        budget = rr_next_checkpoint - count;
+    }
+    if (rr_replay_until && rr_replay_until - count < budget) {
+        budget = rr_replay_until - count;
+    }
+    if (budget < tb->icount) {
+        budget = tb->icount;
+    }
+    if (budget > INT32_MAX) {
+        budget = INT32_MAX;
+    }
+    env->rr_chain_budget = budget;
+}
+
 
 void rr_clear_rr_guest_instr_count(CPUState *cpu_state) {
   cpu_state->rr_guest_instr_count = 0;
 }
+
+void rr_set_rr_guest_instr_count(CPUState *cpu_state, uint64_t guest_instr_count) {
+  cpu_state->rr_guest_instr_count = guest_instr_count;
+}
 #endif
 
 
+#if defined(CONFIG_LLVM)
+// PANDA: with -llvm-trace, a trace calls this where one of its blocks jumps
+// straight to the next one, tb, to do what going around the loop in
+// cpu_exec would do in between.  Stopping is always safe: the trace then
+// returns next_tb, as the block would have on its own.  Going on is only
+// safe if cpu_exec would have found tb and run it right away.
+int cpu_llvm_trace_step(uintptr_t next_tb, TranslationBlock *tb)
+{
+    CPUState *env = cpu_single_env;
+    TranslationBlock *prev = (TranslationBlock *)(next_tb & ~3);
+    target_ulong pc, cs_base;
+    int flags;
+    panda_cb_list *plist;
+    bool panda_invalidate_tb = false;
+
+    for(plist = panda_cbs[PANDA_CB_AFTER_BLOCK_EXEC]; plist != NULL;
+            plist = panda_cb_list_next(plist)) {
+        plist->entry.after_block_exec(env, prev, prev);
+    }
+    trace_after_block_done = true;
+
+    // the top of the cpu_exec loop has something to do
+    if (exit_request || env->exit_request || env->interrupt_request ||
+            env->singlestep_enabled || !execute_llvm ||
+            panda_plugin_to_unload || panda_please_flush_tb) {
+        return 0;
+    }
+#ifdef CONFIG_SOFTMMU
+    // without replay chaining, blocks don't keep to env->rr_chain_budget
+    if (rr_in_replay() && (!rr_replay_chaining || rr_replay_finished())) {
+        return 0;
+    }
+#endif
+
+    // tb_find_fast would find tb
+    cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+    if (tb->llvm_invalid || tb->pc != pc || tb->cs_base != cs_base ||
+            tb->flags != ((uint32_t)flags | panda_tb_scope(env, pc))) {
+        return 0;
+    }
+
+    for(plist = panda_cbs[PANDA_CB_BEFORE_BLOCK_EXEC_INVALIDATE_OPT];
+            plist != NULL; plist = panda_cb_list_next(plist)) {
+        panda_invalidate_tb |=
+            plist->entry.before_block_exec_invalidate_opt(env, tb);
+    }
+    if (panda_invalidate_tb) {
+        // cpu_exec translates it again, without asking a second time
+        invalidate_single_tb(env, tb->pc);
+        bb_invalidate_done = true;
+        return 0;
+    }
+
+    env->current_tb = tb;
+    tcg_llvm_runtime.last_tb = tb;
+#ifdef CONFIG_SOFTMMU
+    rr_set_program_point();
+#endif
+    for(plist = panda_cbs[PANDA_CB_BEFORE_BLOCK_EXEC]; plist != NULL;
+            plist = panda_cb_list_next(plist)) {
+        plist->entry.before_block_exec(env, tb);
+    }
+    trace_after_block_done = false;
+    return 1;
+}
+#endif
+
 /* main execution loop */
 
 volatile sig_atomic_t exit_request;
@@ -385,6 +525,23 @@ int cpu_exec(CPUState *env)
             next_tb = 0; /* force lookup of first TB */
             for(;;) {
 #ifdef CONFIG_SOFTMMU
+                //mz Reached the end of a bounded replay (-replay-until).
+                if (rr_in_replay() && rr_replay_until &&
+                        env->rr_guest_instr_count >= rr_replay_until) {
+                    rr_end_replay_requested = 1;
+                    env->exception_index = EXCP_INTERRUPT;
+                    cpu_loop_exit(env);
+                }
+
+                //mz Reached a checkpoint boundary.  Get out to the main loop
+                //mz before touching the log so it can save one.  A replay
+                //mz resumed from it re-enters cpu_exec right here.
+                if (rr_in_replay() && env->rr_guest_instr_count >= rr_next_checkpoint) {
+                    rr_checkpoint_requested = 1;
+                    env->exception_index = EXCP_INTERRUPT;
+                    cpu_loop_exit(env);
+                }
+
                 //bdg Replay skipped calls from the I/O thread here
                 if(rr_in_replay()) {
                     rr_skipped_callsite_location = RR_CALLSITE_MAIN_LOOP_WAIT;
@@ -733,6 +890,16 @@ int cpu_exec(CPUState *env)
                     tb_invalidated_flag = 1;
                 }
 
+#ifdef CONFIG_SOFTMMU
+                //mz a plugin now wants to see every block (say, one loaded
+                //mz from the monitor), so the replay chains have to go
+                if (rr_replay_chained && !rr_replay_chain_ok()) {
+                    rr_replay_chained = false;
+                    tb_flush(env);
+                    tb_invalidated_flag = 1;
+                }
+#endif
+
                 spin_lock(&tb_lock);
 
                 //bdg WARNING! This can cause an exception
@@ -755,7 +922,8 @@ int cpu_exec(CPUState *env)
                 // will get cleared when we actually get to execute the basic block.
                 panda_cb_list *plist;
                 bool panda_invalidate_tb = false;
-                if (unlikely(!bb_invalidate_done)) {
+                bool panda_instrumented = panda_tb_instrumented(tb);
+                if (unlikely(!bb_invalidate_done) && panda_instrumented) {
                     for(plist = panda_cbs[PANDA_CB_BEFORE_BLOCK_EXEC_INVALIDATE_OPT];
                             plist != NULL; plist = panda_cb_list_next(plist)) {
                         panda_invalidate_tb |=
@@ -797,23 +965,44 @@ int cpu_exec(CPUState *env)
                 // (T0 & ~3) contains pointer to previous translation block.
                 // (T0 & 3) contains info about which branch we took (why 2 bits?)
                 // tb is current translation block.  
+                //mz in replay, chained TBs keep to env->rr_chain_budget (see
+                // gen_rr_budget_start) so they come back here in time for
+                // the next interrupt or skipped call.
 #ifdef CONFIG_SOFTMMU
                 if (rr_mode != RR_REPLAY){
 #endif
-                    if ((panda_tb_chaining == true)){
-                        if (next_tb != 0 && tb->page_addr[1] == -1) {
+                    // PANDA: uninstrumented TBs have no callbacks to miss,
+                    // so they stay chained either way
+                    if ((panda_tb_chaining == true) || !panda_instrumented){
+                        if (next_tb != 0 && tb->page_addr[1] == -1 &&
+                                panda_tb_same_scope(next_tb, tb)) {
                             tb_add_jump((TranslationBlock *)(next_tb & ~3), next_tb & 3, tb);
                         }
                     }
 #ifdef CONFIG_SOFTMMU
                 }
+                else if (rr_replay_chain_ok() ||
+                        (rr_replay_chaining && !panda_instrumented)) {
+                    if (next_tb != 0 && tb->page_addr[1] == -1 &&
+                            panda_tb_same_scope(next_tb, tb)) {
+                        tb_add_jump((TranslationBlock *)(next_tb & ~3), next_tb & 3, tb);
+                        if (panda_instrumented) {
+                            rr_replay_chained = true;
+                        }
+                    }
+                }
 #endif
-                else {
-                  /*
-                    TRL In 0.9.1, here, in the else branch, we BREAK_CHAIN.
-                    There appears to be no equivalent in 1.0.1.  :<
-                  */
+
+#if defined(CONFIG_LLVM)
+                // PANDA: LLVM blocks never chain, but -llvm-trace keeps
+                // track of the direct jumps between them
+                if (tcg_llvm_trace_threshold && execute_llvm &&
+                        panda_instrumented && next_tb != 0 &&
+                        (next_tb & 3) < 2) {
+                    tcg_llvm_trace_link((TranslationBlock *)(next_tb & ~3),
+                            next_tb & 3, tb);
                 }
+#endif
 
                 spin_unlock(&tb_lock);	       
 
@@ -869,16 +1058,31 @@ int cpu_exec(CPUState *env)
                         // this block. Clear the before_bb_invalidate_opt flag
                         bb_invalidate_done = false;
 
+#ifdef CONFIG_SOFTMMU
+                        if (rr_in_replay()) {
+                            rr_set_chain_budget(env, tb);
+                        }
+#endif
+
                         // PANDA instrumentation: before basic block exec
-                        for(plist = panda_cbs[PANDA_CB_BEFORE_BLOCK_EXEC];
+                        for(plist = panda_instrumented ? panda_cbs[PANDA_CB_BEFORE_BLOCK_EXEC] : NULL;
                                 plist != NULL; plist = panda_cb_list_next(plist)) {
                             plist->entry.before_block_exec(env, tb);
                         }
 
 #if defined(CONFIG_LLVM)
-                        if(execute_llvm) {
-                            assert(tb->llvm_tc_ptr);
+                        if(execute_llvm && panda_instrumented &&
+                                !tb->llvm_tc_ptr) {
+                            // -llvm-tiered: not hot yet, or still being
+                            // compiled (may compile it right now)
+                            assert(tcg_llvm_tiered_threshold);
+                            tcg_llvm_tb_ran_on_tcg(tb);
+                        }
+                        if(execute_llvm && panda_instrumented &&
+                                tb->llvm_tc_ptr) {
                             next_tb = tcg_llvm_qemu_tb_exec(env, tb);
+                            // the last block of a trace
+                            tb = tcg_llvm_runtime.last_tb;
                         } else {
                             assert(tc_ptr);
                             next_tb = tcg_qemu_tb_exec(env, tc_ptr);
@@ -887,9 +1091,23 @@ int cpu_exec(CPUState *env)
                         next_tb = tcg_qemu_tb_exec(env, tc_ptr);
 #endif
 
-                        for(plist = panda_cbs[PANDA_CB_AFTER_BLOCK_EXEC]; plist != NULL; plist = panda_cb_list_next(plist)) {
+                        for(plist = (panda_instrumented && !trace_after_block_done) ?
+                                panda_cbs[PANDA_CB_AFTER_BLOCK_EXEC] : NULL;
+                                plist != NULL; plist = panda_cb_list_next(plist)) {
                             plist->entry.after_block_exec(env, tb, (TranslationBlock *)(next_tb & ~3));
                         }
+                        trace_after_block_done = false;
+
+#ifdef CONFIG_SOFTMMU
+                        if ((next_tb & 3) == 3) {
+                            //mz a chained TB found the replay budget used
+                            //mz up and left without running.  the jump into
+                            //mz it skipped setting the PC, so do that here.
+                            tb = (TranslationBlock *)(long)(next_tb & ~3);
+                            cpu_pc_from_tb(env, tb);
+                            next_tb = 0;
+                        }
+#endif
 
                         if ((next_tb & 3) == 2) {
                             /* Instruction counter expired.  */
@@ -142,6 +142,7 @@ void tlb_set_page(CPUState *env, target_ulong vaddr,
 #ifdef CONFIG_LLVM
 struct TCGLLVMTranslationBlock;
 struct TCGLLVMContext;
+struct TCGLLVMTrace;
 #ifdef __cplusplus
 namespace llvm { class Function; }
 using llvm::Function;
@@ -198,6 +199,20 @@ struct TranslationBlock {
     uint8_t *llvm_tc_ptr;
     uint8_t *llvm_tc_end;
     struct TranslationBlock* llvm_tb_next[2];
+    /* runs on TCG so far, with -llvm-tiered */
+    uint32_t llvm_exec_count;
+    /* -llvm-cache key for llvm_function, and where it stands with the
+       cache (TCG_LLVM_CACHE_* in tcg-llvm.cpp) */
+    uint64_t llvm_cache_key[2];
+    uint8_t llvm_cache_state;
+    /* -llvm-trace: the trace this block heads, how many times it has
+       jumped straight to another LLVM block, through which of its exits
+       it did so last (llvm_tb_next has where to), and whether it has been
+       invalidated */
+    struct TCGLLVMTrace *llvm_trace;
+    uint32_t llvm_trace_count;
+    uint8_t llvm_trace_exit;
+    uint8_t llvm_invalid;
 #endif
 
 };
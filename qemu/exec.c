@@ -80,6 +80,9 @@
 //#include "tcg-llvm.h"
 void tcg_llvm_tb_alloc(TranslationBlock *tb);
 void tcg_llvm_tb_free(struct TranslationBlock *tb);
+void tcg_llvm_tb_invalidate(struct TranslationBlock *tb);
+TranslationBlock *tcg_llvm_trace_find_pc(uintptr_t tc_ptr);
+void tcg_llvm_dump_info(FILE *f, fprintf_function cpu_fprintf);
 #endif
 
 //#define DEBUG_TB_INVALIDATE
@@ -920,6 +923,11 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     tb_page_addr_t phys_pc;
     TranslationBlock *tb1, *tb2;
 
+#ifdef CONFIG_LLVM
+    /* no trace may run into it any more */
+    tcg_llvm_tb_invalidate(tb);
+#endif
+
     /* remove the TB from the hash list */
     phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
     h = tb_phys_hash_func(phys_pc);
@@ -1046,9 +1054,13 @@ TranslationBlock *tb_gen_code(CPUState *env,
     tc_ptr = code_gen_ptr;
     tb->tc_ptr = tc_ptr;
     tb->cs_base = cs_base;
-    tb->flags = flags;
+    /* PANDA: every way of making a TB comes through here, so work out
+       whether it gets instrumented here too.  */
+    tb->flags = (uint32_t)flags | panda_tb_scope(env, pc);
     tb->cflags = cflags;
+    panda_tb_in_scope = panda_tb_instrumented(tb);
     cpu_gen_code(env, tb, &code_gen_size);
+    panda_tb_in_scope = true;
     code_gen_ptr = (void *)(((unsigned long)code_gen_ptr + code_gen_size + CODE_GEN_ALIGN - 1) & ~(CODE_GEN_ALIGN - 1));
 
     /* check next page if needed */
@@ -1381,16 +1393,22 @@ TranslationBlock *tb_find_pc(unsigned long tc_ptr)
         return NULL;
 
 #if defined(CONFIG_LLVM)
+    // PANDA: blocks out of scope, and with -llvm-tiered blocks that aren't
+    // compiled yet, run TCG code even with execute_llvm
     if(execute_llvm) {
+        // -llvm-trace: the block the running trace is in
+        tb = tcg_llvm_trace_find_pc(tc_ptr);
+        if (tb)
+            return tb;
         for(m=0; m<nb_tbs; m++) {
             tb = &tbs[m];
-            if(tb->llvm_function) {
+            if(tb->llvm_function && tb->llvm_tc_ptr) {
+                smp_rmb();
                 if(tc_ptr >= (uintptr_t) tb->llvm_tc_ptr &&
                    tc_ptr <  (uintptr_t) tb->llvm_tc_end)
                     return tb;
             }
         }
-        return NULL;
     }
 #endif
 
@@ -2184,10 +2202,11 @@ static inline void tlb_reset_dirty_range(CPUTLBEntry *tlb_entry,
                                          unsigned long start, unsigned long length)
 {
     unsigned long addr;
-    if ((tlb_entry->addr_write & ~TARGET_PAGE_MASK) == IO_MEM_RAM) {
+    if ((tlb_entry->addr_write & ~(TARGET_PAGE_MASK | TLB_PANDA_WATCH)) == IO_MEM_RAM) {
         addr = (tlb_entry->addr_write & TARGET_PAGE_MASK) + tlb_entry->addend;
         if ((addr - start) < length) {
-            tlb_entry->addr_write = (tlb_entry->addr_write & TARGET_PAGE_MASK) | TLB_NOTDIRTY;
+            tlb_entry->addr_write = (tlb_entry->addr_write &
+                (TARGET_PAGE_MASK | TLB_PANDA_WATCH)) | TLB_NOTDIRTY;
         }
     }
 }
@@ -2293,7 +2312,7 @@ static inline void tlb_update_dirty(CPUTLBEntry *tlb_entry)
     fprintf(logfile, "cpu_tlb_update_dirty:\n");
 #endif
 
-    if ((tlb_entry->addr_write & ~TARGET_PAGE_MASK) == IO_MEM_RAM) {
+    if ((tlb_entry->addr_write & ~(TARGET_PAGE_MASK | TLB_PANDA_WATCH)) == IO_MEM_RAM) {
         p = (void *)(unsigned long)((tlb_entry->addr_write & TARGET_PAGE_MASK)
             + tlb_entry->addend);
         ram_addr = qemu_ram_addr_from_host_nofail(p);
@@ -2316,8 +2335,8 @@ void cpu_tlb_update_dirty(CPUState *env)
 
 static inline void tlb_set_dirty1(CPUTLBEntry *tlb_entry, target_ulong vaddr)
 {
-    if (tlb_entry->addr_write == (vaddr | TLB_NOTDIRTY))
-        tlb_entry->addr_write = vaddr;
+    if ((tlb_entry->addr_write & ~TLB_PANDA_WATCH) == (vaddr | TLB_NOTDIRTY))
+        tlb_entry->addr_write &= ~TLB_NOTDIRTY;
 }
 
 /* update the TLB corresponding to virtual page vaddr
@@ -2435,6 +2454,12 @@ void tlb_set_page(CPUState *env, target_ulong vaddr,
         }
     }
 
+    /* PANDA: likewise send accesses to pages with memory callback watches
+       to the _mmu_panda helpers.  */
+    if (panda_memcb_num_watches && panda_memcb_page_watched(env, vaddr, paddr)) {
+        address |= TLB_PANDA_WATCH;
+    }
+
     index = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     env->iotlb[mmu_idx][index] = iotlb - vaddr;
     te = &env->tlb_table[mmu_idx][index];
@@ -5084,6 +5109,57 @@ int panda_virtual_memory_rw(CPUState *env, target_ulong addr,
     return 0;
 }
 
+/* PANDA: read guest code through the code TLB, which the translator has
+   just filled for the page it is translating, rather than walking the
+   page tables again.  Anything not in the TLB as plain RAM goes through
+   panda_virtual_memory_rw.  */
+int panda_read_code(CPUState *env, target_ulong pc, uint8_t *buf, int len)
+{
+    int mmu_idx = cpu_mmu_index(env);
+    int l, index;
+    target_ulong page;
+    CPUTLBEntry *te;
+
+    while (len > 0) {
+        page = pc & TARGET_PAGE_MASK;
+        l = (page + TARGET_PAGE_SIZE) - pc;
+        if (l > len)
+            l = len;
+        index = (pc >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+        te = &env->tlb_table[mmu_idx][index];
+        if (te->addr_code == page) {
+            memcpy(buf, (void *)(uintptr_t)(pc + te->addend), l);
+        } else if (panda_virtual_memory_rw(env, pc, buf, l, 0) < 0) {
+            return -1;
+        }
+        len -= l;
+        buf += l;
+        pc += l;
+    }
+    return 0;
+}
+
+/* PANDA: throw away translations of the code at pc, the way setting a
+   breakpoint there does, so the next time it runs INSN_TRANSLATE
+   callbacks get to look at it again.  */
+void panda_invalidate_tb_at(CPUState *env, target_ulong pc)
+{
+    target_phys_addr_t addr;
+    target_ulong pd;
+    ram_addr_t ram_addr;
+    PhysPageDesc *p;
+
+    addr = cpu_get_phys_page_debug(env, pc);
+    if (addr == -1)
+        return;
+    p = phys_page_find(addr >> TARGET_PAGE_BITS);
+    if (!p)
+        return;
+    pd = p->phys_offset;
+    ram_addr = (pd & TARGET_PAGE_MASK) | (pc & ~TARGET_PAGE_MASK);
+    tb_invalidate_phys_page_range(ram_addr, ram_addr + 1, 0);
+}
+
 #endif
 
 /* in deterministic execution mode, instructions doing device I/Os
@@ -5206,6 +5282,11 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
     cpu_fprintf(f, "TB invalidate count %d\n", tb_phys_invalidate_count);
     cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
     tcg_dump_info(f, cpu_fprintf);
+#if defined(CONFIG_LLVM)
+    if (execute_llvm) {
+        tcg_llvm_dump_info(f, cpu_fprintf);
+    }
+#endif
 }
 
 #define MMUSUFFIX _cmmu
@@ -5,10 +5,56 @@
 static TCGArg *icount_arg;
 static int icount_label;
 
+#ifdef CONFIG_SOFTMMU
+#include "rr_log_all.h"
+
+/* Replay with TB chaining: take the TB's length out of rr_chain_budget
+   before running it, and leave the chain (returning tb + 3, nothing run)
+   if that would take it below zero.  cpu_exec sets the budget so this
+   happens right where the next log entry has to be handled.  */
+static TCGArg *rr_budget_arg;
+static int rr_budget_label;
+static int rr_budget_gen;
+
+static inline void gen_rr_budget_start(void)
+{
+    TCGv_i32 budget;
+
+    rr_budget_gen = rr_in_replay() && rr_replay_chaining;
+    if (!rr_budget_gen)
+        return;
+
+    rr_budget_label = gen_new_label();
+    budget = tcg_temp_local_new_i32();
+    tcg_gen_ld_i32(budget, cpu_env, offsetof(CPUState, rr_chain_budget));
+    /* Same hack as icount_arg.  */
+    rr_budget_arg = gen_opparam_ptr + 1;
+    tcg_gen_subi_i32(budget, budget, 0xdeadbeef);
+
+    tcg_gen_brcondi_i32(TCG_COND_LT, budget, 0, rr_budget_label);
+    tcg_gen_st_i32(budget, cpu_env, offsetof(CPUState, rr_chain_budget));
+    tcg_temp_free_i32(budget);
+}
+
+static void gen_rr_budget_end(TranslationBlock *tb, int num_insns)
+{
+    if (rr_budget_gen) {
+        *rr_budget_arg = num_insns;
+        gen_set_label(rr_budget_label);
+        tcg_gen_exit_tb((tcg_target_long)tb + 3);
+    }
+}
+#else
+static inline void gen_rr_budget_start(void) { }
+static inline void gen_rr_budget_end(TranslationBlock *tb, int num_insns) { }
+#endif
+
 static inline void gen_icount_start(void)
 {
     TCGv_i32 count;
 
+    gen_rr_budget_start();
+
     if (!use_icount)
         return;
 
@@ -31,6 +77,7 @@ static void gen_icount_end(TranslationBlock *tb, int num_insns)
         gen_set_label(icount_label);
         tcg_gen_exit_tb((tcg_target_long)tb + 2);
     }
+    gen_rr_budget_end(tb, num_insns);
 }
 
 static inline void gen_io_start(void)
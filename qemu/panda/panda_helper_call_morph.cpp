@@ -135,9 +135,13 @@ extern const char *qemu_loc;
  */
 void init_llvm_helpers(){
     assert(tcg_llvm_ctx);
+    // Keep the compile thread (-llvm-tiered) off the module while we link
+    tcg_llvm_ctx->lock();
     llvm::ExecutionEngine *ee = tcg_llvm_ctx->getExecutionEngine();
     assert(ee);
-    llvm::FunctionPassManager *fpm = tcg_llvm_ctx->getFunctionPassManager();
+    // Morphed helper calls do the same thing as the native ones
+    llvm::FunctionPassManager *fpm =
+        tcg_llvm_ctx->getFunctionPassManager(false);
     assert(fpm);
     llvm::Module *mod = tcg_llvm_ctx->getModule();
     assert(mod);
@@ -174,6 +178,12 @@ void init_llvm_helpers(){
     // Create call morph pass and add to function pass manager
     llvm::FunctionPass *fp = new llvm::PandaCallMorphFunctionPass();
     fpm->add(fp);
+
+    // Morphed calls go to the helpers linked in above by name, so cached
+    // blocks stay good as long as they come from the same bitcode file
+    tcg_llvm_cache_add_config("helper_call_morph", bitcode.c_str(),
+            bitcode.size());
+    tcg_llvm_ctx->unlock();
 }
 
 /*
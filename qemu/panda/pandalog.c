@@ -8,9 +8,89 @@
 #include "pandalog.pb-c.h"
 #include "pandalog.h"
 #include <zlib.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
-gzFile pandalog_file = 0;
+/* Pandalog v2 file layout (all integers host-endian):
+
+     PL_file_header       magic "PANDALG2", version, chunk size
+     chunk 0              PL_chunk_header + zlib-compressed entries
+     chunk 1 ...
+     PL_dir_header        the chunk directory: a PL_dir_entry for every
+     PL_dir_entry ...     chunk, so readers can go straight to the chunks
+     PL_trailer           for an instr range or an asid
+
+   Inside a chunk every entry is a PL_entry_header followed by the packed
+   protobuf.  Offsets in the directory are from the file header, so logs
+   can be concatenated (rrparallel.py does) and still read as one; the
+   reader follows the trailers back from the end of the file.  A log with
+   no trailer (qemu died) is found by walking the chunk headers instead.
+
+   Old logs are a single gzip stream of (size_t length, protobuf) pairs.
+   They are still read, front to back only.  */
+
+#define PL_MAGIC "PANDALG2"
+#define PL_MAGIC_LEN 8
+#define PL_VERSION 2
+#define PL_CHUNK_TAG "PLCK"
+#define PL_DIR_TAG "PLDR"
+#define PL_TRAILER_MAGIC "PLDIREND"
+
+// a chunk is cut once it holds this many bytes of entries
+#define PL_CHUNK_SIZE (256 * 1024)
+
+typedef struct {
+    char magic[PL_MAGIC_LEN];
+    uint32_t version;
+    uint32_t chunk_size;
+} PL_file_header;
+
+typedef struct {
+    char tag[4];
+    uint32_t num_entries;
+    uint32_t size;              // uncompressed
+    uint32_t compressed_size;
+    uint64_t min_instr;
+    uint64_t max_instr;
+    uint64_t asid_mask;         // PL_ASID_BIT of every entry's asid
+} PL_chunk_header;
+
+typedef struct {
+    char tag[4];
+    uint32_t pad;
+    uint64_t num_chunks;
+} PL_dir_header;
+
+typedef struct {
+    PL_chunk_header h;
+    uint64_t offset;            // of the chunk header
+} PL_dir_entry;
+
+typedef struct {
+    uint64_t dir_offset;        // of the PL_dir_header
+    uint64_t log_size;          // file header through this trailer
+    char magic[PL_MAGIC_LEN];
+} PL_trailer;
+
+typedef struct {
+    uint32_t size;
+    uint32_t pad;
+    uint64_t instr;
+    uint64_t asid;
+} PL_entry_header;
+
+// one bit per asid hash; good enough to skip most chunks when
+// reading a single process back
+#define PL_ASID_BIT(asid) (1ULL << ((((asid) >> 12) ^ (asid)) & 63))
+
+// the log being read is an old gzip one
+static gzFile pandalog_gz = 0;
 
 uint32_t pandalog_buf_size = 16;
 unsigned char *pandalog_buf = 0;
@@ -34,15 +114,621 @@ void resize_pandalog(size_t n) {
 }
 
 
+/* Writing.  The CPU thread only packs entries into a chunk buffer.  Full
+   chunks go to a writer thread that compresses them and appends them to
+   the file, so zlib never runs on the emulation thread.  */
+
+#define PL_WRITER_NUM_BUFFERS 4
+
+typedef struct {
+    uint8_t *buf;
+    uint32_t len;
+    uint32_t capacity;
+    PL_chunk_header h;
+} PL_chunk;
+
+static struct {
+    int open;
+    FILE *fp;
+    uint64_t pos;               // bytes written so far
+
+    PL_chunk cur;               // being filled by the CPU thread
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    PL_chunk queue[PL_WRITER_NUM_BUFFERS];  // full chunks, FIFO
+    unsigned head, tail;
+    PL_chunk free[PL_WRITER_NUM_BUFFERS];   // empty buffers
+    int num_free;
+    int stop;
+
+    // writer thread only
+    PL_dir_entry *dir;
+    uint64_t num_chunks;
+    uint64_t dir_capacity;
+    uint8_t *zbuf;
+    uLong zbuf_capacity;
+
+    // stats
+    uint64_t num_entries;
+    uint64_t bytes_in;
+    uint64_t stalls;
+} pl_writer;
+
+static void pl_chunk_reset(PL_chunk *c) {
+    c->len = 0;
+    memset(&c->h, 0, sizeof(c->h));
+    memcpy(c->h.tag, PL_CHUNK_TAG, 4);
+    c->h.min_instr = (uint64_t) -1;
+}
+
+static void pl_write(const void *ptr, size_t len) {
+    if (fwrite(ptr, len, 1, pl_writer.fp) != 1) {
+        perror("pandalog: write failed");
+        exit(1);
+    }
+    pl_writer.pos += len;
+}
+
+// writer thread: compress one chunk and append it
+static void pl_emit_chunk(PL_chunk *c) {
+    uLong bound = compressBound(c->len);
+    if (bound > pl_writer.zbuf_capacity) {
+        pl_writer.zbuf = (uint8_t *) realloc(pl_writer.zbuf, bound);
+        pl_writer.zbuf_capacity = bound;
+    }
+    uLongf zlen = pl_writer.zbuf_capacity;
+    int ret = compress2(pl_writer.zbuf, &zlen, c->buf, c->len, Z_DEFAULT_COMPRESSION);
+    assert(ret == Z_OK);
+
+    c->h.size = c->len;
+    c->h.compressed_size = zlen;
+    if (pl_writer.num_chunks == pl_writer.dir_capacity) {
+        pl_writer.dir_capacity = pl_writer.dir_capacity ? 2 * pl_writer.dir_capacity : 1024;
+        pl_writer.dir = (PL_dir_entry *) realloc(pl_writer.dir,
+                pl_writer.dir_capacity * sizeof(PL_dir_entry));
+    }
+    PL_dir_entry *d = &pl_writer.dir[pl_writer.num_chunks++];
+    d->h = c->h;
+    d->offset = pl_writer.pos;
+
+    pl_write(&c->h, sizeof(c->h));
+    pl_write(pl_writer.zbuf, zlen);
+}
+
+static void *pl_writer_thread(void *arg) {
+    PL_chunk c;
+
+    pthread_mutex_lock(&pl_writer.lock);
+    while (1) {
+        while (pl_writer.head == pl_writer.tail && !pl_writer.stop) {
+            pthread_cond_wait(&pl_writer.cond, &pl_writer.lock);
+        }
+        if (pl_writer.head == pl_writer.tail) {
+            break;
+        }
+        c = pl_writer.queue[pl_writer.head % PL_WRITER_NUM_BUFFERS];
+        pthread_mutex_unlock(&pl_writer.lock);
+
+        pl_emit_chunk(&c);
+
+        pthread_mutex_lock(&pl_writer.lock);
+        pl_writer.head++;
+        pl_chunk_reset(&c);
+        pl_writer.free[pl_writer.num_free++] = c;
+        pthread_cond_broadcast(&pl_writer.cond);
+    }
+    pthread_mutex_unlock(&pl_writer.lock);
+    return NULL;
+}
+
+static void pl_writer_open(const char *path) {
+    int i;
+    memset(&pl_writer, 0, sizeof(pl_writer));
+    pl_writer.fp = fopen(path, "wb");
+    if (!pl_writer.fp) {
+        perror("pandalog: can't open log");
+        exit(1);
+    }
+    PL_file_header fh;
+    memset(&fh, 0, sizeof(fh));
+    memcpy(fh.magic, PL_MAGIC, PL_MAGIC_LEN);
+    fh.version = PL_VERSION;
+    fh.chunk_size = PL_CHUNK_SIZE;
+    pl_write(&fh, sizeof(fh));
+
+    for (i = 0; i < PL_WRITER_NUM_BUFFERS; i++) {
+        PL_chunk *c = (i == 0) ? &pl_writer.cur : &pl_writer.free[pl_writer.num_free++];
+        c->capacity = PL_CHUNK_SIZE;
+        c->buf = (uint8_t *) malloc(c->capacity);
+        pl_chunk_reset(c);
+    }
+    pthread_mutex_init(&pl_writer.lock, NULL);
+    pthread_cond_init(&pl_writer.cond, NULL);
+    pthread_create(&pl_writer.thread, NULL, pl_writer_thread, NULL);
+    pl_writer.open = 1;
+}
+
+// hand over the last chunk, wait for the writer, then add the directory
+static int pl_writer_close(void) {
+    int i;
+    pthread_mutex_lock(&pl_writer.lock);
+    if (pl_writer.cur.h.num_entries > 0) {
+        pl_writer.queue[pl_writer.tail++ % PL_WRITER_NUM_BUFFERS] = pl_writer.cur;
+        pl_writer.cur.buf = NULL;
+    }
+    pl_writer.stop = 1;
+    pthread_cond_broadcast(&pl_writer.cond);
+    pthread_mutex_unlock(&pl_writer.lock);
+    pthread_join(pl_writer.thread, NULL);
+
+    PL_dir_header dh;
+    memset(&dh, 0, sizeof(dh));
+    memcpy(dh.tag, PL_DIR_TAG, 4);
+    dh.num_chunks = pl_writer.num_chunks;
+    PL_trailer t;
+    t.dir_offset = pl_writer.pos;
+    pl_write(&dh, sizeof(dh));
+    pl_write(pl_writer.dir, pl_writer.num_chunks * sizeof(PL_dir_entry));
+    t.log_size = pl_writer.pos + sizeof(t);
+    memcpy(t.magic, PL_TRAILER_MAGIC, PL_MAGIC_LEN);
+    pl_write(&t, sizeof(t));
+
+    printf("pandalog: %llu entries in %llu chunks, %llu bytes -> %llu on disk. "
+           "Waited for writer %llu times.\n",
+           (unsigned long long) pl_writer.num_entries,
+           (unsigned long long) pl_writer.num_chunks,
+           (unsigned long long) pl_writer.bytes_in,
+           (unsigned long long) pl_writer.pos,
+           (unsigned long long) pl_writer.stalls);
+
+    free(pl_writer.cur.buf);
+    for (i = 0; i < pl_writer.num_free; i++) {
+        free(pl_writer.free[i].buf);
+    }
+    free(pl_writer.dir);
+    free(pl_writer.zbuf);
+    pthread_cond_destroy(&pl_writer.cond);
+    pthread_mutex_destroy(&pl_writer.lock);
+    pl_writer.open = 0;
+    return fclose(pl_writer.fp);
+}
+
+#ifndef PANDALOG_READER
+// CPU thread: queue the current chunk and take an empty one
+static void pl_writer_handoff(void) {
+    pthread_mutex_lock(&pl_writer.lock);
+    pl_writer.queue[pl_writer.tail++ % PL_WRITER_NUM_BUFFERS] = pl_writer.cur;
+    pthread_cond_broadcast(&pl_writer.cond);
+    if (pl_writer.num_free == 0) {
+        // the writer can't keep up
+        pl_writer.stalls++;
+        while (pl_writer.num_free == 0) {
+            pthread_cond_wait(&pl_writer.cond, &pl_writer.lock);
+        }
+    }
+    pl_writer.cur = pl_writer.free[--pl_writer.num_free];
+    pthread_mutex_unlock(&pl_writer.lock);
+}
+
+// CPU thread: append one packed entry to the current chunk
+static void pl_write_entry(Panda__LogEntry *entry, uint64_t asid) {
+    size_t n = panda__log_entry__get_packed_size(entry);
+    uint32_t need = sizeof(PL_entry_header) + n;
+    PL_chunk *c = &pl_writer.cur;
+
+    if (c->len + need > PL_CHUNK_SIZE && c->h.num_entries > 0) {
+        pl_writer_handoff();
+    }
+    if (c->len + need > c->capacity) {
+        // one entry bigger than a whole chunk gets a chunk to itself
+        c->capacity = c->len + need;
+        c->buf = (uint8_t *) realloc(c->buf, c->capacity);
+    }
+
+    PL_entry_header eh;
+    eh.size = n;
+    eh.pad = 0;
+    eh.instr = entry->instr;
+    eh.asid = asid;
+    memcpy(c->buf + c->len, &eh, sizeof(eh));
+    panda__log_entry__pack(entry, c->buf + c->len + sizeof(eh));
+    c->len += need;
+
+    c->h.num_entries++;
+    if (eh.instr < c->h.min_instr) c->h.min_instr = eh.instr;
+    if (eh.instr > c->h.max_instr) c->h.max_instr = eh.instr;
+    c->h.asid_mask |= PL_ASID_BIT(asid);
+    pl_writer.num_entries++;
+    pl_writer.bytes_in += need;
+}
+#endif
+
+
+/* Reading.  The directory (from the trailers, or rebuilt by walking the
+   chunk headers) says which chunks can hold entries the reader wants.
+   Those are decompressed in order into a ring of slots, either right
+   when the reader needs one or ahead of it by a pool of threads.  */
+
+#define PL_READER_MAX_THREADS 64
+
+enum { PL_SLOT_EMPTY, PL_SLOT_PENDING, PL_SLOT_WORKING, PL_SLOT_DONE };
+
+typedef struct {
+    int state;
+    uint64_t chunk;             // directory index
+    uint8_t *buf;
+    uint32_t capacity;
+    uint8_t *zbuf;
+    uint32_t zbuf_capacity;
+} PL_slot;
+
+static struct {
+    int open;
+    int fd;
+    PL_dir_entry *dir;          // offsets absolute in the file
+    uint64_t num_chunks;
+
+    uint64_t first_instr, last_instr, asid;
+
+    // chunks are scheduled into slots [head, tail) in directory order
+    uint64_t next_chunk;        // next directory entry to consider
+    PL_slot *slots;
+    unsigned num_slots;
+    unsigned head, tail;
+
+    // the chunk being read, in slots[head]
+    PL_slot *cur;
+    uint32_t pos;
+
+    pthread_t threads[PL_READER_MAX_THREADS];
+    int num_threads;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int stop;
+} pl_reader;
+
+static int pl_pread(void *buf, size_t len, uint64_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(pl_reader.fd, (char *) buf + done, len - done, offset + done);
+        if (n <= 0) return -1;
+        done += n;
+    }
+    return 0;
+}
+
+static void pl_dir_add(PL_dir_entry **dir, uint64_t *num, uint64_t *capacity,
+                       const PL_dir_entry *d) {
+    if (*num == *capacity) {
+        *capacity = *capacity ? 2 * *capacity : 1024;
+        *dir = (PL_dir_entry *) realloc(*dir, *capacity * sizeof(PL_dir_entry));
+    }
+    (*dir)[(*num)++] = *d;
+}
+
+// follow the trailers back from the end of the file.  returns -1 unless
+// they account for all of it.
+static int pl_read_trailers(uint64_t file_size) {
+    PL_dir_entry *dir = NULL;
+    uint64_t num = 0, capacity = 0;
+    uint64_t end = file_size;
+    // logs were found last-to-first; remember where each starts
+    uint64_t *log_start = NULL, *log_chunks = NULL;
+    uint64_t num_logs = 0, i, j;
+
+    while (end > 0) {
+        PL_trailer t;
+        PL_dir_header dh;
+        if (end < sizeof(PL_file_header) + sizeof(dh) + sizeof(t)) goto fail;
+        if (pl_pread(&t, sizeof(t), end - sizeof(t))) goto fail;
+        if (memcmp(t.magic, PL_TRAILER_MAGIC, PL_MAGIC_LEN) || t.log_size > end) goto fail;
+        uint64_t start = end - t.log_size;
+        char magic[PL_MAGIC_LEN];
+        if (pl_pread(magic, PL_MAGIC_LEN, start) || memcmp(magic, PL_MAGIC, PL_MAGIC_LEN)) goto fail;
+        if (pl_pread(&dh, sizeof(dh), start + t.dir_offset)) goto fail;
+        if (memcmp(dh.tag, PL_DIR_TAG, 4) ||
+            t.dir_offset + sizeof(dh) + dh.num_chunks * sizeof(PL_dir_entry)
+                + sizeof(t) != t.log_size) goto fail;
+
+        uint64_t first = num;
+        for (i = 0; i < dh.num_chunks; i++) {
+            PL_dir_entry d;
+            if (pl_pread(&d, sizeof(d), start + t.dir_offset + sizeof(dh) + i * sizeof(d))) goto fail;
+            d.offset += start;
+            pl_dir_add(&dir, &num, &capacity, &d);
+        }
+        log_start = (uint64_t *) realloc(log_start, (num_logs + 1) * sizeof(uint64_t));
+        log_chunks = (uint64_t *) realloc(log_chunks, (num_logs + 1) * sizeof(uint64_t));
+        log_start[num_logs] = first;
+        log_chunks[num_logs] = dh.num_chunks;
+        num_logs++;
+        end = start;
+    }
+
+    // put the logs back in file order
+    pl_reader.dir = (PL_dir_entry *) malloc((num ? num : 1) * sizeof(PL_dir_entry));
+    pl_reader.num_chunks = 0;
+    for (i = num_logs; i-- > 0; ) {
+        for (j = 0; j < log_chunks[i]; j++) {
+            pl_reader.dir[pl_reader.num_chunks++] = dir[log_start[i] + j];
+        }
+    }
+    free(dir);
+    free(log_start);
+    free(log_chunks);
+    return 0;
+
+ fail:
+    free(dir);
+    free(log_start);
+    free(log_chunks);
+    return -1;
+}
+
+// no usable trailer: walk the file, stopping at the first thing that
+// isn't whole (the chunk qemu was writing when it died)
+static void pl_scan_chunks(uint64_t file_size) {
+    uint64_t capacity = 0;
+    uint64_t pos = 0;
+    pl_reader.dir = NULL;
+    pl_reader.num_chunks = 0;
+    while (pos < file_size) {
+        char tag[4];
+        if (pl_pread(tag, 4, pos)) break;
+        if (!memcmp(tag, PL_MAGIC, 4)) {
+            PL_file_header fh;
+            if (pl_pread(&fh, sizeof(fh), pos) || memcmp(fh.magic, PL_MAGIC, PL_MAGIC_LEN)) break;
+            pos += sizeof(fh);
+        } else if (!memcmp(tag, PL_CHUNK_TAG, 4)) {
+            PL_dir_entry d;
+            if (pl_pread(&d.h, sizeof(d.h), pos)) break;
+            if (pos + sizeof(d.h) + d.h.compressed_size > file_size) break;
+            d.offset = pos;
+            pl_dir_add(&pl_reader.dir, &pl_reader.num_chunks, &capacity, &d);
+            pos += sizeof(d.h) + d.h.compressed_size;
+        } else if (!memcmp(tag, PL_DIR_TAG, 4)) {
+            PL_dir_header dh;
+            if (pl_pread(&dh, sizeof(dh), pos)) break;
+            pos += sizeof(dh) + dh.num_chunks * sizeof(PL_dir_entry) + sizeof(PL_trailer);
+        } else {
+            break;
+        }
+    }
+    fprintf(stderr, "pandalog: no directory, log is truncated? Found %llu chunks.\n",
+            (unsigned long long) pl_reader.num_chunks);
+}
+
+static int pl_chunk_wanted(const PL_dir_entry *d) {
+    return d->h.max_instr >= pl_reader.first_instr &&
+        d->h.min_instr <= pl_reader.last_instr &&
+        (pl_reader.asid == PANDALOG_ANY_ASID ||
+         (d->h.asid_mask & PL_ASID_BIT(pl_reader.asid)));
+}
+
+// decompress slot's chunk.  called without the lock held.
+static void pl_decompress(PL_slot *s) {
+    const PL_dir_entry *d = &pl_reader.dir[s->chunk];
+    if (d->h.compressed_size > s->zbuf_capacity) {
+        s->zbuf_capacity = d->h.compressed_size;
+        s->zbuf = (uint8_t *) realloc(s->zbuf, s->zbuf_capacity);
+    }
+    if (d->h.size > s->capacity) {
+        s->capacity = d->h.size;
+        s->buf = (uint8_t *) realloc(s->buf, s->capacity);
+    }
+    uLongf len = d->h.size;
+    if (pl_pread(s->zbuf, d->h.compressed_size, d->offset + sizeof(d->h)) ||
+        uncompress(s->buf, &len, s->zbuf, d->h.compressed_size) != Z_OK ||
+        len != d->h.size) {
+        fprintf(stderr, "pandalog: chunk at offset %llu is corrupt\n",
+                (unsigned long long) d->offset);
+        exit(1);
+    }
+}
+
+static void *pl_reader_thread(void *arg) {
+    pthread_mutex_lock(&pl_reader.lock);
+    while (!pl_reader.stop) {
+        // oldest chunk nobody has started on
+        PL_slot *s = NULL;
+        unsigned i;
+        for (i = pl_reader.head; i != pl_reader.tail; i++) {
+            if (pl_reader.slots[i % pl_reader.num_slots].state == PL_SLOT_PENDING) {
+                s = &pl_reader.slots[i % pl_reader.num_slots];
+                break;
+            }
+        }
+        if (!s) {
+            pthread_cond_wait(&pl_reader.cond, &pl_reader.lock);
+            continue;
+        }
+        s->state = PL_SLOT_WORKING;
+        pthread_mutex_unlock(&pl_reader.lock);
+        pl_decompress(s);
+        pthread_mutex_lock(&pl_reader.lock);
+        s->state = PL_SLOT_DONE;
+        pthread_cond_broadcast(&pl_reader.cond);
+    }
+    pthread_mutex_unlock(&pl_reader.lock);
+    return NULL;
+}
+
+// fill free slots with the next chunks worth reading.  lock held.
+static void pl_schedule(void) {
+    while (pl_reader.tail - pl_reader.head < pl_reader.num_slots &&
+           pl_reader.next_chunk < pl_reader.num_chunks) {
+        uint64_t c = pl_reader.next_chunk++;
+        if (!pl_chunk_wanted(&pl_reader.dir[c])) continue;
+        PL_slot *s = &pl_reader.slots[pl_reader.tail++ % pl_reader.num_slots];
+        s->chunk = c;
+        s->state = PL_SLOT_PENDING;
+    }
+    pthread_cond_broadcast(&pl_reader.cond);
+}
+
+static void pl_free_slots(void) {
+    unsigned i;
+    for (i = 0; i < pl_reader.num_slots; i++) {
+        free(pl_reader.slots[i].buf);
+        free(pl_reader.slots[i].zbuf);
+    }
+    free(pl_reader.slots);
+}
+
+// drop whatever was scheduled and go back to the first chunk
+static void pl_reader_restart(void) {
+    unsigned i;
+    pthread_mutex_lock(&pl_reader.lock);
+    // nothing new gets started, then wait out what already was
+    for (i = pl_reader.head; i != pl_reader.tail; i++) {
+        PL_slot *s = &pl_reader.slots[i % pl_reader.num_slots];
+        if (s->state == PL_SLOT_PENDING) s->state = PL_SLOT_EMPTY;
+    }
+    for (i = pl_reader.head; i != pl_reader.tail; i++) {
+        while (pl_reader.slots[i % pl_reader.num_slots].state == PL_SLOT_WORKING) {
+            pthread_cond_wait(&pl_reader.cond, &pl_reader.lock);
+        }
+    }
+    pl_reader.head = pl_reader.tail = 0;
+    pl_reader.cur = NULL;
+    pl_reader.next_chunk = 0;
+    // a chunk for every reader thread, and one ready for each
+    if (pl_reader.num_slots != 2 * (unsigned) pl_reader.num_threads + 1) {
+        pl_free_slots();
+        pl_reader.num_slots = 2 * pl_reader.num_threads + 1;
+        pl_reader.slots = (PL_slot *) calloc(pl_reader.num_slots, sizeof(PL_slot));
+    }
+    for (i = 0; i < pl_reader.num_slots; i++) {
+        pl_reader.slots[i].state = PL_SLOT_EMPTY;
+    }
+    pthread_mutex_unlock(&pl_reader.lock);
+}
+
+// the next chunk to read, decompressed, or NULL at the end of the log
+static PL_slot *pl_next_chunk(void) {
+    PL_slot *s;
+    pthread_mutex_lock(&pl_reader.lock);
+    if (pl_reader.cur) {
+        pl_reader.cur->state = PL_SLOT_EMPTY;
+        pl_reader.head++;
+        pl_reader.cur = NULL;
+    }
+    pl_schedule();
+    if (pl_reader.head == pl_reader.tail) {
+        pthread_mutex_unlock(&pl_reader.lock);
+        return NULL;
+    }
+    s = &pl_reader.slots[pl_reader.head % pl_reader.num_slots];
+    if (s->state == PL_SLOT_PENDING) {
+        // nobody got to it yet, do it here
+        s->state = PL_SLOT_WORKING;
+        pthread_mutex_unlock(&pl_reader.lock);
+        pl_decompress(s);
+        pthread_mutex_lock(&pl_reader.lock);
+        s->state = PL_SLOT_DONE;
+    }
+    while (s->state != PL_SLOT_DONE) {
+        pthread_cond_wait(&pl_reader.cond, &pl_reader.lock);
+    }
+    pl_reader.cur = s;
+    pl_reader.pos = 0;
+    pthread_mutex_unlock(&pl_reader.lock);
+    return s;
+}
+
+static void pl_reader_open(int fd, uint64_t file_size) {
+    memset(&pl_reader, 0, sizeof(pl_reader));
+    pl_reader.fd = fd;
+    if (pl_read_trailers(file_size)) {
+        pl_scan_chunks(file_size);
+    }
+    pl_reader.first_instr = 0;
+    pl_reader.last_instr = (uint64_t) -1;
+    pl_reader.asid = PANDALOG_ANY_ASID;
+    pthread_mutex_init(&pl_reader.lock, NULL);
+    pthread_cond_init(&pl_reader.cond, NULL);
+    pl_reader.open = 1;
+    pl_reader_restart();
+}
+
+static void pl_reader_stop_threads(void) {
+    int i;
+    pthread_mutex_lock(&pl_reader.lock);
+    pl_reader.stop = 1;
+    pthread_cond_broadcast(&pl_reader.cond);
+    pthread_mutex_unlock(&pl_reader.lock);
+    for (i = 0; i < pl_reader.num_threads; i++) {
+        pthread_join(pl_reader.threads[i], NULL);
+    }
+    pl_reader.num_threads = 0;
+    pl_reader.stop = 0;
+}
+
+static int pl_reader_close(void) {
+    pl_reader_stop_threads();
+    pl_free_slots();
+    free(pl_reader.dir);
+    pthread_cond_destroy(&pl_reader.cond);
+    pthread_mutex_destroy(&pl_reader.lock);
+    pl_reader.open = 0;
+    return close(pl_reader.fd);
+}
+
+static Panda__LogEntry *pl_read_entry(void) {
+    while (1) {
+        PL_slot *s = pl_reader.cur;
+        if (!s || pl_reader.pos >= pl_reader.dir[s->chunk].h.size) {
+            s = pl_next_chunk();
+            if (!s) return NULL;
+        }
+        PL_entry_header eh;
+        memcpy(&eh, s->buf + pl_reader.pos, sizeof(eh));
+        const uint8_t *data = s->buf + pl_reader.pos + sizeof(eh);
+        pl_reader.pos += sizeof(eh) + eh.size;
+        if (eh.instr < pl_reader.first_instr || eh.instr > pl_reader.last_instr ||
+            (pl_reader.asid != PANDALOG_ANY_ASID && eh.asid != pl_reader.asid)) {
+            continue;
+        }
+        return panda__log_entry__unpack(NULL, eh.size, data);
+    }
+}
+
 
 // open for read or write
 void pandalog_open(const char *path, const char *mode) {
-    pandalog_file = gzopen(path, mode);
+    if (mode[0] == 'w') {
+        pl_writer_open(path);
+        return;
+    }
+    int fd = open(path, O_RDONLY);
+    char magic[PL_MAGIC_LEN];
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror("pandalog: can't open log");
+        exit(1);
+    }
+    if (pread(fd, magic, PL_MAGIC_LEN, 0) == PL_MAGIC_LEN &&
+        !memcmp(magic, PL_MAGIC, PL_MAGIC_LEN)) {
+        pl_reader_open(fd, st.st_size);
+    } else {
+        // old format
+        close(fd);
+        pandalog_gz = gzopen(path, mode);
+    }
 }
 
 
 int  pandalog_close(void) {
-    return gzclose(pandalog_file);  
+    if (pl_writer.open) {
+        return pl_writer_close();
+    } else if (pl_reader.open) {
+        return pl_reader_close();
+    }
+    int ret = gzclose(pandalog_gz);
+    pandalog_gz = 0;
+    return ret;
 }
 
 extern int panda_in_main_loop;
@@ -50,45 +736,70 @@ extern int panda_in_main_loop;
 
 #ifndef PANDALOG_READER
 void pandalog_write_entry(Panda__LogEntry *entry) {
-    // fill in required fields. 
-    // NOTE: any other fields will already have been filled in 
-    // by the plugin that made this call.  
+    uint64_t asid = 0;
+    // fill in required fields.
+    // NOTE: any other fields will already have been filled in
+    // by the plugin that made this call.
     if (panda_in_main_loop) {
         entry->pc = panda_current_pc(cpu_single_env);
         entry->instr = rr_get_guest_instr_count ();
+        asid = panda_current_asid(cpu_single_env);
     }
-    else {        
+    else {
         entry->pc = -1;
         entry->instr = -1;
     }
-    size_t n = panda__log_entry__get_packed_size(entry);   
-    resize_pandalog(n);
-    panda__log_entry__pack(entry, pandalog_buf);
-    // write size of log entry
-    gzwrite(pandalog_file, (void *) &n, sizeof(n));
-    // and then the entry itself
-    gzwrite(pandalog_file, pandalog_buf, n);        
+    pl_write_entry(entry, asid);
 }
 #endif
 
 Panda__LogEntry *pandalog_read_entry(void) {
+    if (pl_reader.open) {
+        return pl_read_entry();
+    }
     // read the size of the log entry
     size_t n,nbr;
-    nbr = gzread(pandalog_file, (void *) &n, sizeof(n));
+    nbr = gzread(pandalog_gz, (void *) &n, sizeof(n));
     if (nbr == 0) {
         return NULL;
     }
     resize_pandalog(n);
     // and then read the entry iself
-    gzread(pandalog_file, pandalog_buf, n);
+    gzread(pandalog_gz, pandalog_buf, n);
     // and unpack it
-    return panda__log_entry__unpack(NULL, n, pandalog_buf);                                             
+    return panda__log_entry__unpack(NULL, n, pandalog_buf);
 }
 
 
-void pandalog_free_entry(Panda__LogEntry *entry) {    
+void pandalog_free_entry(Panda__LogEntry *entry) {
     panda__log_entry__free_unpacked(entry, NULL);
 }
 
 
+int pandalog_read_range(uint64_t first_instr, uint64_t last_instr) {
+    if (!pl_reader.open) return -1;
+    pl_reader_restart();
+    pl_reader.first_instr = first_instr;
+    pl_reader.last_instr = last_instr;
+    return 0;
+}
+
+int pandalog_read_asid(uint64_t asid) {
+    if (!pl_reader.open) return -1;
+    pl_reader_restart();
+    pl_reader.asid = asid;
+    return 0;
+}
 
+int pandalog_read_threads(int num_threads) {
+    int i;
+    if (!pl_reader.open) return -1;
+    if (num_threads > PL_READER_MAX_THREADS) num_threads = PL_READER_MAX_THREADS;
+    pl_reader_stop_threads();
+    pl_reader.num_threads = num_threads;
+    pl_reader_restart();
+    for (i = 0; i < num_threads; i++) {
+        pthread_create(&pl_reader.threads[i], NULL, pl_reader_thread, NULL);
+    }
+    return 0;
+}
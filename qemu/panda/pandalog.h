@@ -2,6 +2,7 @@
 #ifndef __PANDALOG_H_
 #define __PANDALOG_H_
 
+#include <stdint.h>
 #include "pandalog.pb-c.h"
 
 
@@ -22,7 +23,23 @@ Panda__LogEntry *pandalog_read_entry(void);
 // Must call this to free the entry returned by pandalog_read_entry
 void pandalog_free_entry(Panda__LogEntry *entry);
 
+// The rest only work on v2 (chunked) logs, and return -1 on old ones.
+
+// Only return entries with first_instr <= instr <= last_instr from now on,
+// starting over at the first of them.  Chunks that hold none are never
+// decompressed.  Entries written outside of replay have instr == -1.
+int pandalog_read_range(uint64_t first_instr, uint64_t last_instr);
+
+// Same, but for the asid each entry was written in.
+// PANDALOG_ANY_ASID turns this off again.
+#define PANDALOG_ANY_ASID ((uint64_t) -1)
+int pandalog_read_asid(uint64_t asid);
+
+// Decompress chunks ahead of the reader on this many threads.  0 (the
+// default) decompresses each chunk when the reader gets to it.  Like the
+// two above, this starts reading over, so call it right after opening.
+int pandalog_read_threads(int num_threads);
+
 extern int pandalog;
 
 #endif
-
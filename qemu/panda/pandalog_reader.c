@@ -1,6 +1,8 @@
 
 // cd panda/qemu
-// g++ -g -o pandalog_reader pandalog_reader.c pandalog.c pandalog.pb-c.c  -L/usr/local/lib -lprotobuf-c -I .. -lz -D PANDALOG_READER
+// g++ -g -o pandalog_reader pandalog_reader.c pandalog.c pandalog.pb-c.c  -L/usr/local/lib -lprotobuf-c -I .. -lz -lpthread -D PANDALOG_READER
+//
+// usage: pandalog_reader [-j threads] [-r first_instr last_instr] [-a asid] pandalog
 
 #define __STDC_FORMAT_MACROS
 
@@ -8,6 +10,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include "pandalog.h"
 
 
@@ -41,7 +44,44 @@ void print_process_key_index(Panda__ProcessKeyIndex *pki) {
 
 
 int main (int argc, char **argv) {
-    pandalog_open(argv[1], "r");
+    int threads = 0;
+    uint64_t first_instr = 0, last_instr = -1;
+    uint64_t asid = PANDALOG_ANY_ASID;
+    int i = 1;
+    while (i + 1 < argc && argv[i][0] == '-') {
+        if (!strcmp(argv[i], "-j")) {
+            threads = atoi(argv[i+1]);
+            i += 2;
+        }
+        else if (!strcmp(argv[i], "-r") && i + 2 < argc) {
+            first_instr = strtoull(argv[i+1], NULL, 0);
+            last_instr = strtoull(argv[i+2], NULL, 0);
+            i += 3;
+        }
+        else if (!strcmp(argv[i], "-a")) {
+            asid = strtoull(argv[i+1], NULL, 0);
+            i += 2;
+        }
+        else {
+            break;
+        }
+    }
+    if (i + 1 != argc) {
+        fprintf(stderr, "usage: %s [-j threads] [-r first_instr last_instr] [-a asid] pandalog\n", argv[0]);
+        return 1;
+    }
+    pandalog_open(argv[i], "r");
+    // these are only for v2 logs; old ones are just read through
+    if (threads > 0 && pandalog_read_threads(threads) < 0) {
+        fprintf(stderr, "old-style pandalog, -j ignored\n");
+    }
+    if ((first_instr != 0 || last_instr != (uint64_t) -1) &&
+        pandalog_read_range(first_instr, last_instr) < 0) {
+        fprintf(stderr, "old-style pandalog, -r ignored\n");
+    }
+    if (asid != PANDALOG_ANY_ASID && pandalog_read_asid(asid) < 0) {
+        fprintf(stderr, "old-style pandalog, -a ignored\n");
+    }
     Panda__LogEntry *ple;
     while (1) {
         ple = pandalog_read_entry();
@@ -224,4 +264,6 @@ int main (int argc, char **argv) {
         printf ("\n");
         panda__log_entry__free_unpacked(ple, NULL);
     }
+    pandalog_close();
+    return 0;
 }
@@ -1,6 +1,6 @@
 
 // cd panda/qemu
-// g++ -g -o stuw stuw.cpp pandalog.c pandalog.pb-c.c  -L/usr/local/lib -lprotobuf-c -I .. -lz -D PANDALOG_READER  -std=c++11
+// g++ -g -o stuw stuw.cpp pandalog.c pandalog.pb-c.c  -L/usr/local/lib -lprotobuf-c -I .. -lz -lpthread -D PANDALOG_READER  -std=c++11
 
 #define __STDC_FORMAT_MACROS
 
@@ -18,6 +18,7 @@ PANDAENDCOMMENT */
 #include "qmp-commands.h"
 #include "hmp.h"
 #include "error.h"
+#include "panda/panda_common.h"
 
 #include <libgen.h>
 
@@ -301,6 +302,208 @@ void panda_disable_memcb(void) {
     panda_use_memcb = false;
 }
 
+bool panda_scope_active = false;
+bool panda_tb_in_scope = true;
+
+static target_ulong panda_scope_asids[MAX_PANDA_SCOPE_ENTRIES];
+static int panda_scope_num_asids = 0;
+static target_ulong panda_scope_ranges[MAX_PANDA_SCOPE_ENTRIES][2];
+static int panda_scope_num_ranges = 0;
+
+// Translations made under the old scope are keyed by the old scope bits
+static void panda_scope_changed(void) {
+    panda_scope_active = panda_scope_num_asids > 0 || panda_scope_num_ranges > 0;
+    panda_do_flush_tb();
+}
+
+bool panda_scope_add_asid(target_ulong asid) {
+    int i;
+    for (i = 0; i < panda_scope_num_asids; i++) {
+        if (panda_scope_asids[i] == asid) return true;
+    }
+    if (panda_scope_num_asids == MAX_PANDA_SCOPE_ENTRIES) {
+        fprintf(stderr, "panda: too many ASIDs in scope\n");
+        return false;
+    }
+    panda_scope_asids[panda_scope_num_asids++] = asid;
+    panda_scope_changed();
+    return true;
+}
+
+bool panda_scope_add_range(target_ulong start, target_ulong end) {
+    if (panda_scope_num_ranges == MAX_PANDA_SCOPE_ENTRIES) {
+        fprintf(stderr, "panda: too many code ranges in scope\n");
+        return false;
+    }
+    panda_scope_ranges[panda_scope_num_ranges][0] = start;
+    panda_scope_ranges[panda_scope_num_ranges][1] = end;
+    panda_scope_num_ranges++;
+    panda_scope_changed();
+    return true;
+}
+
+void panda_scope_clear(void) {
+    if (!panda_scope_active) return;
+    panda_scope_num_asids = 0;
+    panda_scope_num_ranges = 0;
+    panda_scope_changed();
+}
+
+uint64_t panda_tb_scope_slow(CPUState *env, target_ulong pc) {
+    uint64_t scope = 0;
+    int i;
+    if (panda_scope_num_asids) {
+        target_ulong asid = panda_current_asid(env);
+        for (i = 0; i < panda_scope_num_asids; i++) {
+            if (panda_scope_asids[i] == asid) break;
+        }
+        if (i == panda_scope_num_asids) scope |= PANDA_TB_OUT_OF_ASID;
+    }
+    if (panda_scope_num_ranges) {
+        for (i = 0; i < panda_scope_num_ranges; i++) {
+            if (pc >= panda_scope_ranges[i][0] && pc < panda_scope_ranges[i][1]) break;
+        }
+        if (i == panda_scope_num_ranges) scope |= PANDA_TB_OUT_OF_RANGE;
+    }
+    return scope;
+}
+
+#ifdef CONFIG_SOFTMMU
+typedef struct panda_memcb_watch {
+    bool used;
+    bool phys;
+    uint64_t start, end;    // [start, end)
+    target_ulong asid;      // virtual watches only; 0 means any
+} panda_memcb_watch;
+
+static panda_memcb_watch panda_memcb_watches[MAX_PANDA_MEMCB_WATCHES];
+int panda_memcb_num_watches = 0;
+static int panda_memcb_num_asid_watches = 0;
+
+static inline bool panda_memcb_overlaps(panda_memcb_watch *w,
+        uint64_t start, uint64_t len) {
+    return start < w->end && w->start <= start + (len - 1);
+}
+
+// Pages that are (or were) watched have their TLB entries made without (or
+// with) TLB_PANDA_WATCH, so throw them all out.  Code translated before the
+// first watch calls the plain helpers, so that has to go too.
+static void panda_memcb_watches_changed(bool first) {
+    CPUState *env;
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        tlb_flush(env, 1);
+    }
+    if (first && !panda_use_memcb) {
+        panda_do_flush_tb();
+    }
+}
+
+static int panda_memcb_add_watch(bool phys, uint64_t start, uint64_t len,
+        target_ulong asid) {
+    int i;
+    for (i = 0; i < MAX_PANDA_MEMCB_WATCHES; i++) {
+        if (!panda_memcb_watches[i].used) break;
+    }
+    if (i == MAX_PANDA_MEMCB_WATCHES) {
+        fprintf(stderr, "panda: too many memory callback watches\n");
+        return -1;
+    }
+    panda_memcb_watch *w = &panda_memcb_watches[i];
+    w->used = true;
+    w->phys = phys;
+    w->start = start;
+    w->end = start + len < start ? UINT64_MAX : start + len;
+    w->asid = asid;
+    panda_memcb_num_watches++;
+    if (!phys && asid) panda_memcb_num_asid_watches++;
+    panda_memcb_watches_changed(panda_memcb_num_watches == 1);
+    return i;
+}
+
+int panda_memcb_watch_virt(target_ulong start, target_ulong len, target_ulong asid) {
+    return panda_memcb_add_watch(false, start, len, asid);
+}
+
+int panda_memcb_watch_phys(target_phys_addr_t start, target_phys_addr_t len) {
+    return panda_memcb_add_watch(true, start, len, 0);
+}
+
+int panda_memcb_watch_asid(target_ulong asid) {
+    return panda_memcb_add_watch(false, 0, UINT64_MAX, asid);
+}
+
+void panda_memcb_unwatch(int handle) {
+    if (handle < 0 || handle >= MAX_PANDA_MEMCB_WATCHES ||
+            !panda_memcb_watches[handle].used) {
+        return;
+    }
+    panda_memcb_watch *w = &panda_memcb_watches[handle];
+    w->used = false;
+    panda_memcb_num_watches--;
+    if (!w->phys && w->asid) panda_memcb_num_asid_watches--;
+    panda_memcb_watches_changed(false);
+}
+
+// Does any watch cover part of this page?  Called when the TLB entry for it
+// is made.
+bool panda_memcb_page_watched(CPUState *env, target_ulong vaddr, target_phys_addr_t paddr) {
+    target_ulong asid = 0;
+    int i, seen;
+    if (panda_memcb_num_asid_watches) {
+        asid = panda_current_asid(env);
+    }
+    vaddr &= TARGET_PAGE_MASK;
+    paddr &= TARGET_PAGE_MASK;
+    for (i = 0, seen = 0; seen < panda_memcb_num_watches; i++) {
+        panda_memcb_watch *w = &panda_memcb_watches[i];
+        if (!w->used) continue;
+        seen++;
+        if (w->phys) {
+            if (panda_memcb_overlaps(w, paddr, TARGET_PAGE_SIZE)) return true;
+        } else if (w->asid == 0 || w->asid == asid) {
+            if (panda_memcb_overlaps(w, vaddr, TARGET_PAGE_SIZE)) return true;
+        }
+    }
+    return false;
+}
+
+// Does any watch cover this access?  Called from the _mmu_panda helpers,
+// i.e. only for accesses that left the fast path.
+bool panda_memcb_watched(CPUState *env, target_ulong addr, int size) {
+    target_ulong asid = 0;
+    target_phys_addr_t paddr = -1;
+    bool have_paddr = false;
+    int i, seen;
+    if (panda_memcb_num_asid_watches) {
+        asid = panda_current_asid(env);
+    }
+    for (i = 0, seen = 0; seen < panda_memcb_num_watches; i++) {
+        panda_memcb_watch *w = &panda_memcb_watches[i];
+        if (!w->used) continue;
+        seen++;
+        if (w->phys) {
+            if (!have_paddr) {
+                paddr = panda_virt_to_phys(env, addr);
+                have_paddr = true;
+            }
+            if (paddr != -1 && panda_memcb_overlaps(w, paddr, size)) return true;
+        } else if (w->asid == 0 || w->asid == asid) {
+            if (panda_memcb_overlaps(w, addr, size)) return true;
+        }
+    }
+    return false;
+}
+
+// TLB entries made under the old address space were marked for its watches.
+// Targets that don't flush the TLB when the page table base changes call
+// this.
+void panda_memcb_asid_changed(CPUState *env) {
+    if (panda_memcb_num_asid_watches) {
+        tlb_flush(env, 1);
+    }
+}
+#endif
+
 void panda_enable_tb_chaining(void){
     panda_tb_chaining = true;
 }
@@ -545,6 +545,17 @@ target_phys_addr_t panda_virt_to_phys(CPUState *env, target_ulong addr);
 // is_write == 0 is a read from that addr into buf.  
 int panda_virtual_memory_rw(CPUState *env, target_ulong addr, uint8_t *buf, int len, int is_write);
 
+#ifdef CONFIG_SOFTMMU
+// Reads guest code at pc the way the translator does.  Much cheaper than
+// panda_virtual_memory_rw from an INSN_TRANSLATE callback, since the page
+// is already in the code TLB.  Returns -1 if pc isn't mapped.
+int panda_read_code(CPUState *env, target_ulong pc, uint8_t *buf, int len);
+// Drops any translation of the code at pc, so it is translated again (and
+// INSN_TRANSLATE callbacks see it) the next time it runs.  For plugins
+// that decide at runtime which instructions they want an exec callback on.
+void panda_invalidate_tb_at(CPUState *env, target_ulong pc);
+#endif
+
 bool panda_flush_tb(void);
 
 void panda_do_flush_tb(void);
@@ -565,8 +576,75 @@ extern bool panda_use_memcb;
 extern panda_cb_list *panda_cbs[PANDA_CB_LAST];
 extern bool panda_plugins_to_unload[MAX_PANDA_PLUGINS];
 extern bool panda_plugin_to_unload;
+extern bool panda_please_flush_tb;
 extern bool panda_tb_chaining;
 
+// Instrumentation scope.  By default every block is instrumented.  Once a
+// plugin adds an ASID or a code range here, a block is in scope only if it
+// runs in one of the added ASIDs (when any were added) and starts in one of
+// the added ranges (when any were added).  Blocks out of scope are
+// translated without instrumentation: no insn callbacks, no memory
+// callbacks, no LLVM, and no block callbacks when they run.  They also stay
+// chained to each other even with TB chaining off.  Scopes from all plugins
+// are combined.  Changing the scope flushes the translation cache.
+#define MAX_PANDA_SCOPE_ENTRIES 64
+bool panda_scope_add_asid(target_ulong asid);
+bool panda_scope_add_range(target_ulong start, target_ulong end);  // [start, end)
+void panda_scope_clear(void);
+
+// Out-of-scope TBs carry these in the otherwise unused high bits of
+// tb->flags, so that one piece of code can have an instrumented and an
+// uninstrumented translation at once.
+#define PANDA_TB_OUT_OF_ASID  (1ULL << 62)
+#define PANDA_TB_OUT_OF_RANGE (1ULL << 63)
+#define PANDA_TB_SCOPE_MASK   (PANDA_TB_OUT_OF_ASID | PANDA_TB_OUT_OF_RANGE)
+
+extern bool panda_scope_active;
+// Whether the block being translated right now is in scope
+extern bool panda_tb_in_scope;
+
+uint64_t panda_tb_scope_slow(CPUState *env, target_ulong pc);
+
+// Scope bits for a block starting at pc in the current address space
+static inline uint64_t panda_tb_scope(CPUState *env, target_ulong pc) {
+    return panda_scope_active ? panda_tb_scope_slow(env, pc) : 0;
+}
+
+static inline bool panda_tb_instrumented(TranslationBlock *tb) {
+    return (tb->flags & PANDA_TB_SCOPE_MASK) == 0;
+}
+
+#ifdef CONFIG_SOFTMMU
+// Memory callbacks for part of memory only.  panda_enable_memcb() sends
+// every load and store through the callbacks; with watches instead, only
+// TLB entries for watched pages leave the inline fast path (the way QEMU's
+// watchpoints do) and the callbacks run for accesses that touch a watched
+// range.  A virtual watch with asid 0 matches any address space.  Each call
+// returns a handle for panda_memcb_unwatch, or -1 if the table is full.
+// Takes effect from the next basic block.
+#define MAX_PANDA_MEMCB_WATCHES 64
+int  panda_memcb_watch_virt(target_ulong start, target_ulong len, target_ulong asid);
+int  panda_memcb_watch_phys(target_phys_addr_t start, target_phys_addr_t len);
+int  panda_memcb_watch_asid(target_ulong asid);
+void panda_memcb_unwatch(int handle);
+
+// Used by the TLB and the softmmu helpers
+bool panda_memcb_page_watched(CPUState *env, target_ulong vaddr, target_phys_addr_t paddr);
+bool panda_memcb_watched(CPUState *env, target_ulong addr, int size);
+void panda_memcb_asid_changed(CPUState *env);
+extern int panda_memcb_num_watches;
+
+// Whether generated code should call the _mmu_panda helpers on the slow path
+static inline bool panda_memcb_helpers(void) {
+    return panda_tb_in_scope && (panda_use_memcb || panda_memcb_num_watches > 0);
+}
+
+// Whether generated code should skip the inline TLB fast path altogether
+static inline bool panda_memcb_all(void) {
+    return panda_tb_in_scope && panda_use_memcb;
+}
+#endif
+
 extern char panda_argv[MAX_PANDA_PLUGIN_ARGS][256];
 extern int panda_argc;
 
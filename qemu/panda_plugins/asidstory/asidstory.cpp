@@ -203,7 +203,8 @@ int asidstory_before_block_exec(CPUState *env, TranslationBlock *tb) {
     if ((a_counter % SAMPLE_RATE) != 0) {
         return 0;
     }
-    OsiProc *p = get_current_process(env);
+    // osi's own copy, only re-read when the guest switches address spaces
+    OsiProc *p = get_current_process_cached(env);
     if (pid_ok(p->pid)) {
         const NamePid namepid(p->name, p->pid, p->asid);
         ProcessData &pd = process_datas[namepid];
@@ -248,7 +249,6 @@ int asidstory_before_block_exec(CPUState *env, TranslationBlock *tb) {
             }
         }
     }
-    free (p);
     return 0;
 }
 
@@ -257,7 +257,7 @@ int asidstory_after_block_exec(CPUState *env, TranslationBlock *tb, TranslationB
     if ((b_counter % SAMPLE_RATE) != 0) {
         return 0;
     }
-    OsiProc *p = get_current_process(env);
+    OsiProc *p = get_current_process_cached(env);
     if (pid_ok(p->pid)) {
         Instr instr = rr_get_guest_instr_count();
         ProcessData &pd = process_datas[NamePid(p->name, p->pid, p->asid)];
@@ -266,7 +266,6 @@ int asidstory_after_block_exec(CPUState *env, TranslationBlock *tb, TranslationB
         pd.cells[cell]++;
         pd.last = std::max(pd.last, instr);
     }
-    free(p);
     return 0;
 }
 
@@ -24,6 +24,7 @@ extern "C" {
 #include "disas.h"
 
 #include "panda_plugin.h"
+#include "../taps/taps.h"
 
 }
 
@@ -31,13 +32,12 @@ extern "C" {
 #include <stdlib.h>
 #include <ctype.h>
 #include <math.h>
-#include <map>
-#include <list>
+#include <vector>
 #include <algorithm>
 
 #include "../common/prog_point.h"
-
-#include "../callstack_instr/callstack_instr_ext.h"
+#include "../taps/taps_ext.h"
+#include "panda_plugin_plugin.h"
 
 // These need to be extern "C" so that the ABI is compatible with
 // QEMU/PANDA, which is written in C
@@ -45,7 +45,6 @@ extern "C" {
 
 bool init_plugin(void *);
 void uninit_plugin(void *);
-int mem_write_callback(CPUState *env, target_ulong pc, target_ulong addr, target_ulong size, void *buf);
 int mem_read_callback(CPUState *env, target_ulong pc, target_ulong addr, target_ulong size, void *buf);
 
 }
@@ -53,105 +52,258 @@ int mem_read_callback(CPUState *env, target_ulong pc, target_ulong addr, target_
 uint64_t bytes_read, bytes_written;
 uint64_t num_reads, num_writes;
 
+// Bigram counts for one tap point.  A tap starts out with a small
+// open-addressed table of (bigram, count) pairs.  Once it has seen enough
+// distinct bigrams that the table would grow past SPARSE_MAX_SLOTS, the
+// counts move to a flat array with one entry per possible bigram.
+#define NUM_BIGRAMS 65536
+#define SPARSE_INIT_SLOTS 16
+#define SPARSE_MAX_SLOTS 8192
+
+struct sparse_slot {
+    uint32_t key;       // bigram + 1, 0 if empty
+    uint32_t count;
+};
+
+struct bigram_hist {
+    uint32_t *dense;    // NUM_BIGRAMS counts, or NULL while sparse
+    sparse_slot *slots;
+    uint32_t nslots;
+    uint32_t shift;     // 32 - log2(nslots)
+    uint32_t nkeys;     // distinct bigrams
+};
+
 struct text_counter {
     bool started;
-    int num_bytes;
     unsigned char prev_char;
-    std::map<unsigned short,unsigned int> hist;
+    uint64_t num_bytes;
+    bigram_hist *hist;  // NULL until the tap has a bigram
 };
 
-std::map<prog_point,text_counter> text_tracker;
+// tap ID -> counter
+std::vector<text_counter> text_tracker;
 //FILE *text_memlog;
 
-int mem_write_callback(CPUState *env, target_ulong pc, target_ulong addr,
-                       target_ulong size, void *buf) {
-    bytes_written += size;
-    num_writes++;
-    prog_point p = {};
-
-    get_prog_point(env, &p);
-
-    text_counter &tc = text_tracker[p];    
-
-    for (unsigned int i = 0; i < size; i++) {
-        unsigned char val = ((unsigned char *)buf)[i];
-        //fprintf(text_memlog, TARGET_FMT_lx "." TARGET_FMT_lx " " TARGET_FMT_lx " %02x\n" , p.pc, p.caller, addr+i, val);
-        if (!tc.started) {
-            tc.prev_char = val;
-            tc.started = true;
-        } 
-        else {
-            unsigned short bigram;
-            bigram = (tc.prev_char << 8) | val;
-            tc.hist[bigram]++;
-            tc.prev_char = val;
+FILE *mem_report;
+
+// Memory held by histograms, and how much we let it get to before writing
+// out the ones that are done enough to be worth keeping (see flush_hists).
+static uint64_t hist_bytes;
+static uint64_t max_hist_bytes;
+static uint64_t flush_at;
+static uint64_t num_flushes;
+static uint64_t num_dense;
+
+static inline uint32_t sparse_index(const bigram_hist *h, uint32_t bigram) {
+    return (bigram * 2654435761U) >> h->shift;
+}
+
+static void sparse_alloc(bigram_hist *h, uint32_t nslots) {
+    h->slots = (sparse_slot *) calloc(nslots, sizeof(sparse_slot));
+    h->nslots = nslots;
+    h->shift = 32 - __builtin_ctz(nslots);
+    hist_bytes += nslots * sizeof(sparse_slot);
+}
+
+static bigram_hist *hist_new(void) {
+    bigram_hist *h = (bigram_hist *) calloc(1, sizeof(bigram_hist));
+    hist_bytes += sizeof(bigram_hist);
+    sparse_alloc(h, SPARSE_INIT_SLOTS);
+    return h;
+}
+
+static void hist_free(bigram_hist *h) {
+    if (h->dense) {
+        free(h->dense);
+        hist_bytes -= NUM_BIGRAMS * sizeof(uint32_t);
+    }
+    else {
+        free(h->slots);
+        hist_bytes -= h->nslots * sizeof(sparse_slot);
+    }
+    free(h);
+    hist_bytes -= sizeof(bigram_hist);
+}
+
+// Out of room in the sparse table: double it, or go dense.
+static void hist_grow(bigram_hist *h) {
+    sparse_slot *old = h->slots;
+    uint32_t old_nslots = h->nslots;
+
+    if (old_nslots * 2 > SPARSE_MAX_SLOTS) {
+        h->dense = (uint32_t *) calloc(NUM_BIGRAMS, sizeof(uint32_t));
+        hist_bytes += NUM_BIGRAMS * sizeof(uint32_t);
+        for (uint32_t i = 0; i < old_nslots; i++) {
+            if (old[i].key) h->dense[old[i].key - 1] = old[i].count;
+        }
+        h->slots = NULL;
+        num_dense++;
+    }
+    else {
+        sparse_alloc(h, old_nslots * 2);
+        for (uint32_t i = 0; i < old_nslots; i++) {
+            if (!old[i].key) continue;
+            uint32_t j = sparse_index(h, old[i].key - 1);
+            while (h->slots[j].key) j = (j + 1) & (h->nslots - 1);
+            h->slots[j] = old[i];
         }
-        tc.num_bytes++;
     }
- 
-    return 1;
+    free(old);
+    hist_bytes -= old_nslots * sizeof(sparse_slot);
 }
 
-bool init_plugin(void *self) {
-    panda_cb pcb;
+static inline void hist_add(bigram_hist *h, uint32_t bigram) {
+    if (h->dense) {
+        h->dense[bigram]++;
+        return;
+    }
+    uint32_t key = bigram + 1;
+    uint32_t i = sparse_index(h, bigram);
+    while (h->slots[i].key) {
+        if (h->slots[i].key == key) {
+            h->slots[i].count++;
+            return;
+        }
+        i = (i + 1) & (h->nslots - 1);
+    }
+    h->slots[i].key = key;
+    h->slots[i].count = 1;
+    // keep the table at most half full
+    if (2 * ++h->nkeys > h->nslots) hist_grow(h);
+}
 
-    printf("Initializing plugin bigrams\n");
+// Write one record: the program point, the number of keys, and each
+// key/value of the histogram, in key order.
+static void write_hist(const prog_point &p, const bigram_hist *h) {
+    std::vector<std::pair<unsigned short,unsigned int>> entries;
+    if (h->dense) {
+        for (uint32_t bigram = 0; bigram < NUM_BIGRAMS; bigram++) {
+            if (h->dense[bigram]) entries.push_back(std::make_pair(bigram, h->dense[bigram]));
+        }
+    }
+    else {
+        for (uint32_t i = 0; i < h->nslots; i++) {
+            if (h->slots[i].key) entries.push_back(std::make_pair(h->slots[i].key - 1, h->slots[i].count));
+        }
+        std::sort(entries.begin(), entries.end());
+    }
 
-    if (!init_callstack_instr_api()) return false;
+    unsigned int hist_keys = entries.size();
 
-    // Need this to get EIP with our callbacks
-    panda_enable_precise_pc();
-    // Enable memory logging
-    panda_enable_memcb();
+    // Write the program point
+    fwrite(&p, sizeof(prog_point), 1, mem_report);
 
-    pcb.virt_mem_write = mem_write_callback;
-    panda_register_callback(self, PANDA_CB_VIRT_MEM_WRITE, pcb);
+    // Write the number of keys
+    fwrite(&hist_keys, sizeof(hist_keys), 1, mem_report);
 
-    //text_memlog = fopen("text_memlog.txt", "w");
+    // Write each key/value of the (hopefully sparse) histogram
+    for (auto &e : entries) {
+        fwrite(&e.first, sizeof(e.first), 1, mem_report);   // Key: unsigned short
+        fwrite(&e.second, sizeof(e.second), 1, mem_report); // Value: unsigned int
+    }
+}
 
-    return true;
+// Write out and free the histograms of every tap that has seen at least 80
+// bytes (smaller ones are skipped in the report, so they have to stay
+// until they get there), in prog_point order.  Bigrams spanning the flush
+// are still counted, since prev_char stays.  A tap that keeps writing gets
+// another record the next time; the scripts that read the report add up
+// records for the same tap.
+static void flush_hists(void) {
+    std::vector<std::pair<prog_point,uint32_t>> order;
+    for (uint32_t tap = 0; tap < text_tracker.size(); tap++) {
+        // Skip low-data entries
+        if (!text_tracker[tap].hist || text_tracker[tap].num_bytes < 80) continue;
+        prog_point p;
+        taps_get_prog_point(tap, &p);
+        order.push_back(std::make_pair(p, tap));
+    }
+    std::sort(order.begin(), order.end());
+
+    for (auto &o : order) {
+        text_counter &tc = text_tracker[o.second];
+        write_hist(o.first, tc.hist);
+        hist_free(tc.hist);
+        tc.hist = NULL;
+    }
 }
 
-void uninit_plugin(void *self) {
-    printf("Memory statistics: %lu stores, %lu bytes written.\n",
-        num_writes, bytes_written
-    );
+static void tap_write(CPUState *env, uint32_t tap, const prog_point *p,
+                      target_ulong addr, target_ulong size, void *buf) {
+    bytes_written += size;
+    num_writes++;
+
+    if (tap >= text_tracker.size()) text_tracker.resize(taps_count());
+    text_counter &tc = text_tracker[tap];
+    const unsigned char *bytes = (const unsigned char *)buf;
+
+    unsigned int i = 0;
+    if (!tc.started && size > 0) {
+        tc.prev_char = bytes[0];
+        tc.started = true;
+        i = 1;
+    }
+    tc.num_bytes += size;
+    if (i >= size) return;
+
+    if (!tc.hist) tc.hist = hist_new();
+    bigram_hist *h = tc.hist;
+    unsigned char prev = tc.prev_char;
+    for (; i < size; i++) {
+        //fprintf(text_memlog, TARGET_FMT_lx "." TARGET_FMT_lx " " TARGET_FMT_lx " %02x\n" , p->pc, p->caller, addr+i, bytes[i]);
+        hist_add(h, (prev << 8) | bytes[i]);
+        prev = bytes[i];
+    }
+    tc.prev_char = prev;
+
+    if (hist_bytes > flush_at) {
+        flush_hists();
+        num_flushes++;
+        // If what's left is mostly taps under 80 bytes, don't flush again
+        // on the very next write
+        flush_at = std::max(max_hist_bytes, hist_bytes + max_hist_bytes / 4);
+    }
+}
+
+bool init_plugin(void *self) {
+    printf("Initializing plugin bigrams\n");
 
-    FILE *mem_report = fopen("bigram_mem_report.bin", "w");
+    panda_arg_list *args = panda_get_args("bigrams");
+    // MB of histograms to keep before writing some out
+    max_hist_bytes = panda_parse_uint64(args, "mem", 4096) << 20;
+    flush_at = max_hist_bytes;
+
+    mem_report = fopen("bigram_mem_report.bin", "w");
     if(!mem_report) {
         printf("Couldn't write report:\n");
         perror("fopen");
-        return;
+        return false;
     }
 
     // Cross platform support: need to know how big a target_ulong is
     uint32_t target_ulong_size = sizeof(target_ulong);
     fwrite(&target_ulong_size, sizeof(uint32_t), 1, mem_report);
 
-    std::map<prog_point,text_counter>::iterator it;
-    for(it = text_tracker.begin(); it != text_tracker.end(); it++) {
-        // Skip low-data entries
-        if (it->second.num_bytes < 80) continue;
-
-        unsigned int hist_keys = 0;
-        hist_keys = it->second.hist.size();
-
-        // Write the program point
-        fwrite(&it->first, sizeof(prog_point), 1, mem_report);
-
-        // Write the number of keys
-        fwrite(&hist_keys, sizeof(hist_keys), 1, mem_report);
-        
-        // Write each key/value of the (hopefully sparse) histogram
-        std::map<unsigned short,unsigned int>::iterator it2;
-        for(it2 = it->second.hist.begin(); it2 != it->second.hist.end(); it2++) {
-            fwrite(&it2->first, sizeof(it2->first), 1, mem_report);   // Key: unsigned short
-            fwrite(&it2->second, sizeof(it2->second), 1, mem_report); // Value: unsigned int
-        }
-        //printf("Wrote histogram with %d entries (%ld bytes)\n", 
-        //    hist_keys, (sizeof(unsigned short)+sizeof(unsigned long))*hist_keys + sizeof(prog_point) + sizeof(hist_keys));
-    }
+    panda_require("taps");
+    if (!init_taps_api()) return false;
+
+    PPP_REG_CB("taps", on_tap_write, tap_write);
+
+    //text_memlog = fopen("text_memlog.txt", "w");
+
+    return true;
+}
+
+void uninit_plugin(void *self) {
+    printf("Memory statistics: %lu stores, %lu bytes written.\n",
+        num_writes, bytes_written
+    );
+    printf("bigrams: %lu dense histograms, flushed %lu times\n",
+        num_dense, num_flushes
+    );
+
+    flush_hists();
     fclose(mem_report);
-    
+
     //fclose(text_memlog);
 }
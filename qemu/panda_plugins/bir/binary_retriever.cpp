@@ -8,7 +8,10 @@ extern "C" {
 #include <unistd.h>
 #include <stdio.h>
 #include <assert.h>
-#include "my_mem.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+    //#include "my_mem.h"
 
 }
 
@@ -27,6 +30,12 @@ compare_count_pairs (const CountPair & s1, const CountPair & s2) {
 }
 
 extern uint32_t max_row_length;
+extern uint32_t num_score_threads;
+
+// take the log once per query gram, of the sum over all n (Eq 2), which is 
+// what the preprocessor puts in the plugin's score rows.  Otherwise the log
+// term is added after each n, as it always has been here.
+static bool log_once_per_gram = false;
 
 /*
 
@@ -110,109 +119,184 @@ extern uint32_t max_row_length;
 
 std::map < uint32_t, uint32_t > row_sizes;
 
-// query is a passage.  
-// score is 1-d array, one item for each passage in the index
-void query_with_passage (InvIndex & inv,
-                         std::vector < FILE * >fpinv,
-                         Passage & query,
-                         std::vector < float >&par,
-                         std::vector < Score > &score,
-                         uint32_t min_n, uint32_t max_n)  
-{
-    GramPsgCounts ngram_row;
-    ngram_row.size = 0;
-    ngram_row.max_size = 0;
-    ngram_row.counts = NULL;
 
+// what each scoring thread works in
+typedef struct score_scratch_struct {
+    GramPsgCounts ngram_row;
     GramPsgCounts ppngram_row;
-    ppngram_row.size = 0;
-    ppngram_row.max_size = 0;
-    ppngram_row.counts = NULL;
+    // score for each unique passage from this thread's slice of query grams
+    std::vector < float > score;
+    // sum over n of w * P(q|...,PSG) for the query gram at hand.
+    // all zero except for the passages in touched
+    std::vector < float > pppqs;
+    std::vector < uint32_t > touched;
+    // what every passage gets from this thread's slice
+    float base_score;
+} ScoreScratch;
+
+static std::vector < ScoreScratch > scratch;
 
 
-    std::vector < float >pppqs = std::vector < float >(inv.num_passages);
-    std::vector < uint32_t > sc = std::vector < uint32_t > (inv.num_passages);
+// query is a passage.  
+// top gets the top_k best unique passages for it, best first.
+// rows come straight out of the mmapped compact inv index
+//
+// for a query gram q, a passage that has none of its ngrams gets 
+// P(q | PSG is R) = par[0] * P(q|G), so its term in the sum is log(par[0]),
+// the same for every such passage.  So we only visit the passages in the rows,
+// and everyone gets the log(par[0]) terms at the end.
+// The log term is added after each n, i.e. once per n per query gram,
+// or just once per query gram with log_once_per_gram.
+// Each thread takes a slice of the query's grams and its own arrays, 
+// which are summed before picking the top k
+void query_with_passage (IndexCommon *indc,
+                         CompactInvIndex *cinv,
+                         Passage & query,
+                         std::vector < float >&par,
+                         uint32_t min_n, uint32_t max_n,
+                         uint32_t top_k,
+                         std::vector < Score > &top)  
+{
+    uint32_t num_uind = indc->num_uind;
+    std::map < Gram, uint32_t > &qcount = query.contents[indc->max_n_gram].count;
+    std::vector < std::pair < Gram, uint32_t > > grams(qcount.begin(), qcount.end());
+    std::vector < CompactInv * > ci(indc->max_n_gram + 1);
+    for (uint32_t n = indc->min_n_gram; n <= indc->max_n_gram; n++) {
+        ci[n] = cinv->cinv[n];
+    }
+    float total_count = cinv->total_count[1];
 
-    for (int i = 0; i < inv.num_passages; i++) {
-        score[i].ind = i;
-        score[i].val = 0.0;
-        sc[i] = 0;
+    // how much work this is decides how many threads to use
+    uint64_t num_postings = 0;
+    for (auto &kvp : grams) {
+        for (uint32_t n = min_n; n <= max_n; n++) {
+            num_postings += compact_inv_row_size(ci[n], gramsub(kvp.first, indc->max_n_gram - n, n));
+        }
+    }
+    uint32_t nt = score_threads(num_postings, std::max((uint32_t) grams.size(), (uint32_t) 1));
+    if (scratch.size() < nt) {
+        scratch.resize(nt);
     }
 
-    // iterate over highest order ngrams
-    for (auto &kvp : query.contents[inv.max_n_gram].count)    {
-        // e.g., if inv.max_n_gram = 3 this might be the three bytes "abc"
-        Gram gram = kvp.first;
-        // e.g. count("abc" in query)
-        uint32_t gram_count = kvp.second;
-        // since gram is inv.max_n_gram bytes long,
-        // this is the last byte, i.e. the unigram
-        // e.g. "c"
-        Gram g = gramsub(gram, inv.max_n_gram - 1, 1);               
-        // p(q|G) 
-        float pg = ((float) inv.general_query[1][g]) / inv.total_count[1];
-        // clear per-passage for-this-q scores        
-        for (int i = 0; i < inv.num_passages; i++) 	{
-            pppqs[i] = par[0] * pg;
-        }     
-        for (int n = min_n; n <= max_n; n++) 	{
-            // this is the ngram for n
-            // inv.max_n_gram = 3
-            // n=1, we take substring of length 1 starting at pos=2
-            // n=2, we take substring of length 2 starting at pos=1
-            // n=3, we take substring of length 3 starting at pos=0
-            // e.g. for n=2, this would be "bc"
-            Gram ngram = gramsub(gram, inv.max_n_gram - n, n);
-            int res = unmarshall_row_fp (fpinv[n], inv, n, ngram, ngram_row);            
-            if (res == 0) {
-                // row too long
+    parallel_slices(grams.size(), nt, [&](uint32_t t, uint32_t lo, uint32_t hi) {
+        ScoreScratch &ss = scratch[t];
+        GramPsgCounts &ngram_row = ss.ngram_row;
+        GramPsgCounts &ppngram_row = ss.ppngram_row;
+        ss.score.assign(num_uind, 0.0);
+        ss.pppqs.assign(num_uind, 0.0);
+        ss.base_score = 0;
+        float *pppqs = ss.pppqs.data();
+        // iterate over highest order ngrams
+        for (uint32_t k = lo; k < hi; k++) {
+            // e.g., if max_n_gram = 3 this might be the three bytes "abc"
+            Gram gram = grams[k].first;
+            // e.g. count("abc" in query)
+            uint32_t gram_count = grams[k].second;
+            // since gram is max_n_gram bytes long,
+            // this is the last byte, i.e. the unigram
+            // e.g. "c"
+            Gram g = gramsub(gram, indc->max_n_gram - 1, 1);               
+            // p(q|G) 
+            float pg = ((float) compact_inv_general_query(ci[1], g)) / total_count;
+            if (pg == 0) {
+                // byte never seen in the corpus.  says nothing about any passage
                 continue;
             }
-            Gram prev_part;
-            std::map < uint32_t, uint32_t > prev_part_dw;
-            if (n > 1) {
-                // this is everything but the last byte of ngram
-                // e.g. in this case it would be "b"
-                Gram prev_part = gramsub(ngram, 0, n-1);
-                prev_part_dw = unmarshall_doc_word_fp(fpinv[n-1], inv, n-1, prev_part);
-            }
-            float w = par[n];
-            // e.g. iterate over psgs that have bigram "bc"
-            if (ngram_row.size < max_row_length) {
-                //	  printf ("row_size = %d\n", ngram_row.size);
-                //	  row_sizes[ngram_row.size] ++;
-                for (int i = 0; i < ngram_row.size; i++) {
+            float base = par[0] * pg;
+            float base_term = log (base / pg);
+            // now divide each of those per-query-per-passage scores 
+            // by p(q|G), take log, and accumulate result 
+            // into per-passage score, less the base_term everyone gets.
+            // nb: gram_count is right thing to multiply by
+            // if we multiplied by c(q|psg) we'd be overcounting
+            auto add_log_terms = [&]() {
+                for (auto passage_ind : ss.touched) {
+                    ss.score[passage_ind] += gram_count 
+                        * (log ((base + pppqs[passage_ind]) / pg) - base_term);
+                }
+                ss.base_score += gram_count * base_term;
+            };
+            for (uint32_t n = min_n; n <= max_n; n++) 	{
+                // this is the ngram for n
+                // max_n_gram = 3
+                // n=1, we take substring of length 1 starting at pos=2
+                // n=2, we take substring of length 2 starting at pos=1
+                // n=3, we take substring of length 3 starting at pos=0
+                // e.g. for n=2, this would be "bc"
+                Gram ngram = gramsub(gram, indc->max_n_gram - n, n);
+                int res = compact_inv_row (ci[n], ngram, ngram_row);
+                if (res == 0) {
+                    // row too long
+                    continue;
+                }
+                if (n > 1) {
+                    // this is everything but the last byte of ngram
+                    // e.g. in this case it would be "b"
+                    Gram prev_part = gramsub(ngram, 0, n-1);
+                    res = compact_inv_row (ci[n-1], prev_part, ppngram_row);
+                    if (res == 0) {
+                        continue;
+                    }
+                }
+                float w = par[n];
+                // e.g. iterate over psgs that have bigram "bc"
+                // both rows are sorted by passage, and every passage with "bc"
+                // also has "b", so we find the denominators by walking ppngram_row along
+                uint32_t j = 0;
+                for (uint32_t i = 0; i < ngram_row.size; i++) {
                     uint32_t passage_ind = ngram_row.counts[i].passage_ind;
                     // c("bc" in passage_ind)
                     uint32_t c_ngram = ngram_row.counts[i].count;
                     float denom;
                     if (n == 1) {
-                        denom = inv.passage_len_bytes; 
+                        denom = indc->passage_len_bytes; 
                     }
                     else  {
                         // c("b" in passage_ind), where "b" is prev_part 
-                        denom = prev_part_dw[passage_ind];
+                        while (j < ppngram_row.size && ppngram_row.counts[j].passage_ind < passage_ind) {
+                            j ++;
+                        }
+                        if (j == ppngram_row.size || ppngram_row.counts[j].passage_ind != passage_ind) {
+                            continue;
+                        }
+                        denom = ppngram_row.counts[j].count;
                     }
                     float p = ((float) c_ngram) / denom;
+                    if (pppqs[passage_ind] == 0) {
+                        ss.touched.push_back(passage_ind);
+                    }
                     pppqs[passage_ind] += w * p;
                 }
+                if (!log_once_per_gram) {
+                    add_log_terms();
+                }
+            }			// iterate over n
+            if (log_once_per_gram) {
+                add_log_terms();
             }
-            // now divide each of those per-query-per-passage scores 
-            // by p(q|G), take log, and accumulate result 
-            // into per-passage score
-            
-              for (int i = 0; i < inv.num_passages; i++)   {
-                  // nb: gram_count is right thing to multiply by
-                  // if we multiplied by c(q|psg) we'd be overcounting
-                  score[i].val += gram_count * (log (pppqs[i] / pg));
-                  //              score[i].val += gram_count * pppqs[i];
-              }
-              
-        }			// iterate over n
-    }				// iterate over highest-order ngrams
-    // scale the scores
-    // sort the scores
-    std::sort (score.begin (), score.end (), compare_scores);
+            for (auto passage_ind : ss.touched) {
+                pppqs[passage_ind] = 0;
+            }
+            ss.touched.clear();
+        }				// iterate over highest-order ngrams
+    });
+
+    // this is what a passage with none of the query's ngrams scores
+    float base_score = 0;
+    for (uint32_t u = 0; u < nt; u++) {
+        base_score += scratch[u].base_score;
+    }
+    // sum the threads' scores
+    parallel_slices(num_uind, nt, [&](uint32_t t, uint32_t lo, uint32_t hi) {
+        float *score = scratch[0].score.data();
+        for (uint32_t i = lo; i < hi; i++) {
+            for (uint32_t u = 1; u < nt; u++) {
+                score[i] += scratch[u].score[i];
+            }
+            score[i] += base_score;
+        }
+    });
+    top_k_scores(scratch[0].score.data(), num_uind, top_k, top);
 }
 
 
@@ -234,8 +318,9 @@ std::vector < std::string > files = {
 
 int main (int argc, char **argv) {
 
-    if (argc != 7)     {
-        printf ("usage: br inv_pfx num_tests prob_corrupt min_n max_n\n");
+    if (argc < 7 || argc > 9)     {
+        printf ("usage: br inv_pfx num_tests prob_corrupt min_n max_n max_row_length [num_threads [log_once]]\n");
+        printf ("inv_pfx.cinv-n must have been made from the inv index with ic\n");
         exit (1);
     }
 
@@ -245,37 +330,36 @@ int main (int argc, char **argv) {
     uint32_t  min_n = atoi (argv[4]);
     uint32_t  max_n = atoi (argv[5]);
     max_row_length  = atoi(argv[6]);
+    if (argc >= 8) {
+        num_score_threads = atoi(argv[7]);
+    }
+    if (argc == 9) {
+        log_once_per_gram = (atoi(argv[8]) != 0);
+    }
 
     auto t1 = std::chrono::high_resolution_clock::now();
 
-    InvIndex  inv = unmarshall_invindex_min (filename_prefix);
-    std::vector < float >  scoring_params = std::vector < float >(inv.max_n_gram + 1);
+    // need uind_to_psgs to get from scores back to passages
+    IndexCommon *indc = unmarshall_index_common (filename_prefix, true);
+    // this just mmaps the inv index
+    CompactInvIndex *cinv = open_compact_invindex (indc);
+    std::vector < float >  scoring_params = std::vector < float >(indc->max_n_gram + 1);
     // weight for general_query = scoring_param[0] = 1/2
     // weight for n=1 is 1/3
     // weight for n=2 is 1/4
     // etc
-    for (int n = 0; n <= inv.max_n_gram; n++) {
+    for (uint32_t n = 0; n <= indc->max_n_gram; n++) {
         scoring_params[n] = 1.0 / (n + 2);
     }
     
-    std::vector < Score > score = std::vector < Score > (inv.num_passages);
+    uint32_t	top_n = 5;
+    std::vector < Score > score;
     int  p;
     uint32_t num_correct = 0;
 
     printf ("testing\n");
 
 
-    // open up all the inv files
-    std::vector < FILE * >fpinv = std::vector < FILE * >(inv.max_n_gram + 1);
-    for (int n = inv.min_n_gram; n <= inv.max_n_gram; n++)   {
-        // the inv index for this n, i.e. list of doc/count pairs for grams of this n
-        char	filename[65535];
-        sprintf (filename, "%s.inv-%d", inv.filename_prefix.c_str (), n);
-        fpinv[n] = fopen (filename, "r");
-    }
-
-
-          
     auto t2 = std::chrono::high_resolution_clock::now();
     float elapsedSeconds = std::chrono::duration_cast<std::chrono::duration<float>>(t2-t1).count();
     printf ("%.2f seconds\n", elapsedSeconds);
@@ -293,12 +377,12 @@ int main (int argc, char **argv) {
         stat (filename, &fstat);
         long int	file_len = fstat.st_size;
         long int	offset = (random ()) % file_len;
-        uint32_t	len = (random ())	% (inv.passage_len_bytes / 4) + (inv.passage_len_bytes / 4);
-        uint32_t	start_passage_num = offset / (inv.passage_len_bytes / 2);
+        uint32_t	len = (random ())	% (indc->passage_len_bytes / 4) + (indc->passage_len_bytes / 4);
+        uint32_t	start_passage_num = offset / (indc->passage_len_bytes / 2);
         if (start_passage_num > 0)	{
             start_passage_num--;
         }
-        uint32_t	end_passage_num = (offset + len) / (inv.passage_len_bytes / 2);
+        uint32_t	end_passage_num = (offset + len) / (indc->passage_len_bytes / 2);
         printf ("%d query is %s, offset=%ld [psg=%d..%d] len=%d\n",
                 i, filename, offset, start_passage_num, end_passage_num, len);
         FILE *	fp = fopen (filename, "r");
@@ -314,10 +398,9 @@ int main (int argc, char **argv) {
         auto t1 = std::chrono::high_resolution_clock::now();
 	
 
-        Passage  passage = index_passage (inv.lexicon,
+        Passage  passage = index_passage (indc,
                                           /* update_lexicon = */ false,
-                                          inv.min_n_gram, inv.max_n_gram,
-                                          binbuffer, len,
+                                          (uint8_t *) binbuffer, len,
                                           /* note: we dont really care about passage ind */
                                           /* passage_ind = */ 0xdeadbeef);
 
@@ -328,21 +411,20 @@ int main (int argc, char **argv) {
 
 
         t1 = std::chrono::high_resolution_clock::now();
-        query_with_passage (inv, fpinv, passage, scoring_params, score, min_n, max_n);
+        query_with_passage (indc, cinv, passage, scoring_params, min_n, max_n, top_n, score);
         t2 = std::chrono::high_resolution_clock::now();
         elapsedSeconds = std::chrono::duration_cast<std::chrono::duration<float>>(t2-t1).count();
         printf ("query_with_passage %.2f seconds\n", elapsedSeconds);
 
 
-        uint32_t	top_n = 5;
-
-
         bool correct = false;
-        for (int j = 0; j < top_n; j++)	{
+        for (uint32_t j = 0; j < score.size(); j++)	{
             uint32_t the_offset;
-            const char *the_filename = get_passage_name(inv, score[j].ind, &the_offset);
+            // scores are per unique passage.  name it by the first passage with those bytes
+            uint32_t passage_ind = *(indc->uind_to_psgs[score[j].ind].begin());
+            std::string the_filename = get_passage_name(indc, passage_ind, &the_offset);
             if (j==0) {
-                if ((strcmp(the_filename, filename)==0) && (abs(the_offset - offset) < inv.passage_len_bytes) ) {
+                if ((the_filename == filename) && (labs(the_offset - offset) < indc->passage_len_bytes) ) {
                     correct = true;
                     printf ("CORRECT\n");               
                 }
@@ -354,7 +436,7 @@ int main (int argc, char **argv) {
             printf ("Result %d  score = %0.5f  passage = %d [%s-%d]\n",
                     j, score[j].val,
                     score[j].ind, 
-                    the_filename, the_offset);
+                    the_filename.c_str(), the_offset);
         }
       
 #if 0
@@ -68,6 +68,7 @@ bool compare_scores (const Score & s1, const Score & s2) {
 
 
 extern uint32_t max_row_length;
+extern uint32_t num_score_threads;
 
 
 extern "C" {
@@ -293,6 +294,8 @@ bool init_plugin(void *self) {
                 max_row_length = atoi(args->list[i].value);
             } else if (0 == strncmp(args->list[i].key, "pdice", 5)) {
                 pdice_prob = atof(args->list[i].value);
+            } else if (0 == strncmp(args->list[i].key, "threads", 7)) {
+                num_score_threads = atoi(args->list[i].value);
             }
         }
         if (pfx.compare("none") == 0) {
@@ -6,6 +6,9 @@ extern "C"{
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <string.h>
 #include <assert.h>
 
 }
@@ -15,6 +18,8 @@ extern "C"{
 //#include <chrono>
 #include <iostream>
 #include <unordered_set>
+#include <thread>
+#include <functional>
 
 uint32_t max_row_length=1000000;
 
@@ -791,16 +796,10 @@ InvIndex *unmarshall_invindex_min(std::string pfx, IndexCommon *indc) {
 
  
 static GramPsgCounts row;
-static bool row_init = true;
 
+// rows start out as { 0, 0, NULL }.  
+// no shared state here, since scoring threads decode rows at the same time
 void resize_doc_word(GramPsgCounts &row, uint32_t desired_size) {
-    if (row_init) {
-        row_init = false;
-        row.size = 0;
-        row.counts = NULL;
-        row.max_size = desired_size;
-        row.counts = (CountPair *) malloc(sizeof(CountPair) * row.max_size);
-    }
     // we only ever grow this thing
     if (row.max_size < desired_size) {
         row.max_size = desired_size;
@@ -872,6 +871,272 @@ std::map < uint32_t, uint32_t > unmarshall_doc_word_fp(FILE *fp, InvIndex *inv,
 }
 
 
+//////////////////////////////////////////////////////////////////////
+//
+// compact inv index
+//
+// pfx.cinv-n is laid out so it can be mmapped and used as is
+//
+//   header        CompactInvHeader
+//   grams         uint64_t[num_grams], sorted
+//   offsets       uint64_t[num_grams+1], into postings
+//   general_query uint32_t[num_grams]
+//   postings      uint8_t[postings_len]
+//
+// each row in postings is a varint row length followed by varint pairs of
+// (passage_ind - previous passage_ind, count).  passage_inds are ascending,
+// so the deltas are small and most pairs take two or three bytes
+// instead of the eight a CountPair takes in pfx.inv-n
+
+#define CINV_MAGIC "BIRCINV1"
+
+typedef struct compact_inv_header_struct {
+    char magic[8];
+    uint32_t n;
+    uint32_t num_grams;
+    uint64_t postings_len;
+} CompactInvHeader;
+
+
+static inline void write_varint(std::vector < uint8_t > &buf, uint32_t v) {
+    while (v >= 0x80) {
+        buf.push_back((v & 0x7f) | 0x80);
+        v >>= 7;
+    }
+    buf.push_back(v);
+}
+
+
+static inline uint32_t read_varint(const uint8_t *&p) {
+    uint32_t v = *p & 0x7f;
+    uint32_t shift = 7;
+    while (*p++ & 0x80) {
+        v |= ((uint32_t) (*p & 0x7f)) << shift;
+        shift += 7;
+    }
+    return v;
+}
+
+
+static bool compare_count_pair_psg(const CountPair &c1, const CountPair &c2) {
+    return (c1.passage_ind < c2.passage_ind);
+}
+
+
+// reads rows for grams in the order they are in pfx.inv-map-n, which is 
+// sorted since it was written from a map.  general query counts come
+// from pfx.gen-n, also sorted, so we walk it alongside.
+// nothing but the output arrays are ever held in memory
+static void convert_inv_compact(std::string pfx, uint32_t n) {
+    std::string sn = std::to_string(n);
+    FILE *fpmap = fopen((char *) (pfx + ".inv-map-" + sn).c_str(), "r");
+    FILE *fpgen = fopen((char *) (pfx + ".gen-" + sn).c_str(), "r");
+    FILE *fpinv = fopen((char *) (pfx + ".inv-" + sn).c_str(), "r");
+    std::string filename = pfx + ".cinv-" + sn;
+    FILE *fp = fopen((char *) filename.c_str(), "w");
+    assert (fpmap && fpgen && fpinv && fp);
+    uint32_t num_grams, num_gen;
+    size_t nnn = fread(&num_grams, sizeof(num_grams), 1, fpmap);
+    assert (nnn == 1);
+    nnn = fread(&num_gen, sizeof(num_gen), 1, fpgen);
+    assert (nnn == 1);
+    printf ("converting inv index for n=%d, %d grams -> %s\n", n, num_grams, filename.c_str());
+    std::vector < Gram > grams(num_grams);
+    std::vector < uint64_t > offsets(num_grams + 1);
+    std::vector < uint32_t > general_query(num_grams);
+    // postings go after the arrays, which we write last
+    long postings_start = sizeof(CompactInvHeader) 
+        + num_grams * (sizeof(Gram) + sizeof(uint64_t) + sizeof(uint32_t)) + sizeof(uint64_t);
+    fseek(fp, postings_start, SEEK_SET);
+    std::vector < CountPair > counts;
+    std::vector < uint8_t > buf;
+    uint64_t postings_len = 0;
+    uint32_t gen_i = 0;
+    Gram gen_gram = 0;
+    uint32_t gen_count = 0;
+    bool gen_read = false;
+    for (uint32_t i=0; i<num_grams; i++) {
+        Gram gram;
+        long pos;
+        nnn = fread(&gram, sizeof(gram), 1, fpmap);
+        nnn += fread(&pos, sizeof(pos), 1, fpmap);
+        assert (nnn == 2);
+        assert (i == 0 || gram > grams[i-1]);
+        grams[i] = gram;
+        // catch up with this gram in the general query counts
+        while (gen_i < num_gen && !(gen_read && gen_gram >= gram)) {
+            nnn = fread(&gen_gram, sizeof(gen_gram), 1, fpgen);
+            nnn += fread(&gen_count, sizeof(gen_count), 1, fpgen);
+            assert (nnn == 2);
+            gen_i ++;
+            gen_read = true;
+        }
+        general_query[i] = (gen_read && gen_gram == gram) ? gen_count : 0;
+        // this gram's row
+        fseek(fpinv, pos, SEEK_SET);
+        uint32_t occ;
+        nnn = fread(&occ, sizeof(occ), 1, fpinv);
+        assert (nnn == 1);
+        counts.resize(occ);
+        nnn = fread(counts.data(), sizeof(CountPair), occ, fpinv);
+        assert (nnn == occ);
+        if (!std::is_sorted(counts.begin(), counts.end(), compare_count_pair_psg)) {
+            std::sort(counts.begin(), counts.end(), compare_count_pair_psg);
+        }
+        buf.clear();
+        write_varint(buf, occ);
+        uint32_t prev = 0;
+        for ( auto &c : counts ) {
+            write_varint(buf, c.passage_ind - prev);
+            write_varint(buf, c.count);
+            prev = c.passage_ind;
+        }
+        offsets[i] = postings_len;
+        fwrite(buf.data(), 1, buf.size(), fp);
+        postings_len += buf.size();
+    }
+    offsets[num_grams] = postings_len;
+    CompactInvHeader hdr;
+    memcpy(hdr.magic, CINV_MAGIC, sizeof(hdr.magic));
+    hdr.n = n;
+    hdr.num_grams = num_grams;
+    hdr.postings_len = postings_len;
+    fseek(fp, 0, SEEK_SET);
+    WU(hdr);
+    fwrite(grams.data(), sizeof(Gram), num_grams, fp);
+    fwrite(offsets.data(), sizeof(uint64_t), num_grams + 1, fp);
+    fwrite(general_query.data(), sizeof(uint32_t), num_grams, fp);
+    fclose(fp);
+    fclose(fpinv);
+    fclose(fpgen);
+    fclose(fpmap);
+    printf ("%lu bytes of postings\n", (unsigned long) postings_len);
+}
+
+
+void convert_invindex_compact(std::string pfx) {
+    IndexCommon indc;
+    unmarshall_indc(pfx, &indc);
+    for (uint32_t n=indc.min_n_gram; n<=indc.max_n_gram; n++) {
+        convert_inv_compact(pfx, n);
+    }
+}
+
+
+CompactInv *open_compact_inv(std::string filename) {
+    int fd = open((char *) filename.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    size_t len = st.st_size;
+    if (len < sizeof(CompactInvHeader)) {
+        close(fd);
+        return NULL;
+    }
+    void *map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    CompactInvHeader *hdr = (CompactInvHeader *) map;
+    uint64_t ng = hdr->num_grams;
+    if (memcmp(hdr->magic, CINV_MAGIC, sizeof(hdr->magic)) != 0
+        || len != sizeof(CompactInvHeader) + ng * (sizeof(Gram) + sizeof(uint64_t) + sizeof(uint32_t)) 
+                  + sizeof(uint64_t) + hdr->postings_len) {
+        munmap(map, len);
+        return NULL;
+    }
+    CompactInv *ci = new CompactInv;
+    ci->n = hdr->n;
+    ci->num_grams = hdr->num_grams;
+    ci->grams = (const Gram *) (hdr + 1);
+    ci->offsets = (const uint64_t *) (ci->grams + ng);
+    ci->general_query = (const uint32_t *) (ci->offsets + ng + 1);
+    ci->postings = (const uint8_t *) (ci->general_query + ng);
+    ci->map = map;
+    ci->map_len = len;
+    return ci;
+}
+
+
+void close_compact_inv(CompactInv *ci) {
+    munmap(ci->map, ci->map_len);
+    delete ci;
+}
+
+
+CompactInvIndex *open_compact_invindex(IndexCommon *indc) {
+    std::string pfx = indc->filename_prefix;
+    CompactInvIndex *cinv = new CompactInvIndex;
+    for (uint32_t n=indc->min_n_gram; n<=indc->max_n_gram; n++) {
+        std::string filename = pfx + ".cinv-" + std::to_string(n);
+        CompactInv *ci = open_compact_inv(filename);
+        if (ci == NULL) {
+            printf ("%s is missing or not a compact inv index\n", filename.c_str());
+            exit(1);
+        }
+        cinv->cinv[n] = ci;
+    }
+    cinv->total_count = unmarshall_uint32_uint32_map(pfx + ".total_count");
+    return cinv;
+}
+
+
+uint32_t compact_inv_find(const CompactInv *ci, const Gram gram) {
+    const Gram *end = ci->grams + ci->num_grams;
+    const Gram *g = std::lower_bound(ci->grams, end, gram);
+    if (g == end || *g != gram) {
+        return ci->num_grams;
+    }
+    return g - ci->grams;
+}
+
+
+uint32_t compact_inv_general_query(const CompactInv *ci, const Gram gram) {
+    uint32_t i = compact_inv_find(ci, gram);
+    if (i == ci->num_grams) {
+        return 0;
+    }
+    return ci->general_query[i];
+}
+
+
+uint32_t compact_inv_row_size(const CompactInv *ci, const Gram gram) {
+    uint32_t i = compact_inv_find(ci, gram);
+    if (i == ci->num_grams) {
+        return 0;
+    }
+    const uint8_t *p = ci->postings + ci->offsets[i];
+    return read_varint(p);
+}
+
+
+int compact_inv_row(const CompactInv *ci, const Gram gram, GramPsgCounts &row) {
+    row.size = 0;
+    uint32_t i = compact_inv_find(ci, gram);
+    if (i == ci->num_grams) {
+        return 0;
+    }
+    const uint8_t *p = ci->postings + ci->offsets[i];
+    uint32_t occ = read_varint(p);
+    // some on-the-fly pruning
+    if (occ > max_row_length) {
+        return 0;
+    }
+    resize_doc_word(row, occ);
+    row.size = occ;
+    uint32_t passage_ind = 0;
+    for (uint32_t j=0; j<occ; j++) {
+        passage_ind += read_varint(p);
+        row.counts[j].passage_ind = passage_ind;
+        row.counts[j].count = read_varint(p);
+    }
+    return 1;
+}
+
+
 void marshall_invindex(IndexCommon *indc, InvIndex *inv) {
     std::string pfx = indc->filename_prefix;
     std::string filename;
@@ -1015,8 +1280,73 @@ static bool compare_scores (const Score & s1, const Score & s2) {
 // query is a passage.  
 
 
-Score *score = NULL;
-uint32_t max_num_uind = 0;
+// 0 means one per cpu
+uint32_t num_score_threads = 0;
+
+// below this many postings in a query it costs more to start threads than they save
+#define PARALLEL_MIN_POSTINGS 65536
+
+uint32_t score_threads(uint64_t num_postings, uint32_t max_threads) {
+    if (num_postings < PARALLEL_MIN_POSTINGS) {
+        return 1;
+    }
+    uint32_t nt = num_score_threads;
+    if (nt == 0) {
+        nt = std::thread::hardware_concurrency();
+    }
+    nt = std::min(nt, max_threads);
+    return std::max(nt, (uint32_t) 1);
+}
+
+
+// splits [0,num) into num_threads contiguous slices and runs fn(t, lo, hi) 
+// for each, slice 0 on this thread and the rest on their own threads
+void parallel_slices(uint32_t num, uint32_t num_threads, 
+                     std::function < void (uint32_t, uint32_t, uint32_t) > fn) {
+    std::vector < std::thread > threads;
+    for (uint32_t t=1; t<num_threads; t++) {
+        threads.push_back(std::thread(fn, t, 
+                                      (uint64_t) num * t / num_threads,
+                                      (uint64_t) num * (t+1) / num_threads));
+    }
+    fn(0, 0, num / num_threads);
+    for ( auto &th : threads ) {
+        th.join();
+    }
+}
+
+
+// the k best scores, best first.  
+// keeps a min-heap of the best k so far, which costs num*log(k) instead of num*log(num)
+void top_k_scores(const float *score, uint32_t num, uint32_t k, std::vector < Score > &top) {
+    top.clear();
+    k = std::min(k, num);
+    if (k == 0) {
+        return;
+    }
+    // a min-heap wrt val, so top[0] is the one to beat
+    auto cmp = compare_scores;
+    for (uint32_t i=0; i<num; i++) {
+        if (top.size() < k) {
+            Score s = { i, score[i] };
+            top.push_back(s);
+            std::push_heap(top.begin(), top.end(), cmp);
+        }
+        else if (score[i] > top[0].val) {
+            std::pop_heap(top.begin(), top.end(), cmp);
+            top.back().ind = i;
+            top.back().val = score[i];
+            std::push_heap(top.begin(), top.end(), cmp);
+        }
+    }
+    // sort_heap leaves it ascending wrt cmp, i.e. best first
+    std::sort_heap(top.begin(), top.end(), cmp);
+}
+
+
+// per-thread score accumulators, so threads never write to the same array
+static std::vector < std::vector < float > > thread_score;
+
 /*
   query contains a passage
   scorepair is preprocessed score arrays. let n = scorepare[max_n_gram].first.  
@@ -1024,62 +1354,72 @@ uint32_t max_num_uind = 0;
   scorepair[max_n_gram].second[i].ind is a passage ind and .val is the preprocessed score to add for that psg.
 */ 
 void query_with_passage (IndexCommon *indc, Passage *query, PpScores *pps, uint32_t *ind, float *best_score) {
-    if (score == NULL) {
-        score = (Score *) malloc (sizeof(Score) * indc->num_uind);
-        max_num_uind = indc->num_uind;
-    }
-    if (indc->num_uind > max_num_uind) {
-        score = (Score *) realloc(score, sizeof(Score) * indc->num_uind);
-        max_num_uind = indc->num_uind;
-    }
-   // clear the scores
-    for (uint32_t i = 0; i < indc->num_uind; i++) {
-        score[i].ind = i;
-        score[i].val = 0.0;
-    }
-    // iterate over highest order ngrams in the "query"
+    uint32_t num_uind = indc->num_uind;
+    // find the rows for the highest order ngrams in the "query" up front,
+    // so the threads just add up flat arrays
+    std::vector < std::pair < ScoreRow *, uint32_t > > rows;
+    uint64_t num_postings = 0;
     for (auto &kvp : query->contents[indc->max_n_gram].count)    {
-        Gram gram = kvp.first;
-        uint32_t gram_count = kvp.second;
-        if (pps->scorerow.find(gram) == pps->scorerow.end()) {
+        auto it = pps->scorerow.find(kvp.first);
+        if (it == pps->scorerow.end()) {
             continue;
         }
-        uint32_t rowsize = pps->scorerow[gram].len;
-        assert (rowsize < indc->num_uind);
-        Score *sp = pps->scorerow[gram].el;
-        for (uint32_t i=0; i<rowsize; i++) {
-            uint32_t uid = sp[i].ind; 
-            if (uid >= indc->num_uind) {
-                printf ("uid=%d num_uinq=%d\n", uid, indc->num_uind);
-                assert (uid < indc->num_uind);
+        assert (it->second.len < num_uind);
+        rows.push_back(std::make_pair(&(it->second), kvp.second));
+        num_postings += it->second.len;
+    }
+    uint32_t nt = score_threads(num_postings, std::max((uint32_t) rows.size(), (uint32_t) 1));
+    if (thread_score.size() < nt) {
+        thread_score.resize(nt);
+    }
+    // each thread adds up the rows for a slice of the query's grams
+    parallel_slices(rows.size(), nt, [&](uint32_t t, uint32_t lo, uint32_t hi) {
+        std::vector < float > &score = thread_score[t];
+        score.assign(num_uind, 0.0);
+        for (uint32_t r=lo; r<hi; r++) {
+            uint32_t gram_count = rows[r].second;
+            uint32_t rowsize = rows[r].first->len;
+            Score *sp = rows[r].first->el;
+            for (uint32_t i=0; i<rowsize; i++) {
+                uint32_t uid = sp[i].ind; 
+                if (uid >= num_uind) {
+                    printf ("uid=%d num_uinq=%d\n", uid, num_uind);
+                    assert (uid < num_uind);
+                }
+                score[uid] += gram_count * sp[i].val;
             }
-            score[uid].val += gram_count * sp[i].val;
         }
-    }
-    // scale the scores
+    });
+    // then, for a slice of passages each, sum the threads' scores, 
+    // scale them, and find the best in the slice
+    uint32_t total = query->contents[indc->max_n_gram].total;
+    std::vector < Score > best(nt);
+    parallel_slices(num_uind, nt, [&](uint32_t t, uint32_t lo, uint32_t hi) {
+        float *score = thread_score[0].data();
+        float max_score = -10000.0;
+        uint32_t argmax = 0;
+        for (uint32_t i = lo; i < hi; i++) {
+            for (uint32_t u = 1; u < nt; u++) {
+                score[i] += thread_score[u][i];
+            }
+            score[i] /= total;
+            if (score[i] > max_score) {
+                max_score = score[i];
+                argmax = i;
+            }
+        }
+        best[t].ind = argmax;
+        best[t].val = max_score;
+    });
+    // slices are in passage order, so ties still go to the lowest passage
     float max_score = -10000.0;
     uint32_t argmax = 0;
-    //    float min_score = 10000.0;
-    //    uint32_t argmin = 0;
-    for (uint32_t i = 0; i < indc->num_uind; i++) {
-        score[i].val /= query->contents[indc->max_n_gram].total;
-        if (score[i].val > max_score) {
-            max_score = score[i].val;
-            argmax = i;
+    for ( auto &b : best ) {
+        if (b.val > max_score) {
+            max_score = b.val;
+            argmax = b.ind;
         }
     }
-    /*
-    std::sort (score.begin (), score.end (), compare_scores);  
-    for (uint32_t i=0; i<5; i++) {
-        printf ("%d %d %.4f\n", i, score[i].ind, score[i].val);
-        for ( auto &el : indc->uind_to_psgs[score[i].ind] ) {
-            printf ("%d ", el);
-        }
-        printf ("\n");
-    }
-    
-    printf ("min_score = %.5f\n", min_score);
-    */
     *ind = argmax;
     *best_score = max_score;
 }
@@ -10,6 +10,7 @@ extern "C"{
 #include <algorithm>
 #include <vector>
 #include <string>
+#include <functional>
 
 
 
@@ -115,6 +116,33 @@ typedef struct invindex_struct {
 } InvIndex;
 
 
+// compact inverted index for one value of n, mmapped read-only from
+// pfx.cinv-n (see convert_invindex_compact for the file layout).
+// grams are sorted so rows are found by binary search.
+// the row for grams[i] is postings[offsets[i] .. offsets[i+1]),
+// which is varint-encoded: row length, then (passage_ind delta, count) pairs
+typedef struct compact_inv_struct {
+    uint32_t n;
+    uint32_t num_grams;
+    const Gram *grams;
+    const uint64_t *offsets;
+    // general_query[i] is the count for grams[i] across all passages
+    const uint32_t *general_query;
+    const uint8_t *postings;
+    void *map;
+    size_t map_len;
+} CompactInv;
+
+
+// what the retriever needs of an inv index, without the maps
+typedef struct compact_invindex_struct {
+    // cinv[n] is the compact inv index for this n
+    std::map < uint32_t, CompactInv * > cinv;
+    // total counts for each n gram n.
+    std::map < uint32_t, uint32_t > total_count;
+} CompactInvIndex;
+
+
 typedef struct score_struct {
     uint32_t ind;
     float val;
@@ -266,7 +294,30 @@ Index *unmarshall_index(std::string pfx, IndexCommon *indc, bool passages) ;
 // if uind_to_psgs is false, then we DONT load
 IndexCommon *unmarshall_index_common(const std::string pfx, bool uind_to_psgs) ;
 InvIndex *unmarshall_invindex_min(std::string pfx, IndexCommon *indc);
+void unmarshall_indc(const std::string pfx, IndexCommon *indc);
+
+// writes pfx.cinv-n for each n from the pfx.inv-map-n, pfx.inv-n and pfx.gen-n files
+void convert_invindex_compact(std::string pfx);
+// returns NULL if filename isnt a compact inv index
+CompactInv *open_compact_inv(std::string filename);
+void close_compact_inv(CompactInv *ci);
+CompactInvIndex *open_compact_invindex(IndexCommon *indc);
+// index of gram in ci->grams, or ci->num_grams if it isnt there
+uint32_t compact_inv_find(const CompactInv *ci, const Gram gram);
+uint32_t compact_inv_general_query(const CompactInv *ci, const Gram gram);
+// length of the row for gram, 0 if it isnt there
+uint32_t compact_inv_row_size(const CompactInv *ci, const Gram gram);
+// same contract as unmarshall_row_fp.  also returns 0 if gram isnt there
+int compact_inv_row(const CompactInv *ci, const Gram gram, GramPsgCounts &row);
 void query_with_passage (IndexCommon *indc, Passage *query, PpScores *pps, uint32_t *ind, float *score);
+
+// scoring runs on up to num_score_threads threads (0 means one per cpu), 
+// but only if there are enough postings to be worth it
+uint32_t score_threads(uint64_t num_postings, uint32_t max_threads);
+void parallel_slices(uint32_t num, uint32_t num_threads, 
+                     std::function < void (uint32_t, uint32_t, uint32_t) > fn);
+// top gets the k best of score[0..num), best first
+void top_k_scores(const float *score, uint32_t num, uint32_t k, std::vector < Score > &top);
 Passage index_passage (IndexCommon *indc, bool update,
                        uint8_t *binary_passage, uint32_t len,
                        uint32_t uind);
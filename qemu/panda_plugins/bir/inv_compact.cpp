@@ -0,0 +1,28 @@
+
+extern "C" {
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+}
+
+#include "index.hpp"
+
+
+// converts the inv index rows and general query counts marshalled by
+// marshall_invindex (or the merger) into pfx.cinv-n files, 
+// which the retriever mmaps instead of unmarshalling
+int main(int argc, char **argv) {
+
+    if (argc != 2) {
+        printf ("usage: ic inv_pfx\n");
+        printf ("inv_pfx is file pfx for inv index containing counts\n");
+        exit(1);
+    }
+
+    std::string pfx = std::string(argv[1]);
+    convert_invindex_compact(pfx);
+    printf ("done\n");
+
+}
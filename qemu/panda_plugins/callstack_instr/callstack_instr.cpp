@@ -45,6 +45,7 @@ void uninit_plugin(void *);
 #include <map>
 #include <set>
 #include <vector>
+#include <unordered_map>
 #include <algorithm>
 
 #include "../common/prog_point.h"
@@ -74,7 +75,8 @@ enum instr_type {
 };
 
 struct stack_entry {
-    target_ulong pc;
+    target_ulong pc;        // return address
+    target_ulong function;  // entry point of the function called
     instr_type kind;
 };
 
@@ -90,16 +92,37 @@ std::map<target_ulong,std::set<target_ulong>> stacks_seen;
 typedef std::pair<target_ulong,target_ulong> stackid;
 target_ulong cached_sp = 0;
 target_ulong cached_asid = 0;
+
+struct stackid_hash {
+    size_t operator()(const stackid &id) const {
+        return std::hash<target_ulong>()(id.first) * 31 + std::hash<target_ulong>()(id.second);
+    }
+};
 #else
 typedef target_ulong stackid;
+typedef std::hash<target_ulong> stackid_hash;
 #endif
 
-// stackid -> shadow stack
-std::map<stackid, std::vector<stack_entry>> callstacks;
-// stackid -> function entry points
-std::map<stackid, std::vector<target_ulong>> function_stacks;
-// EIP -> instr_type
-std::map<target_ulong, instr_type> call_cache;
+// stackid -> shadow stack.  Elements of an unordered_map don't move, so we
+// can hold on to the last stack we used.
+std::unordered_map<stackid, std::vector<stack_entry>, stackid_hash> callstacks;
+stackid last_stackid;
+std::vector<stack_entry> *last_stack = NULL;
+
+// (asid, pc) -> instr_type for every block translated, kernel blocks under
+// asid 0.  Looked up on every block exec, so it's a flat open-addressed
+// table instead of a std::map.
+struct call_cache_entry {
+    target_ulong asid;
+    target_ulong pc;
+    instr_type kind;
+    bool used;
+};
+
+call_cache_entry *call_cache = NULL;
+uint64_t call_cache_mask = 0;
+uint64_t call_cache_count = 0;
+
 int last_ret_size = 0;
 
 static inline bool in_kernelspace(CPUState *env) {
@@ -198,8 +221,68 @@ static stackid get_stackid(CPUState *env, target_ulong addr) {
 #endif
 }
 
+static inline std::vector<stack_entry> &get_stack(CPUState *env, target_ulong addr) {
+    stackid id = get_stackid(env, addr);
+    if (!last_stack || id != last_stackid) {
+        last_stackid = id;
+        last_stack = &callstacks[id];
+    }
+    return *last_stack;
+}
+
+static inline target_ulong get_cache_asid(CPUState *env, target_ulong addr) {
+    // Kernel code is the same in every address space
+    return in_kernelspace(env) ? 0 : get_asid(env, addr);
+}
+
+static inline call_cache_entry *call_cache_slot(target_ulong asid, target_ulong pc) {
+    uint64_t h = (uint64_t)asid * 0x9e3779b97f4a7c15ULL ^ (uint64_t)pc;
+    h ^= h >> 29;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 32;
+
+    uint64_t i = h & call_cache_mask;
+    while (call_cache[i].used &&
+            (call_cache[i].pc != pc || call_cache[i].asid != asid)) {
+        i = (i + 1) & call_cache_mask;
+    }
+    return &call_cache[i];
+}
+
+static void call_cache_grow(void) {
+    call_cache_entry *old = call_cache;
+    uint64_t old_size = old ? call_cache_mask + 1 : 0;
+    uint64_t size = old ? 2 * old_size : 1 << 16;
+
+    call_cache = (call_cache_entry *) calloc(size, sizeof(call_cache_entry));
+    call_cache_mask = size - 1;
+    for (uint64_t i = 0; i < old_size; i++) {
+        if (old[i].used) {
+            *call_cache_slot(old[i].asid, old[i].pc) = old[i];
+        }
+    }
+    free(old);
+}
+
+static void call_cache_insert(target_ulong asid, target_ulong pc, instr_type kind) {
+    // keep load under 1/2 so probe runs stay short
+    if (2 * (call_cache_count + 1) > call_cache_mask + 1) {
+        call_cache_grow();
+    }
+    call_cache_entry *e = call_cache_slot(asid, pc);
+    if (!e->used) {
+        e->used = true;
+        e->asid = asid;
+        e->pc = pc;
+        call_cache_count++;
+    }
+    e->kind = kind;
+}
+
 instr_type disas_block(CPUState* env, target_ulong pc, int size) {
-    unsigned char *buf = (unsigned char *) malloc(size);
+    // A TB is never more than a page of guest code
+    unsigned char buf[TARGET_PAGE_SIZE];
+    assert(size <= TARGET_PAGE_SIZE);
     int err = panda_virtual_memory_rw(env, pc, buf, size, 0);
     if (err == -1) printf("Couldn't read TB memory!\n");
     instr_type res = INSTR_UNKNOWN;
@@ -282,29 +365,28 @@ instr_type disas_block(CPUState* env, target_ulong pc, int size) {
 #endif
 
 done:
-    free(buf);
     return res;
 }
 
 int after_block_translate(CPUState *env, TranslationBlock *tb) {
-    call_cache[tb->pc] = disas_block(env, tb->pc, tb->size);
-    
+    call_cache_insert(get_cache_asid(env, tb->pc), tb->pc,
+            disas_block(env, tb->pc, tb->size));
+
     return 1;
 }
 
 int before_block_exec(CPUState *env, TranslationBlock *tb) {
-    std::vector<stack_entry> &v = callstacks[get_stackid(env,tb->pc)];
-    std::vector<target_ulong> &w = function_stacks[get_stackid(env,tb->pc)];
+    std::vector<stack_entry> &v = get_stack(env,tb->pc);
     if (v.empty()) return 1;
 
     // Search up to 10 down
     for (int i = v.size()-1; i > ((int)(v.size()-10)) && i >= 0; i--) {
         if (tb->pc == v[i].pc) {
             //printf("Matched at depth %d\n", v.size()-i);
+            target_ulong function = v[i].function;
             v.erase(v.begin()+i, v.end());
 
-            PPP_RUN_CB(on_ret, env, w[i]);
-            w.erase(w.begin()+i, w.end());
+            PPP_RUN_CB(on_ret, env, function);
 
             break;
         }
@@ -314,18 +396,26 @@ int before_block_exec(CPUState *env, TranslationBlock *tb) {
 }
 
 int after_block_exec(CPUState *env, TranslationBlock *tb, TranslationBlock *next) {
-    instr_type tb_type = call_cache[tb->pc];
+    target_ulong asid = get_cache_asid(env, tb->pc);
+    call_cache_entry *e = call_cache_slot(asid, tb->pc);
+    instr_type tb_type;
+    if (e->used) {
+        tb_type = e->kind;
+    } else {
+        // TB was translated in another address space (shared code)
+        tb_type = disas_block(env, tb->pc, tb->size);
+        call_cache_insert(asid, tb->pc, tb_type);
+    }
 
     if (tb_type == INSTR_CALL) {
-        stack_entry se = {tb->pc+tb->size,tb_type};
-        callstacks[get_stackid(env,tb->pc)].push_back(se);
-
         // Also track the function that gets called
         target_ulong pc, cs_base;
         int flags;
         // This retrieves the pc in an architecture-neutral way
         cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
-        function_stacks[get_stackid(env,tb->pc)].push_back(pc);
+
+        stack_entry se = {tb->pc+tb->size,pc,tb_type};
+        get_stack(env,tb->pc).push_back(se);
 
         PPP_RUN_CB(on_call, env, pc);
     }
@@ -339,7 +429,7 @@ int after_block_exec(CPUState *env, TranslationBlock *tb, TranslationBlock *next
 
 // Public interface implementation
 int get_callers(target_ulong callers[], int n, CPUState *env) {
-    std::vector<stack_entry> &v = callstacks[get_stackid(env,env->panda_guest_pc)];
+    std::vector<stack_entry> &v = get_stack(env,env->panda_guest_pc);
     auto rit = v.rbegin();
     int i = 0;
     for (/*no init*/; rit != v.rend() && i < n; ++rit, ++i) {
@@ -349,14 +439,14 @@ int get_callers(target_ulong callers[], int n, CPUState *env) {
 }
 
 int get_functions(target_ulong functions[], int n, CPUState *env) {
-    std::vector<target_ulong> &v = function_stacks[get_stackid(env,env->panda_guest_pc)];
+    std::vector<stack_entry> &v = get_stack(env,env->panda_guest_pc);
     if (v.empty()) {
         return 0;
     }
     auto rit = v.rbegin();
     int i = 0;
     for (/*no init*/; rit != v.rend() && i < n; ++rit, ++i) {
-        functions[i] = *rit;
+        functions[i] = rit->function;
     }
     return i;
 }
@@ -394,6 +484,8 @@ bool init_plugin(void *self) {
     panda_enable_memcb();
     panda_enable_precise_pc();
 
+    call_cache_grow();
+
     pcb.after_block_translate = after_block_translate;
     panda_register_callback(self, PANDA_CB_AFTER_BLOCK_TRANSLATE, pcb);
     pcb.after_block_exec = after_block_exec;
@@ -405,4 +497,5 @@ bool init_plugin(void *self) {
 }
 
 void uninit_plugin(void *self) {
+    free(call_cache);
 }
@@ -24,6 +24,7 @@ extern "C" {
 #include "disas.h"
 
 #include "panda_plugin.h"
+#include "../taps/taps.h"
 
 }
 
@@ -31,12 +32,13 @@ extern "C" {
 #include <stdlib.h>
 #include <ctype.h>
 #include <math.h>
-#include <map>
-#include <list>
+#include <vector>
+#include <unordered_map>
 #include <algorithm>
 
 #include "../common/prog_point.h"
-#include "../callstack_instr/callstack_instr_ext.h"
+#include "../taps/taps_ext.h"
+#include "panda_plugin_plugin.h"
 
 // These need to be extern "C" so that the ABI is compatible with
 // QEMU/PANDA, which is written in C
@@ -44,32 +46,35 @@ extern "C" {
 
 bool init_plugin(void *);
 void uninit_plugin(void *);
-int mem_write_callback(CPUState *env, target_ulong pc, target_ulong addr, target_ulong size, void *buf);
 
 }
 
 struct recent_addr {
-    prog_point p;
+    uint32_t tap;
     target_ulong start_addr;
     target_ulong end_addr;
 };
 
 #define HISTORY_SIZE 5
+#define NO_TAP UINT32_MAX
 recent_addr history[HISTORY_SIZE];
 int history_pos = 0;
-std::map<std::pair<prog_point,prog_point>,int> correlated;
 
-int mem_write_callback(CPUState *env, target_ulong pc, target_ulong addr,
-                       target_ulong size, void *buf) {
-    prog_point p = {};
-    get_prog_point(env, &p);
+// (first tap ID << 32 | second tap ID) -> count
+std::unordered_map<uint64_t,int> correlated;
 
+static inline uint64_t tap_pair(uint32_t first, uint32_t second) {
+    return ((uint64_t)first << 32) | second;
+}
+
+static void tap_write(CPUState *env, uint32_t tap, const prog_point *p,
+                      target_ulong addr, target_ulong size, void *buf) {
     for (int i = 0; i < HISTORY_SIZE; i++) {
-        if (history[i].p == p) continue;
+        if (history[i].tap == tap || history[i].tap == NO_TAP) continue;
         if (addr == history[i].end_addr)
-            correlated[std::make_pair(history[i].p, p)]++;
+            correlated[tap_pair(history[i].tap, tap)]++;
         else if (addr+size == history[i].start_addr)
-            correlated[std::make_pair(p, history[i].p)]++;
+            correlated[tap_pair(tap, history[i].tap)]++;
     }
 
     // Handle cases like rep stosd. We want to keep extending the
@@ -77,7 +82,7 @@ int mem_write_callback(CPUState *env, target_ulong pc, target_ulong addr,
     // is contiguous. If it's not contiguous, keep the most recent
     // one. Either way, don't add to the history until the program
     // point has actually changed.
-    if (history[history_pos].p == p) {
+    if (history[history_pos].tap == tap) {
         // Can we extend the old one?
         if (history[history_pos].start_addr == addr+size) {
             history[history_pos].start_addr = addr;
@@ -94,28 +99,23 @@ int mem_write_callback(CPUState *env, target_ulong pc, target_ulong addr,
     }
     else {
         history_pos = (history_pos + 1) % HISTORY_SIZE;
-        history[history_pos].p = p;
+        history[history_pos].tap = tap;
         history[history_pos].start_addr = addr;
         history[history_pos].end_addr = addr+size;
     }
- 
-    return 1;
 }
 
 bool init_plugin(void *self) {
-    panda_cb pcb;
-
     printf("Initializing plugin correlatetaps\n");
 
-    if(!init_callstack_instr_api()) return false;
+    panda_require("taps");
+    if(!init_taps_api()) return false;
 
-    // Need this to get EIP with our callbacks
-    panda_enable_precise_pc();
-    // Enable memory logging
-    panda_enable_memcb();
+    for (int i = 0; i < HISTORY_SIZE; i++) {
+        history[i].tap = NO_TAP;
+    }
 
-    pcb.virt_mem_write = mem_write_callback;
-    panda_register_callback(self, PANDA_CB_VIRT_MEM_WRITE, pcb);
+    PPP_REG_CB("taps", on_tap_write, tap_write);
 
     return true;
 }
@@ -128,11 +128,29 @@ void uninit_plugin(void *self) {
         return;
     }
 
-    std::map<std::pair<prog_point,prog_point>,int>::iterator it;
-    for(it = correlated.begin(); it != correlated.end(); it++) {
-        fwrite(&it->first.first, sizeof(prog_point), 1, mem_report);
-        fwrite(&it->first.second, sizeof(prog_point), 1, mem_report);
-        fwrite(&it->second, sizeof(int), 1, mem_report);
+    // Same order as when these were kept in a std::map keyed on the
+    // prog_points
+    struct correlation {
+        prog_point first, second;
+        int count;
+    };
+    std::vector<correlation> out;
+    for (auto &kvp : correlated) {
+        correlation c;
+        taps_get_prog_point(kvp.first >> 32, &c.first);
+        taps_get_prog_point((uint32_t)kvp.first, &c.second);
+        c.count = kvp.second;
+        out.push_back(c);
+    }
+    std::sort(out.begin(), out.end(),
+        [](const correlation &a, const correlation &b) {
+            return a.first < b.first || (a.first == b.first && a.second < b.second);
+        });
+
+    for (auto &c : out) {
+        fwrite(&c.first, sizeof(prog_point), 1, mem_report);
+        fwrite(&c.second, sizeof(prog_point), 1, mem_report);
+        fwrite(&c.count, sizeof(int), 1, mem_report);
     }
     fclose(mem_report);
 }
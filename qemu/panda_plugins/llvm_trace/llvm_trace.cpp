@@ -109,6 +109,7 @@ int phys_mem_read_callback(CPUState *env, target_ulong pc, target_ulong addr,
 namespace llvm {
 
 static void llvm_init(){
+    tcg_llvm_ctx->lock();
     ExecutionEngine *ee = tcg_llvm_ctx->getExecutionEngine();
     FunctionPassManager *fpm = tcg_llvm_ctx->getFunctionPassManager();
     Module *mod = tcg_llvm_ctx->getModule();
@@ -135,6 +136,7 @@ static void llvm_init(){
     llvm::FunctionPass *instfp = createPandaInstrFunctionPass(mod);
     fpm->add(instfp);
     PIFP = static_cast<PandaInstrFunctionPass*>(instfp);
+    tcg_llvm_ctx->unlock();
 }
 
 } // namespace llvm
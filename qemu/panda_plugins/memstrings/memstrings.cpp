@@ -31,9 +31,14 @@ extern "C" {
 #include <zlib.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <ctype.h>
-#include <math.h>
-#include <map>
+#include <string.h>
+#include <inttypes.h>
+
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 // These need to be extern "C" so that the ABI is compatible with
 // QEMU/PANDA, which is written in C
@@ -48,82 +53,384 @@ int mem_read_callback(CPUState *env, target_ulong pc, target_ulong addr, target_
 
 #define MAX_STRLEN 256
 
-struct string_pos {
+// The strings being built up by one pc, for either its reads or its writes.
+struct pc_state {
+    target_ulong pc;
+    bool is_write;
     int nch;
+    int unch;
     uint8_t ch[MAX_STRLEN];
+    uint16_t uch[MAX_STRLEN];
 };
 
-struct ustring_pos {
-    int nch;
-    uint16_t ch[MAX_STRLEN];
+// pc -> pc_state, open addressing with linear probing.  One table for reads
+// and one for writes, so each access costs a single probe sequence.  The
+// pc_states themselves never move, only the slots that point at them.
+struct pc_table {
+    struct slot {
+        target_ulong pc;
+        pc_state *st;
+    };
+    slot *slots;
+    size_t mask;
+    size_t count;
 };
 
-std::map<target_ulong,string_pos> read_text_tracker;
-std::map<target_ulong,string_pos> write_text_tracker;
-std::map<target_ulong,ustring_pos> read_utext_tracker;
-std::map<target_ulong,ustring_pos> write_utext_tracker;
+static pc_table read_tracker;
+static pc_table write_tracker;
+
+static inline size_t hash_pc(target_ulong pc) {
+    uint64_t h = (uint64_t)pc * 0x9e3779b97f4a7c15ULL;
+    return h ^ (h >> 32);
+}
+
+static void pc_table_init(pc_table &t, size_t size) {
+    t.slots = (pc_table::slot *) calloc(size, sizeof(pc_table::slot));
+    t.mask = size - 1;
+    t.count = 0;
+}
+
+static void pc_table_grow(pc_table &t) {
+    pc_table::slot *old = t.slots;
+    size_t old_size = t.mask + 1;
+    pc_table_init(t, old_size * 2);
+    for (size_t i = 0; i < old_size; i++) {
+        if (!old[i].st) continue;
+        size_t j = hash_pc(old[i].pc) & t.mask;
+        while (t.slots[j].st) j = (j + 1) & t.mask;
+        t.slots[j] = old[i];
+        t.count++;
+    }
+    free(old);
+}
+
+static inline pc_state *pc_lookup(pc_table &t, target_ulong pc, bool is_write) {
+    size_t i = hash_pc(pc) & t.mask;
+    while (t.slots[i].st) {
+        if (t.slots[i].pc == pc) return t.slots[i].st;
+        i = (i + 1) & t.mask;
+    }
+    // New pc.  Keep the table at most half full.
+    if (2 * (t.count + 1) > t.mask + 1) {
+        pc_table_grow(t);
+        return pc_lookup(t, pc, is_write);
+    }
+    pc_state *st = (pc_state *) malloc(sizeof(pc_state));
+    st->pc = pc;
+    st->is_write = is_write;
+    st->nch = 0;
+    st->unch = 0;
+    t.slots[i].pc = pc;
+    t.slots[i].st = st;
+    t.count++;
+    return st;
+}
 
 gzFile mem_report = NULL;
 int min_strlen;
 
-int mem_callback(CPUState *env, target_ulong pc, target_ulong addr,
-                       target_ulong size, void *buf, bool is_write) {
+// With dedup=1, each pc only reports a given string the first time it reads
+// (or writes) it.  We remember 64-bit hashes of (pc, is_write, string), in
+// another open-addressed table; 0 marks an empty slot.
+static bool dedup;
+static uint64_t *seen;
+static size_t seen_mask;
+static size_t seen_count;
+static uint64_t num_strings;
+static uint64_t num_dups;
 
-    string_pos &sp = is_write ? write_text_tracker[pc] : read_text_tracker[pc];
-    ustring_pos &usp = is_write ? write_utext_tracker[pc] : read_utext_tracker[pc];
-
-    // ASCII
-    for (unsigned int i = 0; i < size; i++) {
-        uint8_t val = ((uint8_t *)buf)[i];
-        if (isprint(val)) {
-            sp.ch[sp.nch++] = val;
-            // If we max out the string, chop it
-            if (sp.nch == MAX_STRLEN - 1) {
-                gzprintf(mem_report, "%llu:%.*s\n", rr_get_guest_instr_count(), sp.nch, sp.ch);
-                sp.nch = 0;
-            }
+static bool seen_insert(uint64_t h) {
+    if (h == 0) h = 1;
+    size_t i = h & seen_mask;
+    while (seen[i]) {
+        if (seen[i] == h) return false;
+        i = (i + 1) & seen_mask;
+    }
+    seen[i] = h;
+    if (2 * ++seen_count > seen_mask + 1) {
+        uint64_t *old = seen;
+        size_t old_size = seen_mask + 1;
+        seen = (uint64_t *) calloc(old_size * 2, sizeof(uint64_t));
+        seen_mask = old_size * 2 - 1;
+        for (size_t j = 0; j < old_size; j++) {
+            if (!old[j]) continue;
+            size_t k = old[j] & seen_mask;
+            while (seen[k]) k = (k + 1) & seen_mask;
+            seen[k] = old[j];
+        }
+        free(old);
+    }
+    return true;
+}
+
+// FNV-1a over the string, seeded with where it came from.  The final
+// multiply spreads the bits out for the table index.
+static uint64_t string_hash(const pc_state *st, bool utf16, const uint8_t *s, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL ^ ((uint64_t)st->pc * 4 + st->is_write * 2 + utf16);
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ s[i]) * 0x100000001b3ULL;
+    }
+    return h * 0x9e3779b97f4a7c15ULL;
+}
+
+// Found strings are appended to an output buffer as (instr, length, utf16)
+// records followed by the raw bytes.  Full buffers go to a writer thread,
+// which does the UTF-16 -> UTF-8 conversion, formatting and compression, so
+// the guest only waits on it if all of the buffers are in flight.
+#define OUT_BUF_SIZE (1 << 20)
+#define NUM_OUT_BUFS 4
+
+struct out_rec {
+    uint64_t instr;
+    uint16_t len;
+    uint8_t utf16;
+} __attribute__((packed));
+
+struct out_buf {
+    size_t used;
+    uint8_t data[OUT_BUF_SIZE];
+};
+
+static out_buf *cur_buf;
+static std::vector<out_buf *> free_bufs;
+static std::deque<out_buf *> full_bufs;
+static std::mutex out_lock;
+static std::condition_variable out_cond;
+static std::thread writer;
+static bool writer_done;
+static uint64_t writer_stalls;
+
+static void handoff(void) {
+    std::unique_lock<std::mutex> lock(out_lock);
+    full_bufs.push_back(cur_buf);
+    out_cond.notify_all();
+    if (free_bufs.empty()) {
+        writer_stalls++;
+        out_cond.wait(lock, []{ return !free_bufs.empty(); });
+    }
+    cur_buf = free_bufs.back();
+    free_bufs.pop_back();
+    cur_buf->used = 0;
+}
+
+// UCS-2 -> UTF-8.  Everything iswprint accepts is in the BMP.
+static size_t utf16_to_utf8(char *out, const uint8_t *in, size_t nbytes) {
+    char *p = out;
+    for (size_t i = 0; i + 1 < nbytes; i += 2) {
+        uint16_t c = in[i] | (in[i+1] << 8);
+        if (c < 0x80) {
+            *p++ = c;
+        }
+        else if (c < 0x800) {
+            *p++ = 0xc0 | (c >> 6);
+            *p++ = 0x80 | (c & 0x3f);
         }
         else {
-            // Don't bother with strings shorter than min
-            if (sp.nch >= min_strlen) {
-                gzprintf(mem_report, "%llu:%.*s\n", rr_get_guest_instr_count(), sp.nch, sp.ch);
+            *p++ = 0xe0 | (c >> 12);
+            *p++ = 0x80 | ((c >> 6) & 0x3f);
+            *p++ = 0x80 | (c & 0x3f);
+        }
+    }
+    return p - out;
+}
+
+static void writer_thread(void) {
+    // worst case each record is 2 bytes of UTF-16 per 3 of UTF-8, plus the
+    // instr count and punctuation
+    std::vector<char> text(OUT_BUF_SIZE * 3);
+    while (true) {
+        out_buf *buf;
+        {
+            std::unique_lock<std::mutex> lock(out_lock);
+            out_cond.wait(lock, []{ return !full_bufs.empty() || writer_done; });
+            if (full_bufs.empty()) break;
+            buf = full_bufs.front();
+            full_bufs.pop_front();
+        }
+        size_t pos = 0, out = 0;
+        while (pos < buf->used) {
+            out_rec rec;
+            memcpy(&rec, buf->data + pos, sizeof(rec));
+            pos += sizeof(rec);
+            out += sprintf(&text[out], "%" PRIu64 ":", rec.instr);
+            if (rec.utf16) {
+                out += utf16_to_utf8(&text[out], buf->data + pos, rec.len);
             }
-            sp.nch = 0;
-        }
-    }
-
-    // Don't consider one-byte reads/writes for UTF-16
-    if (size < 2) {
-        return 1;
-    }
-
-    // UTF-16-LE
-    for (unsigned int i = 0; i < size; i+=2) {
-        uint8_t vall = ((uint8_t *)buf)[i];
-        uint8_t valh = ((uint8_t *)buf)[i+1];
-        uint16_t val = (valh << 8) | vall;
-        if (iswprint(val)) {
-            usp.ch[usp.nch++] = val;
-            // If we max out the string, chop it
-            if (usp.nch == MAX_STRLEN - 1) {
-                gsize bytes_written = 0;
-                gchar *out_str = g_convert((gchar *)usp.ch, usp.nch*2,
-                    "UTF-8", "UTF-16LE", NULL, &bytes_written, NULL);
-                gzprintf(mem_report, "%llu:%s\n", rr_get_guest_instr_count(), out_str);
-                g_free(out_str);
-                usp.nch = 0;
+            else {
+                memcpy(&text[out], buf->data + pos, rec.len);
+                out += rec.len;
             }
+            text[out++] = '\n';
+            pos += rec.len;
+        }
+        gzwrite(mem_report, &text[0], out);
+        std::lock_guard<std::mutex> lock(out_lock);
+        free_bufs.push_back(buf);
+        out_cond.notify_all();
+    }
+}
+
+static void emit(const pc_state *st, bool utf16, const void *s, size_t len) {
+    if (dedup && !seen_insert(string_hash(st, utf16, (const uint8_t *)s, len))) {
+        num_dups++;
+        return;
+    }
+    num_strings++;
+    if (cur_buf->used + sizeof(out_rec) + len > OUT_BUF_SIZE) {
+        handoff();
+    }
+    out_rec rec = { rr_get_guest_instr_count(), (uint16_t)len, utf16 };
+    memcpy(cur_buf->data + cur_buf->used, &rec, sizeof(rec));
+    memcpy(cur_buf->data + cur_buf->used + sizeof(rec), s, len);
+    cur_buf->used += sizeof(rec) + len;
+}
+
+// Classify the bytes of an access eight at a time (SWAR): bit i of the
+// result is set if byte i of w is printable ASCII, 0x20-0x7e, which is
+// what isprint accepts in the C locale.  Assumes a little-endian host.
+static inline unsigned ascii_printable(uint64_t w) {
+    const uint64_t hi = 0x8080808080808080ULL;
+    uint64_t low = w & ~hi;
+    // top bit of each byte: >= 0x20, and >= 0x7f, without carrying across
+    uint64_t ge_space = low + 0x6060606060606060ULL;
+    uint64_t ge_del = low + 0x0101010101010101ULL;
+    uint64_t m = ge_space & ~ge_del & ~w & hi;
+    // gather the eight top bits into one byte
+    return ((m >> 7) * 0x0102040810204080ULL) >> 56;
+}
+
+// Same, one bit per byte, for bytes that are not zero.
+static inline unsigned nonzero(uint64_t w) {
+    const uint64_t hi = 0x8080808080808080ULL;
+    uint64_t m = (((w & ~hi) + ~hi) | w) & hi;
+    return ((m >> 7) * 0x0102040810204080ULL) >> 56;
+}
+
+// Bit k set if UTF-16LE character k of w is printable.  Printable ASCII
+// and NUL, which is most of what goes through memory, are settled from the
+// byte masks; anything else is up to iswprint.
+static inline unsigned utf16_printable(uint64_t w, unsigned ascii, unsigned nz, unsigned nchars) {
+    unsigned mask = 0;
+    for (unsigned k = 0; k < nchars; k++) {
+        unsigned lo = 1 << (2*k), hi = 2 << (2*k);
+        if (nz & hi) {
+            if (iswprint((uint16_t)(w >> (16*k)))) mask |= 1 << k;
+        }
+        else if (ascii & lo) {
+            mask |= 1 << k;
+        }
+        else if (nz & lo) {
+            if (iswprint((uint8_t)(w >> (16*k)))) mask |= 1 << k;
+        }
+    }
+    return mask;
+}
+
+static inline void ascii_end(pc_state *st) {
+    // Don't bother with strings shorter than min
+    if (st->nch >= min_strlen) {
+        emit(st, false, st->ch, st->nch);
+    }
+    st->nch = 0;
+}
+
+static inline void ascii_append(pc_state *st, const uint8_t *s, unsigned n) {
+    while (n) {
+        unsigned take = MAX_STRLEN - 1 - st->nch;
+        if (take > n) take = n;
+        memcpy(st->ch + st->nch, s, take);
+        st->nch += take;
+        s += take;
+        n -= take;
+        // If we max out the string, chop it
+        if (st->nch == MAX_STRLEN - 1) {
+            emit(st, false, st->ch, st->nch);
+            st->nch = 0;
+        }
+    }
+}
+
+static inline void utf16_end(pc_state *st) {
+    if (st->unch >= min_strlen) {
+        emit(st, true, st->uch, st->unch * 2);
+    }
+    st->unch = 0;
+}
+
+static inline void utf16_append(pc_state *st, const uint8_t *s, unsigned n) {
+    while (n) {
+        unsigned take = MAX_STRLEN - 1 - st->unch;
+        if (take > n) take = n;
+        memcpy(st->uch + st->unch, s, take * 2);
+        st->unch += take;
+        s += take * 2;
+        n -= take;
+        if (st->unch == MAX_STRLEN - 1) {
+            emit(st, true, st->uch, st->unch * 2);
+            st->unch = 0;
+        }
+    }
+}
+
+// Walk the runs of set and clear bits in mask, n units of unit bytes each.
+template <void (*append)(pc_state *, const uint8_t *, unsigned),
+          void (*end)(pc_state *)>
+static inline void scan_runs(pc_state *st, const uint8_t *s, unsigned mask,
+                             unsigned n, unsigned unit) {
+    unsigned i = 0;
+    while (i < n) {
+        unsigned rest = mask >> i;
+        unsigned run;
+        if (rest & 1) {
+            run = __builtin_ctz(~rest);
+            if (run > n - i) run = n - i;
+            append(st, s + i * unit, run);
         }
         else {
-            // Don't bother with strings shorter than min
-            if (usp.nch >= min_strlen) {
-                gsize bytes_written = 0;
-                gchar *out_str = g_convert((gchar *)usp.ch, usp.nch*2,
-                    "UTF-8", "UTF-16LE", NULL, &bytes_written, NULL);
-                gzprintf(mem_report, "%llu:%s\n", rr_get_guest_instr_count(), out_str);
-                g_free(out_str);
-            }
-            usp.nch = 0;
+            end(st);
+            run = rest ? __builtin_ctz(rest) : n - i;
+        }
+        i += run;
+    }
+}
+
+int mem_callback(CPUState *env, target_ulong pc, target_ulong addr,
+                       target_ulong size, void *buf, bool is_write) {
+
+    pc_state *st = pc_lookup(is_write ? write_tracker : read_tracker, pc, is_write);
+    const uint8_t *p = (const uint8_t *)buf;
+
+    for (target_ulong off = 0; off < size; off += 8) {
+        unsigned n = size - off < 8 ? size - off : 8;
+        uint64_t w = 0;
+        memcpy(&w, p + off, n);
+        unsigned full = (1 << n) - 1;
+
+        // ASCII
+        unsigned ascii = ascii_printable(w) & full;
+        if (ascii == full) {
+            ascii_append(st, p + off, n);
+        }
+        else if (ascii == 0) {
+            if (st->nch) ascii_end(st);
+        }
+        else {
+            scan_runs<ascii_append, ascii_end>(st, p + off, ascii, n, 1);
+        }
+
+        // Don't consider one-byte reads/writes for UTF-16
+        if (size < 2) {
+            return 1;
+        }
+
+        // UTF-16-LE
+        unsigned nchars = n / 2;
+        unsigned umask = utf16_printable(w, ascii, nonzero(w), nchars);
+        if (umask == 0) {
+            if (st->unch) utf16_end(st);
+        }
+        else {
+            scan_runs<utf16_append, utf16_end>(st, p + off, umask, nchars, 2);
         }
     }
 
@@ -150,6 +457,7 @@ bool init_plugin(void *self) {
 
     const char *prefix = panda_parse_string(args, "name", "memstrings");
     min_strlen = panda_parse_ulong(args, "len", 4);
+    dedup = panda_parse_bool(args, "dedup");
 
     char matchfile[128] = {};
     sprintf(matchfile, "%s_strings.txt.gz", prefix);
@@ -160,6 +468,21 @@ bool init_plugin(void *self) {
         return false;
     }
 
+    pc_table_init(read_tracker, 1 << 16);
+    pc_table_init(write_tracker, 1 << 16);
+    if (dedup) {
+        seen_mask = (1 << 16) - 1;
+        seen = (uint64_t *) calloc(seen_mask + 1, sizeof(uint64_t));
+    }
+
+    for (int i = 0; i < NUM_OUT_BUFS; i++) {
+        free_bufs.push_back(new out_buf);
+    }
+    cur_buf = free_bufs.back();
+    free_bufs.pop_back();
+    cur_buf->used = 0;
+    writer = std::thread(writer_thread);
+
     // Need this to get EIP with our callbacks
     panda_enable_precise_pc();
     // Enable memory logging
@@ -173,36 +496,43 @@ bool init_plugin(void *self) {
     return true;
 }
 
-void uninit_plugin(void *self) {
-    // Save any that we haven't flushed yet
-    for (auto &kvp : read_text_tracker) {
-        if (kvp.second.nch > min_strlen) {
-            gzprintf(mem_report, "%llu:%.*s\n", rr_get_guest_instr_count(), kvp.second.nch, kvp.second.ch);
+static void pc_table_flush(pc_table &t) {
+    for (size_t i = 0; i <= t.mask; i++) {
+        pc_state *st = t.slots[i].st;
+        if (!st) continue;
+        if (st->nch > min_strlen) {
+            emit(st, false, st->ch, st->nch);
         }
-    }
-    for (auto &kvp : write_text_tracker) {
-        if (kvp.second.nch > min_strlen) {
-            gzprintf(mem_report, "%llu:%.*s\n", rr_get_guest_instr_count(), kvp.second.nch, kvp.second.ch);
+        if (st->unch > min_strlen) {
+            emit(st, true, st->uch, st->unch * 2);
         }
+        free(st);
     }
-    for (auto &kvp : read_utext_tracker) {
-        if (kvp.second.nch > min_strlen) {
-            gsize bytes_written = 0;
-            gchar *out_str = g_convert((gchar *)kvp.second.ch, kvp.second.nch*2,
-                "UTF-8", "UTF-16LE", NULL, &bytes_written, NULL);
-            gzprintf(mem_report, "%llu:%s\n", rr_get_guest_instr_count(), out_str);
-            g_free(out_str);
-        }
+    free(t.slots);
+}
+
+void uninit_plugin(void *self) {
+    // Save any that we haven't flushed yet
+    pc_table_flush(read_tracker);
+    pc_table_flush(write_tracker);
+
+    {
+        std::lock_guard<std::mutex> lock(out_lock);
+        full_bufs.push_back(cur_buf);
+        writer_done = true;
+        out_cond.notify_all();
     }
-    for (auto &kvp : write_utext_tracker) {
-        if (kvp.second.nch > min_strlen) {
-            gsize bytes_written = 0;
-            gchar *out_str = g_convert((gchar *)kvp.second.ch, kvp.second.nch*2,
-                "UTF-8", "UTF-16LE", NULL, &bytes_written, NULL);
-            gzprintf(mem_report, "%llu:%s\n", rr_get_guest_instr_count(), out_str);
-            g_free(out_str);
-        }
+    writer.join();
+    for (out_buf *buf : free_bufs) {
+        delete buf;
+    }
+    free(seen);
+
+    printf("memstrings: %" PRIu64 " strings written", num_strings);
+    if (dedup) {
+        printf(", %" PRIu64 " repeats dropped", num_dups);
     }
+    printf(", guest waited on the writer %" PRIu64 " times\n", writer_stalls);
 
     gzclose(mem_report);
 }
@@ -20,6 +20,7 @@ PANDAENDCOMMENT */
 
 #include "panda_plugin.h"
 #include "panda_plugin_plugin.h"
+#include "panda_common.h"
 
 #include "osi_types.h"
 #include "osi_int_fns.h"
@@ -84,8 +85,105 @@ void free_osimodules(OsiModules *ms) {
     PPP_RUN_CB(on_free_osimodules, ms);
 }
 
+/* Cached views.  A process-aware plugin that asks for the current process
+   on every basic block would otherwise have the OS plugin allocate a new
+   OsiProc and walk guest kernel memory each time.  Here each view is made
+   at most once per stretch of execution in one address space: everything
+   is dropped when the guest writes its page directory register.  Within
+   that stretch, libraries are kept per process (by asid), so several
+   processes can be asked about.
+
+   The cached current process is the one that was running when it was
+   made.  Threads, and kernel threads that borrow the previous address
+   space, don't change the page directory, so plugins that care exactly
+   which thread is running should use get_current_process instead.  */
+
+typedef struct {
+    target_ulong asid;
+    OsiModules *ms;
+} OsiCachedLibraries;
+
+static OsiProc *cached_current = NULL;
+static target_ulong cached_current_asid;    // panda_current_asid when made
+static OsiProcs *cached_processes = NULL;
+static OsiModules *cached_modules = NULL;
+static GArray *cached_libraries = NULL;
+
+void osi_cache_invalidate(void) {
+    guint i;
+    free_osiproc(cached_current);
+    cached_current = NULL;
+    free_osiprocs(cached_processes);
+    cached_processes = NULL;
+    free_osimodules(cached_modules);
+    cached_modules = NULL;
+    for (i = 0; i < cached_libraries->len; i++) {
+        free_osimodules(g_array_index(cached_libraries, OsiCachedLibraries, i).ms);
+    }
+    g_array_set_size(cached_libraries, 0);
+}
+
+OsiProc *get_current_process_cached(CPUState *env) {
+    target_ulong asid = panda_current_asid(env);
+    // a plugin may ask from its own PGD callback, before the register
+    // actually changes; don't let that snapshot outlive the switch
+    if (cached_current == NULL || cached_current_asid != asid) {
+        free_osiproc(cached_current);
+        cached_current = get_current_process(env);
+        cached_current_asid = asid;
+    }
+    return cached_current;
+}
+
+OsiProcs *get_processes_cached(CPUState *env) {
+    if (cached_processes == NULL) {
+        cached_processes = get_processes(env);
+    }
+    return cached_processes;
+}
+
+OsiModules *get_modules_cached(CPUState *env) {
+    if (cached_modules == NULL) {
+        cached_modules = get_modules(env);
+    }
+    return cached_modules;
+}
+
+OsiModules *get_libraries_cached(CPUState *env, OsiProc *p) {
+    OsiCachedLibraries cl;
+    guint i;
+    for (i = 0; i < cached_libraries->len; i++) {
+        OsiCachedLibraries *c = &g_array_index(cached_libraries, OsiCachedLibraries, i);
+        if (c->asid == p->asid) {
+            return c->ms;
+        }
+    }
+    cl.asid = p->asid;
+    cl.ms = get_libraries(env, p);
+    // failures aren't cached; the process may just not be set up yet
+    if (cl.ms != NULL) {
+        g_array_append_val(cached_libraries, cl);
+    }
+    return cl.ms;
+}
+
+static int osi_pgd_changed(CPUState *env, target_ulong oldval, target_ulong newval) {
+    osi_cache_invalidate();
+    return 0;
+}
+
 bool init_plugin(void *self) {
+    panda_cb pcb;
+    cached_libraries = g_array_new(FALSE, FALSE, sizeof(OsiCachedLibraries));
+    pcb.after_PGD_write = osi_pgd_changed;
+    panda_register_callback(self, PANDA_CB_VMI_PGD_CHANGED, pcb);
     return true;
 }
 
-void uninit_plugin(void *self) { }
+void uninit_plugin(void *self) {
+    // the OS plugin that would free these may already be gone
+    cached_current = NULL;
+    cached_processes = NULL;
+    cached_modules = NULL;
+    g_array_free(cached_libraries, TRUE);
+}
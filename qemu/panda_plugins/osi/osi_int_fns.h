@@ -19,4 +19,18 @@ void free_osiproc(OsiProc *p);
 void free_osiprocs(OsiProcs *ps);
 void free_osimodules(OsiModules *ms);
 
+// Cached versions of the above.  These return the osi plugin's own copy,
+// made at most once between two writes of the guest's page directory
+// register, so they are cheap enough to call on every basic block.
+// Don't free or change what they return; it stays valid until the guest
+// switches address spaces or osi_cache_invalidate is called.
+OsiProc *get_current_process_cached(CPUState *env);
+OsiProcs *get_processes_cached(CPUState *env);
+OsiModules *get_modules_cached(CPUState *env);
+OsiModules *get_libraries_cached(CPUState *env, OsiProc *p);
+
+// Drop all cached views now, e.g. when a plugin knows the guest changed
+// its process or module lists without switching address spaces
+void osi_cache_invalidate(void);
+
 #endif
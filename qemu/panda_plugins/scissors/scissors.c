@@ -31,6 +31,8 @@ static char snp_name[128];
 
 static FILE *oldlog = NULL;
 static FILE *newlog = NULL;
+static RR_chunk_stream oldstream;
+static RR_chunk_stream newstream;
 
 static RR_log_entry entry;
 static RR_prog_point orig_last_prog_point = {0, 0, 0};
@@ -48,113 +50,6 @@ static void sassert(bool condition) {
     }
 }
 
-// Returns guest instr count (in old replay counting mode)
-static void write_entry(RR_log_entry *item) {
-    // Code copied from rr_log.c.
-    
-    // Copy entry.
-    entry = *item;
-    item = &entry;
-
-    if (item->header.prog_point.guest_instr_count > end_count) {
-        // We don't want to copy this one.
-        return;
-    }
-
-    //ph Fix up instruction count
-    item->header.prog_point.guest_instr_count -= actual_start_count;
-    sassert(fwrite(&(item->header.prog_point), sizeof(RR_prog_point), 1, newlog) == 1);
-
-    //mz this is more compact, as it doesn't include extra padding.
-    sassert(fwrite(&(item->header.kind), sizeof(item->header.kind), 1, newlog) == 1);
-    sassert(fwrite(&(item->header.callsite_loc), sizeof(item->header.callsite_loc), 1, newlog) == 1);
-
-    //mz read the rest of the item
-    switch (item->header.kind) {
-        case RR_INPUT_1:
-            sassert(fwrite(&(item->variant.input_1), sizeof(item->variant.input_1), 1, newlog) == 1);
-            break;
-        case RR_INPUT_2:
-            sassert(fwrite(&(item->variant.input_2), sizeof(item->variant.input_2), 1, newlog) == 1);
-            break;
-        case RR_INPUT_4:
-            sassert(fwrite(&(item->variant.input_4), sizeof(item->variant.input_4), 1, newlog) == 1);
-            break;
-        case RR_INPUT_8:
-            sassert(fwrite(&(item->variant.input_8), sizeof(item->variant.input_8), 1, newlog) == 1);
-            break;
-        case RR_INTERRUPT_REQUEST:
-            sassert(fwrite(&(item->variant.interrupt_request),
-                        sizeof(item->variant.interrupt_request), 1, newlog) == 1);
-            break;
-        case RR_EXIT_REQUEST:
-            sassert(fwrite(&(item->variant.exit_request),
-                        sizeof(item->variant.exit_request), 1, newlog) == 1);
-            break;
-        case RR_SKIPPED_CALL:
-            {
-                RR_skipped_call_args *args = &item->variant.call_args;
-                //mz read kind first!
-                sassert(fwrite(&(args->kind), sizeof(args->kind), 1, newlog) == 1);
-                switch(args->kind) {
-                    case RR_CALL_CPU_MEM_RW:
-                        sassert(fwrite(&(args->variant.cpu_mem_rw_args),
-                                    sizeof(args->variant.cpu_mem_rw_args), 1, newlog) == 1);
-                        //mz buffer length in args->variant.cpu_mem_rw_args.len
-                        //mz always allocate a new one. we free it when the item is added to the recycle list
-                        args->variant.cpu_mem_rw_args.buf = g_malloc(args->variant.cpu_mem_rw_args.len);
-                        //mz read the buffer
-                        sassert(fwrite(args->variant.cpu_mem_rw_args.buf, 1,
-                                    args->variant.cpu_mem_rw_args.len, newlog) > 0);
-                        break;
-                    case RR_CALL_CPU_MEM_UNMAP:
-                        sassert(fwrite(&(args->variant.cpu_mem_unmap),
-                                    sizeof(args->variant.cpu_mem_unmap), 1, newlog) == 1);
-                        sassert(fwrite(args->variant.cpu_mem_unmap.buf, 1,
-                                    args->variant.cpu_mem_unmap.len, newlog) > 0);
-                        //free(args->variant.cpu_mem_unmap.buf);
-                        break;
-
-                    case RR_CALL_CPU_REG_MEM_REGION:
-                        sassert(fwrite(&(args->variant.cpu_mem_reg_region_args), 
-                                    sizeof(args->variant.cpu_mem_reg_region_args), 1, newlog) == 1);
-                        break;
-
-                    case RR_CALL_HD_TRANSFER:
-                        sassert(fwrite(&(args->variant.hd_transfer_args),
-                                    sizeof(args->variant.hd_transfer_args), 1, newlog) == 1);
-                        break;
-
-                    case RR_CALL_NET_TRANSFER:
-                        sassert(fwrite(&(args->variant.net_transfer_args),
-                                    sizeof(args->variant.net_transfer_args), 1, newlog) == 1);
-                        break;
-
-                    case RR_CALL_HANDLE_PACKET:
-                        sassert(fwrite(&(args->variant.handle_packet_args), 
-                                    sizeof(args->variant.handle_packet_args), 1, newlog) == 1);
-                        sassert(fwrite(args->variant.handle_packet_args.buf, 
-                                    args->variant.handle_packet_args.size, 1,
-                                    newlog) == 1 /*> 0*/);
-                        //free(args->variant.handle_packet_args.buf);
-                        break;
-
-                    default:
-                        //mz unimplemented
-                        sassert(0);
-                }
-            }
-            break;
-        case RR_LAST:
-        case RR_DEBUG:
-            //mz nothing to read
-            break;
-        default:
-            //mz unimplemented
-            sassert(0);
-    }
-}
-
 // Returns guest instr count (in old replay counting mode)
 static RR_prog_point copy_entry(void) {
     // Code copied from rr_log.c.
@@ -162,9 +57,9 @@ static RR_prog_point copy_entry(void) {
     RR_log_entry *item = &entry;
 
     //mz XXX we assume that the log is not trucated - should probably fix this.
-    if (fread(&(item->header.prog_point), sizeof(RR_prog_point), 1, oldlog) != 1) {
+    if (rr_chunk_read(&oldstream, &(item->header.prog_point), sizeof(RR_prog_point), 1) != 1) {
         //mz an error occurred
-        if (feof(oldlog)) {
+        if (rr_chunk_is_empty(&oldstream)) {
             // replay is done - we've reached the end of file
             //mz we should never get here!
             sassert(0);
@@ -183,104 +78,105 @@ static RR_prog_point copy_entry(void) {
     //ph Fix up instruction count
     RR_prog_point original_prog_point = item->header.prog_point;
     item->header.prog_point.guest_instr_count -= actual_start_count;
-    sassert(fwrite(&(item->header.prog_point), sizeof(RR_prog_point), 1, newlog) == 1);
+    rr_chunk_begin_entry(&newstream, item->header.prog_point.guest_instr_count);
+    sassert(rr_chunk_write(&newstream, &(item->header.prog_point), sizeof(RR_prog_point), 1) == 1);
 
     //mz this is more compact, as it doesn't include extra padding.
-    sassert(fread(&(item->header.kind), sizeof(item->header.kind), 1, oldlog) == 1);
-    sassert(fread(&(item->header.callsite_loc), sizeof(item->header.callsite_loc), 1, oldlog) == 1);
-    sassert(fwrite(&(item->header.kind), sizeof(item->header.kind), 1, newlog) == 1);
-    sassert(fwrite(&(item->header.callsite_loc), sizeof(item->header.callsite_loc), 1, newlog) == 1);
+    sassert(rr_chunk_read(&oldstream, &(item->header.kind), sizeof(item->header.kind), 1) == 1);
+    sassert(rr_chunk_read(&oldstream, &(item->header.callsite_loc), sizeof(item->header.callsite_loc), 1) == 1);
+    sassert(rr_chunk_write(&newstream, &(item->header.kind), sizeof(item->header.kind), 1) == 1);
+    sassert(rr_chunk_write(&newstream, &(item->header.callsite_loc), sizeof(item->header.callsite_loc), 1) == 1);
 
     //mz read the rest of the item
     switch (item->header.kind) {
         case RR_INPUT_1:
-            sassert(fread(&(item->variant.input_1), sizeof(item->variant.input_1), 1, oldlog) == 1);
-            sassert(fwrite(&(item->variant.input_1), sizeof(item->variant.input_1), 1, newlog) == 1);
+            sassert(rr_chunk_read(&oldstream, &(item->variant.input_1), sizeof(item->variant.input_1), 1) == 1);
+            sassert(rr_chunk_write(&newstream, &(item->variant.input_1), sizeof(item->variant.input_1), 1) == 1);
             break;
         case RR_INPUT_2:
-            sassert(fread(&(item->variant.input_2), sizeof(item->variant.input_2), 1, oldlog) == 1);
-            sassert(fwrite(&(item->variant.input_2), sizeof(item->variant.input_2), 1, newlog) == 1);
+            sassert(rr_chunk_read(&oldstream, &(item->variant.input_2), sizeof(item->variant.input_2), 1) == 1);
+            sassert(rr_chunk_write(&newstream, &(item->variant.input_2), sizeof(item->variant.input_2), 1) == 1);
             break;
         case RR_INPUT_4:
-            sassert(fread(&(item->variant.input_4), sizeof(item->variant.input_4), 1, oldlog) == 1);
-            sassert(fwrite(&(item->variant.input_4), sizeof(item->variant.input_4), 1, newlog) == 1);
+            sassert(rr_chunk_read(&oldstream, &(item->variant.input_4), sizeof(item->variant.input_4), 1) == 1);
+            sassert(rr_chunk_write(&newstream, &(item->variant.input_4), sizeof(item->variant.input_4), 1) == 1);
             break;
         case RR_INPUT_8:
-            sassert(fread(&(item->variant.input_8), sizeof(item->variant.input_8), 1, oldlog) == 1);
-            sassert(fwrite(&(item->variant.input_8), sizeof(item->variant.input_8), 1, newlog) == 1);
+            sassert(rr_chunk_read(&oldstream, &(item->variant.input_8), sizeof(item->variant.input_8), 1) == 1);
+            sassert(rr_chunk_write(&newstream, &(item->variant.input_8), sizeof(item->variant.input_8), 1) == 1);
             break;
         case RR_INTERRUPT_REQUEST:
-            sassert(fread(&(item->variant.interrupt_request),
-                        sizeof(item->variant.interrupt_request), 1, oldlog) == 1);
-            sassert(fwrite(&(item->variant.interrupt_request),
-                        sizeof(item->variant.interrupt_request), 1, newlog) == 1);
+            sassert(rr_chunk_read(&oldstream, &(item->variant.interrupt_request),
+                        sizeof(item->variant.interrupt_request), 1) == 1);
+            sassert(rr_chunk_write(&newstream, &(item->variant.interrupt_request),
+                        sizeof(item->variant.interrupt_request), 1) == 1);
             break;
         case RR_EXIT_REQUEST:
-            sassert(fread(&(item->variant.exit_request),
-                        sizeof(item->variant.exit_request), 1, oldlog) == 1);
-            sassert(fwrite(&(item->variant.exit_request),
-                        sizeof(item->variant.exit_request), 1, newlog) == 1);
+            sassert(rr_chunk_read(&oldstream, &(item->variant.exit_request),
+                        sizeof(item->variant.exit_request), 1) == 1);
+            sassert(rr_chunk_write(&newstream, &(item->variant.exit_request),
+                        sizeof(item->variant.exit_request), 1) == 1);
             break;
         case RR_SKIPPED_CALL:
             {
                 RR_skipped_call_args *args = &item->variant.call_args;
                 //mz read kind first!
-                sassert(fread(&(args->kind), sizeof(args->kind), 1, oldlog) == 1);
-                sassert(fwrite(&(args->kind), sizeof(args->kind), 1, newlog) == 1);
+                sassert(rr_chunk_read(&oldstream, &(args->kind), sizeof(args->kind), 1) == 1);
+                sassert(rr_chunk_write(&newstream, &(args->kind), sizeof(args->kind), 1) == 1);
                 switch(args->kind) {
                     case RR_CALL_CPU_MEM_RW:
-                        sassert(fread(&(args->variant.cpu_mem_rw_args),
-                                    sizeof(args->variant.cpu_mem_rw_args), 1, oldlog) == 1);
-                        sassert(fwrite(&(args->variant.cpu_mem_rw_args),
-                                    sizeof(args->variant.cpu_mem_rw_args), 1, newlog) == 1);
+                        sassert(rr_chunk_read(&oldstream, &(args->variant.cpu_mem_rw_args),
+                                    sizeof(args->variant.cpu_mem_rw_args), 1) == 1);
+                        sassert(rr_chunk_write(&newstream, &(args->variant.cpu_mem_rw_args),
+                                    sizeof(args->variant.cpu_mem_rw_args), 1) == 1);
                         //mz buffer length in args->variant.cpu_mem_rw_args.len
                         //mz always allocate a new one. we free it when the item is added to the recycle list
                         args->variant.cpu_mem_rw_args.buf = g_malloc(args->variant.cpu_mem_rw_args.len);
                         //mz read the buffer
-                        sassert(fread(args->variant.cpu_mem_rw_args.buf, 1,
-                                    args->variant.cpu_mem_rw_args.len, oldlog) > 0);
-                        sassert(fwrite(args->variant.cpu_mem_rw_args.buf, 1,
-                                    args->variant.cpu_mem_rw_args.len, newlog) > 0);
+                        sassert(rr_chunk_read(&oldstream, args->variant.cpu_mem_rw_args.buf, 1,
+                                    args->variant.cpu_mem_rw_args.len) > 0);
+                        sassert(rr_chunk_write(&newstream, args->variant.cpu_mem_rw_args.buf, 1,
+                                    args->variant.cpu_mem_rw_args.len) > 0);
                         break;
                     case RR_CALL_CPU_MEM_UNMAP:
-                        sassert(fread(&(args->variant.cpu_mem_unmap),
-                                    sizeof(args->variant.cpu_mem_unmap), 1, oldlog) == 1);
-                        sassert(fwrite(&(args->variant.cpu_mem_unmap),
-                                    sizeof(args->variant.cpu_mem_unmap), 1, newlog) == 1);
+                        sassert(rr_chunk_read(&oldstream, &(args->variant.cpu_mem_unmap),
+                                    sizeof(args->variant.cpu_mem_unmap), 1) == 1);
+                        sassert(rr_chunk_write(&newstream, &(args->variant.cpu_mem_unmap),
+                                    sizeof(args->variant.cpu_mem_unmap), 1) == 1);
                         args->variant.cpu_mem_unmap.buf = malloc(args->variant.cpu_mem_unmap.len);
-                        sassert(fread(args->variant.cpu_mem_unmap.buf, 1,
-                                    args->variant.cpu_mem_unmap.len, oldlog) > 0);
-                        sassert(fwrite(args->variant.cpu_mem_unmap.buf, 1,
-                                    args->variant.cpu_mem_unmap.len, newlog) > 0);
+                        sassert(rr_chunk_read(&oldstream, args->variant.cpu_mem_unmap.buf, 1,
+                                    args->variant.cpu_mem_unmap.len) > 0);
+                        sassert(rr_chunk_write(&newstream, args->variant.cpu_mem_unmap.buf, 1,
+                                    args->variant.cpu_mem_unmap.len) > 0);
                         //free(args->variant.cpu_mem_unmap.buf);
                         break;
 
                     case RR_CALL_CPU_REG_MEM_REGION:
-                        sassert(fread(&(args->variant.cpu_mem_reg_region_args), 
-                                    sizeof(args->variant.cpu_mem_reg_region_args), 1, oldlog) == 1);
-                        sassert(fwrite(&(args->variant.cpu_mem_reg_region_args), 
-                                    sizeof(args->variant.cpu_mem_reg_region_args), 1, newlog) == 1);
+                        sassert(rr_chunk_read(&oldstream, &(args->variant.cpu_mem_reg_region_args), 
+                                    sizeof(args->variant.cpu_mem_reg_region_args), 1) == 1);
+                        sassert(rr_chunk_write(&newstream, &(args->variant.cpu_mem_reg_region_args), 
+                                    sizeof(args->variant.cpu_mem_reg_region_args), 1) == 1);
                         break;
 
                     case RR_CALL_HD_TRANSFER:
-                        sassert(fread(&(args->variant.hd_transfer_args),
-                                    sizeof(args->variant.hd_transfer_args), 1, oldlog) == 1);
-                        sassert(fwrite(&(args->variant.hd_transfer_args),
-                                    sizeof(args->variant.hd_transfer_args), 1, newlog) == 1);
+                        sassert(rr_chunk_read(&oldstream, &(args->variant.hd_transfer_args),
+                                    sizeof(args->variant.hd_transfer_args), 1) == 1);
+                        sassert(rr_chunk_write(&newstream, &(args->variant.hd_transfer_args),
+                                    sizeof(args->variant.hd_transfer_args), 1) == 1);
                         break;
 
                     case RR_CALL_NET_TRANSFER:
-                        sassert(fread(&(args->variant.net_transfer_args),
-                                    sizeof(args->variant.net_transfer_args), 1, oldlog) == 1);
-                        sassert(fwrite(&(args->variant.net_transfer_args),
-                                    sizeof(args->variant.net_transfer_args), 1, newlog) == 1);
+                        sassert(rr_chunk_read(&oldstream, &(args->variant.net_transfer_args),
+                                    sizeof(args->variant.net_transfer_args), 1) == 1);
+                        sassert(rr_chunk_write(&newstream, &(args->variant.net_transfer_args),
+                                    sizeof(args->variant.net_transfer_args), 1) == 1);
                         break;
 
                     case RR_CALL_HANDLE_PACKET:
-                        sassert(fread(&(args->variant.handle_packet_args), 
-                                    sizeof(args->variant.handle_packet_args), 1, oldlog) == 1);
-                        sassert(fwrite(&(args->variant.handle_packet_args), 
-                                    sizeof(args->variant.handle_packet_args), 1, newlog) == 1);
+                        sassert(rr_chunk_read(&oldstream, &(args->variant.handle_packet_args), 
+                                    sizeof(args->variant.handle_packet_args), 1) == 1);
+                        sassert(rr_chunk_write(&newstream, &(args->variant.handle_packet_args), 
+                                    sizeof(args->variant.handle_packet_args), 1) == 1);
                         //mz XXX HACK
                         args->old_buf_addr = (uint64_t) args->variant.handle_packet_args.buf;
                         //mz buffer length in args->variant.cpu_mem_rw_args.len 
@@ -288,12 +184,10 @@ static RR_prog_point copy_entry(void) {
                         args->variant.handle_packet_args.buf = 
                             malloc(args->variant.handle_packet_args.size);
                         //mz read the buffer 
-                        sassert(fread(args->variant.handle_packet_args.buf, 
-                                    args->variant.handle_packet_args.size, 1,
-                                    oldlog) == 1 /*> 0*/);
-                        sassert(fwrite(args->variant.handle_packet_args.buf, 
-                                    args->variant.handle_packet_args.size, 1,
-                                    newlog) == 1 /*> 0*/);
+                        sassert(rr_chunk_read(&oldstream, args->variant.handle_packet_args.buf, 
+                                    args->variant.handle_packet_args.size, 1) == 1 /*> 0*/);
+                        sassert(rr_chunk_write(&newstream, args->variant.handle_packet_args.buf, 
+                                    args->variant.handle_packet_args.size, 1) == 1 /*> 0*/);
                         //free(args->variant.handle_packet_args.buf);
                         break;
 
@@ -312,6 +206,7 @@ static RR_prog_point copy_entry(void) {
             //mz unimplemented
             sassert(0);
     }
+    rr_chunk_end_entry(&newstream);
 
     return original_prog_point;
 }
@@ -327,13 +222,20 @@ static void end_snip(void) {
     end.callsite_loc = RR_CALLSITE_LAST;
     end.prog_point = rr_prog_point;
     end.prog_point.guest_instr_count -= actual_start_count;
-    sassert(fwrite(&(end.prog_point), sizeof(end.prog_point), 1, newlog) == 1);
-    sassert(fwrite(&(end.kind), sizeof(end.kind), 1, newlog) == 1);
-    sassert(fwrite(&(end.callsite_loc), sizeof(end.callsite_loc), 1, newlog) == 1);
+    rr_chunk_begin_entry(&newstream, end.prog_point.guest_instr_count);
+    sassert(rr_chunk_write(&newstream, &(end.prog_point), sizeof(end.prog_point), 1) == 1);
+    sassert(rr_chunk_write(&newstream, &(end.kind), sizeof(end.kind), 1) == 1);
+    sassert(rr_chunk_write(&newstream, &(end.callsite_loc), sizeof(end.callsite_loc), 1) == 1);
+    rr_chunk_end_entry(&newstream);
+    rr_chunk_close_write(&newstream);
 
     rewind(newlog);
     fwrite(&prog_point, sizeof(RR_prog_point), 1, newlog);
     fclose(newlog);
+    rr_chunk_destroy(&newstream);
+
+    fclose(oldlog);
+    rr_chunk_destroy(&oldstream);
 
     done = true;
 }
@@ -343,6 +245,7 @@ int before_block_exec(CPUState *env, TranslationBlock *tb) {
     if (!snipping && count+tb->num_guest_insns > start_count) {
         sassert((oldlog = fopen(rr_nondet_log->name, "r")));
         sassert(fread(&orig_last_prog_point, sizeof(RR_prog_point), 1, oldlog) == 1);
+        sassert(rr_chunk_open_read(&oldstream, oldlog, rr_nondet_log->size) == 0);
         printf("Original ending prog point: ");
         rr_spit_prog_point(orig_last_prog_point);
 
@@ -358,18 +261,16 @@ int before_block_exec(CPUState *env, TranslationBlock *tb) {
         // We'll fix this up later.
         RR_prog_point prog_point = {0, 0, 0};
         fwrite(&prog_point, sizeof(RR_prog_point), 1, newlog);
+        rr_chunk_open_write(&newstream, newlog);
 
-        fseek(oldlog, ftell(rr_nondet_log->fp), SEEK_SET);
+        // Start copying at the first entry replay hasn't consumed yet.
+        // (The replay stream itself is read ahead by the prefetch thread.)
+        sassert(rr_chunk_seek(&oldstream, rr_replay_position()) == 0);
 
-        RR_log_entry *item = rr_get_queue_head();
-        while (item != NULL && item->header.prog_point.guest_instr_count < end_count) {
-            write_entry(item);
-            item = item->next;
-        }
-        while (prog_point.guest_instr_count < end_count && !feof(oldlog)) {
+        while (prog_point.guest_instr_count < end_count && !rr_chunk_is_empty(&oldstream)) {
             prog_point = copy_entry();
         } 
-        if (!feof(oldlog)) { // prog_point is the first one AFTER what we want
+        if (!rr_chunk_is_empty(&oldstream)) { // prog_point is the first one AFTER what we want
             printf("Reached end of old nondet log.\n");
         } else {
             printf("Past desired ending point for log.\n");
@@ -25,6 +25,7 @@ extern "C" {
 
 #include "panda_plugin.h"
 #include "stringsearch.h"
+#include "../taps/taps.h"
 #include "rr_log.h"
 }
 
@@ -33,6 +34,8 @@ extern "C" {
 #include <ctype.h>
 #include <math.h>
 #include <map>
+#include <vector>
+#include <queue>
 #include <fstream>
 #include <sstream>
 #include <string>
@@ -40,6 +43,7 @@ extern "C" {
 
 #include "../common/prog_point.h"
 #include "../callstack_instr/callstack_instr_ext.h"
+#include "../taps/taps_ext.h"
 #include "panda_plugin_plugin.h"
 
 // These need to be extern "C" so that the ABI is compatible with
@@ -48,23 +52,12 @@ extern "C" {
 
 bool init_plugin(void *);
 void uninit_plugin(void *);
-int mem_write_callback(CPUState *env, target_ulong pc, target_ulong addr, target_ulong size, void *buf);
-int mem_read_callback(CPUState *env, target_ulong pc, target_ulong addr, target_ulong size, void *buf);
 
 // prototype for the register-this-callback fn
 PPP_PROT_REG_CB(on_ssm);
 
 }
 
-// Silly: since we use these as map values, they have to be
-// copy constructible. Plain arrays aren't, but structs containing
-// arrays are. So we make these goofy wrappers.
-struct match_strings {
-    int val[MAX_STRINGS];
-};
-struct string_pos {
-    uint8_t val[MAX_STRINGS];
-};
 struct fullstack {
     int n;
     target_ulong callers[MAX_CALLERS];
@@ -72,89 +65,135 @@ struct fullstack {
     target_ulong asid;
 };
 
+// tap point -> number of matches of each string
+std::map<prog_point,std::vector<int>> matches;
 std::map<prog_point,fullstack> matchstacks;
-std::map<prog_point,match_strings> matches;
-std::map<prog_point,string_pos> read_text_tracker;
-std::map<prog_point,string_pos> write_text_tracker;
-uint8_t tofind[MAX_STRINGS][MAX_STRLEN];
-uint8_t strlens[MAX_STRINGS];
+std::vector<std::vector<uint8_t>> tofind;
 int num_strings = 0;
 int n_callers = 16;
 
+// All the strings are searched for at once with an Aho-Corasick automaton.
+// State 0 is the root.  The transition table is dense, with failure links
+// already followed, so each byte costs one lookup however many strings
+// there are.
+std::vector<uint32_t> ac_goto;          // state * 256 + byte -> state
+std::vector<std::vector<int>> ac_out;   // state -> strings that end there
+
+// tap ID -> automaton state
+std::vector<uint32_t> read_text_tracker;
+std::vector<uint32_t> write_text_tracker;
+
+static uint32_t ac_new_state(void) {
+    ac_goto.resize(ac_goto.size() + 256, 0);
+    ac_out.emplace_back();
+    return ac_out.size() - 1;
+}
+
+static void ac_build(void) {
+    ac_goto.clear();
+    ac_out.clear();
+    ac_new_state();
+
+    // Trie of all the strings.  0 is never a child, so it means "no edge".
+    for (int str_idx = 0; str_idx < num_strings; str_idx++) {
+        uint32_t state = 0;
+        for (uint8_t c : tofind[str_idx]) {
+            if (!ac_goto[state * 256 + c]) {
+                uint32_t next = ac_new_state();
+                ac_goto[state * 256 + c] = next;
+            }
+            state = ac_goto[state * 256 + c];
+        }
+        ac_out[state].push_back(str_idx);
+    }
+
+    // Breadth-first, fill in missing edges from the failure state and
+    // inherit its matches.
+    std::vector<uint32_t> fail(ac_out.size(), 0);
+    std::queue<uint32_t> q;
+    for (int c = 0; c < 256; c++) {
+        if (ac_goto[c]) q.push(ac_goto[c]);
+    }
+    while (!q.empty()) {
+        uint32_t state = q.front();
+        q.pop();
+        const std::vector<int> &inherited = ac_out[fail[state]];
+        ac_out[state].insert(ac_out[state].end(), inherited.begin(), inherited.end());
+        for (int c = 0; c < 256; c++) {
+            uint32_t next = ac_goto[state * 256 + c];
+            if (next) {
+                fail[next] = ac_goto[fail[state] * 256 + c];
+                q.push(next);
+            } else {
+                ac_goto[state * 256 + c] = ac_goto[fail[state] * 256 + c];
+            }
+        }
+    }
+}
+
 // this creates BOTH the global for this callback fn (on_ssm_func)
 // and the function used by other plugins to register a fn (add_on_ssm)
 PPP_CB_BOILERPLATE(on_ssm)
 
 // this creates the 
 
-int mem_callback(CPUState *env, target_ulong pc, target_ulong addr,
-                       target_ulong size, void *buf, bool is_write,
-                       std::map<prog_point,string_pos> &text_tracker) {
-    prog_point p = {};
-    get_prog_point(env, &p);
-
-    string_pos &sp = text_tracker[p];
+static void mem_callback(CPUState *env, uint32_t tap, const prog_point &p,
+                         target_ulong addr, target_ulong size, void *buf, bool is_write,
+                         std::vector<uint32_t> &text_tracker) {
+    if (tap >= text_tracker.size()) text_tracker.resize(taps_count(), 0);
+    uint32_t state = text_tracker[tap];
 
     for (unsigned int i = 0; i < size; i++) {
         uint8_t val = ((uint8_t *)buf)[i];
-        for(int str_idx = 0; str_idx < num_strings; str_idx++) {
-            if (tofind[str_idx][sp.val[str_idx]] == val)
-                sp.val[str_idx]++;
-            else
-                sp.val[str_idx] = 0;
-
-            if (sp.val[str_idx] == strlens[str_idx]) {
-                // Victory!
-                printf("%s Match of str %d at: instr_count=%lu :  " TARGET_FMT_lx " " TARGET_FMT_lx " " TARGET_FMT_lx "\n",
-                       (is_write ? "WRITE" : "READ"), str_idx, rr_get_guest_instr_count(), p.caller, p.pc, p.cr3);
-                matches[p].val[str_idx]++;
-                sp.val[str_idx] = 0;
-
-                // Also get the full stack here
-                fullstack f = {0};
-                f.n = get_callers(f.callers, n_callers, env);
-                f.pc = p.pc;
-                f.asid = p.cr3;
-                matchstacks[p] = f;
-
-                // call the i-found-a-match registered callbacks here
-                PPP_RUN_CB(on_ssm, env, pc, addr, tofind[str_idx], strlens[str_idx], is_write)
-
-            }
+        state = ac_goto[state * 256 + val];
+        if (ac_out[state].empty()) continue;
+
+        for (int str_idx : ac_out[state]) {
+            // Victory!
+            printf("%s Match of str %d at: instr_count=%lu :  " TARGET_FMT_lx " " TARGET_FMT_lx " " TARGET_FMT_lx "\n",
+                   (is_write ? "WRITE" : "READ"), str_idx, rr_get_guest_instr_count(), p.caller, p.pc, p.cr3);
+            std::vector<int> &counts = matches[p];
+            counts.resize(num_strings);
+            counts[str_idx]++;
+
+            // Also get the full stack here
+            fullstack f = {0};
+            f.n = get_callers(f.callers, n_callers, env);
+            f.pc = p.pc;
+            f.asid = p.cr3;
+            matchstacks[p] = f;
+
+            // call the i-found-a-match registered callbacks here
+            PPP_RUN_CB(on_ssm, env, p.pc, addr, tofind[str_idx].data(), tofind[str_idx].size(), is_write)
         }
     }
- 
-    return 1;
-}
 
-int mem_read_callback(CPUState *env, target_ulong pc, target_ulong addr,
-                       target_ulong size, void *buf) {
-    return mem_callback(env, pc, addr, size, buf, false, read_text_tracker);
+    text_tracker[tap] = state;
+}
 
+static void tap_read(CPUState *env, uint32_t tap, const prog_point *p,
+                     target_ulong addr, target_ulong size, void *buf) {
+    mem_callback(env, tap, *p, addr, size, buf, false, read_text_tracker);
 }
 
-int mem_write_callback(CPUState *env, target_ulong pc, target_ulong addr,
-                       target_ulong size, void *buf) {
-    return mem_callback(env, pc, addr, size, buf, true, write_text_tracker);
+static void tap_write(CPUState *env, uint32_t tap, const prog_point *p,
+                      target_ulong addr, target_ulong size, void *buf) {
+    mem_callback(env, tap, *p, addr, size, buf, true, write_text_tracker);
 }
 
 FILE *mem_report = NULL;
 
 bool init_plugin(void *self) {
-    panda_cb pcb;
-
     printf("Initializing plugin stringsearch\n");
 
-    panda_require("callstack_instr");
+    panda_require("taps");
 
     panda_arg_list *args = panda_get_args("stringsearch");
 
     const char *arg_str = panda_parse_string(args, "str", "");
     size_t arg_len = strlen(arg_str);
     if (arg_len > 0) {
-        memcpy(tofind[num_strings], arg_str, arg_len);
-        strlens[num_strings] = arg_len;
-        num_strings++;
+        tofind.emplace_back(arg_str, arg_str + arg_len);
     }
 
     n_callers = panda_parse_uint64(args, "callers", 16);
@@ -176,31 +215,27 @@ bool init_plugin(void *self) {
     std::string line;
     while(std::getline(search_strings, line)) {
         std::istringstream iss(line);
+        std::vector<uint8_t> str;
 
         if (line[0] == '"') {
+            if (line.size() < 2) continue;
             size_t len = line.size() - 2;
-            memcpy(tofind[num_strings], line.substr(1, len).c_str(), len);
-            strlens[num_strings] = len;
+            str.assign(line.begin() + 1, line.begin() + 1 + len);
         } else {
             std::string x;
-            int i = 0;
             while (std::getline(iss, x, ':')) {
-                tofind[num_strings][i++] = (uint8_t)strtoul(x.c_str(), NULL, 16);
-                if (i >= MAX_STRLEN) {
-                    printf("WARN: Reached max number of characters (%d) on string %d, truncating.\n", MAX_STRLEN, num_strings);
-                    break;
-                }
+                str.push_back((uint8_t)strtoul(x.c_str(), NULL, 16));
             }
-            strlens[num_strings] = i;
         }
+        if (str.empty()) continue;
 
-        printf("stringsearch: added string of length %d to search set\n", strlens[num_strings]);
-
-        if(++num_strings >= MAX_STRINGS) {
-            printf("WARN: maximum number of strings (%d) reached, will not load any more.\n", MAX_STRINGS);
-            break;
-        }
+        printf("stringsearch: added string of length %zu to search set\n", str.size());
+        tofind.push_back(str);
     }
+    num_strings = tofind.size();
+
+    ac_build();
+    printf("stringsearch: %d strings, %zu automaton states\n", num_strings, ac_out.size());
 
     char matchfile[128] = {};
     sprintf(matchfile, "%s_string_matches.txt", prefix);
@@ -212,23 +247,16 @@ bool init_plugin(void *self) {
     }
 
     if(!init_callstack_instr_api()) return false;
+    if(!init_taps_api()) return false;
 
-    // Need this to get EIP with our callbacks
-    panda_enable_precise_pc();
-    // Enable memory logging
-    panda_enable_memcb();
-
-    pcb.virt_mem_write = mem_write_callback;
-    panda_register_callback(self, PANDA_CB_VIRT_MEM_WRITE, pcb);
-    pcb.virt_mem_read = mem_read_callback;
-    panda_register_callback(self, PANDA_CB_VIRT_MEM_READ, pcb);
-
+    PPP_REG_CB("taps", on_tap_write, tap_write);
+    PPP_REG_CB("taps", on_tap_read, tap_read);
 
     return true;
 }
 
 void uninit_plugin(void *self) {
-    std::map<prog_point,match_strings>::iterator it;
+    std::map<prog_point,std::vector<int>>::iterator it;
     for(it = matches.begin(); it != matches.end(); it++) {
         // Print prog point
 
@@ -243,7 +271,7 @@ void uninit_plugin(void *self) {
 
         // Print strings that matched and how many times
         for(int i = 0; i < num_strings; i++)
-            fprintf(mem_report, " %d", it->second.val[i]);
+            fprintf(mem_report, " %d", it->second[i]);
         fprintf(mem_report, "\n");
     }
     fclose(mem_report);
@@ -4,9 +4,7 @@
 #define __STRINGSEARCH_H_
 
 
-#define MAX_STRINGS 100
 #define MAX_CALLERS 128
-#define MAX_STRLEN  256
 
 
 // the type for the ppp callback fn that can be passed to string search to be called
@@ -29,6 +29,8 @@ extern "C" {
 #include <functional>
 #include <string>
 #include <map>
+#include <set>
+#include <unordered_set>
 #include <algorithm>
 #include <memory>
 
@@ -283,45 +285,69 @@ void registerExecPreCallback(void (*callback)(CPUState*, target_ulong)){
 // always return to same process
 static std::map < std::pair < target_ulong, target_ulong >, ReturnPoint > returns; 
 
+// Return addresses that get an exec callback.  Return addresses repeat
+// (every syscall through the vdso or a libc wrapper comes back to the same
+// few places), so once a pc is hooked it stays hooked.
+static std::unordered_set<target_ulong> return_hooks;
+
+// (return address, physical page) pairs whose TBs were thrown away since the
+// pc got hooked.  Another process can have the same return address on a
+// different physical page (another non-PIE binary, a private mapping), with
+// a TB translated before the hook, so each new page needs invalidating too.
+static std::set<std::pair<target_ulong, target_phys_addr_t>> hooked_pages;
+
 void appendReturnPoint(ReturnPoint &rp){
     returns[std::make_pair(rp.retaddr,rp.proc_id)] = rp;
+    return_hooks.insert(rp.retaddr);
+    target_phys_addr_t paddr = panda_virt_to_phys(cpu_single_env, rp.retaddr);
+    if (paddr == (target_phys_addr_t) -1) {
+        // Not mapped, so nothing to invalidate; the next syscall that
+        // returns here will try again.
+        return;
+    }
+    auto page = std::make_pair(rp.retaddr, paddr & TARGET_PAGE_MASK);
+    if (hooked_pages.insert(page).second) {
+        panda_invalidate_tb_at(cpu_single_env, rp.retaddr);
+    }
 }
 
+static bool is_syscall_insn(CPUState *env, target_ulong pc);
 
-static int returned_check_callback(CPUState *env, TranslationBlock* tb){
-    // check if any of the internally tracked syscalls has returned
-    // only one should be at its return point for any given basic block
-    std::pair < target_ulong, target_ulong > ret_key = std::make_pair(tb->pc, panda_current_asid(env));
-    if (returns.count(ret_key) != 0) {
-        ReturnPoint &retVal = returns[ret_key];
-        switch (syscalls_profile) {
-        case PROFILE_LINUX_X86:
-            syscall_return_switch_linux_x86(env, tb->pc, retVal.ordinal);
-            break;
-        case PROFILE_LINUX_ARM:
-            syscall_return_switch_linux_arm(env, tb->pc, retVal.ordinal);
-            break;
-        case PROFILE_WINDOWS7_X86:
-            syscall_return_switch_windows7_x86(env, tb->pc, retVal.ordinal);
-            break;
-        default:
-            assert (1==0);
-        }
-        // used by remove_if to delete from returns list those values
-        // that have been processed
-        //        retVal.retaddr = retVal.proc_id = 0;
-        returns.erase(ret_key);
+// check if any of the internally tracked syscalls has returned here
+static void returned_check(CPUState *env, target_ulong pc){
+    std::pair < target_ulong, target_ulong > ret_key = std::make_pair(pc, panda_current_asid(env));
+    auto it = returns.find(ret_key);
+    if (it == returns.end()) {
+        return;
     }
-    
-    //    returns.remove_if(is_empty);
-    //    return invalidate;
-    return false;
+    target_ulong ordinal = it->second.ordinal;
+    switch (syscalls_profile) {
+    case PROFILE_LINUX_X86:
+        syscall_return_switch_linux_x86(env, pc, ordinal);
+        break;
+    case PROFILE_LINUX_ARM:
+        syscall_return_switch_linux_arm(env, pc, ordinal);
+        break;
+    case PROFILE_WINDOWS7_X86:
+        syscall_return_switch_windows7_x86(env, pc, ordinal);
+        break;
+    default:
+        assert (1==0);
+    }
+    returns.erase(ret_key);
 }
 
 
 // This will only be called for instructions where the
 // translate_callback returned true
 int exec_callback(CPUState *env, target_ulong pc) {
+    if (return_hooks.count(pc) != 0) {
+        returned_check(env, pc);
+        // a return address is hardly ever a syscall itself
+        if (!is_syscall_insn(env, pc)) {
+            return 0;
+        }
+    }
     // run any code we need to update our state
     for(const auto callback : preExecCallbacks){
         callback(env, pc);
@@ -345,10 +371,10 @@ int exec_callback(CPUState *env, target_ulong pc) {
 
 
 // Check if the instruction is sysenter (0F 34)
-bool translate_callback(CPUState *env, target_ulong pc) {
+static bool is_syscall_insn(CPUState *env, target_ulong pc) {
 #if defined(TARGET_I386)
     unsigned char buf[2] = {};
-    panda_virtual_memory_rw(env, pc, buf, 2, 0);
+    panda_read_code(env, pc, buf, 2);
     // Check if the instruction is syscall (0F 05)
     if (buf[0]== 0x0F && buf[1] == 0x05) {
         return true;
@@ -365,7 +391,7 @@ bool translate_callback(CPUState *env, target_ulong pc) {
 
     // Check for ARM mode syscall
     if(env->thumb == 0) {
-        panda_virtual_memory_rw(env, pc, buf, 4, 0);
+        panda_read_code(env, pc, buf, 4);
         // EABI
         if ( ((buf[3] & 0x0F) ==  0x0F)  && (buf[2] == 0) && (buf[1] == 0) && (buf[0] == 0) ) {
             return true;
@@ -377,7 +403,7 @@ bool translate_callback(CPUState *env, target_ulong pc) {
 #endif
     }
     else {
-        panda_virtual_memory_rw(env, pc, buf, 2, 0);
+        panda_read_code(env, pc, buf, 2);
         // check for Thumb mode syscall
         if (buf[1] == 0xDF && buf[0] == 0){
             return true;
@@ -387,6 +413,12 @@ bool translate_callback(CPUState *env, target_ulong pc) {
 #endif
 }
 
+// Syscall instructions and the return addresses of syscalls in flight
+// get an exec callback; nothing else costs anything at run time.
+bool translate_callback(CPUState *env, target_ulong pc) {
+    return return_hooks.count(pc) != 0 || is_syscall_insn(env, pc);
+}
+
 
 extern "C" {
 
@@ -418,10 +450,6 @@ bool init_plugin(void *self) {
     panda_register_callback(self, PANDA_CB_INSN_TRANSLATE, pcb);
     pcb.insn_exec = exec_callback;
     panda_register_callback(self, PANDA_CB_INSN_EXEC, pcb);
-    //    pcb.before_block_exec_invalidate_opt = returned_check_callback;
-    //   panda_register_callback(self, PANDA_CB_BEFORE_BLOCK_EXEC_INVALIDATE_OPT, pcb);
-    pcb.before_block_exec = returned_check_callback;
-    panda_register_callback(self, PANDA_CB_BEFORE_BLOCK_EXEC, pcb);
 #else
     fwrite(stderr,"The syscalls plugin is not currently supported on this platform.\n");
     return false;
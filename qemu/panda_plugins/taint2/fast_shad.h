@@ -51,53 +51,240 @@ struct TaintData {
     TaintData() : ls(NULL), tcn(0) {}
     TaintData(LabelSetP ls, uint32_t tcn) : ls(ls), tcn(tcn) {}
 
+    // Most unions are with nothing or with the same set; answer those here
+    // instead of calling out.
+    static inline LabelSetP ls_union(LabelSetP ls1, LabelSetP ls2) {
+        if (ls1 == ls2 || !ls2) return ls1;
+        else if (!ls1) return ls2;
+        else return label_set_union(ls1, ls2);
+    }
+
     void add(TaintData td) {
-        ls = label_set_union(ls, td.ls);
+        ls = ls_union(ls, td.ls);
         tcn = std::max(tcn, td.tcn) + 1;
     }
 
     static TaintData copy_union(TaintData td1, TaintData td2) {
         return TaintData(
-                label_set_union(td1.ls, td2.ls),
+                ls_union(td1.ls, td2.ls),
                 std::max(td1.tcn, td2.tcn));
     }
 
     static TaintData comp_union(TaintData td1, TaintData td2) {
         return TaintData(
-                label_set_union(td1.ls, td2.ls),
+                ls_union(td1.ls, td2.ls),
                 std::max(td1.tcn, td2.tcn) + 1);
     }
 };
 
+// True if any of the n TaintData at td has labels.  ORs the label pointers
+// together eight at a time, which the compiler turns into vector code, and
+// only branches once per eight.
+static inline bool any_labels(const TaintData *td, uint64_t n) {
+    uint64_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uintptr_t acc = 0;
+        for (unsigned j = 0; j < 8; j++) {
+            acc |= (uintptr_t)td[i + j].ls;
+        }
+        if (acc) return true;
+    }
+    uintptr_t acc = 0;
+    for (; i < n; i++) {
+        acc |= (uintptr_t)td[i].ls;
+    }
+    return acc;
+}
+
+// Each bit of the summary covers this many TaintData (1K of shadow).
+#define FAST_SHAD_BLOCK_BITS 6
+
+// A paged shadow has one page per word of summary (64K of shadow).
+#define FAST_SHAD_PAGE_BITS (FAST_SHAD_BLOCK_BITS + 6)
+#define FAST_SHAD_PAGE_SIZE (1UL << FAST_SHAD_PAGE_BITS)
+
+// Clean pages kept around for reuse instead of going back to free().
+#define FAST_SHAD_FREE_PAGES 16
+
+// Clears that may leave a block marked dirty with no labels in it before
+// sweep() looks for pages to give back, and how many pages it looks at.
+#define FAST_SHAD_SWEEP_INTERVAL (1UL << 14)
+#define FAST_SHAD_SWEEP_PAGES 16
+
 class FastShad {
 private:
     TaintData *labels;
     TaintData *orig_labels;
     uint64_t size; // Number of labelsets contained.
 
-    inline LabelSetP *get_ls_p(uint64_t guest_addr) {
-        //taint_log("  %lx->get_ls_p(%lx)\n", (uint64_t)this, guest_addr);
+    // Only set for paged shadows, which have no labels array and no frames.
+    // pages[p] holds TaintData [p, p + 1) << FAST_SHAD_PAGE_BITS, and is
+    // allocated whenever word p of the summary is nonzero.  Pages that
+    // aren't there read as zero_page.  A page whose labels are all cleared
+    // stays until a whole-block delete or sweep() finds its summary word
+    // clear, and then goes to free_pages, so taint that comes and goes in
+    // one spot doesn't calloc and free a page each time.
+    TaintData **pages;
+    uint64_t num_pages; // currently allocated
+    uint64_t max_pages; // most ever allocated at once
+    static TaintData zero_page[FAST_SHAD_PAGE_SIZE];
+    TaintData *free_pages[FAST_SHAD_FREE_PAGES]; // all zero
+    unsigned num_free_pages;
+    uint64_t num_stale; // clears since the last sweep()
+    uint64_t sweep_next; // page sweep() starts at
+
+    TaintData *alloc_page(uint64_t page);
+    void release_page(uint64_t page);
+    void release_pages(uint64_t addr, uint64_t n);
+    void sweep();
+    static void copy_paged(FastShad *shad_dest, uint64_t dest,
+            FastShad *shad_src, uint64_t src, uint64_t size);
+
+    // One bit per block of 1 << FAST_SHAD_BLOCK_BITS TaintData.  A clear bit
+    // means every TaintData in the block is zero, so copies and deletes on
+    // clean ranges can skip touching the shadow.  Bits are set whenever
+    // labels are written and only cleared when a whole block is wiped, or
+    // sweep() finds one with no labels.
+    uint64_t *summary;
+
+    // The TaintData for guest_addr, to read.
+    inline TaintData *read_p(uint64_t guest_addr) {
+        //taint_log("  %lx->read_p(%lx)\n", (uint64_t)this, guest_addr);
         tassert(guest_addr < size);
-        return &(labels[guest_addr].ls);
+        if (!pages) return &labels[guest_addr];
+        TaintData *page = pages[guest_addr >> FAST_SHAD_PAGE_BITS];
+        if (!page) page = zero_page;
+        return &page[guest_addr & (FAST_SHAD_PAGE_SIZE - 1)];
     }
 
-    inline bool range_tainted(uint64_t addr, uint64_t size) {
-        for (unsigned i = addr; i < size; i++) {
-            if (*get_ls_p(addr)) return true;
+    // Same, to store labels in, allocating the page if need be.  The caller
+    // has to mark() what it writes.
+    inline TaintData *write_p(uint64_t guest_addr) {
+        tassert(guest_addr < size);
+        if (!pages) return &labels[guest_addr];
+        TaintData *page = pages[guest_addr >> FAST_SHAD_PAGE_BITS];
+        if (!page) page = alloc_page(guest_addr >> FAST_SHAD_PAGE_BITS);
+        return &page[guest_addr & (FAST_SHAD_PAGE_SIZE - 1)];
+    }
+
+    // Index into the whole array, independent of the current frame.
+    inline uint64_t abs_addr(uint64_t addr) {
+        return (labels - orig_labels) + addr;
+    }
+
+    inline bool block_dirty(uint64_t block) {
+        return summary[block >> 6] & (1UL << (block & 63));
+    }
+
+    inline void mark(uint64_t addr) {
+        uint64_t block = abs_addr(addr) >> FAST_SHAD_BLOCK_BITS;
+        summary[block >> 6] |= 1UL << (block & 63);
+    }
+
+    inline void mark_range(uint64_t addr, uint64_t n) {
+        uint64_t first = abs_addr(addr) >> FAST_SHAD_BLOCK_BITS;
+        uint64_t last = abs_addr(addr + n - 1) >> FAST_SHAD_BLOCK_BITS;
+        for (uint64_t b = first; b <= last; b++) {
+            summary[b >> 6] |= 1UL << (b & 63);
         }
-        return false;
+    }
+
+    // Some labels in a paged shadow were cleared without clearing their
+    // blocks' summary bits.  Every so often, go and look for those.
+    inline void stale() {
+        if (++num_stale >= FAST_SHAD_SWEEP_INTERVAL) sweep();
+    }
+
+    // [addr, addr + n) was just zeroed; forget the blocks it covers fully.
+    // Paged shadows also give back pages that are clean now.
+    inline void clear_range(uint64_t addr, uint64_t n) {
+        uint64_t start = abs_addr(addr);
+        uint64_t first = (start + (1UL << FAST_SHAD_BLOCK_BITS) - 1) >> FAST_SHAD_BLOCK_BITS;
+        uint64_t end = (start + n) >> FAST_SHAD_BLOCK_BITS;
+        for (uint64_t b = first; b < end; b++) {
+            summary[b >> 6] &= ~(1UL << (b & 63));
+        }
+        if (pages && n > 0) {
+            release_pages(addr, n);
+            // partly wiped blocks at the ends are left to sweep()
+            if ((start | (start + n)) & ((1UL << FAST_SHAD_BLOCK_BITS) - 1)) {
+                stale();
+            }
+        }
+    }
+
+    // Zero [addr, addr + n).
+    inline void zero_range(uint64_t addr, uint64_t n) {
+        if (!pages) {
+            memset(&labels[addr], 0, n * sizeof(TaintData));
+        } else {
+            uint64_t i = addr;
+            while (i < addr + n) {
+                uint64_t page_end = std::min(addr + n,
+                        (i | (FAST_SHAD_PAGE_SIZE - 1)) + 1);
+                if (pages[i >> FAST_SHAD_PAGE_BITS]) {
+                    memset(write_p(i), 0, (page_end - i) * sizeof(TaintData));
+                }
+                i = page_end;
+            }
+        }
+        clear_range(addr, n);
+    }
+
+    // True if nothing in [addr, addr + n) can be tainted.  Checks a word of
+    // summary (64 blocks) at a time.
+    inline bool range_clean(uint64_t addr, uint64_t n) {
+        if (n == 0) return true;
+        uint64_t first = abs_addr(addr) >> FAST_SHAD_BLOCK_BITS;
+        uint64_t last = abs_addr(addr + n - 1) >> FAST_SHAD_BLOCK_BITS;
+        uint64_t first_mask = ~0UL << (first & 63);
+        uint64_t last_mask = ~0UL >> (63 - (last & 63));
+        if (first >> 6 == last >> 6) {
+            return !(summary[first >> 6] & first_mask & last_mask);
+        }
+        if (summary[first >> 6] & first_mask) return false;
+        for (uint64_t w = (first >> 6) + 1; w < last >> 6; w++) {
+            if (summary[w]) return false;
+        }
+        return !(summary[last >> 6] & last_mask);
     }
 
 public:
-    FastShad(uint64_t size);
+    // A paged shadow only allocates memory for the parts that hold labels,
+    // for big sparse shadows like guest RAM.
+    FastShad(uint64_t size, bool paged = false);
     ~FastShad();
 
     uint64_t get_size() { return size; }
 
+    // True if anything in [addr, addr + n) has labels.  Exact, but only
+    // looks at blocks the summary says might be tainted.
+    inline bool range_tainted(uint64_t addr, uint64_t n) {
+        if (range_clean(addr, n)) return false;
+        uint64_t block_size = 1UL << FAST_SHAD_BLOCK_BITS;
+        uint64_t i = addr;
+        while (i < addr + n) {
+            uint64_t block = abs_addr(i) >> FAST_SHAD_BLOCK_BITS;
+            uint64_t block_end = std::min(addr + n,
+                    i + block_size - (abs_addr(i) & (block_size - 1)));
+            if (block_dirty(block) && any_labels(read_p(i), block_end - i)) {
+                return true;
+            }
+            i = block_end;
+        }
+        return false;
+    }
+
     // Taint an address with a labelset.
     inline void set(uint64_t addr, LabelSetP ls) {
         if (track_taint_state && ls) taint_state_changed();
-        *get_ls_p(addr) = ls;
+        if (ls) {
+            write_p(addr)->ls = ls;
+            mark(addr);
+        } else if (!range_clean(addr, 1)) {
+            *read_p(addr) = TaintData();
+            if (pages) stale();
+        }
     }
 
     static inline void copy(FastShad *shad_dest, uint64_t dest, FastShad *shad_src, uint64_t src, uint64_t size) {
@@ -105,48 +292,62 @@ public:
         tassert(src + size >= src);
         tassert(dest + size <= shad_dest->size);
         tassert(src + size <= shad_src->size);
-        
+
+        bool src_clean = shad_src->range_clean(src, size);
+        // Clean to clean: nothing to do.
+        if (src_clean && shad_dest->range_clean(dest, size)) return;
+
         if (track_taint_state &&
                 (shad_dest->range_tainted(dest, size) ||
-                 shad_src->range_tainted(src, size)))
+                 (!src_clean && shad_src->range_tainted(src, size))))
             taint_state_changed();
 #ifdef TAINTDEBUG
         for (unsigned i = 0; i < size; i++) {
-            if (*shad_src->get_ls_p(src + i) != NULL) {
+            if (shad_src->query(src + i) != NULL) {
                 taint_log("TAINTED COPY: %lx[%lx] <- %lx[%lx] (%lx)\n",
                         (uint64_t)shad_dest, dest + i,
                         (uint64_t)shad_src, src + i,
-                        (uint64_t)*shad_src->get_ls_p(src + i));
+                        (uint64_t)shad_src->query(src + i));
                 break;
             }
         }
 #endif
 
-        memcpy(shad_dest->get_ls_p(dest), shad_src->get_ls_p(src), size * sizeof(TaintData));
+        if (src_clean) {
+            shad_dest->zero_range(dest, size);
+        } else if (shad_dest->pages || shad_src->pages) {
+            copy_paged(shad_dest, dest, shad_src, src, size);
+        } else {
+            memcpy(&shad_dest->labels[dest], &shad_src->labels[src], size * sizeof(TaintData));
+            shad_dest->mark_range(dest, size);
+        }
     }
 
     // Remove taint.
     inline void remove(uint64_t addr, uint64_t remove_size) {
         tassert(addr + remove_size >= addr);
         tassert(addr + remove_size <= size);
-        
+
+        // Already clean: nothing to do.
+        if (range_clean(addr, remove_size)) return;
+
         if (track_taint_state && range_tainted(addr, remove_size))
             taint_state_changed();
 #ifdef TAINTDEBUG
         for (unsigned i = 0; i < remove_size; i++) {
-            if (*get_ls_p(addr + i) != NULL) {
+            if (query(addr + i) != NULL) {
                 taint_log("TAINTED DELETE\n");
                 break;
             }
         }
 #endif
 
-        memset(get_ls_p(addr), 0, remove_size * sizeof(TaintData));
+        zero_range(addr, remove_size);
     }
 
     // Query. NULL if untainted.
     inline LabelSetP query(uint64_t addr) {
-        return *get_ls_p(addr);
+        return read_p(addr)->ls;
     } 
 
     inline void reset_frame() {
@@ -167,14 +368,37 @@ public:
     }
 
     inline TaintData query_full(uint64_t addr) {
-        return labels[addr];
+        return *read_p(addr);
     }
 
     inline void set_full(uint64_t addr, TaintData td) {
         tassert(addr < size);
-        if (track_taint_state && (td.ls || *get_ls_p(addr)))
+        if (track_taint_state && (td.ls || query(addr)))
             taint_state_changed();
-        labels[addr] = td;
+        // tcn only means something for tainted data; keep it 0 otherwise so
+        // untainted shadow stays all zero and the summary stays exact.
+        if (td.ls) {
+            *write_p(addr) = td;
+            mark(addr);
+        } else if (!range_clean(addr, 1)) {
+            *read_p(addr) = TaintData();
+            if (pages) stale();
+        }
+    }
+
+    // Set all of [addr, addr + n) to td, e.g. the result of a mix.
+    inline void set_range(uint64_t addr, uint64_t n, TaintData td) {
+        if (!td.ls) {
+            remove(addr, n);
+            return;
+        }
+        if (n == 0) return;
+        tassert(addr + n <= size);
+        if (track_taint_state) taint_state_changed();
+        for (uint64_t i = 0; i < n; i++) {
+            *write_p(addr + i) = td;
+        }
+        mark_range(addr, n);
     }
 };
 
@@ -26,14 +26,21 @@ extern "C" {
 #include <map>
 #include <set>
 
+// Label sets are immutable and hash-consed (see taint2_label_set.cpp), so
+// equal sets are the same pointer.  NULL is the empty set.
+struct LabelSet;
+
 extern "C" {
-typedef const std::set<uint32_t> *LabelSetP;
+typedef const struct LabelSet *LabelSetP;
 
 LabelSetP label_set_union(LabelSetP ls1, LabelSetP ls2);
 LabelSetP label_set_singleton(uint32_t label);
 }
 
 void label_set_iter(LabelSetP ls, void (*leaf)(uint32_t, void *), void *user);
+uint32_t label_set_card(LabelSetP ls);
 std::set<uint32_t> label_set_render_set(LabelSetP ls);
+// number of sets, memory use and union cache hit rate
+void label_set_spit_stats(void);
 
 #endif
@@ -17,6 +17,7 @@ PANDAENDCOMMENT */
 
 #include <map>
 #include <cstdio>
+#include <cstdint>
 #include <vector>
 #include <set>
 
@@ -202,8 +203,15 @@ public:
     static char ID;
     PandaTaintVisitor PTV; // Our LLVM instruction visitor
 
+    // Remove taint ops that can't change what later ops see (see
+    // cleanupTaintOps), and count taint op calls in block functions.
+    bool cleanup;
+    uint64_t opsBefore;
+    uint64_t opsAfter;
+
     PandaTaintFunctionPass(Shad *shad, taint2_memlog *taint_memlog)
-        : FunctionPass(ID), shad(shad), taint_memlog(taint_memlog), PTV(shad, taint_memlog) {}
+        : FunctionPass(ID), shad(shad), taint_memlog(taint_memlog), PTV(shad, taint_memlog),
+          cleanup(true), opsBefore(0), opsAfter(0) {}
 
     ~PandaTaintFunctionPass() { }
 
@@ -212,6 +220,9 @@ public:
     // runOnFunction - Our custom function pass implementation
     bool runOnFunction(Function &F);
 
+    // Drop unneeded breadcrumbs and llv ops from an instrumented TB function
+    void cleanupTaintOps(Function &F);
+
     // debug print all taint ops for a function
     void debugTaintOps();
 
@@ -141,6 +141,7 @@ bool tainted_pointer = true;
 static TaintGranularity granularity;
 static TaintLabelMode mode;
 bool optimize_llvm = true;
+static bool cleanup_taint_ops = true;
 extern bool inline_taint;
 
 
@@ -223,11 +224,16 @@ void __taint2_enable_taint(void) {
     // Initialize memlog.
     memset(&taint_memlog, 0, sizeof(taint_memlog));
 
+    // With -llvm-tiered the compile thread may be using the module and the
+    // pass manager, and this can run in the middle of a replay
+    tcg_llvm_ctx->lock();
+
     llvm::Module *mod = tcg_llvm_ctx->getModule();
     FPM = tcg_llvm_ctx->getFunctionPassManager();
 
     // Add the taint analysis pass to our taint pass manager
     PTFP = new llvm::PandaTaintFunctionPass(shadow, &taint_memlog);
+    PTFP->cleanup = cleanup_taint_ops;
     FPM->add(PTFP);
 
     if (optimize_llvm) {
@@ -240,6 +246,25 @@ void __taint2_enable_taint(void) {
 
     FPM->doInitialization();
 
+    // The taint pass puts the addresses of the shadows into the code it
+    // generates; cached blocks get this run's addresses by name.
+    struct {
+        bool optimize;
+        bool cleanup;
+    } cache_config;
+    memset(&cache_config, 0, sizeof(cache_config));
+    cache_config.optimize = optimize_llvm;
+    cache_config.cleanup = cleanup_taint_ops;
+    tcg_llvm_cache_add_config("taint2", &cache_config, sizeof(cache_config));
+    tcg_llvm_cache_add_symbol("taint2_shad", shadow, sizeof(Shad));
+    tcg_llvm_cache_add_symbol("taint2_llv", shadow->llv, sizeof(FastShad));
+    tcg_llvm_cache_add_symbol("taint2_ram", shadow->ram, sizeof(FastShad));
+    tcg_llvm_cache_add_symbol("taint2_grv", shadow->grv, sizeof(FastShad));
+    tcg_llvm_cache_add_symbol("taint2_gsv", shadow->gsv, sizeof(FastShad));
+    tcg_llvm_cache_add_symbol("taint2_ret", shadow->ret, sizeof(FastShad));
+    tcg_llvm_cache_add_symbol("taint2_memlog", &taint_memlog,
+            sizeof(taint_memlog));
+
     // Populate module with helper function taint ops
     for (auto i = mod->begin(); i != mod->end(); i++){
         if (!i->isDeclaration()) PTFP->runOnFunction(*i);
@@ -253,6 +278,8 @@ void __taint2_enable_taint(void) {
         exit(1);
     }
 
+    tcg_llvm_ctx->unlock();
+
     tcg_llvm_write_module(tcg_llvm_ctx, "/tmp/llvm-mod.bc");
 
     printf("taint2: Done verifying module. Running...\n");
@@ -713,6 +740,7 @@ bool init_plugin(void *self) {
     if (panda_parse_bool(args, "binary")) mode = TAINT_BINARY_LABEL;
     if (panda_parse_bool(args, "word")) granularity = TAINT_GRANULARITY_WORD;
     optimize_llvm = panda_parse_bool(args, "opt");
+    cleanup_taint_ops = !panda_parse_bool(args, "no_cleanup");
 
     return true;
 }
@@ -725,6 +753,13 @@ void uninit_plugin(void *self) {
 
     if (shadow) tp_free(shadow);
 
+    if (PTFP && PTFP->opsBefore) {
+        printf("taint2: %lu taint op calls in blocks, %lu after cleanup\n",
+                PTFP->opsBefore, PTFP->opsAfter);
+    }
+
+    label_set_spit_stats();
+
     panda_disable_llvm();
     panda_disable_memcb();
     panda_enable_tb_chaining();
@@ -29,13 +29,26 @@ PANDAENDCOMMENT */
 
 #include <set>
 
-typedef const std::set<uint32_t> *LabelSetP;
+typedef const struct LabelSet *LabelSetP;
 
-FastShad::FastShad(uint64_t labelsets) {
+TaintData FastShad::zero_page[FAST_SHAD_PAGE_SIZE];
+
+FastShad::FastShad(uint64_t labelsets, bool paged) {
     uint64_t bytes = sizeof(TaintData) * labelsets;
 
-    TaintData *array;
-    if (labelsets < (1UL << 24)) {
+    TaintData *array = NULL;
+    pages = NULL;
+    num_pages = max_pages = 0;
+    num_free_pages = 0;
+    num_stale = sweep_next = 0;
+    if (paged) {
+        uint64_t npages = (labelsets >> FAST_SHAD_PAGE_BITS) + 1;
+        printf("taint2: Allocating paged fast_shad (%" PRIu64 " bytes) in %" PRIu64
+                " pages of %" PRIu64 " bytes.\n",
+                bytes, npages, FAST_SHAD_PAGE_SIZE * sizeof(TaintData));
+        pages = (TaintData **)calloc(npages, sizeof(TaintData *));
+        assert(pages);
+    } else if (labelsets < (1UL << 24)) {
         array = (TaintData *)malloc(bytes);
         printf("taint2: Allocating small fast_shad (%" PRIu64 " bytes) using malloc @ %lx.\n",
                 bytes, (uint64_t)array);
@@ -68,13 +81,116 @@ FastShad::FastShad(uint64_t labelsets) {
     labels = array;
     orig_labels = array;
     size = labelsets;
+
+    // one bit per block, rounded up to whole words
+    uint64_t blocks = (labelsets >> FAST_SHAD_BLOCK_BITS) + 1;
+    summary = (uint64_t *)calloc((blocks >> 6) + 1, sizeof(uint64_t));
+    assert(summary);
 }
 
 // release all memory associated with this fast_shad.
 FastShad::~FastShad() {
-    if (size < (1UL << 24)) {
+    free(summary);
+    if (pages) {
+        printf("taint2: Paged fast_shad used at most %" PRIu64 " pages (%" PRIu64 " bytes).\n",
+                max_pages, max_pages * FAST_SHAD_PAGE_SIZE * sizeof(TaintData));
+        for (uint64_t p = 0; p <= (size >> FAST_SHAD_PAGE_BITS); p++) {
+            free(pages[p]);
+        }
+        for (unsigned i = 0; i < num_free_pages; i++) {
+            free(free_pages[i]);
+        }
+        free(pages);
+    } else if (size < (1UL << 24)) {
         free(orig_labels);
     } else {
         munmap(orig_labels, sizeof(TaintData) * size);
     }
 }
+
+TaintData *FastShad::alloc_page(uint64_t page) {
+    tassert(!pages[page]);
+    if (num_free_pages > 0) {
+        pages[page] = free_pages[--num_free_pages];
+    } else {
+        pages[page] = (TaintData *)calloc(FAST_SHAD_PAGE_SIZE, sizeof(TaintData));
+        assert(pages[page]);
+    }
+    num_pages++;
+    if (num_pages > max_pages) max_pages = num_pages;
+    return pages[page];
+}
+
+// The page's summary word is clear, so it's all zero and can be reused as is.
+void FastShad::release_page(uint64_t page) {
+    tassert(pages[page] && !summary[page]);
+    if (num_free_pages < FAST_SHAD_FREE_PAGES) {
+        free_pages[num_free_pages++] = pages[page];
+    } else {
+        free(pages[page]);
+    }
+    pages[page] = NULL;
+    num_pages--;
+}
+
+// Gives back the pages in [addr, addr + n) whose summary word is clear.
+void FastShad::release_pages(uint64_t addr, uint64_t n) {
+    for (uint64_t p = addr >> FAST_SHAD_PAGE_BITS;
+            p <= (addr + n - 1) >> FAST_SHAD_PAGE_BITS; p++) {
+        if (pages[p] && !summary[p]) release_page(p);
+    }
+}
+
+// set(), set_full(), copies and deletes that clear only part of a block
+// leave it marked dirty, since finding out whether it still has labels
+// means reading the whole block.  Rather than do that every time, look at
+// the next FAST_SHAD_SWEEP_PAGES allocated pages every so often, clear the
+// bits of blocks there with no labels, and give back pages that end up
+// clean.
+void FastShad::sweep() {
+    uint64_t block_size = 1UL << FAST_SHAD_BLOCK_BITS;
+    uint64_t npages = (size >> FAST_SHAD_PAGE_BITS) + 1;
+    unsigned swept = 0;
+    num_stale = 0;
+    for (uint64_t i = 0; i < npages && swept < FAST_SHAD_SWEEP_PAGES; i++) {
+        uint64_t p = sweep_next;
+        sweep_next = (sweep_next + 1) % npages;
+        if (!pages[p]) continue;
+        for (uint64_t b = p << 6; b < (p + 1) << 6; b++) {
+            // Pages are whole, so this may read past size but not past the page.
+            if (block_dirty(b) && !any_labels(&pages[p][(b & 63) << FAST_SHAD_BLOCK_BITS], block_size)) {
+                summary[p] &= ~(1UL << (b & 63));
+            }
+        }
+        if (!summary[p]) release_page(p);
+        swept++;
+    }
+}
+
+// copy() for when either side is paged and the source isn't clean.  Goes a
+// page of either side at a time; parts of the source without labels are
+// deleted from the destination instead, so they don't allocate pages there.
+void FastShad::copy_paged(FastShad *shad_dest, uint64_t dest,
+        FastShad *shad_src, uint64_t src, uint64_t size) {
+    uint64_t done = 0;
+    while (done < size) {
+        uint64_t n = size - done;
+        uint64_t d = dest + done, s = src + done;
+        if (shad_dest->pages) {
+            n = std::min(n, FAST_SHAD_PAGE_SIZE - (d & (FAST_SHAD_PAGE_SIZE - 1)));
+        }
+        if (shad_src->pages) {
+            n = std::min(n, FAST_SHAD_PAGE_SIZE - (s & (FAST_SHAD_PAGE_SIZE - 1)));
+        }
+        if (!shad_src->range_tainted(s, n)) {
+            if (!shad_dest->range_clean(d, n)) shad_dest->zero_range(d, n);
+        } else {
+            memcpy(shad_dest->write_p(d), shad_src->read_p(s), n * sizeof(TaintData));
+            shad_dest->mark_range(d, n);
+            // Overwriting the labels in a block with clean ones from the
+            // source can leave it, or the page, with none.
+            if (shad_dest->pages) shad_dest->stale();
+        }
+        done += n;
+    }
+}
@@ -2,121 +2,194 @@ extern "C" {
 #include <sys/mman.h>
 }
 
-#include <map>
+#include <cassert>
+#include <cstring>
+#include <cinttypes>
+#include <algorithm>
 #include <vector>
 #include <set>
-#include <unordered_set>
-#include <unordered_map>
-#include <functional>
 
 #include "label_set.h"
 
-template<typename T>
-class ArenaAlloc {
+// A label set is an immutable sorted array of labels.  Sets are hash-consed:
+// each distinct set is stored exactly once, so two sets are equal iff their
+// pointers are, and unions can be cached by operand address.
+struct LabelSet {
+    uint64_t hash;
+    uint32_t size;
+    uint32_t labels[];      // sorted, no duplicates
+};
+
+// Sets live back to back in big mmap'd blocks and are never freed.
+class LabelSetArena {
 private:
     uint8_t *next = NULL;
+    uint8_t *end = NULL;
+    size_t next_block_size = 1 << 20;
     std::vector<std::pair<uint8_t *, size_t>> blocks;
-    size_t next_block_size = 1 << 15;
 
-    void alloc_block() {
-        //printf("taint2: allocating block of size %lu\n", next_block_size);
-        next = (uint8_t *)mmap(NULL, next_block_size, PROT_READ | PROT_WRITE,
+    static const size_t max_block_size = 1 << 28;
+
+    void alloc_block(size_t min_size) {
+        size_t size = std::max(next_block_size, min_size);
+        next = (uint8_t *)mmap(NULL, size, PROT_READ | PROT_WRITE,
                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-        assert(next);
-        blocks.push_back(std::make_pair(next, next_block_size));
-        next_block_size <<= 1;
+        assert(next != MAP_FAILED);
+        end = next + size;
+        blocks.push_back(std::make_pair(next, size));
+        mapped += size;
+        if (next_block_size < max_block_size) next_block_size <<= 1;
     }
 
-    T *alloc_imp() {
-        assert(blocks.size() > 0);
-        std::pair<uint8_t *, size_t>& block = blocks.back();
-        if (next + sizeof(T) > block.first + block.second) {
-            alloc_block();
-            assert(next != NULL);
+public:
+    size_t mapped = 0;      // bytes mmap'd
+    size_t used = 0;        // bytes handed out
+
+    LabelSet *alloc(uint32_t size) {
+        // keep the uint64_t hash aligned
+        size_t bytes = (sizeof(LabelSet) + size * sizeof(uint32_t) + 7) & ~(size_t)7;
+        if (next + bytes > end) {
+            alloc_block(bytes);
         }
-
-        T *result = new(next) T;
-        next += sizeof(T);
+        LabelSet *result = (LabelSet *)next;
+        next += bytes;
+        used += bytes;
         return result;
     }
 
-public:
-    ArenaAlloc() {
-        alloc_block();
+    ~LabelSetArena() {
+        for (auto&& block : blocks) {
+            munmap(block.first, block.second);
+        }
     }
+};
 
-    const T *alloc() {
-        return alloc_imp();
-    }
+static LabelSetArena LSA;
+
+// 64-bit mixing as in xxHash/murmur3.  The old XOR-shift hash collided on
+// any two sets with the same labels rotated into the same bits.
+static inline uint64_t mix64(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
 
-    const T *alloc(T &old) {
-        T *result = alloc_imp();
-        result->swap(old);
-        return result;
+static inline uint64_t hash_labels(const uint32_t *labels, uint32_t size) {
+    uint64_t h = 0x9e3779b97f4a7c15ULL + size;
+    for (uint32_t i = 0; i < size; i++) {
+        h ^= labels[i] * 0xc2b2ae3d27d4eb4fULL;
+        h = (h << 31 | h >> 33) * 0x9e3779b97f4a7c15ULL;
     }
+    return mix64(h);
+}
 
-    ~ArenaAlloc() {
-        for (auto&& block : blocks) {
-            munmap(block.first, block.second);
+// Open-addressed table of every set ever made, for deduplication.
+static LabelSetP *set_table = NULL;
+static uint64_t set_table_mask = 0;
+static uint64_t num_sets = 0;
+static uint64_t num_labels = 0;     // total over all sets
+
+static void set_table_insert(LabelSetP ls) {
+    uint64_t i = ls->hash & set_table_mask;
+    while (set_table[i]) i = (i + 1) & set_table_mask;
+    set_table[i] = ls;
+}
+
+static void set_table_grow() {
+    LabelSetP *old = set_table;
+    uint64_t old_size = set_table_mask + 1;
+
+    uint64_t size = old ? 2 * old_size : 1 << 16;
+    set_table = (LabelSetP *)calloc(size, sizeof(LabelSetP));
+    assert(set_table);
+    set_table_mask = size - 1;
+    if (old) {
+        for (uint64_t i = 0; i < old_size; i++) {
+            if (old[i]) set_table_insert(old[i]);
         }
+        free(old);
     }
-};
+}
 
-static ArenaAlloc<std::set<uint32_t>> LSA;
-
-namespace std {
-template<>
-class hash<set<uint32_t>> {
-  public:
-    size_t operator()(const set<uint32_t> &labels) const {
-        uint64_t result = 0;
-        for (uint32_t l : labels) {
-            result ^= l;
-            result = result << 11 | result >> 53;
+// the one copy of this set, making it if needed
+static LabelSetP label_set_intern(const uint32_t *labels, uint32_t size) {
+    uint64_t hash = hash_labels(labels, size);
+
+    if (set_table == NULL) set_table_grow();
+    uint64_t i = hash & set_table_mask;
+    for (LabelSetP ls; (ls = set_table[i]) != NULL; i = (i + 1) & set_table_mask) {
+        if (ls->hash == hash && ls->size == size &&
+                memcmp(ls->labels, labels, size * sizeof(uint32_t)) == 0) {
+            return ls;
         }
-        return result;
     }
-};
 
-template<>
-class hash<pair<LabelSetP, LabelSetP>> {
-  public:
-    size_t operator()(const pair<LabelSetP, LabelSetP> &labels) const {
-        return hash<LabelSetP>()(labels.first) ^
-            (hash<LabelSetP>()(labels.second) << (sizeof(LabelSetP) / 2));
+    LabelSet *result = LSA.alloc(size);
+    result->hash = hash;
+    result->size = size;
+    memcpy(result->labels, labels, size * sizeof(uint32_t));
+
+    num_sets++;
+    num_labels += size;
+    // keep load under 1/2 so probe runs stay short
+    if (2 * num_sets > set_table_mask) {
+        set_table_grow();
+        set_table_insert(result);
+    } else {
+        set_table[i] = result;
     }
+    return result;
+}
+
+// Fixed-size, direct-mapped cache of recent unions.  A new union simply
+// evicts whatever was in its slot, so this never grows.
+#define UNION_CACHE_BITS 18
+
+struct UnionCacheEntry {
+    LabelSetP min, max, result;
 };
+
+static UnionCacheEntry union_cache[1 << UNION_CACHE_BITS];
+static uint64_t union_cache_hits = 0;
+static uint64_t union_cache_misses = 0;
+
+static inline UnionCacheEntry *union_cache_slot(LabelSetP min, LabelSetP max) {
+    uint64_t h = mix64((uint64_t)min ^ ((uint64_t)max << 1));
+    return &union_cache[h >> (64 - UNION_CACHE_BITS)];
 }
 
-static std::unordered_set<std::set<uint32_t>> label_sets;
 LabelSetP label_set_union(LabelSetP ls1, LabelSetP ls2) {
-    static std::unordered_map<std::pair<LabelSetP, LabelSetP>, LabelSetP> memoized_unions;
-
     if (ls1 == ls2) {
         return ls1;
     } else if (ls1 && ls2) {
         LabelSetP min = std::min(ls1, ls2);
         LabelSetP max = std::max(ls1, ls2);
-        std::pair<LabelSetP, LabelSetP> minmax(min, max);
-
-        {
-            auto it = memoized_unions.find(minmax);
-            if (it != memoized_unions.end()) {
-                return it->second;
-            }
-        }
 
-        std::set<uint32_t> temp(*min);
-        for (auto l : *max) {
-            temp.insert(l);
+        UnionCacheEntry *slot = union_cache_slot(min, max);
+        if (slot->min == min && slot->max == max) {
+            union_cache_hits++;
+            return slot->result;
         }
-
-        // insert returns a pair <iterator, bool>; second is whether it happened
-        // first is iterator to new/existing element
-        auto it = label_sets.insert(temp).first;
-        const std::set<uint32_t> *result = &(*it);
-
-        memoized_unions.insert(std::make_pair(minmax, result));
+        union_cache_misses++;
+
+        static std::vector<uint32_t> temp;
+        temp.resize(min->size + max->size);
+        auto end = std::set_union(min->labels, min->labels + min->size,
+                max->labels, max->labels + max->size, temp.begin());
+
+        uint32_t size = end - temp.begin();
+        LabelSetP result;
+        // one side already has everything; no need to look it up
+        if (size == max->size) result = max;
+        else if (size == min->size) result = min;
+        else result = label_set_intern(temp.data(), size);
+
+        slot->min = min;
+        slot->max = max;
+        slot->result = result;
         return result;
     } else if (ls1) {
         return ls1;
@@ -126,12 +199,30 @@ LabelSetP label_set_union(LabelSetP ls1, LabelSetP ls2) {
 }
 
 LabelSetP label_set_singleton(uint32_t label) {
-    std::set<uint32_t> temp;
-    temp.insert(label);
-    return LSA.alloc(temp);
+    return label_set_intern(&label, 1);
+}
+
+void label_set_iter(LabelSetP ls, void (*leaf)(uint32_t, void *), void *user) {
+    if (!ls) return;
+    for (uint32_t i = 0; i < ls->size; i++) {
+        leaf(ls->labels[i], user);
+    }
+}
+
+uint32_t label_set_card(LabelSetP ls) {
+    return ls ? ls->size : 0;
 }
 
 std::set<uint32_t> label_set_render_set(LabelSetP ls) {
-    if (ls) return *ls;
+    if (ls) return std::set<uint32_t>(ls->labels, ls->labels + ls->size);
     else return std::set<uint32_t>();
 }
+
+void label_set_spit_stats(void) {
+    printf("taint2: %" PRIu64 " label sets, %" PRIu64 " labels total, "
+            "%zu bytes used of %zu mapped, %" PRIu64 " bytes of index.\n",
+            num_sets, num_labels, LSA.used, LSA.mapped,
+            (set_table_mask + 1) * (uint64_t)sizeof(LabelSetP));
+    printf("taint2: union cache %" PRIu64 " hits, %" PRIu64 " misses.\n",
+            union_cache_hits, union_cache_misses);
+}
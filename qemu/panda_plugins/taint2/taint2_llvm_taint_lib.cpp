@@ -28,6 +28,8 @@ PANDAENDCOMMENT */
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/Transforms/Utils/Cloning.h>
 #include <llvm/IR/Instruction.h>
+#include <llvm/Analysis/Dominators.h>
+#include <llvm/Support/CFG.h>
 
 #include "tcg/tcg-llvm.h"
 #include "panda_plugin_plugin.h"
@@ -79,6 +81,13 @@ static inline Constant *const_struct_ptr(LLVMContext &C, Type *ptrT, void *ptr)
     return ConstantExpr::getIntToPtr(const_uint64_ptr(C, ptr), ptrT);
 }
 
+// A function for one TB, or for a chain of TBs with -llvm-trace.  These are
+// what cpu_exec calls, so their frame starts out empty.
+static inline bool isBlockFunction(Function &F) {
+    return F.getName().startswith("tcg-llvm-tb-") ||
+        F.getName().startswith("tcg-llvm-trace-");
+}
+
 static void taint_branch_run(FastShad *shad, uint64_t src) {
     // this arg should be the register number
     PPP_RUN_CB(on_branch2, src / MAXREGSIZE);
@@ -214,9 +223,12 @@ bool PandaTaintFunctionPass::runOnFunction(Function &F) {
         for (Instruction &I : BB) insts.push_back(&I);
         PTV.visitBasicBlock(BB);
         for (Instruction *I : insts) {
+            // Where a trace goes from one TB to the next; not guest code
+            if (I->getMetadata("trace_step")) continue;
             PTV.visit(I);
         }
     }
+    cleanupTaintOps(F);
 #ifdef TAINTDEBUG
     //F.dump();
     /*std::string err;
@@ -230,6 +242,253 @@ bool PandaTaintFunctionPass::runOnFunction(Function &F) {
     return true;
 }
 
+/***
+ *** Taint op cleanup
+ ***/
+
+// What one taint op call does to the llv frame it runs in.
+struct LlvAccess {
+    CallInst *CI;
+    vector<pair<uint64_t, uint64_t>> reads; // (offset, size)
+    uint64_t dest, dest_size; // dest_size is 0 if it writes no llv
+    bool full; // every byte of the dest is overwritten
+};
+
+static inline bool constArg(CallInst *CI, unsigned i, uint64_t &out) {
+    ConstantInt *C = dyn_cast<ConstantInt>(CI->getArgOperand(i));
+    if (!C) return false;
+    out = C->getZExtValue();
+    return true;
+}
+
+// Fills in acc for a call to one of the taint ops.  Calls that don't touch
+// the llv frame get no reads and no dest.  Returns false if an llv offset or
+// size isn't a constant, in which case we can't reason about the function.
+static bool llvAccess(PandaTaintVisitor &PTV, CallInst *CI, LlvAccess &acc) {
+    Function *F = CI->getCalledFunction();
+    Value *llv = PTV.llvConst;
+    uint64_t dest, dest_size, src, src2, size;
+    acc.CI = CI;
+    acc.dest = acc.dest_size = 0;
+    acc.full = true;
+#define ARG(i, v) if (!constArg(CI, i, v)) return false
+    if (F == PTV.copyF) {
+        if (CI->getArgOperand(2) == llv) {
+            ARG(3, src); ARG(4, size);
+            acc.reads.push_back(std::make_pair(src, size));
+        }
+        if (CI->getArgOperand(0) == llv) {
+            ARG(1, acc.dest); ARG(4, acc.dest_size);
+        }
+    } else if (F == PTV.deleteF) {
+        if (CI->getArgOperand(0) == llv) {
+            ARG(1, acc.dest); ARG(2, acc.dest_size);
+        }
+    } else if (F == PTV.mixF || F == PTV.sextF) {
+        ARG(1, acc.dest); ARG(2, acc.dest_size);
+        ARG(3, src); ARG(4, size);
+        acc.reads.push_back(std::make_pair(src, size));
+    } else if (F == PTV.mixCompF || F == PTV.parallelCompF) {
+        ARG(1, dest); ARG(2, dest_size);
+        ARG(3, src); ARG(4, src2); ARG(5, size);
+        acc.reads.push_back(std::make_pair(src, size));
+        acc.reads.push_back(std::make_pair(src2, size));
+        acc.dest = dest;
+        // Parallel compute ignores dest_size.
+        acc.dest_size = F == PTV.mixCompF ? dest_size : size;
+    } else if (F == PTV.selectF) {
+        // Picking a constant leaves the dest alone.
+        ARG(1, acc.dest); ARG(2, acc.dest_size);
+        acc.full = false;
+        for (unsigned i = 4; i + 1 < CI->getNumArgOperands(); i += 2) {
+            ARG(i, src);
+            if (src != ~0UL) acc.reads.push_back(std::make_pair(src, acc.dest_size));
+        }
+    } else if (F == PTV.pointerF) {
+        ARG(3, src); ARG(4, size);
+        acc.reads.push_back(std::make_pair(src, size));
+        ARG(7, size);
+        if (CI->getArgOperand(5) == llv) {
+            ARG(6, src);
+            if (src != ~0UL) acc.reads.push_back(std::make_pair(src, size));
+        }
+        if (CI->getArgOperand(0) == llv) {
+            ARG(1, acc.dest);
+            acc.dest_size = size;
+        }
+    } else if (F == PTV.hostCopyF) {
+        uint64_t is_store;
+        ARG(3, dest); ARG(6, size); ARG(8, is_store);
+        if (is_store) {
+            acc.reads.push_back(std::make_pair(dest, size));
+        } else {
+            // Nothing is copied if the address isn't in the CPUState.
+            acc.dest = dest;
+            acc.dest_size = size;
+            acc.full = false;
+        }
+    } else if (F == PTV.branchF) {
+        // on_branch2 callbacks query the condition's slot.
+        ARG(1, src);
+        acc.reads.push_back(std::make_pair(src, (uint64_t)MAXREGSIZE));
+    }
+#undef ARG
+    return true;
+}
+
+/*
+ * Taint for a TB function's LLVM values only lives for one run of the
+ * function, since visitBasicBlock resets the frame at entry (once for all
+ * the TBs of a trace function).  So, after
+ * instrumenting one, we can drop:
+ *  - breadcrumbs at the end of blocks that aren't a predecessor of a block
+ *    with a PHI, because nothing will read prev_bb before it's written again;
+ *  - ops whose only effect is writing llv bytes that no op in the function
+ *    reads (ops reading the ret and arg areas and memlog pops are kept);
+ *  - the delete of the whole frame at entry, except for bytes that may be
+ *    read before an op that overwrites them.
+ */
+void PandaTaintFunctionPass::cleanupTaintOps(Function &F) {
+    if (!isBlockFunction(F)) return;
+
+    vector<LlvAccess> ops;
+    vector<CallInst *> breadcrumbs;
+    std::set<BasicBlock *> reads_prev_bb;
+    CallInst *entryDelete = NULL;
+    uint64_t before = 0;
+    bool analyzable = true;
+    for (BasicBlock &BB : F) {
+        for (Instruction &I : BB) {
+            LoadInst *LI = dyn_cast<LoadInst>(&I);
+            if (LI && LI->getPointerOperand() == PTV.prevBbConst) {
+                reads_prev_bb.insert(&BB);
+            }
+            CallInst *CI = dyn_cast<CallInst>(&I);
+            if (!CI || !CI->getCalledFunction()) continue;
+            Function *callee = CI->getCalledFunction();
+            if (callee->getName().startswith("taint_")) before++;
+
+            if (callee == PTV.breadcrumbF) {
+                breadcrumbs.push_back(CI);
+            } else if (callee == PTV.resetFrameF && &BB == &F.front()) {
+                CallInst *delCI = dyn_cast_or_null<CallInst>(I.getNextNode());
+                uint64_t off;
+                if (delCI && delCI->getCalledFunction() == PTV.deleteF &&
+                        delCI->getArgOperand(0) == PTV.llvConst &&
+                        constArg(delCI, 1, off) && off == 0) {
+                    entryDelete = delCI;
+                }
+            } else if (CI != entryDelete) {
+                LlvAccess acc;
+                if (!llvAccess(PTV, CI, acc)) {
+                    analyzable = false;
+                } else if (acc.dest_size || !acc.reads.empty()) {
+                    ops.push_back(acc);
+                }
+            }
+        }
+    }
+    opsBefore += before;
+    if (!cleanup || !analyzable) {
+        opsAfter += before;
+        return;
+    }
+    uint64_t removed = 0, added = 0;
+
+    std::set<BasicBlock *> keep;
+    for (BasicBlock *BB : reads_prev_bb) {
+        for (pred_iterator PI = pred_begin(BB); PI != pred_end(BB); ++PI) {
+            keep.insert(*PI);
+        }
+    }
+    for (CallInst *CI : breadcrumbs) {
+        if (!keep.count(CI->getParent())) {
+            CI->eraseFromParent();
+            removed++;
+        }
+    }
+
+    // Writes to the arg area (past num_vals) are read by the callee.
+    uint64_t frame_bytes = (uint64_t)shad->num_vals * MAXREGSIZE;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        vector<bool> read(frame_bytes, false);
+        for (LlvAccess &acc : ops) {
+            for (auto &r : acc.reads) {
+                for (uint64_t b = r.first; b < r.first + r.second && b < frame_bytes; b++) {
+                    read[b] = true;
+                }
+            }
+        }
+        vector<LlvAccess> live;
+        for (LlvAccess &acc : ops) {
+            bool dead = acc.dest_size > 0 && acc.dest + acc.dest_size <= frame_bytes;
+            for (uint64_t b = acc.dest; dead && b < acc.dest + acc.dest_size; b++) {
+                if (read[b]) dead = false;
+            }
+            if (dead) {
+                acc.CI->eraseFromParent();
+                removed++;
+                changed = true;
+            } else {
+                live.push_back(acc);
+            }
+        }
+        ops.swap(live);
+    }
+
+    uint64_t clear_size;
+    if (entryDelete && constArg(entryDelete, 2, clear_size)) {
+        DominatorTree DT;
+        DT.runOnFunction(F);
+
+        std::map<uint64_t, vector<CallInst *>> writers;
+        for (LlvAccess &acc : ops) {
+            if (!acc.full) continue;
+            for (uint64_t b = acc.dest; b < acc.dest + acc.dest_size; b++) {
+                writers[b].push_back(acc.CI);
+            }
+        }
+        vector<bool> clear(clear_size, false);
+        for (LlvAccess &acc : ops) {
+            for (auto &r : acc.reads) {
+                for (uint64_t b = r.first; b < r.first + r.second && b < clear_size; b++) {
+                    if (clear[b]) continue;
+                    bool covered = false;
+                    auto it = writers.find(b);
+                    if (it != writers.end()) {
+                        for (CallInst *W : it->second) {
+                            if (W != acc.CI && DT.dominates(W, acc.CI)) {
+                                covered = true;
+                                break;
+                            }
+                        }
+                    }
+                    if (!covered) clear[b] = true;
+                }
+            }
+        }
+
+        LLVMContext &ctx = F.getContext();
+        uint64_t b = 0;
+        while (b < clear_size) {
+            if (!clear[b]) { b++; continue; }
+            uint64_t start = b;
+            while (b < clear_size && clear[b]) b++;
+            vector<Value *> args{
+                PTV.llvConst, const_uint64(ctx, start), const_uint64(ctx, b - start)
+            };
+            CallInst::Create(PTV.deleteF, args, "", entryDelete);
+            added++;
+        }
+        entryDelete->eraseFromParent();
+        removed++;
+    }
+
+    opsAfter += before - removed + added;
+}
+
 /***
  *** PandaSlotTracker
  ***/
@@ -390,7 +649,7 @@ void PandaTaintVisitor::visitBasicBlock(BasicBlock &BB) {
     LLVMContext &ctx = BB.getContext();
     Function *F = BB.getParent();
     assert(F);
-    if (&F->front() == &BB && F->getName().startswith("tcg-llvm-tb-")) {
+    if (&F->front() == &BB && isBlockFunction(*F)) {
         // Entry block.
         // This is a single guest BB, so callstack should be empty.
         // Insert call to reset llvm frame.
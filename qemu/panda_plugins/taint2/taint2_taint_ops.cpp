@@ -96,6 +96,12 @@ void taint_parallel_compute(
         uint64_t src1, uint64_t src2, uint64_t src_size) {
     taint_log("pcompute: %lx[%lx+%lx] <- %lx + %lx\n",
             (uint64_t)shad, dest, src_size, src1, src2);
+    // Usually neither operand is tainted, and the result is just clean.
+    if (!shad->range_tainted(src1, src_size) &&
+            !shad->range_tainted(src2, src_size)) {
+        shad->remove(dest, src_size);
+        return;
+    }
     uint64_t i;
     for (i = 0; i < src_size; ++i) {
         TaintData td = TaintData::comp_union(
@@ -105,20 +111,35 @@ void taint_parallel_compute(
     }
 }
 
+static inline bool same_taint(TaintData td1, TaintData td2) {
+    return td1.ls == td2.ls && td1.tcn == td2.tcn;
+}
+
 static inline TaintData mixed_labels(FastShad *shad, uint64_t addr, uint64_t size) {
     TaintData td;
-    uint64_t i;
-    for (i = 0; i < size; ++i) {
-        td.add(shad->query_full(addr + i));
+    // Nothing to union, and every add() just counts.
+    if (!shad->range_tainted(addr, size)) {
+        td.tcn = size;
+        return td;
+    }
+    // Values are mostly tainted the same in every byte.  Adding a run of k
+    // identical TaintData unions their labels once and bumps tcn by k.
+    uint64_t i = 0;
+    while (i < size) {
+        TaintData cur = shad->query_full(addr + i);
+        uint64_t run = 1;
+        while (i + run < size && same_taint(shad->query_full(addr + i + run), cur)) {
+            run++;
+        }
+        td.ls = TaintData::ls_union(td.ls, cur.ls);
+        td.tcn = std::max(td.tcn, cur.tcn) + run;
+        i += run;
     }
     return td;
 }
 
 static inline void bulk_set(FastShad *shad, uint64_t addr, uint64_t size, TaintData td) {
-    uint64_t i;
-    for (i = 0; i < size; ++i) {
-        shad->set_full(addr + i, td);
-    }
+    shad->set_range(addr, size, td);
 }
 
 void taint_mix_compute(
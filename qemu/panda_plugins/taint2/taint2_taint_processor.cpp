@@ -105,7 +105,7 @@ Shad *tp_init(TaintLabelMode mode, TaintGranularity granularity) {
 
     if (granularity == TAINT_GRANULARITY_BYTE) {
         printf("taint2: Creating byte-level taint processor\n");
-        shad->ram = new FastShad(ram_size);
+        shad->ram = new FastShad(ram_size, true);
         // we're working with LLVM values that can be up to 128 bits
         shad->llv = new FastShad(MAXFRAMESIZE * FUNCTIONFRAMES * MAXREGSIZE);
         shad->ret = new FastShad(MAXREGSIZE);
@@ -113,7 +113,7 @@ Shad *tp_init(TaintLabelMode mode, TaintGranularity granularity) {
         shad->grv = new FastShad(NUMREGS * WORDSIZE);
     } else {
         printf("taint2: Creating word-level taint processor\n");
-        shad->ram = new FastShad(ram_size / WORDSIZE);
+        shad->ram = new FastShad(ram_size / WORDSIZE, true);
         shad->llv = new FastShad(MAXFRAMESIZE * FUNCTIONFRAMES);
         shad->ret = new FastShad(1);
         shad->grv = new FastShad(NUMREGS);
@@ -197,7 +197,7 @@ LabelSetP tp_query_llvm(Shad *shad, int reg_num, int offset) {
 }
 
 uint32_t ls_card(LabelSetP ls) {
-    return label_set_render_set(ls).size();
+    return label_set_card(ls);
 }
 
 
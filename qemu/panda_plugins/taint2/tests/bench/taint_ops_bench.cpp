@@ -0,0 +1,117 @@
+/* PANDABEGINCOMMENT
+ *
+ * Authors:
+ *  Tim Leek               tleek@ll.mit.edu
+ *  Ryan Whelan            rwhelan@ll.mit.edu
+ *  Joshua Hodosh          josh.hodosh@ll.mit.edu
+ *  Michael Zhivich        mzhivich@ll.mit.edu
+ *  Brendan Dolan-Gavitt   brendandg@gatech.edu
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ *
+PANDAENDCOMMENT */
+
+// Microbenchmark for the taint ops that run inline in instrumented code.
+// Times each op on clean and tainted shadow, with and without
+// track_taint_state.  Not part of the plugin build; from
+// qemu/panda_plugins/taint2, with the include flags the plugin gets:
+//
+//   g++ -std=c++11 -O2 -I. <qemu includes> tests/bench/taint_ops_bench.cpp \
+//       taint2_taint_ops.cpp taint2_fast_shad.cpp taint2_label_set.cpp \
+//       -o taint_ops_bench
+//   ./taint_ops_bench [iterations]
+
+#ifndef __STDC_FORMAT_MACROS
+#define __STDC_FORMAT_MACROS
+#endif
+
+#include <cstdio>
+#include <cstdlib>
+#include <cinttypes>
+#include <ctime>
+
+#include "fast_shad.h"
+#include "label_set.h"
+#include "taint_ops.h"
+
+bool track_taint_state = false;
+static uint64_t state_changes = 0;
+void taint_state_changed(void) { state_changes++; }
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t iters;
+
+#define BENCH(name, op) do { \
+    state_changes = 0; \
+    double start = now(); \
+    for (uint64_t i = 0; i < iters; i++) { op; } \
+    printf("  %-28s %8.2f ns  (%" PRIu64 " state changes)\n", name, \
+            (now() - start) * 1e9 / iters, state_changes); \
+} while (0)
+
+// Walk memory a page and a bit at a time, staying clear of the end.
+static inline uint64_t mem_addr(uint64_t i) {
+    return (i * 4104) % ((1 << 24) - 128);
+}
+
+// The ops a typical basic block does: register and memory loads into llvm
+// values, computes on those, a store back, and clearing the llvm frame.
+static void bench(const char *name, FastShad *mem, FastShad *greg,
+        FastShad *llv) {
+    const uint64_t mem_mask = (1 << 24) - 1;
+    for (int tracking = 0; tracking < 2; tracking++) {
+        track_taint_state = tracking;
+        printf("%s, track_taint_state=%d:\n", name, tracking);
+        BENCH("copy greg -> llv [8]", taint_copy(llv, 0, greg, (i & 7) * 8, 8));
+        BENCH("copy mem -> llv [8]",
+                taint_copy(llv, 8, mem, mem_addr(i), 8));
+        BENCH("parallel_compute [8]", taint_parallel_compute(llv, 16, 8, 0, 8, 8));
+        BENCH("mix_compute [8]", taint_mix_compute(llv, 24, 8, 0, 8, 8));
+        BENCH("mix [8]", taint_mix(llv, 32, 8, 8, 8));
+        BENCH("set [8]", taint_set(llv, 40, 8, llv, 8));
+        BENCH("copy llv -> mem [8]",
+                taint_copy(mem, mem_addr(i) + 64, llv, 16, 8));
+        BENCH("delete llv [64]", taint_delete(llv, 0, 64));
+        // misses the sparse labels, which sit on 64K boundaries
+        BENCH("delete mem [224]",
+                taint_delete(mem, ((i << 12) & mem_mask) + 16, 224));
+    }
+}
+
+int main(int argc, char **argv) {
+    iters = argc > 1 ? strtoull(argv[1], NULL, 0) : 10000000;
+
+    // paged, like the RAM shadow tp_init makes
+    FastShad *mem = new FastShad(1 << 24, true);
+    FastShad *greg = new FastShad(16 * 8);
+    FastShad *llv = new FastShad(1 << 16);
+
+    // clean memory has no pages at all, so this is the zero page path
+    bench("clean", mem, greg, llv);
+
+    // one tainted byte every 64K of memory, i.e. one per shadow page, so
+    // every page is there but most loads still come up clean.
+    // each op runs in its own loop, so whatever a load picks up is copied
+    // around by the ops after it.
+    for (uint64_t addr = 0; addr < (1 << 24); addr += 1 << 16) {
+        taint_label(mem, addr, addr >> 16);
+    }
+    bench("sparse memory taint", mem, greg, llv);
+
+    // every register tainted, so every op has labels to move
+    for (uint64_t r = 0; r < 16 * 8; r++) {
+        taint_label(greg, r, r);
+    }
+    bench("tainted registers", mem, greg, llv);
+
+    delete llv;
+    delete greg;
+    delete mem;
+    return 0;
+}
@@ -24,6 +24,7 @@ extern "C" {
 #include "disas.h"
 
 #include "panda_plugin.h"
+#include "../taps/taps.h"
 
 }
 
@@ -31,79 +32,72 @@ extern "C" {
 #include <stdlib.h>
 #include <ctype.h>
 #include <math.h>
-#include <map>
-#include <list>
+#include <vector>
+#include <utility>
 #include <algorithm>
 
+#include "../common/prog_point.h"
+#include "../taps/taps_ext.h"
+#include "panda_plugin_plugin.h"
+
 // These need to be extern "C" so that the ABI is compatible with
 // QEMU/PANDA, which is written in C
 extern "C" {
 
 bool init_plugin(void *);
 void uninit_plugin(void *);
-int mem_write_callback(CPUState *env, target_ulong pc, target_ulong addr, target_ulong size, void *buf);
-int mem_read_callback(CPUState *env, target_ulong pc, target_ulong addr, target_ulong size, void *buf);
 
 }
 
-struct prog_point {
-    target_ulong caller;
-    target_ulong pc;
-    target_ulong cr3;
-    bool operator <(const prog_point &p) const {
-        return (this->pc < p.pc) || \
-               (this->pc == p.pc && this->caller < p.caller) || \
-               (this->pc == p.pc && this->caller == p.caller && this->cr3 < p.cr3);
-    }
-};
-
-std::map<prog_point,long> read_tracker;
-std::map<prog_point,long> write_tracker;
+// tap ID -> bytes read / written
+std::vector<long> read_tracker;
+std::vector<long> write_tracker;
 FILE *read_index;
 FILE *write_index;
 
-int mem_write_callback(CPUState *env, target_ulong pc, target_ulong addr,
-                       target_ulong size, void *buf) {
-    prog_point p = {};
-#ifdef TARGET_I386
-    panda_virtual_memory_rw(env, env->regs[R_EBP]+4, (uint8_t *)&p.caller, 4, 0);
-    if((env->hflags & HF_CPL_MASK) != 0) // Lump all kernel-mode CR3s together
-        p.cr3 = env->cr[3];
-#endif
-    p.pc = pc;
-    write_tracker[p] += size;
- 
-    return 1;
+static void tap_write(CPUState *env, uint32_t tap, const prog_point *p,
+                      target_ulong addr, target_ulong size, void *buf) {
+    if (tap >= write_tracker.size()) write_tracker.resize(taps_count());
+    write_tracker[tap] += size;
 }
 
-int mem_read_callback(CPUState *env, target_ulong pc, target_ulong addr,
-                       target_ulong size, void *buf) {
-    prog_point p = {};
-#ifdef TARGET_I386
-    panda_virtual_memory_rw(env, env->regs[R_EBP]+4, (uint8_t *)&p.caller, 4, 0);
-    if((env->hflags & HF_CPL_MASK) != 0) // Lump all kernel-mode CR3s together
-        p.cr3 = env->cr[3];
-#endif
-    p.pc = pc;
-    read_tracker[p] += size;
- 
-    return 1;
+static void tap_read(CPUState *env, uint32_t tap, const prog_point *p,
+                     target_ulong addr, target_ulong size, void *buf) {
+    if (tap >= read_tracker.size()) read_tracker.resize(taps_count());
+    read_tracker[tap] += size;
 }
 
-bool init_plugin(void *self) {
-    panda_cb pcb;
+// Write the taps that saw any data, in prog_point order
+static void write_index_file(FILE *f, const std::vector<long> &tracker) {
+    std::vector<std::pair<prog_point,long>> entries;
+    for (uint32_t tap = 0; tap < tracker.size(); tap++) {
+        if (!tracker[tap]) continue;
+        prog_point p;
+        taps_get_prog_point(tap, &p);
+        entries.push_back(std::make_pair(p, tracker[tap]));
+    }
+    std::sort(entries.begin(), entries.end(),
+        [](const std::pair<prog_point,long> &a, const std::pair<prog_point,long> &b) {
+            return a.first < b.first;
+        });
+
+    // Cross platform support: need to know how big a target_ulong is
+    uint32_t target_ulong_size = sizeof(target_ulong);
+    fwrite(&target_ulong_size, sizeof(uint32_t), 1, f);
+    for (auto &e : entries) {
+        fwrite(&e.first, sizeof(prog_point), 1, f);
+        fwrite(&e.second, sizeof(long), 1, f);
+    }
+}
 
+bool init_plugin(void *self) {
     printf("Initializing plugin tapindex\n");
 
-    // Need this to get EIP with our callbacks
-    panda_enable_precise_pc();
-    // Enable memory logging
-    panda_enable_memcb();
+    panda_require("taps");
+    if(!init_taps_api()) return false;
 
-    pcb.virt_mem_read = mem_read_callback;
-    panda_register_callback(self, PANDA_CB_VIRT_MEM_READ, pcb);
-    pcb.virt_mem_write = mem_write_callback;
-    panda_register_callback(self, PANDA_CB_VIRT_MEM_WRITE, pcb);
+    PPP_REG_CB("taps", on_tap_read, tap_read);
+    PPP_REG_CB("taps", on_tap_write, tap_write);
 
     return true;
 }
@@ -123,25 +117,11 @@ void uninit_plugin(void *self) {
         return;
     }
 
-    // Cross platform support: need to know how big a target_ulong is
-    uint32_t target_ulong_size = sizeof(target_ulong);
-    fwrite(&target_ulong_size, sizeof(uint32_t), 1, read_index);
-
     // Save reads
-    std::map<prog_point,long>::iterator it;
-    for(it = read_tracker.begin(); it != read_tracker.end(); it++) {
-        fwrite(&it->first, sizeof(prog_point), 1, read_index);
-        fwrite(&it->second, sizeof(long), 1, read_index);
-    }
+    write_index_file(read_index, read_tracker);
     fclose(read_index);
 
-    // Cross platform support: need to know how big a target_ulong is
-    fwrite(&target_ulong_size, sizeof(uint32_t), 1, write_index);
-
     // Save writes
-    for(it = write_tracker.begin(); it != write_tracker.end(); it++) {
-        fwrite(&it->first, sizeof(prog_point), 1, write_index);
-        fwrite(&it->second, sizeof(long), 1, write_index);
-    }
+    write_index_file(write_index, write_tracker);
     fclose(write_index);
 }
@@ -0,0 +1,178 @@
+/* PANDABEGINCOMMENT
+ * 
+ * Authors:
+ *  Tim Leek               tleek@ll.mit.edu
+ *  Ryan Whelan            rwhelan@ll.mit.edu
+ *  Joshua Hodosh          josh.hodosh@ll.mit.edu
+ *  Michael Zhivich        mzhivich@ll.mit.edu
+ *  Brendan Dolan-Gavitt   brendandg@gatech.edu
+ * 
+ * This work is licensed under the terms of the GNU GPL, version 2. 
+ * See the COPYING file in the top-level directory. 
+ * 
+PANDAENDCOMMENT */
+// Computes the tap point (caller, pc, asid) of every memory access once,
+// turns it into a small dense integer, and hands both to the plugins that
+// subscribe to on_tap_read / on_tap_write.  Plugins that aggregate over tap
+// points can then keep flat vectors indexed by tap ID instead of each
+// keeping a std::map<prog_point,...> and calling get_prog_point themselves.
+
+// This needs to be defined before anything is included in order to get
+// the PRIx64 macro
+#define __STDC_FORMAT_MACROS
+
+extern "C" {
+
+#include "config.h"
+#include "qemu-common.h"
+#include "monitor.h"
+#include "cpu.h"
+#include "disas.h"
+
+#include "panda_plugin.h"
+#include "taps.h"
+}
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+#include "../common/prog_point.h"
+#include "../callstack_instr/callstack_instr_ext.h"
+#include "panda_plugin_plugin.h"
+
+// These need to be extern "C" so that the ABI is compatible with
+// QEMU/PANDA, which is written in C
+extern "C" {
+
+bool init_plugin(void *);
+void uninit_plugin(void *);
+int mem_write_callback(CPUState *env, target_ulong pc, target_ulong addr, target_ulong size, void *buf);
+int mem_read_callback(CPUState *env, target_ulong pc, target_ulong addr, target_ulong size, void *buf);
+
+// prototypes for the register-this-callback fns
+PPP_PROT_REG_CB(on_tap_read);
+PPP_PROT_REG_CB(on_tap_write);
+
+// API
+uint32_t taps_count(void);
+void taps_get_prog_point(uint32_t tap, prog_point *p);
+
+}
+
+PPP_CB_BOILERPLATE(on_tap_read)
+PPP_CB_BOILERPLATE(on_tap_write)
+
+// tap ID -> prog_point
+std::vector<prog_point> taps;
+
+// prog_point -> tap ID + 1, open addressing with linear probing.  0 marks
+// an empty slot.
+static uint32_t *tap_index;
+static size_t tap_index_mask;
+
+// Loops hit the same tap over and over, so remember the last one.
+static prog_point last_p;
+static uint32_t last_tap = UINT32_MAX;
+
+static inline size_t hash_tap(const prog_point &p) {
+    uint64_t h = (uint64_t)p.pc * 0x9e3779b97f4a7c15ULL;
+    h ^= (uint64_t)p.caller * 0xc2b2ae3d27d4eb4fULL;
+    h ^= (uint64_t)p.cr3 * 0x165667b19e3779f9ULL;
+    return h ^ (h >> 29);
+}
+
+static void tap_index_grow(void) {
+    size_t size = (tap_index_mask + 1) * 2;
+    free(tap_index);
+    tap_index = (uint32_t *) calloc(size, sizeof(uint32_t));
+    tap_index_mask = size - 1;
+    for (uint32_t tap = 0; tap < taps.size(); tap++) {
+        size_t i = hash_tap(taps[tap]) & tap_index_mask;
+        while (tap_index[i]) i = (i + 1) & tap_index_mask;
+        tap_index[i] = tap + 1;
+    }
+}
+
+static uint32_t intern_tap(const prog_point &p) {
+    if (last_tap != UINT32_MAX && p == last_p) return last_tap;
+
+    size_t i = hash_tap(p) & tap_index_mask;
+    while (tap_index[i]) {
+        if (taps[tap_index[i] - 1] == p) {
+            last_p = p;
+            return last_tap = tap_index[i] - 1;
+        }
+        i = (i + 1) & tap_index_mask;
+    }
+
+    // New tap point.  Keep the index at most half full.
+    uint32_t tap = taps.size();
+    taps.push_back(p);
+    tap_index[i] = tap + 1;
+    if (2 * taps.size() > tap_index_mask + 1) {
+        tap_index_grow();
+    }
+    last_p = p;
+    return last_tap = tap;
+}
+
+uint32_t taps_count(void) {
+    return taps.size();
+}
+
+void taps_get_prog_point(uint32_t tap, prog_point *p) {
+    *p = taps[tap];
+}
+
+int mem_read_callback(CPUState *env, target_ulong pc, target_ulong addr,
+                       target_ulong size, void *buf) {
+    // Nobody listening, so don't bother working out the tap point
+    if (ppp_on_tap_read_num_cb == 0) return 1;
+
+    prog_point p = {};
+    get_prog_point(env, &p);
+    uint32_t tap = intern_tap(p);
+    PPP_RUN_CB(on_tap_read, env, tap, &p, addr, size, buf)
+    return 1;
+}
+
+int mem_write_callback(CPUState *env, target_ulong pc, target_ulong addr,
+                       target_ulong size, void *buf) {
+    if (ppp_on_tap_write_num_cb == 0) return 1;
+
+    prog_point p = {};
+    get_prog_point(env, &p);
+    uint32_t tap = intern_tap(p);
+    PPP_RUN_CB(on_tap_write, env, tap, &p, addr, size, buf)
+    return 1;
+}
+
+bool init_plugin(void *self) {
+    panda_cb pcb;
+
+    printf("Initializing plugin taps\n");
+
+    panda_require("callstack_instr");
+    if(!init_callstack_instr_api()) return false;
+
+    tap_index_mask = (1 << 16) - 1;
+    tap_index = (uint32_t *) calloc(tap_index_mask + 1, sizeof(uint32_t));
+
+    // Need this to get EIP with our callbacks
+    panda_enable_precise_pc();
+    // Enable memory logging
+    panda_enable_memcb();
+
+    pcb.virt_mem_write = mem_write_callback;
+    panda_register_callback(self, PANDA_CB_VIRT_MEM_WRITE, pcb);
+    pcb.virt_mem_read = mem_read_callback;
+    panda_register_callback(self, PANDA_CB_VIRT_MEM_READ, pcb);
+
+    return true;
+}
+
+void uninit_plugin(void *self) {
+    printf("taps: %zu tap points\n", taps.size());
+    free(tap_index);
+}
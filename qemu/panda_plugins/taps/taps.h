@@ -0,0 +1,14 @@
+#ifndef __TAPS_H_
+#define __TAPS_H_
+
+struct prog_point;
+
+// The types for the ppp callbacks run on every memory read and write.  tap
+// is the dense ID of the tap point p, which is only valid during the call;
+// use taps_get_prog_point to get it back later.
+typedef void (* on_tap_read_t)(CPUState *env, uint32_t tap, const struct prog_point *p,
+                               target_ulong addr, target_ulong size, void *buf);
+typedef void (* on_tap_write_t)(CPUState *env, uint32_t tap, const struct prog_point *p,
+                                target_ulong addr, target_ulong size, void *buf);
+
+#endif
@@ -0,0 +1,6 @@
+//  NOTE.  This file is a manually generated spec for the API to this plugin.
+//  It is intended to be consumed by apigen.py.  See osi/osi_int.h.
+
+typedef void prog_point;
+
+#include "taps_int_fns.h"
@@ -0,0 +1,14 @@
+#ifndef __TAPS_INT_FNS_H__
+#define __TAPS_INT_FNS_H__
+
+#include <stdint.h>
+
+// Number of tap points seen so far.  Tap IDs are handed out in order of
+// first access, so they run from 0 to taps_count()-1 and can index a
+// plain array.
+uint32_t taps_count(void);
+
+// Get the program point (caller, pc, asid) behind a tap ID
+void taps_get_prog_point(uint32_t tap, prog_point *p);
+
+#endif
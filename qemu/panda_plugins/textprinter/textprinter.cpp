@@ -24,6 +24,7 @@ extern "C" {
 #include "disas.h"
 
 #include "panda_plugin.h"
+#include "../taps/taps.h"
 
 }
 
@@ -33,11 +34,14 @@ extern "C" {
 #include <ctype.h>
 #include <math.h>
 #include <set>
+#include <vector>
 #include <iostream>
 #include <fstream>
 
 #include "../common/prog_point.h"
 #include "../callstack_instr/callstack_instr_ext.h"
+#include "../taps/taps_ext.h"
+#include "panda_plugin_plugin.h"
 
 // These need to be extern "C" so that the ABI is compatible with
 // QEMU/PANDA, which is written in C
@@ -45,8 +49,6 @@ extern "C" {
 
 bool init_plugin(void *);
 void uninit_plugin(void *);
-int read_mem_callback(CPUState *env, target_ulong pc, target_ulong addr, target_ulong size, void *buf);
-int write_mem_callback(CPUState *env, target_ulong pc, target_ulong addr, target_ulong size, void *buf);
 
 }
 
@@ -56,12 +58,19 @@ std::set<prog_point> tap_points;
 gzFile read_tap_buffers;
 gzFile write_tap_buffers;
 
-int mem_callback(CPUState *env, target_ulong pc, target_ulong addr,
-                       target_ulong size, void *buf, gzFile f) {
-    prog_point p = {};
-    get_prog_point(env, &p);
+// tap ID -> whether it's in tap_points, looked up the first time we see it
+enum { TAP_UNKNOWN = 0, TAP_PRINT, TAP_SKIP };
+std::vector<uint8_t> tap_state;
+
+static void mem_callback(CPUState *env, uint32_t tap, const prog_point *pp,
+                         target_ulong addr, target_ulong size, void *buf, gzFile f) {
+    if (tap >= tap_state.size()) tap_state.resize(taps_count(), TAP_UNKNOWN);
+    if (tap_state[tap] == TAP_UNKNOWN) {
+        tap_state[tap] = tap_points.count(*pp) ? TAP_PRINT : TAP_SKIP;
+    }
 
-    if (tap_points.find(p) != tap_points.end()) {
+    if (tap_state[tap] == TAP_PRINT) {
+        const prog_point &p = *pp;
         target_ulong callers[16] = {0};
         int nret = get_callers(callers, 16, env);
         for (unsigned int i = 0; i < size; i++) {
@@ -73,20 +82,18 @@ int mem_callback(CPUState *env, target_ulong pc, target_ulong addr,
         }
     }
     mem_counter++;
-
-    return 1;
 }
 
-int read_mem_callback(CPUState *env, target_ulong pc, target_ulong addr, target_ulong size, void *buf) {
-    return mem_callback(env, pc, addr, size, buf, read_tap_buffers);
+static void tap_read(CPUState *env, uint32_t tap, const prog_point *p,
+                     target_ulong addr, target_ulong size, void *buf) {
+    mem_callback(env, tap, p, addr, size, buf, read_tap_buffers);
 }
-int write_mem_callback(CPUState *env, target_ulong pc, target_ulong addr, target_ulong size, void *buf ) {
-    return mem_callback(env, pc, addr, size, buf, write_tap_buffers);
+static void tap_write(CPUState *env, uint32_t tap, const prog_point *p,
+                      target_ulong addr, target_ulong size, void *buf) {
+    mem_callback(env, tap, p, addr, size, buf, write_tap_buffers);
 }
 
 bool init_plugin(void *self) {
-    panda_cb pcb;
-
     printf("Initializing plugin textprinter\n");
     
     std::ifstream taps("tap_points.txt");
@@ -117,15 +124,12 @@ bool init_plugin(void *self) {
         return false;
     }
 
+    panda_require("taps");
     if(!init_callstack_instr_api()) return false;
+    if(!init_taps_api()) return false;
 
-    panda_enable_precise_pc();
-    panda_enable_memcb();    
-
-    pcb.virt_mem_write = write_mem_callback;
-    panda_register_callback(self, PANDA_CB_VIRT_MEM_WRITE, pcb);
-    pcb.virt_mem_read = read_mem_callback;
-    panda_register_callback(self, PANDA_CB_VIRT_MEM_READ, pcb);
+    PPP_REG_CB("taps", on_tap_write, tap_write);
+    PPP_REG_CB("taps", on_tap_read, tap_read);
 
     return true;
 }
@@ -39,6 +39,7 @@ extern "C" {
 #include <stdlib.h>
 #include <ctype.h>
 #include <math.h>
+#include <vector>
 //#include <map>
 //#include <fstream>
 //#include <sstream>
@@ -120,7 +121,8 @@ void tstringsearch_match(CPUState *env, target_ulong pc, target_ulong addr,
     // determine if the search string is sitting in memory, starting at addr - (strlen-1)
     // first, grab that string out of memory
     target_ulong p = addr - (matched_string_length-1);
-    uint8_t thestring[MAX_STRLEN*2];
+    std::vector<uint8_t> buf(matched_string_length);
+    uint8_t *thestring = buf.data();
     panda_virtual_memory_rw(env, p, thestring, matched_string_length, 0);
     printf ("tstringsearch: thestring = [");
     for (unsigned i=0; i<matched_string_length; i++) {
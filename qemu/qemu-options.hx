@@ -2598,6 +2598,16 @@ DEF("llvm", 0, QEMU_OPTION_execute_llvm,
     "-llvm           execute code using LLVM JIT\n", QEMU_ARCH_ALL)
 DEF("generate-llvm", 0, QEMU_OPTION_generate_llvm,
     "-generate-llvm  translate code into LLVM but don't execute it\n", QEMU_ARCH_ALL)
+DEF("llvm-cache", HAS_ARG, QEMU_OPTION_llvm_cache,
+    "-llvm-cache dir keep optimized LLVM code for each block in dir and\n"
+    "                reuse it in later runs\n", QEMU_ARCH_ALL)
+DEF("llvm-tiered", HAS_ARG, QEMU_OPTION_llvm_tiered,
+    "-llvm-tiered n  with -llvm, run blocks that need no instrumentation on TCG\n"
+    "                until they have run n times, then compile them to LLVM\n"
+    "                on a background thread\n", QEMU_ARCH_ALL)
+DEF("llvm-trace", HAS_ARG, QEMU_OPTION_llvm_trace,
+    "-llvm-trace n   with -llvm, compile the chain of blocks a block usually\n"
+    "                jumps into as one function once it has done so n times\n", QEMU_ARCH_ALL)
 #endif
 
 #if defined(CONFIG_ANDROID)
@@ -2609,10 +2619,31 @@ DEF("record-from", HAS_ARG, QEMU_OPTION_record_from,
     "-record-from <snapshot>\n"
     "                load snapshot <snapshot> and begin recording\n", QEMU_ARCH_ALL)
 
+DEF("record-fsync", HAS_ARG, QEMU_OPTION_record_fsync,
+    "-record-fsync <MB>\n"
+    "                sync the nondet log to disk every <MB> megabytes while recording\n", QEMU_ARCH_ALL)
+
 DEF("replay", HAS_ARG, QEMU_OPTION_replay,
     "-replay <snapshot>\n"
     "                replay the recording that starts at <snapshot>\n", QEMU_ARCH_ALL)
 
+DEF("replay-checkpoint-interval", HAS_ARG, QEMU_OPTION_replay_checkpoint_interval,
+    "-replay-checkpoint-interval <n>\n"
+    "                during replay, save a checkpoint every <n> guest instructions\n", QEMU_ARCH_ALL)
+
+DEF("replay-from", HAS_ARG, QEMU_OPTION_replay_from,
+    "-replay-from <n>\n"
+    "                start replay at the last checkpoint at or before instruction <n>\n", QEMU_ARCH_ALL)
+
+DEF("replay-until", HAS_ARG, QEMU_OPTION_replay_until,
+    "-replay-until <n>\n"
+    "                end replay at instruction <n> and exit\n", QEMU_ARCH_ALL)
+
+DEF("replay-no-chaining", 0, QEMU_OPTION_replay_no_chaining,
+    "-replay-no-chaining\n"
+    "                return to the CPU loop after every TB during replay, even with\n"
+    "                no block-level plugins loaded\n", QEMU_ARCH_ALL)
+
 DEF("pandalog", HAS_ARG, QEMU_OPTION_pandalog,
     "-pandalog <filename>\n"
     "                enable panda logging to file\n", QEMU_ARCH_ALL)
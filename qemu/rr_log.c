@@ -42,6 +42,8 @@
 #include "hmp.h"
 #include "sysemu.h"
 #include "rr_log.h"
+#include "qemu-thread.h"
+#include "qemu-barrier.h"
 
 #include "panda_plugin.h"
 
@@ -85,9 +87,13 @@ double rr_get_percentage (void) {
         rr_nondet_log->last_prog_point.guest_instr_count;
 }
 
+static uint8_t rr_prefetch_drained(void);
+
+//mz in replay, the log is empty once the prefetch thread has read all of it
+//and the CPU has taken every entry it decoded.
 static inline uint8_t rr_log_is_empty(void) {
     if ((rr_nondet_log->type == REPLAY) &&
-        (rr_nondet_log->size - ftell(rr_nondet_log->fp) == 0)) {
+        rr_prefetch_drained()) {
         return 1;
     }
     else {
@@ -108,6 +114,17 @@ volatile sig_atomic_t rr_end_replay_requested = 0;
 char * rr_requested_name = NULL;
 char * rr_snapshot_name  = NULL;
 
+//mz sync the nondet log to disk every this many bytes while recording (0 = never)
+uint64_t rr_record_fsync_bytes = 0;
+
+//mz replay checkpoints (0 = off / start from the beginning)
+uint64_t rr_checkpoint_interval = 0;
+uint64_t rr_replay_from = 0;
+uint64_t rr_replay_until = 0;
+int rr_replay_chaining = 1;
+volatile uint64_t rr_next_checkpoint = UINT64_MAX;
+volatile sig_atomic_t rr_checkpoint_requested = 0;
+
 //mz FIFO queue of log entries read from the log file
 static RR_log_entry *rr_queue_head;
 static RR_log_entry *rr_queue_tail;
@@ -126,6 +143,7 @@ RR_log_entry *rr_get_queue_head(void) {
     return rr_queue_head;
 }
 
+
 // Check if replay is really finished. Conditions:
 // 1) The log is empty
 // 2) The only thing in the queue is RR_LAST
@@ -261,6 +279,171 @@ inline void rr_assert_fail(const char *exp, const char *file, int line, const ch
     /* NOT REACHED */
 }
 
+/******************************************************************************************/
+/* RECORD WRITER */
+/******************************************************************************************/
+
+//mz The CPU thread only serializes entries into chunk buffers.  Full chunks
+//are handed to a writer thread that compresses them and writes them out, so
+//a slow disk doesn't stall the guest until all the buffers are in flight.
+#define RR_WRITER_NUM_BUFFERS 8
+
+typedef struct {
+    uint8_t *buf;
+    uint32_t len;
+    uint32_t capacity;
+    uint32_t num_entries;
+    uint64_t first_instr;
+} RR_writer_buffer;
+
+static struct {
+    QemuThread thread;
+    QemuMutex lock;
+    QemuCond cond;
+    RR_writer_buffer queue[RR_WRITER_NUM_BUFFERS];  // full chunks, FIFO
+    unsigned head, tail;
+    RR_writer_buffer free[RR_WRITER_NUM_BUFFERS];   // empty buffers
+    unsigned num_free;
+    int stop;
+    int done;
+    int running;
+    //mz what the writer hasn't gotten to yet.  if these stay up, the disk
+    //can't keep up with the guest.
+    uint64_t queued_bytes;
+    uint64_t queued_entries;
+    uint64_t max_queued_bytes;
+    uint64_t max_queued_entries;
+    uint64_t stalls;                 // times the CPU waited for a buffer
+    uint64_t bytes_since_sync;
+} rr_writer;
+
+//mz called on the CPU thread by the chunk stream when a chunk is full
+static uint8_t *rr_writer_handoff(void *opaque, uint8_t *buf, uint32_t len,
+                                  uint32_t num_entries, uint64_t first_instr,
+                                  uint32_t *capacity) {
+    RR_chunk_stream *s = (RR_chunk_stream *) opaque;
+    RR_writer_buffer *b;
+    uint8_t *empty;
+
+    qemu_mutex_lock(&rr_writer.lock);
+    b = &rr_writer.queue[rr_writer.tail % RR_WRITER_NUM_BUFFERS];
+    b->buf = buf;
+    b->len = len;
+    b->capacity = s->buf_capacity;
+    b->num_entries = num_entries;
+    b->first_instr = first_instr;
+    rr_writer.tail++;
+    rr_writer.queued_bytes += len;
+    rr_writer.queued_entries += num_entries;
+    rr_writer.max_queued_bytes = MAX(rr_writer.max_queued_bytes, rr_writer.queued_bytes);
+    rr_writer.max_queued_entries = MAX(rr_writer.max_queued_entries, rr_writer.queued_entries);
+    qemu_cond_broadcast(&rr_writer.cond);
+
+    if (rr_writer.num_free == 0) {
+        rr_writer.stalls++;
+        while (rr_writer.num_free == 0) {
+            qemu_cond_wait(&rr_writer.cond, &rr_writer.lock);
+        }
+    }
+    b = &rr_writer.free[--rr_writer.num_free];
+    empty = b->buf;
+    *capacity = b->capacity;
+    qemu_mutex_unlock(&rr_writer.lock);
+    return empty;
+}
+
+static void *rr_writer_thread(void *arg) {
+    RR_chunk_stream *s = (RR_chunk_stream *) arg;
+    RR_writer_buffer b;
+
+    qemu_mutex_lock(&rr_writer.lock);
+    for (;;) {
+        while (rr_writer.head == rr_writer.tail && !rr_writer.stop) {
+            qemu_cond_wait(&rr_writer.cond, &rr_writer.lock);
+        }
+        if (rr_writer.head == rr_writer.tail) {
+            //mz asked to stop and nothing left to write
+            break;
+        }
+        b = rr_writer.queue[rr_writer.head % RR_WRITER_NUM_BUFFERS];
+        qemu_mutex_unlock(&rr_writer.lock);
+
+        rr_chunk_emit(s, b.buf, b.len, b.num_entries, b.first_instr);
+        if (rr_record_fsync_bytes) {
+            rr_writer.bytes_since_sync += b.len;
+            if (rr_writer.bytes_since_sync >= rr_record_fsync_bytes) {
+                fflush(s->fp);
+                fdatasync(fileno(s->fp));
+                rr_writer.bytes_since_sync = 0;
+            }
+        }
+
+        qemu_mutex_lock(&rr_writer.lock);
+        rr_writer.head++;
+        rr_writer.queued_bytes -= b.len;
+        rr_writer.queued_entries -= b.num_entries;
+        rr_writer.free[rr_writer.num_free++] = b;
+        qemu_cond_broadcast(&rr_writer.cond);
+    }
+    rr_writer.done = 1;
+    qemu_cond_broadcast(&rr_writer.cond);
+    qemu_mutex_unlock(&rr_writer.lock);
+    return NULL;
+}
+
+static void rr_writer_start(RR_chunk_stream *s) {
+    int i;
+    memset(&rr_writer, 0, sizeof(rr_writer));
+    qemu_mutex_init(&rr_writer.lock);
+    qemu_cond_init(&rr_writer.cond);
+    //mz the stream already has one buffer; preallocate the rest
+    for (i = 0; i < RR_WRITER_NUM_BUFFERS - 1; i++) {
+        rr_writer.free[i].buf = g_malloc(RR_CHUNK_MAX_BYTES);
+        rr_writer.free[i].capacity = RR_CHUNK_MAX_BYTES;
+    }
+    rr_writer.num_free = RR_WRITER_NUM_BUFFERS - 1;
+    s->handoff = rr_writer_handoff;
+    s->handoff_opaque = s;
+    rr_writer.running = 1;
+    qemu_thread_create(&rr_writer.thread, rr_writer_thread, s);
+}
+
+//mz hand over the last partial chunk and wait for everything to hit the file
+static void rr_writer_stop(RR_chunk_stream *s) {
+    unsigned i;
+    if (!rr_writer.running) {
+        return;
+    }
+    rr_chunk_flush(s);
+    qemu_mutex_lock(&rr_writer.lock);
+    rr_writer.stop = 1;
+    qemu_cond_broadcast(&rr_writer.cond);
+    while (!rr_writer.done) {
+        qemu_cond_wait(&rr_writer.cond, &rr_writer.lock);
+    }
+    qemu_mutex_unlock(&rr_writer.lock);
+
+    s->handoff = NULL;
+    s->handoff_opaque = NULL;
+    for (i = 0; i < rr_writer.num_free; i++) {
+        g_free(rr_writer.free[i].buf);
+    }
+    rr_writer.num_free = 0;
+    qemu_cond_destroy(&rr_writer.cond);
+    qemu_mutex_destroy(&rr_writer.lock);
+    rr_writer.running = 0;
+}
+
+void rr_get_record_backlog(uint64_t *queued_bytes, uint64_t *queued_entries) {
+    *queued_bytes = *queued_entries = 0;
+    if (rr_writer.running) {
+        qemu_mutex_lock(&rr_writer.lock);
+        *queued_bytes = rr_writer.queued_bytes;
+        *queued_entries = rr_writer.queued_entries;
+        qemu_mutex_unlock(&rr_writer.lock);
+    }
+}
+
 /******************************************************************************************/
 /* RECORD */
 /******************************************************************************************/
@@ -272,10 +455,11 @@ static inline void rr_write_item(void) {
     //mz save the header
     rr_assert (rr_in_record());
     rr_assert (rr_nondet_log != NULL);
+    rr_chunk_begin_entry(&rr_nondet_log->stream, item->header.prog_point.guest_instr_count);
     //mz this is more compact, as it doesn't include extra padding.
-    fwrite(&(item->header.prog_point), sizeof(RR_prog_point), 1, rr_nondet_log->fp);
-    fwrite(&(item->header.kind), sizeof(item->header.kind), 1, rr_nondet_log->fp);
-    fwrite(&(item->header.callsite_loc), sizeof(item->header.callsite_loc), 1, rr_nondet_log->fp);
+    rr_chunk_write(&rr_nondet_log->stream, &(item->header.prog_point), sizeof(RR_prog_point), 1);
+    rr_chunk_write(&rr_nondet_log->stream, &(item->header.kind), sizeof(item->header.kind), 1);
+    rr_chunk_write(&rr_nondet_log->stream, &(item->header.callsite_loc), sizeof(item->header.callsite_loc), 1);
 
     //mz also save the program point in the log structure to ensure that our
     //header will include the latest program point.
@@ -283,68 +467,68 @@ static inline void rr_write_item(void) {
 
     switch (item->header.kind) {
         case RR_INPUT_1:
-            fwrite(&(item->variant.input_1), sizeof(item->variant.input_1), 1, rr_nondet_log->fp);
+            rr_chunk_write(&rr_nondet_log->stream, &(item->variant.input_1), sizeof(item->variant.input_1), 1);
             break;
         case RR_INPUT_2:
-            fwrite(&(item->variant.input_2), sizeof(item->variant.input_2), 1, rr_nondet_log->fp);
+            rr_chunk_write(&rr_nondet_log->stream, &(item->variant.input_2), sizeof(item->variant.input_2), 1);
             break;
         case RR_INPUT_4:
-            fwrite(&(item->variant.input_4), sizeof(item->variant.input_4), 1, rr_nondet_log->fp);
+            rr_chunk_write(&rr_nondet_log->stream, &(item->variant.input_4), sizeof(item->variant.input_4), 1);
             break;
         case RR_INPUT_8:
-            fwrite(&(item->variant.input_8), sizeof(item->variant.input_8), 1, rr_nondet_log->fp);
+            rr_chunk_write(&rr_nondet_log->stream, &(item->variant.input_8), sizeof(item->variant.input_8), 1);
             break;
         case RR_INTERRUPT_REQUEST:
-            fwrite(&(item->variant.interrupt_request), sizeof(item->variant.interrupt_request), 1, rr_nondet_log->fp);
+            rr_chunk_write(&rr_nondet_log->stream, &(item->variant.interrupt_request), sizeof(item->variant.interrupt_request), 1);
             break;
         case RR_EXIT_REQUEST:
-            fwrite(&(item->variant.exit_request), sizeof(item->variant.exit_request), 1, rr_nondet_log->fp);
+            rr_chunk_write(&rr_nondet_log->stream, &(item->variant.exit_request), sizeof(item->variant.exit_request), 1);
             break;
         case RR_SKIPPED_CALL:
             {
                 RR_skipped_call_args *args = &item->variant.call_args;
                 //mz write kind first!
-                fwrite(&(args->kind), sizeof(args->kind), 1, rr_nondet_log->fp);
+                rr_chunk_write(&rr_nondet_log->stream, &(args->kind), sizeof(args->kind), 1);
                 switch (args->kind) {
                     case RR_CALL_CPU_MEM_RW:
                         rr_assert(args->variant.cpu_mem_rw_args.buf != NULL || 
                                 args->variant.cpu_mem_rw_args.len == 0);
-                        fwrite(&(args->variant.cpu_mem_rw_args), 
+                        rr_chunk_write(&rr_nondet_log->stream, &(args->variant.cpu_mem_rw_args), 
 			       sizeof(args->variant.cpu_mem_rw_args), 
-			       1, rr_nondet_log->fp);
+			       1);
                         //mz write the buffer
-                        fwrite(args->variant.cpu_mem_rw_args.buf, 1, 
-			       args->variant.cpu_mem_rw_args.len, rr_nondet_log->fp);
+                        rr_chunk_write(&rr_nondet_log->stream, args->variant.cpu_mem_rw_args.buf, 1, 
+			       args->variant.cpu_mem_rw_args.len);
                         break;
                     case RR_CALL_CPU_MEM_UNMAP:
                         //bdg same deal as RR_CALL_CPU_MEM_RW
                         rr_assert(args->variant.cpu_mem_unmap.buf != NULL || 
                                 args->variant.cpu_mem_unmap.len == 0);
-                        fwrite(&(args->variant.cpu_mem_unmap),
-			       sizeof(args->variant.cpu_mem_unmap), 1, rr_nondet_log->fp);
-                        fwrite(args->variant.cpu_mem_unmap.buf, 1, 
-			       args->variant.cpu_mem_unmap.len, rr_nondet_log->fp);
+                        rr_chunk_write(&rr_nondet_log->stream, &(args->variant.cpu_mem_unmap),
+			       sizeof(args->variant.cpu_mem_unmap), 1);
+                        rr_chunk_write(&rr_nondet_log->stream, args->variant.cpu_mem_unmap.buf, 1, 
+			       args->variant.cpu_mem_unmap.len);
                         break;
                     case RR_CALL_CPU_REG_MEM_REGION:
-                        fwrite(&(args->variant.cpu_mem_reg_region_args), 
-                               sizeof(args->variant.cpu_mem_reg_region_args), 1, rr_nondet_log->fp);
+                        rr_chunk_write(&rr_nondet_log->stream, &(args->variant.cpu_mem_reg_region_args), 
+                               sizeof(args->variant.cpu_mem_reg_region_args), 1);
                         break;
                     case RR_CALL_HD_TRANSFER:
-		        fwrite(&(args->variant.hd_transfer_args), 
-                               sizeof(args->variant.hd_transfer_args), 1, rr_nondet_log->fp);
+		        rr_chunk_write(&rr_nondet_log->stream, &(args->variant.hd_transfer_args), 
+                               sizeof(args->variant.hd_transfer_args), 1);
                         break;
                     case RR_CALL_NET_TRANSFER:
-		        fwrite(&(args->variant.net_transfer_args), 
-                               sizeof(args->variant.net_transfer_args), 1, rr_nondet_log->fp);
+		        rr_chunk_write(&rr_nondet_log->stream, &(args->variant.net_transfer_args), 
+                               sizeof(args->variant.net_transfer_args), 1);
                         break;
                     case RR_CALL_HANDLE_PACKET:
                         assert(args->variant.handle_packet_args.buf != NULL || 
                                 args->variant.handle_packet_args.size == 0);
-                        fwrite(&(args->variant.handle_packet_args), 
-			       sizeof(args->variant.handle_packet_args), 1, rr_nondet_log->fp);
+                        rr_chunk_write(&rr_nondet_log->stream, &(args->variant.handle_packet_args), 
+			       sizeof(args->variant.handle_packet_args), 1);
                         //mz write the buffer
-                        fwrite(args->variant.handle_packet_args.buf, 1, 
-			       args->variant.handle_packet_args.size, rr_nondet_log->fp);
+                        rr_chunk_write(&rr_nondet_log->stream, args->variant.handle_packet_args.buf, 1, 
+			       args->variant.handle_packet_args.size);
                         break;
                     default:
                         //mz unimplemented
@@ -360,6 +544,7 @@ static inline void rr_write_item(void) {
             //mz unimplemented
             rr_assert(0);
     }
+    rr_chunk_end_entry(&rr_nondet_log->stream);
     rr_nondet_log->item_number++;
 }
 
@@ -617,9 +802,76 @@ static void rr_record_end_of_log(void) {
 /* REPLAY */
 /******************************************************************************************/
 
-//mz avoid actually releasing memory
-static RR_log_entry *recycle_list = NULL;
+//mz Entries are read and decoded ahead of the CPU by a prefetch thread and
+//handed over through a single-producer/single-consumer ring.  Used entries go
+//back to the prefetch thread through a second ring so they (and their
+//buffers) get reused instead of released.
+#define RR_PREFETCH_RING_LEN 4096             // must be a power of 2
+#define RR_PREFETCH_MAX_BYTES (64 << 20)      // cap on buffered DMA data
+
+typedef struct {
+    RR_log_entry *slots[RR_PREFETCH_RING_LEN];
+    volatile unsigned head;                   // advanced by consumer
+    volatile unsigned tail;                   // advanced by producer
+} RR_entry_ring;
+
+static inline int rr_ring_push(RR_entry_ring *ring, RR_log_entry *entry) {
+    unsigned tail = ring->tail;
+    if (tail - ring->head == RR_PREFETCH_RING_LEN) {
+        return 0;
+    }
+    ring->slots[tail & (RR_PREFETCH_RING_LEN - 1)] = entry;
+    //mz slot must be visible before the new tail
+    smp_wmb();
+    ring->tail = tail + 1;
+    return 1;
+}
+
+static inline RR_log_entry *rr_ring_peek(RR_entry_ring *ring) {
+    unsigned head = ring->head;
+    if (head == ring->tail) {
+        return NULL;
+    }
+    smp_rmb();
+    return ring->slots[head & (RR_PREFETCH_RING_LEN - 1)];
+}
+
+static inline void rr_ring_advance(RR_entry_ring *ring) {
+    //mz done reading the slot before the producer may reuse it
+    smp_mb();
+    ring->head = ring->head + 1;
+}
 
+static inline RR_log_entry *rr_ring_pop(RR_entry_ring *ring) {
+    RR_log_entry *entry = rr_ring_peek(ring);
+    if (entry != NULL) {
+        rr_ring_advance(ring);
+    }
+    return entry;
+}
+
+static struct {
+    QemuThread thread;
+    QemuMutex lock;
+    QemuCond cond;                 // broadcast when either side makes progress
+    RR_entry_ring full;            // decoded entries, prefetch thread -> CPU
+    RR_entry_ring free;            // used entries, CPU -> prefetch thread
+    volatile uint64_t bytes_ahead; // buffer bytes sitting in the full ring
+    volatile int consumer_waiting;
+    volatile int producer_waiting;
+    volatile int done;             // prefetch thread has exited
+    volatile int stop;             // prefetch thread asked to exit
+    int running;
+} rr_prefetch;
+
+//mz really release an entry and its buffer
+static inline void rr_free_entry(RR_log_entry *entry)
+{
+    g_free(entry->data);
+    g_free(entry);
+}
+
+//mz skipped call buffers point into entry->data, which outlives them
 static inline void free_entry_params(RR_log_entry *entry) 
 {
     //mz cleanup associated resources
@@ -627,15 +879,12 @@ static inline void free_entry_params(RR_log_entry *entry)
         case RR_SKIPPED_CALL:
             switch (entry->variant.call_args.kind) {
                 case RR_CALL_CPU_MEM_RW:
-                    g_free(entry->variant.call_args.variant.cpu_mem_rw_args.buf);
                     entry->variant.call_args.variant.cpu_mem_rw_args.buf = NULL;
                     break;
                 case RR_CALL_CPU_MEM_UNMAP:
-                    g_free(entry->variant.call_args.variant.cpu_mem_unmap.buf);
                     entry->variant.call_args.variant.cpu_mem_unmap.buf = NULL;
                     break;
 	        case RR_CALL_HANDLE_PACKET:
-	            g_free(entry->variant.call_args.variant.handle_packet_args.buf);
 		    entry->variant.call_args.variant.handle_packet_args.buf = NULL;
 		    break;
             }
@@ -648,56 +897,71 @@ static inline void free_entry_params(RR_log_entry *entry)
         default:
              break;
     }
+    entry->data_len = 0;
 }
 
 //mz "free" a used entry
 static inline void add_to_recycle_list(RR_log_entry *entry)
 {
     free_entry_params(entry);
-    //mz add to the recycle list
-    if (recycle_list == NULL) {
-        recycle_list = entry;
-    }
-    else {
-        entry->next = recycle_list;
-        recycle_list = entry;
-    }
+    entry->next = NULL;
     //mz save item in history
     //mz NB: we're not saving the buffer here (for RR_SKIPPED_CALL/RR_CALL_CPU_MEM_RW),
     //mz so don't try to read it later!
     rr_log_entry_history[rr_hist_index] = *entry;
     rr_hist_index = (rr_hist_index + 1) % RR_HIST_SIZE;
+    //mz hand it back to the prefetch thread, unless it has plenty already
+    if (!rr_ring_push(&rr_prefetch.free, entry)) {
+        rr_free_entry(entry);
+    }
 }
 
-//mz allocate a new entry (not filled yet)
+//mz allocate a new entry (not filled yet).  called from the prefetch thread.
 static inline RR_log_entry *alloc_new_entry(void) 
 {
-    RR_log_entry *new_entry = NULL;
-    if (recycle_list != NULL) {
-        new_entry = recycle_list;
-        recycle_list = recycle_list->next;
-        new_entry->next = NULL;
+    RR_log_entry *new_entry = rr_ring_pop(&rr_prefetch.free);
+    uint8_t *data = NULL;
+    uint32_t data_capacity = 0;
+    if (new_entry != NULL) {
+        data = new_entry->data;
+        data_capacity = new_entry->data_capacity;
     }
     else {
         new_entry = g_new(RR_log_entry, 1);
     }
     memset(new_entry, 0, sizeof(RR_log_entry));
+    new_entry->data = data;
+    new_entry->data_capacity = data_capacity;
     return new_entry;
 }
 
+//mz get a buffer of len bytes for a skipped call, reusing the entry's storage
+static inline uint8_t *entry_data_buf(RR_log_entry *entry, uint32_t len)
+{
+    if (len > entry->data_capacity) {
+        entry->data = g_realloc(entry->data, len);
+        entry->data_capacity = len;
+    }
+    entry->data_len = len;
+    return entry->data;
+}
+
 //mz fill an entry
 static RR_log_entry *rr_read_item(void) {
     RR_log_entry *item = alloc_new_entry();
 
     //mz read header
     rr_assert (rr_in_replay());
-    rr_assert ( ! rr_log_is_empty());
+    rr_assert ( ! rr_chunk_is_empty(&rr_nondet_log->stream));
     rr_assert (rr_nondet_log->fp != NULL);
 
+    //mz remember where this entry came from so we can get back to it
+    item->pos = rr_chunk_tell(&rr_nondet_log->stream);
+
     //mz XXX we assume that the log is not trucated - should probably fix this.
-    if (fread(&(item->header.prog_point), sizeof(RR_prog_point), 1, rr_nondet_log->fp) != 1) {
+    if (rr_chunk_read(&rr_nondet_log->stream, &(item->header.prog_point), sizeof(RR_prog_point), 1) != 1) {
         //mz an error occurred
-        if (feof(rr_nondet_log->fp)) {
+        if (rr_chunk_is_empty(&rr_nondet_log->stream)) {
             // replay is done - we've reached the end of file
             //mz we should never get here!
             rr_assert(0);
@@ -709,8 +973,8 @@ static RR_log_entry *rr_read_item(void) {
         }
     }
     //mz this is more compact, as it doesn't include extra padding.
-    rr_assert(fread(&(item->header.kind), sizeof(item->header.kind), 1, rr_nondet_log->fp) == 1);
-    rr_assert(fread(&(item->header.callsite_loc), sizeof(item->header.callsite_loc), 1, rr_nondet_log->fp) == 1);
+    rr_assert(rr_chunk_read(&rr_nondet_log->stream, &(item->header.kind), sizeof(item->header.kind), 1) == 1);
+    rr_assert(rr_chunk_read(&rr_nondet_log->stream, &(item->header.callsite_loc), sizeof(item->header.callsite_loc), 1) == 1);
 
     //mz let's do some counting
     rr_number_of_log_entries[item->header.kind]++;
@@ -720,86 +984,85 @@ static RR_log_entry *rr_read_item(void) {
     //mz read the rest of the item
     switch (item->header.kind) {
         case RR_INPUT_1:
-            rr_assert(fread(&(item->variant.input_1), sizeof(item->variant.input_1), 1, rr_nondet_log->fp) == 1);
+            rr_assert(rr_chunk_read(&rr_nondet_log->stream, &(item->variant.input_1), sizeof(item->variant.input_1), 1) == 1);
             rr_size_of_log_entries[item->header.kind] += sizeof(item->variant.input_1);
             break;
         case RR_INPUT_2:
-            rr_assert(fread(&(item->variant.input_2), sizeof(item->variant.input_2), 1, rr_nondet_log->fp) == 1);
+            rr_assert(rr_chunk_read(&rr_nondet_log->stream, &(item->variant.input_2), sizeof(item->variant.input_2), 1) == 1);
             rr_size_of_log_entries[item->header.kind] += sizeof(item->variant.input_2);
             break;
         case RR_INPUT_4:
-            rr_assert(fread(&(item->variant.input_4), sizeof(item->variant.input_4), 1, rr_nondet_log->fp) == 1);
+            rr_assert(rr_chunk_read(&rr_nondet_log->stream, &(item->variant.input_4), sizeof(item->variant.input_4), 1) == 1);
             rr_size_of_log_entries[item->header.kind] += sizeof(item->variant.input_4);
             break;
         case RR_INPUT_8:
-            rr_assert(fread(&(item->variant.input_8), sizeof(item->variant.input_8), 1, rr_nondet_log->fp) == 1);
+            rr_assert(rr_chunk_read(&rr_nondet_log->stream, &(item->variant.input_8), sizeof(item->variant.input_8), 1) == 1);
             rr_size_of_log_entries[item->header.kind] += sizeof(item->variant.input_8);
             break;
         case RR_INTERRUPT_REQUEST:
-            rr_assert(fread(&(item->variant.interrupt_request), sizeof(item->variant.interrupt_request), 1, rr_nondet_log->fp) == 1);
+            rr_assert(rr_chunk_read(&rr_nondet_log->stream, &(item->variant.interrupt_request), sizeof(item->variant.interrupt_request), 1) == 1);
             rr_size_of_log_entries[item->header.kind] += sizeof(item->variant.interrupt_request);
             break;
         case RR_EXIT_REQUEST:
-            rr_assert(fread(&(item->variant.exit_request), sizeof(item->variant.exit_request), 1, rr_nondet_log->fp) == 1);
+            rr_assert(rr_chunk_read(&rr_nondet_log->stream, &(item->variant.exit_request), sizeof(item->variant.exit_request), 1) == 1);
             rr_size_of_log_entries[item->header.kind] += sizeof(item->variant.exit_request);
             break;
         case RR_SKIPPED_CALL:
             {
                 RR_skipped_call_args *args = &item->variant.call_args;
                 //mz read kind first!
-                rr_assert(fread(&(args->kind), sizeof(args->kind), 1, rr_nondet_log->fp) == 1);
+                rr_assert(rr_chunk_read(&rr_nondet_log->stream, &(args->kind), sizeof(args->kind), 1) == 1);
                 rr_size_of_log_entries[item->header.kind] += sizeof(args->kind);
                 switch(args->kind) {
                     case RR_CALL_CPU_MEM_RW:
-                        rr_assert(fread(&(args->variant.cpu_mem_rw_args), sizeof(args->variant.cpu_mem_rw_args), 1, rr_nondet_log->fp) == 1);
+                        rr_assert(rr_chunk_read(&rr_nondet_log->stream, &(args->variant.cpu_mem_rw_args), sizeof(args->variant.cpu_mem_rw_args), 1) == 1);
                         rr_size_of_log_entries[item->header.kind] += sizeof(args->variant.cpu_mem_rw_args);
                         //mz buffer length in args->variant.cpu_mem_rw_args.len
-                        //mz always allocate a new one. we free it when the item is added to the recycle list
-                        args->variant.cpu_mem_rw_args.buf = g_malloc(args->variant.cpu_mem_rw_args.len);
+                        //mz the entry keeps its buffer across recycling; grow it if needed
+                        args->variant.cpu_mem_rw_args.buf = entry_data_buf(item, args->variant.cpu_mem_rw_args.len);
                         //mz read the buffer
-                        rr_assert(fread(args->variant.cpu_mem_rw_args.buf, 1, args->variant.cpu_mem_rw_args.len, rr_nondet_log->fp) > 0);
+                        rr_assert(rr_chunk_read(&rr_nondet_log->stream, args->variant.cpu_mem_rw_args.buf, 1, args->variant.cpu_mem_rw_args.len) > 0);
                         rr_size_of_log_entries[item->header.kind] += args->variant.cpu_mem_rw_args.len;
                         break;
                     case RR_CALL_CPU_MEM_UNMAP:
-                        rr_assert(fread(&(args->variant.cpu_mem_unmap), sizeof(args->variant.cpu_mem_unmap), 1, rr_nondet_log->fp) == 1);
+                        rr_assert(rr_chunk_read(&rr_nondet_log->stream, &(args->variant.cpu_mem_unmap), sizeof(args->variant.cpu_mem_unmap), 1) == 1);
                         rr_size_of_log_entries[item->header.kind] += sizeof(args->variant.cpu_mem_unmap);
-                        args->variant.cpu_mem_unmap.buf = g_malloc(args->variant.cpu_mem_unmap.len);
-                        rr_assert(fread(args->variant.cpu_mem_unmap.buf, 1, args->variant.cpu_mem_unmap.len, rr_nondet_log->fp) > 0);
+                        args->variant.cpu_mem_unmap.buf = entry_data_buf(item, args->variant.cpu_mem_unmap.len);
+                        rr_assert(rr_chunk_read(&rr_nondet_log->stream, args->variant.cpu_mem_unmap.buf, 1, args->variant.cpu_mem_unmap.len) > 0);
                         rr_size_of_log_entries[item->header.kind] += args->variant.cpu_mem_unmap.len;
                         break;
 
                     case RR_CALL_CPU_REG_MEM_REGION:
-                        rr_assert(fread(&(args->variant.cpu_mem_reg_region_args), 
-                              sizeof(args->variant.cpu_mem_reg_region_args), 1, rr_nondet_log->fp) == 1);
+                        rr_assert(rr_chunk_read(&rr_nondet_log->stream, &(args->variant.cpu_mem_reg_region_args), 
+                              sizeof(args->variant.cpu_mem_reg_region_args), 1) == 1);
                         rr_size_of_log_entries[item->header.kind] += sizeof(args->variant.cpu_mem_reg_region_args);
                         break;
 		     
 		    case RR_CALL_HD_TRANSFER:
-		        rr_assert(fread(&(args->variant.hd_transfer_args),
-			      sizeof(args->variant.hd_transfer_args), 1, rr_nondet_log->fp) == 1);
+		        rr_assert(rr_chunk_read(&rr_nondet_log->stream, &(args->variant.hd_transfer_args),
+			      sizeof(args->variant.hd_transfer_args), 1) == 1);
 			rr_size_of_log_entries[item->header.kind] += sizeof(args->variant.hd_transfer_args);
 			break;
 		    
                     case RR_CALL_NET_TRANSFER:
-		        rr_assert(fread(&(args->variant.net_transfer_args),
-			      sizeof(args->variant.net_transfer_args), 1, rr_nondet_log->fp) == 1);
+		        rr_assert(rr_chunk_read(&rr_nondet_log->stream, &(args->variant.net_transfer_args),
+			      sizeof(args->variant.net_transfer_args), 1) == 1);
 			rr_size_of_log_entries[item->header.kind] += sizeof(args->variant.net_transfer_args);
 			break;
 		    
 		    case RR_CALL_HANDLE_PACKET:
-  		        rr_assert(fread(&(args->variant.handle_packet_args), 
-					sizeof(args->variant.handle_packet_args), 1, rr_nondet_log->fp) == 1);
+  		        rr_assert(rr_chunk_read(&rr_nondet_log->stream, &(args->variant.handle_packet_args), 
+					sizeof(args->variant.handle_packet_args), 1) == 1);
 		        rr_size_of_log_entries[item->header.kind] += sizeof(args->variant.handle_packet_args);
 			//mz XXX HACK
 			args->old_buf_addr = (uint64_t) args->variant.handle_packet_args.buf;
 			//mz buffer length in args->variant.cpu_mem_rw_args.len 
-			//mz always allocate a new one. we free it when the item is added to the recycle list
+			//mz the entry keeps its buffer across recycling; grow it if needed
 			args->variant.handle_packet_args.buf = 
-			  g_malloc(args->variant.handle_packet_args.size);
+			  entry_data_buf(item, args->variant.handle_packet_args.size);
 			//mz read the buffer 
-			assert (fread(args->variant.handle_packet_args.buf, 
-				      args->variant.handle_packet_args.size, 1,
-                                      rr_nondet_log->fp) == 1 /*> 0*/);
+			assert (rr_chunk_read(&rr_nondet_log->stream, args->variant.handle_packet_args.buf, 
+				      args->variant.handle_packet_args.size, 1) == 1 /*> 0*/);
 			rr_size_of_log_entries[item->header.kind] += args->variant.handle_packet_args.size;
 			break;
 
@@ -822,6 +1085,133 @@ static RR_log_entry *rr_read_item(void) {
     return item;
 }
 
+/******************************************************************************************/
+/* REPLAY PREFETCH */
+/******************************************************************************************/
+
+static void rr_prefetch_wake(volatile int *waiting) {
+    //mz pairs with the smp_mb() after setting *waiting below
+    smp_mb();
+    if (*waiting) {
+        qemu_mutex_lock(&rr_prefetch.lock);
+        qemu_cond_broadcast(&rr_prefetch.cond);
+        qemu_mutex_unlock(&rr_prefetch.lock);
+    }
+}
+
+static inline int rr_prefetch_has_room(void) {
+    return rr_prefetch.full.tail - rr_prefetch.full.head < RR_PREFETCH_RING_LEN &&
+        rr_prefetch.bytes_ahead < RR_PREFETCH_MAX_BYTES;
+}
+
+//mz decode entries from the log ahead of the CPU until the log is empty,
+//RR_LAST has been read or we're told to stop
+static void *rr_prefetch_thread(void *arg) {
+    while (!rr_prefetch.stop && !rr_chunk_is_empty(&rr_nondet_log->stream)) {
+        RR_log_entry *entry;
+        uint8_t kind;
+
+        if (!rr_prefetch_has_room()) {
+            qemu_mutex_lock(&rr_prefetch.lock);
+            rr_prefetch.producer_waiting = 1;
+            smp_mb();
+            while (!rr_prefetch.stop && !rr_prefetch_has_room()) {
+                qemu_cond_wait(&rr_prefetch.cond, &rr_prefetch.lock);
+            }
+            rr_prefetch.producer_waiting = 0;
+            qemu_mutex_unlock(&rr_prefetch.lock);
+            continue;
+        }
+
+        entry = rr_read_item();
+        kind = entry->header.kind;
+        __sync_fetch_and_add(&rr_prefetch.bytes_ahead, entry->data_len);
+        rr_assert(rr_ring_push(&rr_prefetch.full, entry));
+        rr_prefetch_wake(&rr_prefetch.consumer_waiting);
+
+        if (kind == RR_LAST) {
+            break;
+        }
+    }
+    qemu_mutex_lock(&rr_prefetch.lock);
+    rr_prefetch.done = 1;
+    qemu_cond_broadcast(&rr_prefetch.cond);
+    qemu_mutex_unlock(&rr_prefetch.lock);
+    return NULL;
+}
+
+//mz next decoded entry, waiting for the prefetch thread if it's behind.
+//NULL once the whole log has been handed out.
+static RR_log_entry *rr_prefetch_next(bool consume) {
+    RR_log_entry *entry = rr_ring_peek(&rr_prefetch.full);
+    if (entry == NULL) {
+        qemu_mutex_lock(&rr_prefetch.lock);
+        rr_prefetch.consumer_waiting = 1;
+        smp_mb();
+        while ((entry = rr_ring_peek(&rr_prefetch.full)) == NULL && !rr_prefetch.done) {
+            qemu_cond_wait(&rr_prefetch.cond, &rr_prefetch.lock);
+        }
+        rr_prefetch.consumer_waiting = 0;
+        qemu_mutex_unlock(&rr_prefetch.lock);
+    }
+    if (entry != NULL && consume) {
+        rr_ring_advance(&rr_prefetch.full);
+        __sync_fetch_and_sub(&rr_prefetch.bytes_ahead, entry->data_len);
+        rr_prefetch_wake(&rr_prefetch.producer_waiting);
+    }
+    return entry;
+}
+
+static uint8_t rr_prefetch_drained(void) {
+    return rr_prefetch.done && rr_ring_peek(&rr_prefetch.full) == NULL;
+}
+
+static void rr_prefetch_start(void) {
+    memset(&rr_prefetch, 0, sizeof(rr_prefetch));
+    qemu_mutex_init(&rr_prefetch.lock);
+    qemu_cond_init(&rr_prefetch.cond);
+    rr_prefetch.running = 1;
+    qemu_thread_create(&rr_prefetch.thread, rr_prefetch_thread, NULL);
+}
+
+//mz stop the prefetch thread and release everything it decoded that the CPU
+//never got to
+static void rr_prefetch_stop(void) {
+    RR_log_entry *entry;
+    if (!rr_prefetch.running) {
+        return;
+    }
+    qemu_mutex_lock(&rr_prefetch.lock);
+    rr_prefetch.stop = 1;
+    qemu_cond_broadcast(&rr_prefetch.cond);
+    while (!rr_prefetch.done) {
+        qemu_cond_wait(&rr_prefetch.cond, &rr_prefetch.lock);
+    }
+    qemu_mutex_unlock(&rr_prefetch.lock);
+
+    while ((entry = rr_ring_pop(&rr_prefetch.full)) != NULL) {
+        rr_free_entry(entry);
+    }
+    rr_prefetch.bytes_ahead = 0;
+    qemu_cond_destroy(&rr_prefetch.cond);
+    qemu_mutex_destroy(&rr_prefetch.lock);
+    rr_prefetch.running = 0;
+}
+
+//mz log position of the next entry the CPU will consume
+RR_log_position rr_replay_position(void) {
+    RR_log_entry *next = rr_queue_head;
+    if (next == NULL && rr_prefetch.running) {
+        next = rr_prefetch_next(false);
+    }
+    if (next != NULL) {
+        return next->pos;
+    }
+    //mz everything has been read, so the prefetch thread is gone and the
+    //stream is ours
+    return rr_chunk_tell(&rr_nondet_log->stream);
+}
+
 #define RR_MAX_QUEUE_LEN 65536
 
 //mz fill the queue of log entries from the file
@@ -832,8 +1222,7 @@ static void rr_fill_queue(void) {
     //mz first, some sanity checks.  The queue should be empty when this is called.
     rr_assert(rr_queue_head == NULL && rr_queue_tail == NULL);
 
-    while ( ! rr_log_is_empty()) {
-        log_entry = rr_read_item();
+    while ((log_entry = rr_prefetch_next(true)) != NULL) {
 
         //mz add it to the queue
         if (rr_queue_head == NULL) {
@@ -864,6 +1253,10 @@ static void rr_fill_queue(void) {
             break;
         }
     }
+    //mz rr_num_instr_before_next_interrupt just moved, and chained TBs
+    //mz running right now only know the old value
+    rr_chain_break();
+
     //mz let's gather some stats
     if (num_entries > rr_max_num_queue_entries) {
         rr_max_num_queue_entries = num_entries;
@@ -1253,6 +1646,10 @@ void rr_create_record_log (const char *filename) {
   //This way, when we print progress, we can use something better than size of log consumed
   //(as that can jump //sporadically).
   fwrite(&(rr_nondet_log->last_prog_point), sizeof(RR_prog_point), 1, rr_nondet_log->fp);
+  //mz entries go into compressed chunks after that
+  rr_chunk_open_write(&rr_nondet_log->stream, rr_nondet_log->fp);
+  //mz which get written out in the background
+  rr_writer_start(&rr_nondet_log->stream);
 }
 
 
@@ -1277,6 +1674,13 @@ void rr_create_replay_log (const char *filename) {
   }
   //mz read the last program point from the log header.
   rr_assert(fread(&(rr_nondet_log->last_prog_point), sizeof(RR_prog_point), 1, rr_nondet_log->fp) == 1);
+  //mz figure out whether this is a chunked or an old flat log
+  rr_assert(rr_chunk_open_read(&rr_nondet_log->stream, rr_nondet_log->fp, rr_nondet_log->size) == 0);
+  if (rr_debug_whisper()) {
+    fprintf (logfile, "nondet log is %s, %llu chunks indexed.\n",
+             rr_nondet_log->stream.legacy ? "flat" : "chunked",
+             (unsigned long long) rr_nondet_log->stream.num_chunks);
+  }
 }
 
 
@@ -1285,12 +1689,24 @@ void rr_destroy_log(void) {
   if (rr_nondet_log->fp) {
     //mz if in record, update the header with the last written prog point.
     if (rr_nondet_log->type == RECORD) {
+        //mz flush the last chunk and write out the chunk index
+        rr_writer_stop(&rr_nondet_log->stream);
+        rr_chunk_close_write(&rr_nondet_log->stream);
+        printf("nondet log: %llu bytes of entries, %llu bytes on disk in %llu chunks.\n",
+               (unsigned long long) rr_nondet_log->stream.bytes_in,
+               (unsigned long long) rr_nondet_log->stream.bytes_out,
+               (unsigned long long) rr_nondet_log->stream.num_chunks);
+        printf("nondet log writer: max backlog %llu bytes / %llu entries, cpu waited %llu times.\n",
+               (unsigned long long) rr_writer.max_queued_bytes,
+               (unsigned long long) rr_writer.max_queued_entries,
+               (unsigned long long) rr_writer.stalls);
         rewind(rr_nondet_log->fp);
         fwrite(&(rr_nondet_log->last_prog_point), sizeof(RR_prog_point), 1, rr_nondet_log->fp);
     }
     fclose(rr_nondet_log->fp);
     rr_nondet_log->fp = NULL;
   }
+  rr_chunk_destroy(&rr_nondet_log->stream);
   g_free(rr_nondet_log->name);
   g_free(rr_nondet_log);
   rr_nondet_log = NULL;
@@ -1372,6 +1788,117 @@ void rr_reset_state(void *cpu_state) {
 }
 
 
+//////////////////////////////////////////////////////////////
+//
+// Replay checkpoints
+
+static char *rr_checkpoint_base = NULL;    // <path>/<name> of the replay
+static FILE *rr_checkpoint_index = NULL;   // <name>-rr-checkpoints, while saving
+
+static inline void rr_get_checkpoint_file_name(const char *base, uint64_t guest_instr_count, char *file_name, size_t file_name_len) {
+  snprintf(file_name, file_name_len, "%s-rr-ckpt-%llu", base, (unsigned long long) guest_instr_count);
+}
+
+static inline void rr_get_checkpoint_index_name(const char *base, char *file_name, size_t file_name_len) {
+  snprintf(file_name, file_name_len, "%s-rr-checkpoints", base);
+}
+
+//mz first checkpoint boundary strictly after guest_instr_count
+static inline uint64_t rr_checkpoint_after(uint64_t guest_instr_count) {
+  if (rr_checkpoint_interval == 0) {
+    return UINT64_MAX;
+  }
+  return (guest_instr_count / rr_checkpoint_interval + 1) * rr_checkpoint_interval;
+}
+
+//mz find the last checkpoint at or before guest_instr_count.  returns 1 if there is one.
+static int rr_find_checkpoint(const char *base, uint64_t guest_instr_count, RR_checkpoint *checkpoint) {
+  char name_buf[1024];
+  unsigned long long instr, pc, secondary, chunk_offset;
+  unsigned int byte_offset;
+  int found = 0;
+  FILE *fp;
+
+  rr_get_checkpoint_index_name(base, name_buf, sizeof(name_buf));
+  fp = fopen(name_buf, "r");
+  if (fp == NULL) {
+    return 0;
+  }
+  while (fscanf(fp, "%llu %llx %llx %llu %u", &instr, &pc, &secondary, &chunk_offset, &byte_offset) == 5) {
+    if (instr > guest_instr_count) {
+      continue;
+    }
+    if (found && instr <= checkpoint->prog_point.guest_instr_count) {
+      continue;
+    }
+    checkpoint->prog_point.guest_instr_count = instr;
+    checkpoint->prog_point.pc = pc;
+    checkpoint->prog_point.secondary = secondary;
+    checkpoint->pos.chunk_offset = chunk_offset;
+    checkpoint->pos.byte_offset = byte_offset;
+    found = 1;
+  }
+  fclose(fp);
+  return found;
+}
+
+//mz set up for saving checkpoints during this replay, if asked to
+static void rr_checkpoint_begin(const char *base, uint64_t guest_instr_count, int resumed) {
+  char name_buf[1024];
+
+  rr_checkpoint_base = g_strdup(base);
+  rr_checkpoint_requested = 0;
+  rr_next_checkpoint = rr_checkpoint_after(guest_instr_count);
+  if (rr_checkpoint_interval == 0) {
+    return;
+  }
+  //mz a replay from the start makes a fresh set of checkpoints
+  rr_get_checkpoint_index_name(base, name_buf, sizeof(name_buf));
+  rr_checkpoint_index = fopen(name_buf, resumed ? "a" : "w");
+  rr_assert(rr_checkpoint_index != NULL);
+  printf ("saving a checkpoint every %llu instrs, index in %s\n",
+          (unsigned long long) rr_checkpoint_interval, name_buf);
+}
+
+static void rr_checkpoint_end(void) {
+  if (rr_checkpoint_index) {
+    fclose(rr_checkpoint_index);
+    rr_checkpoint_index = NULL;
+  }
+  g_free(rr_checkpoint_base);
+  rr_checkpoint_base = NULL;
+  rr_next_checkpoint = UINT64_MAX;
+  rr_checkpoint_requested = 0;
+}
+
+//mz called from the main loop once the CPU has stopped at a checkpoint boundary
+void rr_do_checkpoint(void) {
+#ifdef CONFIG_SOFTMMU
+  char name_buf[1024];
+  RR_checkpoint checkpoint;
+
+  rr_assert(rr_in_replay() && rr_checkpoint_index != NULL);
+  checkpoint.prog_point = rr_prog_point;
+  checkpoint.pos = rr_replay_position();
+
+  rr_get_checkpoint_file_name(rr_checkpoint_base, checkpoint.prog_point.guest_instr_count,
+                              name_buf, sizeof(name_buf));
+  printf ("writing checkpoint:\t%s\n", name_buf);
+  if (do_savevm_rr(get_monitor(), name_buf) == 0) {
+    //mz only list it once the snapshot is safely on disk
+    fprintf(rr_checkpoint_index, "%llu %llx %llx %llu %u\n",
+            (unsigned long long) checkpoint.prog_point.guest_instr_count,
+            (unsigned long long) checkpoint.prog_point.pc,
+            (unsigned long long) checkpoint.prog_point.secondary,
+            (unsigned long long) checkpoint.pos.chunk_offset,
+            checkpoint.pos.byte_offset);
+    fflush(rr_checkpoint_index);
+  }
+  rr_next_checkpoint = rr_checkpoint_after(checkpoint.prog_point.guest_instr_count);
+#endif
+}
+
+
 //////////////////////////////////////////////////////////////
 //
 // QMP commands
@@ -1543,14 +2070,32 @@ int rr_do_begin_replay(const char *file_name_full, void *cpu_state) {
   char *rr_path = g_strdup(file_name_full);
   char *rr_name = g_strdup(file_name_full);
   __attribute__((unused)) int snapshot_ret;
+  char *rr_base;
+  RR_checkpoint checkpoint;
+  int have_checkpoint = 0;
   rr_path = dirname(rr_path);
   rr_name = basename(rr_name);
+  rr_base = g_strdup_printf("%s/%s", rr_path, rr_name);
   if (rr_debug_whisper()) {
     fprintf (logfile,"Begin vm replay for file_name_full = %s\n", file_name_full);    
     fprintf (logfile,"path = [%s]  file_name_base = [%s]\n", rr_path, rr_name);
   }
   // first retrieve snapshot
   rr_get_snapshot_file_name(rr_name, rr_path, name_buf, sizeof(name_buf));
+  //mz or skip ahead to the closest checkpoint, if asked
+  if (rr_replay_from) {
+    have_checkpoint = rr_find_checkpoint(rr_base, rr_replay_from, &checkpoint);
+    if (have_checkpoint) {
+      rr_get_checkpoint_file_name(rr_base, checkpoint.prog_point.guest_instr_count,
+                                  name_buf, sizeof(name_buf));
+      printf ("starting from checkpoint at instr %llu\n",
+              (unsigned long long) checkpoint.prog_point.guest_instr_count);
+    }
+    else {
+      printf ("no checkpoint before instr %llu, starting from the beginning\n",
+              (unsigned long long) rr_replay_from);
+    }
+  }
   if (rr_debug_whisper()) {
     fprintf (logfile,"reading snapshot:\t%s\n", name_buf);
   }
@@ -1580,11 +2125,21 @@ int rr_do_begin_replay(const char *file_name_full, void *cpu_state) {
   rr_create_replay_log(name_buf);
   // reset record/replay counters and flags
   rr_reset_state(cpu_state);
+  //mz pick up where the checkpoint left off in the log
+  if (have_checkpoint) {
+    rr_prog_point = checkpoint.prog_point;
+    rr_set_rr_guest_instr_count(cpu_state, checkpoint.prog_point.guest_instr_count);
+    rr_assert(rr_chunk_seek(&rr_nondet_log->stream, checkpoint.pos) == 0);
+  }
+  rr_checkpoint_begin(rr_base, rr_prog_point.guest_instr_count, have_checkpoint);
+  g_free(rr_base);
   // set global to turn on replay
   rr_mode = RR_REPLAY;
 
   //cpu_set_log(CPU_LOG_TB_IN_ASM|CPU_LOG_RR);
 
+  //mz start decoding entries in the background
+  rr_prefetch_start();
   //mz fill the queue!
   rr_fill_queue();
   return 0; //snapshot_ret;
@@ -1619,15 +2174,16 @@ void rr_do_end_replay(int is_error) {
     }
     printf("max_queue_len = %llu\n", rr_max_num_queue_entries);
     rr_max_num_queue_entries = 0;
+    //mz no more reading ahead
+    rr_prefetch_stop();
+    rr_checkpoint_end();
     // cleanup the recycled list for log entries
     {
         unsigned long num_items = 0;
         RR_log_entry *entry;
-        while (recycle_list) {
-            entry = recycle_list;
-            recycle_list = entry->next;
+        while ((entry = rr_ring_pop(&rr_prefetch.free)) != NULL) {
             //mz entry params already freed
-            g_free(entry);
+            rr_free_entry(entry);
             num_items++;
         }
         printf("%lu items on recycle list, %lu bytes total\n", num_items, num_items * sizeof(RR_log_entry));
@@ -1651,8 +2207,7 @@ void rr_do_end_replay(int is_error) {
             entry = rr_queue_head;
             rr_queue_head = entry->next;
             entry->next = NULL;
-            free_entry_params(entry);
-            g_free(entry);
+            rr_free_entry(entry);
         }
     }
     rr_queue_head = NULL;
@@ -1672,6 +2227,12 @@ void rr_do_end_replay(int is_error) {
     else {
 #ifdef RR_QUIT_AFTER_REPLAY
         qemu_system_shutdown_request();
+#else
+        //mz bounded replays (-replay-until) are batch jobs, e.g. one segment
+        //mz of scripts/rrparallel.py, so don't hang around afterwards
+        if (rr_replay_until) {
+            qemu_system_shutdown_request();
+        }
 #endif
     }
 #endif // CONFIG_SOFTMMU
@@ -10,6 +10,7 @@
 #include "cpu.h"
 #include "targphys.h"
 #include "rr_log_all.h"
+#include "rr_log_chunk.h"
 
 // accessors
 uint64_t rr_get_pc(void);
@@ -19,6 +20,7 @@ double rr_get_percentage(void);
 
 
 void rr_clear_rr_guest_instr_count(CPUState *cpu_state);
+void rr_set_rr_guest_instr_count(CPUState *cpu_state, uint64_t guest_instr_count);
 
 //mz structure for arguments to cpu_physical_memory_rw()
 typedef struct {
@@ -105,6 +107,13 @@ typedef struct rr_log_entry_t {
         // if log_entry.kind == RR_LAST
         // no variant fields
     } variant;
+    // where the entry starts in the log file (replay only)
+    RR_log_position pos;
+    // backing store for skipped-call buffers during replay.  it stays with
+    // the entry when it is recycled so we don't malloc for every DMA.
+    uint8_t *data;
+    uint32_t data_len;
+    uint32_t data_capacity;
     struct rr_log_entry_t *next;
 } RR_log_entry;
 
@@ -118,6 +127,7 @@ typedef struct RR_log_t {
   char *name;                  // file name
   FILE *fp;                    // file pointer for log
   unsigned long long size;     // for a log being opened for read, this will be the size in bytes
+  RR_chunk_stream stream;      // (de)compression of entries to/from fp
 
   RR_log_entry current_item;
   uint8_t current_item_valid;
@@ -125,6 +135,17 @@ typedef struct RR_log_t {
 } RR_log;
 
 RR_log_entry *rr_get_queue_head(void);
+// position in the log of the next entry replay hasn't consumed yet
+RR_log_position rr_replay_position(void);
+// a replay checkpoint: snapshot <name>-rr-ckpt-<instr> was taken here, and
+// replay resumes with the entry at pos.  one per line in <name>-rr-checkpoints.
+typedef struct {
+    RR_prog_point prog_point;
+    RR_log_position pos;
+} RR_checkpoint;
+
+// bytes and entries recorded but not yet written out by the log writer
+void rr_get_record_backlog(uint64_t *queued_bytes, uint64_t *queued_entries);
 
 uint64_t replay_get_guest_instr_count(void);
 uint64_t replay_get_total_num_instructions(void);
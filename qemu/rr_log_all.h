@@ -51,6 +51,8 @@ extern volatile int rr_end_record_requested;
 extern volatile int rr_end_replay_requested;
 extern char *rr_requested_name;
 extern char *rr_snapshot_name;
+//mz fsync the nondet log every this many bytes during record (0 = never)
+extern uint64_t rr_record_fsync_bytes;
 
 // used from monitor.c 
 int  rr_do_begin_record(const char *name, void *cpu_state);
@@ -68,6 +70,8 @@ uint64_t replay_get_total_num_instructions(void);
 
 void rr_quit_cpu_loop(void);
 void rr_set_program_point(void);
+//mz make chained TBs drop back to cpu_exec at the next TB boundary
+void rr_chain_break(void);
 
 //mz 10.20.2009 
 //mz A record of a point in the program.  This is a subset of guest CPU state
@@ -94,6 +98,25 @@ extern volatile sig_atomic_t rr_record_in_progress;
 
 extern volatile sig_atomic_t rr_use_live_exit_request;
 
+//mz replay checkpoints.  every rr_checkpoint_interval instructions, replay
+//mz stops at the next TB boundary and the main loop saves a snapshot plus
+//mz where we are in the nondet log (rr_do_checkpoint).  with rr_replay_from
+//mz set, replay starts at the last checkpoint at or before that instruction.
+extern uint64_t rr_checkpoint_interval;
+extern uint64_t rr_replay_from;
+//mz end replay (and quit) once this many instructions have run (0 = run to the end)
+extern uint64_t rr_replay_until;
+extern volatile uint64_t rr_next_checkpoint;
+extern volatile sig_atomic_t rr_checkpoint_requested;
+void rr_do_checkpoint(void);
+
+//mz keep TBs chained during replay when no plugin needs to see every block.
+//mz each chained TB takes its length out of env->rr_chain_budget and drops
+//mz back to cpu_exec once that runs out, i.e. at the next interrupt,
+//mz main-loop skipped call, checkpoint or -replay-until.  on by default;
+//mz -replay-no-chaining turns it off.
+extern int rr_replay_chaining;
+
 static inline void rr_set_prog_point(uint64_t pc, uint64_t secondary, uint64_t guest_instr_count) {
   rr_num_instr_before_next_interrupt -= (guest_instr_count - rr_prog_point.guest_instr_count);
   rr_prog_point.guest_instr_count = guest_instr_count;
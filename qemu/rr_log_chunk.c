@@ -0,0 +1,365 @@
+/* PANDABEGINCOMMENT
+ *
+ * Authors:
+ *  Tim Leek               tleek@ll.mit.edu
+ *  Ryan Whelan            rwhelan@ll.mit.edu
+ *  Joshua Hodosh          josh.hodosh@ll.mit.edu
+ *  Michael Zhivich        mzhivich@ll.mit.edu
+ *  Brendan Dolan-Gavitt   brendandg@gatech.edu
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ *
+PANDAENDCOMMENT */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include <glib.h>
+#include <zlib.h>
+
+#include "rr_log_chunk.h"
+
+static void rr_chunk_reserve(RR_chunk_stream *s, uint32_t len) {
+    uint32_t capacity;
+    if (len <= s->buf_capacity) {
+        return;
+    }
+    capacity = s->buf_capacity ? s->buf_capacity : RR_CHUNK_MAX_BYTES;
+    while (capacity < len) {
+        capacity *= 2;
+    }
+    s->buf = g_realloc(s->buf, capacity);
+    s->buf_capacity = capacity;
+}
+
+static void rr_chunk_reserve_z(RR_chunk_stream *s, unsigned long len) {
+    if (len > s->zbuf_capacity) {
+        s->zbuf = g_realloc(s->zbuf, len);
+        s->zbuf_capacity = len;
+    }
+}
+
+static void rr_chunk_index_add(RR_chunk_stream *s, uint64_t first_instr, uint64_t offset) {
+    if (s->num_chunks == s->index_capacity) {
+        s->index_capacity = s->index_capacity ? 2 * s->index_capacity : 1024;
+        s->index = g_renew(RR_chunk_index_entry, s->index, s->index_capacity);
+    }
+    s->index[s->num_chunks].first_instr = first_instr;
+    s->index[s->num_chunks].offset = offset;
+    s->num_chunks++;
+}
+
+/******************************************************************************************/
+/* RECORD */
+/******************************************************************************************/
+
+// a short write means the recording is lost, so don't go on without it
+static void rr_chunk_fwrite(const void *ptr, size_t size, size_t nmemb, FILE *fp) {
+    if (fwrite(ptr, size, nmemb, fp) != nmemb) {
+        perror("rr: write to nondet log failed");
+        exit(1);
+    }
+}
+
+void rr_chunk_open_write(RR_chunk_stream *s, FILE *fp) {
+    RR_log_file_header hdr;
+
+    memset(s, 0, sizeof(*s));
+    s->fp = fp;
+    rr_chunk_reserve(s, RR_CHUNK_MAX_BYTES);
+
+    memcpy(hdr.magic, RR_LOG_MAGIC, RR_LOG_MAGIC_LEN);
+    hdr.version = RR_LOG_VERSION;
+    hdr.entries_per_chunk = RR_CHUNK_MAX_ENTRIES;
+    rr_chunk_fwrite(&hdr, sizeof(hdr), 1, fp);
+}
+
+void rr_chunk_emit(RR_chunk_stream *s, const uint8_t *buf, uint32_t len,
+                   uint32_t num_entries, uint64_t first_instr) {
+    RR_chunk_header hdr;
+    uLongf zlen;
+
+    zlen = compressBound(len);
+    rr_chunk_reserve_z(s, zlen);
+    // fastest level -- the log is mostly small fixed-size headers and
+    // DMA buffers, and we may be on the CPU thread here.
+    if (compress2(s->zbuf, &zlen, buf, len, Z_BEST_SPEED) != Z_OK) {
+        fprintf(stderr, "rr: compressing nondet log chunk failed\n");
+        exit(1);
+    }
+
+    hdr.first_instr = first_instr;
+    hdr.num_entries = num_entries;
+    hdr.size = len;
+    hdr.compressed_size = zlen;
+
+    rr_chunk_index_add(s, first_instr, ftello(s->fp));
+    rr_chunk_fwrite(&hdr, sizeof(hdr), 1, s->fp);
+    rr_chunk_fwrite(s->zbuf, 1, zlen, s->fp);
+
+    s->bytes_out += sizeof(hdr) + zlen;
+}
+
+void rr_chunk_flush(RR_chunk_stream *s) {
+    if (s->chunk_entries == 0) {
+        return;
+    }
+    s->bytes_in += s->len;
+    if (s->handoff) {
+        s->buf = s->handoff(s->handoff_opaque, s->buf, s->len, s->chunk_entries,
+                            s->chunk_first_instr, &s->buf_capacity);
+    }
+    else {
+        rr_chunk_emit(s, s->buf, s->len, s->chunk_entries, s->chunk_first_instr);
+    }
+    s->len = 0;
+    s->chunk_entries = 0;
+}
+
+void rr_chunk_begin_entry(RR_chunk_stream *s, uint64_t guest_instr_count) {
+    if (s->chunk_entries == 0) {
+        s->chunk_first_instr = guest_instr_count;
+    }
+}
+
+size_t rr_chunk_write(RR_chunk_stream *s, const void *ptr, size_t size, size_t nmemb) {
+    size_t len = size * nmemb;
+    rr_chunk_reserve(s, s->len + len);
+    memcpy(s->buf + s->len, ptr, len);
+    s->len += len;
+    return nmemb;
+}
+
+void rr_chunk_end_entry(RR_chunk_stream *s) {
+    s->chunk_entries++;
+    if (s->chunk_entries >= RR_CHUNK_MAX_ENTRIES || s->len >= RR_CHUNK_MAX_BYTES) {
+        rr_chunk_flush(s);
+    }
+}
+
+void rr_chunk_close_write(RR_chunk_stream *s) {
+    RR_log_trailer trailer;
+
+    rr_chunk_flush(s);
+    trailer.index_offset = ftello(s->fp);
+    trailer.num_chunks = s->num_chunks;
+    memcpy(trailer.magic, RR_LOG_MAGIC, RR_LOG_MAGIC_LEN);
+    rr_chunk_fwrite(s->index, sizeof(RR_chunk_index_entry), s->num_chunks, s->fp);
+    rr_chunk_fwrite(&trailer, sizeof(trailer), 1, s->fp);
+}
+
+/******************************************************************************************/
+/* REPLAY */
+/******************************************************************************************/
+
+// pick up the index from the end of the file, if it's there.
+static void rr_chunk_read_index(RR_chunk_stream *s, uint64_t file_size) {
+    RR_log_trailer trailer;
+    uint64_t index_bytes;
+
+    if (file_size < s->next_chunk_offset + sizeof(trailer)) {
+        return;
+    }
+    fseeko(s->fp, file_size - sizeof(trailer), SEEK_SET);
+    if (fread(&trailer, sizeof(trailer), 1, s->fp) != 1 ||
+        memcmp(trailer.magic, RR_LOG_MAGIC, RR_LOG_MAGIC_LEN) != 0) {
+        return;
+    }
+    index_bytes = trailer.num_chunks * sizeof(RR_chunk_index_entry);
+    if (trailer.index_offset + index_bytes + sizeof(trailer) != file_size) {
+        return;
+    }
+    s->index = g_new(RR_chunk_index_entry, trailer.num_chunks ? trailer.num_chunks : 1);
+    fseeko(s->fp, trailer.index_offset, SEEK_SET);
+    if (fread(s->index, sizeof(RR_chunk_index_entry), trailer.num_chunks, s->fp) != trailer.num_chunks) {
+        g_free(s->index);
+        s->index = NULL;
+        return;
+    }
+    s->num_chunks = s->index_capacity = trailer.num_chunks;
+    s->data_end = trailer.index_offset;
+}
+
+int rr_chunk_open_read(RR_chunk_stream *s, FILE *fp, uint64_t file_size) {
+    RR_log_file_header hdr;
+    off_t start = ftello(fp);
+
+    memset(s, 0, sizeof(*s));
+    s->fp = fp;
+    s->data_end = file_size;
+
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+        memcmp(hdr.magic, RR_LOG_MAGIC, RR_LOG_MAGIC_LEN) != 0) {
+        // old flat log.  entries start right after the prog point.
+        s->legacy = 1;
+        fseeko(fp, start, SEEK_SET);
+        return 0;
+    }
+    if (hdr.version != RR_LOG_VERSION) {
+        fprintf(stderr, "nondet log version %u, expected %u\n", hdr.version, RR_LOG_VERSION);
+        return -1;
+    }
+    s->next_chunk_offset = ftello(fp);
+    rr_chunk_read_index(s, file_size);
+    fseeko(fp, s->next_chunk_offset, SEEK_SET);
+    return 0;
+}
+
+// read and decompress the chunk at offset into buf
+static int rr_chunk_load(RR_chunk_stream *s, uint64_t offset) {
+    RR_chunk_header hdr;
+    uLongf len;
+
+    if (offset + sizeof(hdr) > s->data_end) {
+        return -1;
+    }
+    if ((uint64_t) ftello(s->fp) != offset) {
+        fseeko(s->fp, offset, SEEK_SET);
+    }
+    if (fread(&hdr, sizeof(hdr), 1, s->fp) != 1) {
+        return -1;
+    }
+    rr_chunk_reserve(s, hdr.size);
+    rr_chunk_reserve_z(s, hdr.compressed_size);
+    if (fread(s->zbuf, 1, hdr.compressed_size, s->fp) != hdr.compressed_size) {
+        return -1;
+    }
+    len = hdr.size;
+    if (uncompress(s->buf, &len, s->zbuf, hdr.compressed_size) != Z_OK || len != hdr.size) {
+        return -1;
+    }
+    s->chunk_offset = offset;
+    s->next_chunk_offset = offset + sizeof(hdr) + hdr.compressed_size;
+    s->chunk_first_instr = hdr.first_instr;
+    s->chunk_entries = hdr.num_entries;
+    s->len = hdr.size;
+    s->pos = 0;
+    s->bytes_in += sizeof(hdr) + hdr.compressed_size;
+    s->bytes_out += hdr.size;
+    return 0;
+}
+
+size_t rr_chunk_read(RR_chunk_stream *s, void *ptr, size_t size, size_t nmemb) {
+    size_t want = size * nmemb;
+    size_t got = 0;
+
+    if (s->legacy) {
+        return fread(ptr, size, nmemb, s->fp);
+    }
+    if (want == 0) {
+        return 0;
+    }
+    while (got < want) {
+        size_t n;
+        if (s->pos == s->len) {
+            if (rr_chunk_load(s, s->next_chunk_offset) != 0) {
+                break;
+            }
+            continue;
+        }
+        n = MIN(want - got, s->len - s->pos);
+        memcpy((uint8_t *) ptr + got, s->buf + s->pos, n);
+        s->pos += n;
+        got += n;
+    }
+    return got / size;
+}
+
+int rr_chunk_skip(RR_chunk_stream *s, size_t len) {
+    if (s->legacy) {
+        return fseeko(s->fp, len, SEEK_CUR);
+    }
+    while (len > 0) {
+        size_t n;
+        if (s->pos == s->len) {
+            if (rr_chunk_load(s, s->next_chunk_offset) != 0) {
+                return -1;
+            }
+            continue;
+        }
+        n = MIN(len, s->len - s->pos);
+        s->pos += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int rr_chunk_is_empty(RR_chunk_stream *s) {
+    if (s->legacy) {
+        return (uint64_t) ftello(s->fp) >= s->data_end;
+    }
+    return s->pos == s->len && s->next_chunk_offset >= s->data_end;
+}
+
+RR_log_position rr_chunk_tell(RR_chunk_stream *s) {
+    RR_log_position pos = {0, 0};
+    if (s->legacy) {
+        pos.chunk_offset = ftello(s->fp);
+    }
+    else if (s->pos == s->len) {
+        // next read will load the next chunk
+        pos.chunk_offset = s->next_chunk_offset;
+    }
+    else {
+        pos.chunk_offset = s->chunk_offset;
+        pos.byte_offset = s->pos;
+    }
+    return pos;
+}
+
+int rr_chunk_seek(RR_chunk_stream *s, RR_log_position pos) {
+    if (s->legacy) {
+        return fseeko(s->fp, pos.chunk_offset, SEEK_SET);
+    }
+    if (pos.byte_offset == 0) {
+        // load lazily on the next read
+        s->len = s->pos = 0;
+        s->next_chunk_offset = pos.chunk_offset;
+        return 0;
+    }
+    if (s->len == 0 || pos.chunk_offset != s->chunk_offset) {
+        if (rr_chunk_load(s, pos.chunk_offset) != 0) {
+            return -1;
+        }
+    }
+    if (pos.byte_offset > s->len) {
+        return -1;
+    }
+    s->pos = pos.byte_offset;
+    return 0;
+}
+
+int rr_chunk_find(RR_chunk_stream *s, uint64_t guest_instr_count, RR_log_position *pos) {
+    uint64_t lo = 0, hi;
+
+    if (s->legacy || s->index == NULL || s->num_chunks == 0) {
+        return -1;
+    }
+    // last chunk whose first entry is strictly before guest_instr_count
+    hi = s->num_chunks;
+    while (hi - lo > 1) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (s->index[mid].first_instr < guest_instr_count) {
+            lo = mid;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    pos->chunk_offset = s->index[lo].offset;
+    pos->byte_offset = 0;
+    return 0;
+}
+
+void rr_chunk_destroy(RR_chunk_stream *s) {
+    g_free(s->buf);
+    g_free(s->zbuf);
+    g_free(s->index);
+    s->buf = s->zbuf = NULL;
+    s->index = NULL;
+    s->buf_capacity = s->zbuf_capacity = 0;
+    s->num_chunks = s->index_capacity = 0;
+}
@@ -0,0 +1,151 @@
+/* PANDABEGINCOMMENT
+ *
+ * Authors:
+ *  Tim Leek               tleek@ll.mit.edu
+ *  Ryan Whelan            rwhelan@ll.mit.edu
+ *  Joshua Hodosh          josh.hodosh@ll.mit.edu
+ *  Michael Zhivich        mzhivich@ll.mit.edu
+ *  Brendan Dolan-Gavitt   brendandg@gatech.edu
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ *
+PANDAENDCOMMENT */
+
+#ifndef __RR_LOG_CHUNK_H_
+#define __RR_LOG_CHUNK_H_
+
+/* Chunked, compressed on-disk format for the nondet log.
+
+   Layout of a -rr-nondet.log file (all integers host-endian, as before):
+
+     RR_prog_point         last prog point (same as the old format, so
+                           rrpack.py & co. still find the instr count)
+     RR_log_file_header    magic "PANDARRZ", version, entries per chunk
+     chunk 0               RR_chunk_header + zlib-compressed entries
+     chunk 1 ...
+     index                 RR_chunk_index_entry for each chunk
+     RR_log_trailer        index offset, number of chunks, magic
+
+   Entries inside a chunk are serialized exactly as the old format wrote
+   them to the file, and never span two chunks.  A log without the magic
+   after the first prog point is an old-style flat log and is read
+   straight from the FILE.  A chunked log with no trailer (qemu died
+   during record) is still readable front-to-back, just not seekable.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define RR_LOG_MAGIC "PANDARRZ"
+#define RR_LOG_MAGIC_LEN 8
+#define RR_LOG_VERSION 2
+
+// a chunk is cut when either of these is reached
+#define RR_CHUNK_MAX_ENTRIES 4096
+#define RR_CHUNK_MAX_BYTES (1 << 20)
+
+typedef struct {
+    char magic[RR_LOG_MAGIC_LEN];
+    uint32_t version;
+    uint32_t entries_per_chunk;
+} RR_log_file_header;
+
+typedef struct {
+    uint64_t first_instr;      // guest_instr_count of first entry in chunk
+    uint32_t num_entries;
+    uint32_t size;             // uncompressed size
+    uint32_t compressed_size;
+} __attribute__((packed)) RR_chunk_header;
+
+typedef struct {
+    uint64_t first_instr;
+    uint64_t offset;           // file offset of the RR_chunk_header
+} RR_chunk_index_entry;
+
+typedef struct {
+    uint64_t index_offset;
+    uint64_t num_chunks;
+    char magic[RR_LOG_MAGIC_LEN];
+} RR_log_trailer;
+
+// Where an entry lives in the log.  For old flat logs chunk_offset is just
+// the file offset of the entry and byte_offset is always 0.
+typedef struct {
+    uint64_t chunk_offset;
+    uint32_t byte_offset;
+} RR_log_position;
+
+// Record side can hand full chunks off to another thread instead of
+// compressing and writing them on the caller's.  Gets the chunk's buffer and
+// returns an empty one (its size in *capacity) to keep filling; whoever has
+// the full buffer calls rr_chunk_emit() on it.
+typedef uint8_t *(*RR_chunk_handoff)(void *opaque, uint8_t *buf, uint32_t len,
+                                     uint32_t num_entries, uint64_t first_instr,
+                                     uint32_t *capacity);
+
+typedef struct {
+    FILE *fp;
+    uint8_t legacy;            // old flat format, read through fp directly
+
+    // current (de)compressed chunk
+    uint8_t *buf;
+    uint32_t buf_capacity;
+    uint32_t len;              // bytes valid in buf
+    uint32_t pos;              // read cursor in buf
+    uint32_t chunk_entries;
+    uint64_t chunk_first_instr;
+    uint64_t chunk_offset;     // file offset of chunk in buf
+    uint64_t next_chunk_offset;
+    uint64_t data_end;         // where chunks stop (index offset or file size)
+
+    uint8_t *zbuf;
+    unsigned long zbuf_capacity;
+
+    RR_chunk_index_entry *index;
+    uint64_t num_chunks;
+    uint64_t index_capacity;
+
+    // record side, optional
+    RR_chunk_handoff handoff;
+    void *handoff_opaque;
+
+    // stats.  on record, bytes_in belongs to the writing thread and
+    // bytes_out to whoever calls rr_chunk_emit().
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+} RR_chunk_stream;
+
+// record side.  fp must be positioned just past the header prog point.
+void rr_chunk_open_write(RR_chunk_stream *s, FILE *fp);
+void rr_chunk_begin_entry(RR_chunk_stream *s, uint64_t guest_instr_count);
+// fwrite()-style: returns nmemb
+size_t rr_chunk_write(RR_chunk_stream *s, const void *ptr, size_t size, size_t nmemb);
+void rr_chunk_end_entry(RR_chunk_stream *s);
+// cut the current chunk now, even if it isn't full
+void rr_chunk_flush(RR_chunk_stream *s);
+// compress a chunk and append it to the file.  called by rr_chunk_flush()
+// unless s->handoff is set.
+void rr_chunk_emit(RR_chunk_stream *s, const uint8_t *buf, uint32_t len,
+                   uint32_t num_entries, uint64_t first_instr);
+// flushes the last chunk and writes index + trailer.  does not close fp.
+// with a handoff, flush first and wait for the other side to finish emitting.
+void rr_chunk_close_write(RR_chunk_stream *s);
+
+// replay side.  fp must be positioned just past the header prog point.
+// returns 0 on success, -1 if the log is corrupt.
+int rr_chunk_open_read(RR_chunk_stream *s, FILE *fp, uint64_t file_size);
+// fread()-style: returns number of complete items read
+size_t rr_chunk_read(RR_chunk_stream *s, void *ptr, size_t size, size_t nmemb);
+int rr_chunk_skip(RR_chunk_stream *s, size_t len);
+int rr_chunk_is_empty(RR_chunk_stream *s);
+RR_log_position rr_chunk_tell(RR_chunk_stream *s);
+int rr_chunk_seek(RR_chunk_stream *s, RR_log_position pos);
+// position of the last chunk that starts strictly before instr, so every
+// entry at or after instr is still ahead of it.  returns -1 if the log has
+// no index (old format or truncated).
+int rr_chunk_find(RR_chunk_stream *s, uint64_t guest_instr_count, RR_log_position *pos);
+
+void rr_chunk_destroy(RR_chunk_stream *s);
+
+#endif
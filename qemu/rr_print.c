@@ -29,7 +29,7 @@ RR_log *rr_nondet_log = NULL;
 
 static inline uint8_t log_is_empty(void) {
     if ((rr_nondet_log->type == REPLAY) &&
-        (rr_nondet_log->size - ftell(rr_nondet_log->fp) == 0)) {
+        rr_chunk_is_empty(&rr_nondet_log->stream)) {
         return 1;
     }
     else {
@@ -165,9 +165,9 @@ static RR_log_entry *rr_read_item(void) {
     assert (rr_nondet_log->fp != NULL);
 
     //mz XXX we assume that the log is not trucated - should probably fix this.
-    if (fread(&(item->header.prog_point), sizeof(RR_prog_point), 1, rr_nondet_log->fp) != 1) {
+    if (rr_chunk_read(&rr_nondet_log->stream, &(item->header.prog_point), sizeof(RR_prog_point), 1) != 1) {
         //mz an error occurred
-        if (feof(rr_nondet_log->fp)) {
+        if (rr_chunk_is_empty(&rr_nondet_log->stream)) {
             // replay is done - we've reached the end of file
             //mz we should never get here!
             assert(0);
@@ -179,70 +179,69 @@ static RR_log_entry *rr_read_item(void) {
         }
     }
     //mz this is more compact, as it doesn't include extra padding.
-    assert(fread(&(item->header.kind), sizeof(item->header.kind), 1, rr_nondet_log->fp) == 1);
-    assert(fread(&(item->header.callsite_loc), sizeof(item->header.callsite_loc), 1, rr_nondet_log->fp) == 1);
+    assert(rr_chunk_read(&rr_nondet_log->stream, &(item->header.kind), sizeof(item->header.kind), 1) == 1);
+    assert(rr_chunk_read(&rr_nondet_log->stream, &(item->header.callsite_loc), sizeof(item->header.callsite_loc), 1) == 1);
 
     //mz read the rest of the item
     switch (item->header.kind) {
         case RR_INPUT_1:
-            assert(fread(&(item->variant.input_1), sizeof(item->variant.input_1), 1, rr_nondet_log->fp) == 1);
+            assert(rr_chunk_read(&rr_nondet_log->stream, &(item->variant.input_1), sizeof(item->variant.input_1), 1) == 1);
             break;
         case RR_INPUT_2:
-            assert(fread(&(item->variant.input_2), sizeof(item->variant.input_2), 1, rr_nondet_log->fp) == 1);
+            assert(rr_chunk_read(&rr_nondet_log->stream, &(item->variant.input_2), sizeof(item->variant.input_2), 1) == 1);
             break;
         case RR_INPUT_4:
-            assert(fread(&(item->variant.input_4), sizeof(item->variant.input_4), 1, rr_nondet_log->fp) == 1);
+            assert(rr_chunk_read(&rr_nondet_log->stream, &(item->variant.input_4), sizeof(item->variant.input_4), 1) == 1);
             break;
         case RR_INPUT_8:
-            assert(fread(&(item->variant.input_8), sizeof(item->variant.input_8), 1, rr_nondet_log->fp) == 1);
+            assert(rr_chunk_read(&rr_nondet_log->stream, &(item->variant.input_8), sizeof(item->variant.input_8), 1) == 1);
             break;
         case RR_INTERRUPT_REQUEST:
-            assert(fread(&(item->variant.interrupt_request), sizeof(item->variant.interrupt_request), 1, rr_nondet_log->fp) == 1);
+            assert(rr_chunk_read(&rr_nondet_log->stream, &(item->variant.interrupt_request), sizeof(item->variant.interrupt_request), 1) == 1);
             break;
         case RR_EXIT_REQUEST:
-            assert(fread(&(item->variant.exit_request), sizeof(item->variant.exit_request), 1, rr_nondet_log->fp) == 1);
+            assert(rr_chunk_read(&rr_nondet_log->stream, &(item->variant.exit_request), sizeof(item->variant.exit_request), 1) == 1);
             break;
         case RR_SKIPPED_CALL:
             {
                 RR_skipped_call_args *args = &item->variant.call_args;
                 //mz read kind first!
-                assert(fread(&(args->kind), sizeof(args->kind), 1, rr_nondet_log->fp) == 1);
+                assert(rr_chunk_read(&rr_nondet_log->stream, &(args->kind), sizeof(args->kind), 1) == 1);
                 switch(args->kind) {
                     case RR_CALL_CPU_MEM_RW:
-                        assert(fread(&(args->variant.cpu_mem_rw_args), sizeof(args->variant.cpu_mem_rw_args), 1, rr_nondet_log->fp) == 1);
+                        assert(rr_chunk_read(&rr_nondet_log->stream, &(args->variant.cpu_mem_rw_args), sizeof(args->variant.cpu_mem_rw_args), 1) == 1);
                         //mz buffer length in args->variant.cpu_mem_rw_args.len
                         //mz always allocate a new one. we free it when the item is added to the recycle list
                         //args->variant.cpu_mem_rw_args.buf = g_malloc(args->variant.cpu_mem_rw_args.len);
                         //mz read the buffer
-                        //assert(fread(args->variant.cpu_mem_rw_args.buf, 1, args->variant.cpu_mem_rw_args.len, rr_nondet_log->fp) > 0);
-                        fseek(rr_nondet_log->fp, args->variant.cpu_mem_rw_args.len, SEEK_CUR);
+                        //assert(rr_chunk_read(&rr_nondet_log->stream, args->variant.cpu_mem_rw_args.buf, 1, args->variant.cpu_mem_rw_args.len) > 0);
+                        rr_chunk_skip(&rr_nondet_log->stream, args->variant.cpu_mem_rw_args.len);
                         break;
                     case RR_CALL_CPU_MEM_UNMAP:
-                        assert(fread(&(args->variant.cpu_mem_unmap), sizeof(args->variant.cpu_mem_unmap), 1, rr_nondet_log->fp) == 1);
+                        assert(rr_chunk_read(&rr_nondet_log->stream, &(args->variant.cpu_mem_unmap), sizeof(args->variant.cpu_mem_unmap), 1) == 1);
                         //mz buffer length in args->variant.cpu_mem_unmap.len
                         //mz always allocate a new one. we free it when the item is added to the recycle list
                         //args->variant.cpu_mem_unmap.buf = g_malloc(args->variant.cpu_mem_unmap.len);
                         //mz read the buffer
-                        //assert(fread(args->variant.cpu_mem_unmap.buf, 1, args->variant.cpu_mem_unmap.len, rr_nondet_log->fp) > 0);
-                        fseek(rr_nondet_log->fp, args->variant.cpu_mem_unmap.len, SEEK_CUR);
+                        //assert(rr_chunk_read(&rr_nondet_log->stream, args->variant.cpu_mem_unmap.buf, 1, args->variant.cpu_mem_unmap.len) > 0);
+                        rr_chunk_skip(&rr_nondet_log->stream, args->variant.cpu_mem_unmap.len);
                         break;
                     case RR_CALL_CPU_REG_MEM_REGION:
-                        assert(fread(&(args->variant.cpu_mem_reg_region_args), 
-                              sizeof(args->variant.cpu_mem_reg_region_args), 1, rr_nondet_log->fp) == 1);
+                        assert(rr_chunk_read(&rr_nondet_log->stream, &(args->variant.cpu_mem_reg_region_args), 
+                              sizeof(args->variant.cpu_mem_reg_region_args), 1) == 1);
                         break;
                     case RR_CALL_HD_TRANSFER:
-                        assert(fread(&(args->variant.hd_transfer_args),
-                              sizeof(args->variant.hd_transfer_args), 1, rr_nondet_log->fp) == 1);
+                        assert(rr_chunk_read(&rr_nondet_log->stream, &(args->variant.hd_transfer_args),
+                              sizeof(args->variant.hd_transfer_args), 1) == 1);
                         break;
                     case RR_CALL_HANDLE_PACKET:
-                        assert(fread(&(args->variant.handle_packet_args),
-                              sizeof(args->variant.handle_packet_args), 1, rr_nondet_log->fp) == 1);
-                        fseek(rr_nondet_log->fp,
-                            args->variant.handle_packet_args.size, SEEK_CUR);
+                        assert(rr_chunk_read(&rr_nondet_log->stream, &(args->variant.handle_packet_args),
+                              sizeof(args->variant.handle_packet_args), 1) == 1);
+                        rr_chunk_skip(&rr_nondet_log->stream, args->variant.handle_packet_args.size);
                         break;
                     case RR_CALL_NET_TRANSFER:
-                        assert(fread(&(args->variant.net_transfer_args),
-                              sizeof(args->variant.net_transfer_args), 1, rr_nondet_log->fp) == 1);
+                        assert(rr_chunk_read(&rr_nondet_log->stream, &(args->variant.net_transfer_args),
+                              sizeof(args->variant.net_transfer_args), 1) == 1);
                         break;
                     default:
                         //mz unimplemented
@@ -285,6 +284,12 @@ void rr_create_replay_log (const char *filename) {
   }
   //mz read the last program point from the log header.
   assert(fread(&(rr_nondet_log->last_prog_point), sizeof(RR_prog_point), 1, rr_nondet_log->fp) == 1);
+  assert(rr_chunk_open_read(&rr_nondet_log->stream, rr_nondet_log->fp, rr_nondet_log->size) == 0);
+  if (rr_debug_whisper()) {
+    fprintf (stdout, "%s log, %llu chunks indexed.\n",
+             rr_nondet_log->stream.legacy ? "flat" : "chunked",
+             (unsigned long long) rr_nondet_log->stream.num_chunks);
+  }
 }
 
 int main(int argc, char **argv) {
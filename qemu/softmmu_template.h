@@ -138,7 +138,7 @@ DATA_TYPE REGPARM glue(glue(__ld, SUFFIX), MMUSUFFIX)(target_ulong addr,
  redo:
     tlb_addr = env->tlb_table[mmu_idx][index].ADDR_READ;
     if ((addr & TARGET_PAGE_MASK) == (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
-        if (tlb_addr & ~TARGET_PAGE_MASK) {
+        if (tlb_addr & ~(TARGET_PAGE_MASK | TLB_PANDA_WATCH)) {
             /* IO access */
             if ((addr & (DATA_SIZE - 1)) != 0)
                 goto do_unaligned_access;
@@ -178,16 +178,18 @@ DATA_TYPE REGPARM glue(glue(__ld, SUFFIX), MMUSUFFIX)(target_ulong addr,
 
 #ifdef MMU_INSTR
     // PANDA instrumentation: memory read
-    panda_cb_list *plist;
-    for(plist = panda_cbs[PANDA_CB_VIRT_MEM_READ]; plist != NULL;
-            plist = panda_cb_list_next(plist)) {
-        plist->entry.virt_mem_read(env, env->panda_guest_pc, addr,
-            DATA_SIZE, &res);
-    }
-    for(plist = panda_cbs[PANDA_CB_PHYS_MEM_READ]; plist != NULL;
-            plist = panda_cb_list_next(plist)) {
-        plist->entry.phys_mem_read(env, env->panda_guest_pc,
-            cpu_get_phys_addr(env, addr), DATA_SIZE, &res);
+    if (panda_use_memcb || panda_memcb_watched(env, addr, DATA_SIZE)) {
+        panda_cb_list *plist;
+        for(plist = panda_cbs[PANDA_CB_VIRT_MEM_READ]; plist != NULL;
+                plist = panda_cb_list_next(plist)) {
+            plist->entry.virt_mem_read(env, env->panda_guest_pc, addr,
+                DATA_SIZE, &res);
+        }
+        for(plist = panda_cbs[PANDA_CB_PHYS_MEM_READ]; plist != NULL;
+                plist = panda_cb_list_next(plist)) {
+            plist->entry.phys_mem_read(env, env->panda_guest_pc,
+                cpu_get_phys_addr(env, addr), DATA_SIZE, &res);
+        }
     }
 #endif
 
@@ -209,7 +211,7 @@ static DATA_TYPE glue(glue(slow_ld, SUFFIX), MMUSUFFIX)(target_ulong addr,
  redo:
     tlb_addr = env->tlb_table[mmu_idx][index].ADDR_READ;
     if ((addr & TARGET_PAGE_MASK) == (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
-        if (tlb_addr & ~TARGET_PAGE_MASK) {
+        if (tlb_addr & ~(TARGET_PAGE_MASK | TLB_PANDA_WATCH)) {
             /* IO access */
             if ((addr & (DATA_SIZE - 1)) != 0)
                 goto do_unaligned_access;
@@ -330,23 +332,25 @@ void REGPARM glue(glue(__st, SUFFIX), MMUSUFFIX)(target_ulong addr,
 
 #ifdef MMU_INSTR
     // PANDA instrumentation: memory write
-    panda_cb_list *plist;
-    for(plist = panda_cbs[PANDA_CB_VIRT_MEM_WRITE]; plist != NULL;
-            plist = panda_cb_list_next(plist)) {
-        plist->entry.virt_mem_write(env, env->panda_guest_pc, addr,
-            DATA_SIZE, &val);
-    }
-    for(plist = panda_cbs[PANDA_CB_PHYS_MEM_WRITE]; plist != NULL;
-            plist = panda_cb_list_next(plist)) {
-        plist->entry.phys_mem_write(env, env->panda_guest_pc,
-            cpu_get_phys_addr(env, addr), DATA_SIZE, &val);
+    if (panda_use_memcb || panda_memcb_watched(env, addr, DATA_SIZE)) {
+        panda_cb_list *plist;
+        for(plist = panda_cbs[PANDA_CB_VIRT_MEM_WRITE]; plist != NULL;
+                plist = panda_cb_list_next(plist)) {
+            plist->entry.virt_mem_write(env, env->panda_guest_pc, addr,
+                DATA_SIZE, &val);
+        }
+        for(plist = panda_cbs[PANDA_CB_PHYS_MEM_WRITE]; plist != NULL;
+                plist = panda_cb_list_next(plist)) {
+            plist->entry.phys_mem_write(env, env->panda_guest_pc,
+                cpu_get_phys_addr(env, addr), DATA_SIZE, &val);
+        }
     }
 #endif
 
  redo:
     tlb_addr = env->tlb_table[mmu_idx][index].addr_write;
     if ((addr & TARGET_PAGE_MASK) == (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
-        if (tlb_addr & ~TARGET_PAGE_MASK) {
+        if (tlb_addr & ~(TARGET_PAGE_MASK | TLB_PANDA_WATCH)) {
             //mz 10.20.2009  There's something in the lower 12 bits (and
             //TLB_INVALID_MASK is not it) - therefore, it must be IO
             /* IO access */
@@ -411,7 +415,7 @@ static void glue(glue(slow_st, SUFFIX), MMUSUFFIX)(target_ulong addr,
  redo:
     tlb_addr = env->tlb_table[mmu_idx][index].addr_write;
     if ((addr & TARGET_PAGE_MASK) == (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
-        if (tlb_addr & ~TARGET_PAGE_MASK) {
+        if (tlb_addr & ~(TARGET_PAGE_MASK | TLB_PANDA_WATCH)) {
             /* IO access */
             if ((addr & (DATA_SIZE - 1)) != 0)
                 goto do_unaligned_access;
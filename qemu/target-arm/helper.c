@@ -1510,6 +1510,7 @@ void HELPER(set_cp15)(CPUState *env, uint32_t insn, uint32_t val)
                     plist->entry.after_PGD_write(env, oldval, val);
 		}
 		env->cp15.c2_base0 = val;
+                panda_memcb_asid_changed(env);
 		break;
 	    case 1:
                 oldval = env->cp15.c2_base1;
@@ -1517,6 +1518,7 @@ void HELPER(set_cp15)(CPUState *env, uint32_t insn, uint32_t val)
                     plist->entry.after_PGD_write(env, oldval, val);
 		}
 		env->cp15.c2_base1 = val;
+                panda_memcb_asid_changed(env);
 		break;
 	    case 2:
                 val &= 7;
@@ -10033,7 +10033,7 @@ static inline void gen_intermediate_code_internal(CPUState *env,
 #ifdef CONFIG_SOFTMMU
             rr_mode != RR_OFF ||
 #endif
-            panda_update_pc) {
+            (panda_update_pc && panda_tb_in_scope)) {
             gen_op_update_panda_pc(dc->pc);
         }
 
@@ -10055,7 +10055,8 @@ static inline void gen_intermediate_code_internal(CPUState *env,
         // PANDA: ask if anyone wants execution notification
         bool panda_exec_cb = false;
         panda_cb_list *plist;
-        for(plist = panda_cbs[PANDA_CB_INSN_TRANSLATE]; plist != NULL; plist = panda_cb_list_next(plist)) {
+        for(plist = panda_tb_in_scope ? panda_cbs[PANDA_CB_INSN_TRANSLATE] : NULL;
+                plist != NULL; plist = panda_cb_list_next(plist)) {
             panda_exec_cb |= plist->entry.insn_translate(env, dc->pc);
         }
 
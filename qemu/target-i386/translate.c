@@ -7977,7 +7977,7 @@ static void gen_intermediate_code_internal(CPUState *env,
 #ifdef CONFIG_SOFTMMU
                 rr_mode != RR_OFF ||
 #endif
-                panda_update_pc) {
+                (panda_update_pc && panda_tb_in_scope)) {
                 gen_op_update_panda_pc(pc_ptr);
             }
 #ifdef CONFIG_SOFTMMU
@@ -7989,7 +7989,8 @@ static void gen_intermediate_code_internal(CPUState *env,
             // PANDA: ask if anyone wants execution notification
             bool panda_exec_cb = false;
             panda_cb_list *plist;
-            for(plist = panda_cbs[PANDA_CB_INSN_TRANSLATE]; plist != NULL; plist = panda_cb_list_next(plist)) {
+            for(plist = panda_tb_in_scope ? panda_cbs[PANDA_CB_INSN_TRANSLATE] : NULL;
+                    plist != NULL; plist = panda_cb_list_next(plist)) {
                 panda_exec_cb |= plist->entry.insn_translate(env, pc_ptr);
             }
 
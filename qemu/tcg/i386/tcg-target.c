@@ -1076,7 +1076,7 @@ static inline void tcg_out_tlb_load(TCGContext *s, int addrlo_idx,
     tcg_out_mov(s, type, r0, addrlo);
 
     /* jne label1 */
-    if (panda_use_memcb)
+    if (panda_memcb_all())
         tcg_out8(s, OPC_JMP_short);
     else
         tcg_out8(s, OPC_JCC_short + JCC_JNE);
@@ -1232,7 +1232,7 @@ static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args,
     tcg_out_movi(s, TCG_TYPE_I32, tcg_target_call_iarg_regs[arg_idx],
                  mem_index);
 
-    if (panda_use_memcb)
+    if (panda_memcb_helpers())
         tcg_out_calli(s, (tcg_target_long)qemu_ld_helpers_panda[s_bits]);
     else
         tcg_out_calli(s, (tcg_target_long)qemu_ld_helpers[s_bits]);
@@ -1442,7 +1442,7 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
         }
     }
 
-    if (panda_use_memcb)
+    if (panda_memcb_helpers())
         tcg_out_calli(s, (tcg_target_long)qemu_st_helpers_panda[s_bits]);
     else
         tcg_out_calli(s, (tcg_target_long)qemu_st_helpers[s_bits]);
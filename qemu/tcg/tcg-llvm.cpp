@@ -47,6 +47,8 @@ extern "C" {
 #include "disas.h"
 
 #include "panda_plugin.h"
+#include "qemu-thread.h"
+#include "qemu-barrier.h"
 
 #if defined(CONFIG_SOFTMMU)
 
@@ -144,9 +146,23 @@ static char *qemu_st_helper_names[5] = {
 
 #include <llvm/Support/DynamicLibrary.h>
 #include <llvm/Support/raw_ostream.h>
+#include <llvm/Support/SourceMgr.h>
+#include <llvm/IRReader/IRReader.h>
+#include <llvm/Linker.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <llvm/IR/IntrinsicInst.h>
 
 #include <iostream>
 #include <sstream>
+#include <algorithm>
+#include <set>
+#include <map>
+#include <vector>
+#include <deque>
+
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 //#undef NDEBUG
 
@@ -157,7 +173,17 @@ extern "C" {
     TCGLLVMRuntime tcg_llvm_runtime = {
         0, 0, {0,0,0}
         , 0, 0, 0
+        , 0, 0
     };
+
+    /* -llvm-cache <dir> */
+    const char *tcg_llvm_cache_dir = NULL;
+
+    /* -llvm-tiered <n> */
+    unsigned tcg_llvm_tiered_threshold = 0;
+
+    /* -llvm-trace <n> */
+    unsigned tcg_llvm_trace_threshold = 0;
 }
 
 extern CPUState *env;
@@ -165,6 +191,21 @@ extern CPUState *env;
 using namespace llvm;
 
 class TJITMemoryManager;
+class TCGLLVMBlockCache;
+
+/* A chain of blocks compiled into one function (-llvm-trace).  tbs[0] is
+ * the head, which runs the trace instead of its own function. */
+struct TCGLLVMTrace {
+    Function *function;
+    uint8_t *tc_ptr;
+    uint8_t *tc_end;
+    std::vector<TranslationBlock*> tbs;
+};
+
+/* Keep traces small enough for passes that give each LLVM value a slot of
+ * their own (taint2 has room for 5000) */
+#define TCG_LLVM_TRACE_MAX_TBS   16
+#define TCG_LLVM_TRACE_MAX_INSTS 3000
 
 struct TCGLLVMContextPrivate {
     LLVMContext& m_context;
@@ -183,6 +224,51 @@ struct TCGLLVMContextPrivate {
     /* Count of generated translation blocks */
     int m_tbCount;
 
+    /* On-disk cache of optimized functions, NULL without -llvm-cache */
+    TCGLLVMBlockCache *m_blockCache;
+
+    /* How many times someone asked for m_functionPassManager to add passes
+     * to it. Each of them has to describe its passes to the block cache. */
+    int m_fpmUsers;
+
+    /* How many of those add passes that change what the code does (taint,
+     * tracing).  With any of them, every block has to run in LLVM. */
+    int m_instrumentingUsers;
+
+    /* Tiered mode (-llvm-tiered): blocks run on TCG until they get hot and
+     * are compiled on m_compileThread.  m_lock protects everything that
+     * touches the LLVM context, the module or the JIT, and the queue. */
+    QemuMutex m_lock;
+    QemuCond m_queueCond;
+    QemuThread m_compileThread;
+    bool m_compileThreadStarted;
+    bool m_compileThreadRunning;
+    bool m_stopCompileThread;
+    std::deque<TranslationBlock*> m_compileQueue;
+
+    struct {
+        uint64_t compiled;      /* blocks compiled to machine code */
+        uint64_t compiledAsync; /* of those, on m_compileThread */
+        uint64_t compileTime;   /* ns spent in passes and codegen */
+        uint64_t queueDepth;
+        uint64_t maxQueueDepth;
+        uint64_t tcgExecs;      /* in-scope blocks run on TCG meanwhile */
+        uint64_t traces;        /* traces formed */
+        uint64_t traceBlocks;   /* blocks in them */
+        uint64_t tracesDropped; /* traces dropped since a block changed */
+    } m_stats;
+
+    /* -llvm-trace.  Traces are built from copies of the block functions
+     * made before the passes ran on them, since the passes have to see the
+     * whole trace.  All of this is only used on the CPU thread; m_lock is
+     * only needed for the module and the JIT. */
+    std::map<TranslationBlock*, Function*> m_traceSources;
+    std::multimap<TranslationBlock*, TCGLLVMTrace*> m_traceMembers;
+    /* Dropped traces whose code may still be running, see traceLink */
+    std::vector<TCGLLVMTrace*> m_deadTraces;
+    Function *m_traceStepFunction;
+    int m_traceCount;
+
     /* XXX: The following members are "local" to generateCode method */
 
     /* TCGContext for current translation block */
@@ -278,7 +364,24 @@ public:
                              int mem_index, int bits);
     void generateTraceCall(uintptr_t pc);
     int generateOperation(int opc, const TCGArg *args);
+    void generateFunction(TCGContext *s, const std::string &name);
     void generateCode(TCGContext *s, TranslationBlock *tb);
+
+    bool blockCacheUsable();
+
+    /* These need m_lock */
+    void optimizeFunction(TranslationBlock *tb);
+    void compileBlock(TranslationBlock *tb);
+    void dequeueBlock(TranslationBlock *tb);
+
+    void blockRanOnTCG(TranslationBlock *tb);
+    static void *compileThread(void *opaque);
+
+    void traceLink(TranslationBlock *prev, int n, TranslationBlock *tb);
+    std::vector<TCGLLVMTrace*> detachTraces(TranslationBlock *tb);
+    /* These need m_lock */
+    bool formTrace(TranslationBlock *head);
+    void freeTrace(TCGLLVMTrace *trace);
 };
 
 /* Custom JITMemoryManager in order to capture the size of
@@ -356,10 +459,493 @@ public:
     unsigned GetNumStubSlabs() { return m_base->GetNumStubSlabs(); }
 };
 
+/* Bump this when a change to code generation makes old cache entries wrong
+ * in a way the key wouldn't catch */
+#define TCG_LLVM_CACHE_VERSION "tcg-llvm-cache-2"
+
+/* Cached functions refer to host objects through external globals named
+ * with this prefix.  "tb" is the block's own TranslationBlock. */
+#define TCG_LLVM_CACHE_SYMBOL_PREFIX "tcg-llvm-sym-"
+#define TCG_LLVM_CACHE_TB_SYMBOL "tb"
+
+/* tb->llvm_cache_state */
+#define TCG_LLVM_CACHE_NONE   0 /* not cacheable, or no cache */
+#define TCG_LLVM_CACHE_KEYED  1 /* tb->llvm_cache_key is good, not stored */
+#define TCG_LLVM_CACHE_LOADED 2 /* llvm_function came from the cache */
+
+struct TCGLLVMBlockKey {
+    uint64_t h[2];
+};
+
+/* Address of the helper that block functions call under name, so cached
+ * functions can call helpers no block has called yet in this run */
+static void *tcg_llvm_helper_addr(const std::string &name)
+{
+    TCGContext *s = &tcg_ctx;
+    for (int i = 0; i < s->nb_helpers; i++) {
+        if (name == std::string("helper_") + s->helpers[i].name) {
+            return (void *) s->helpers[i].func;
+        }
+    }
+#ifdef CONFIG_SOFTMMU
+    for (int i = 0; i < 5; i++) {
+        if (name == qemu_ld_helper_names[i]) return qemu_ld_helpers[i];
+        if (name == qemu_st_helper_names[i]) return qemu_st_helpers[i];
+#if (defined(TARGET_I386) || defined(TARGET_ARM))
+        if (name == qemu_panda_ld_helper_names[i]) {
+            return qemu_panda_ld_helpers[i];
+        }
+        if (name == qemu_panda_st_helper_names[i]) {
+            return qemu_panda_st_helpers[i];
+        }
+#endif
+    }
+#endif
+    return NULL;
+}
+
+/* Keeps the optimized and instrumented function for each TB on disk, so a
+ * later run that translates the same block can skip generating LLVM code
+ * for it and running the function passes.  The JIT still compiles it.
+ *
+ * The key covers the guest code, the TB's pc, flags and cs_base, the TCG
+ * ops the guest code was translated to (which also catches things like
+ * precise pc updates and insn_translate callbacks), and the configuration
+ * every pass user registered with tcg_llvm_cache_add_config.  Host
+ * addresses in the ops are hashed by helper name, or relative to the TB.
+ *
+ * The code generator and the passes bake host addresses into the function
+ * (the CPU state, tcg_llvm_runtime, taint2's shadow memory).  Before a
+ * function is stored, every address inside an object we know about (the
+ * ones above, and whatever was registered with tcg_llvm_cache_add_symbol)
+ * becomes an offset from an external global named after the object.  On
+ * load those globals are mapped to where the objects are in this run, so
+ * entries are good across runs with address space randomization. */
+class TCGLLVMBlockCache {
+    struct Symbol {
+        std::string name;
+        uintptr_t addr;
+        size_t size;
+    };
+
+    std::string m_dir;
+    std::string m_config;
+    int m_configs;
+    std::vector<Symbol> m_symbols;
+
+    uint64_t m_hits;
+    uint64_t m_misses;
+    uint64_t m_stores;
+    uint64_t m_uncacheable;
+
+    static void hashBytes(TCGLLVMBlockKey &key, const void *data, size_t len) {
+        const uint8_t *p = (const uint8_t *) data;
+        for (size_t i = 0; i < len; i++) {
+            key.h[0] = (key.h[0] ^ p[i]) * 0x100000001b3ULL;
+            key.h[1] = ((key.h[1] << 5 | key.h[1] >> 59) ^ p[i])
+                    * 0x517cc1b727220a95ULL;
+        }
+    }
+
+    /* The guest code is still in the TLB, translation just read it.
+     * Returns false if it isn't plain RAM. */
+    static bool hashGuestCode(TCGLLVMBlockKey &key, CPUState *env,
+                              TranslationBlock *tb) {
+#ifdef CONFIG_USER_ONLY
+        hashBytes(key, g2h(tb->pc), tb->size);
+#else
+        int mmu_idx = cpu_mmu_index(env);
+        target_ulong pc = tb->pc, end = tb->pc + tb->size;
+        while (pc < end) {
+            target_ulong page = pc & TARGET_PAGE_MASK;
+            int index = (pc >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+            CPUTLBEntry *entry = &env->tlb_table[mmu_idx][index];
+            if (entry->addr_code != page) {
+                return false;
+            }
+            target_ulong len = end - pc;
+            if (len > page + TARGET_PAGE_SIZE - pc) {
+                len = page + TARGET_PAGE_SIZE - pc;
+            }
+            hashBytes(key, (void *) (uintptr_t) (pc + entry->addend), len);
+            pc += len;
+        }
+#endif
+        return true;
+    }
+
+    static void hashOps(TCGLLVMBlockKey &key, TCGContext *s,
+                        TranslationBlock *tb) {
+        const TCGArg *args = gen_opparam_buf;
+        for (const uint16_t *opc = gen_opc_buf; *opc != INDEX_op_end;
+                opc++) {
+            const TCGOpDef &def = tcg_op_defs[*opc];
+            int nb_args = def.nb_args;
+            if (*opc == INDEX_op_nopn) {
+                nb_args = args[0];
+            } else if (*opc == INDEX_op_call) {
+                nb_args = (args[0] >> 16) + (args[0] & 0xffff)
+                        + def.nb_cargs + 1;
+            }
+            hashBytes(key, opc, sizeof(*opc));
+            for (int i = 0; i < nb_args; i++) {
+                TCGArg arg = args[i];
+                const char *helper;
+                if (*opc == INDEX_op_exit_tb && arg) {
+                    /* (tcg_target_long) tb + n */
+                    arg -= (TCGArg) tb;
+                    hashBytes(key, "tb", 2);
+                } else if (*opc == INDEX_op_movi_i64 && i == 1 &&
+                        (helper = tcg_helper_get_name(s, (void *) arg))) {
+                    hashBytes(key, helper, strlen(helper));
+                    continue;
+                }
+                hashBytes(key, &arg, sizeof(arg));
+            }
+            args += nb_args;
+        }
+    }
+
+    std::string path(const TCGLLVMBlockKey &key) const {
+        char name[40];
+        snprintf(name, sizeof(name), "/%016" PRIx64 "%016" PRIx64 ".bc",
+                key.h[0], key.h[1]);
+        return m_dir + name;
+    }
+
+    /* Everything whose address may be in tb's function */
+    std::vector<Symbol> symbols(TranslationBlock *tb) const {
+        std::vector<Symbol> syms(m_symbols);
+        Symbol runtime = { "tcg_llvm_runtime", (uintptr_t) &tcg_llvm_runtime,
+                           sizeof(tcg_llvm_runtime) };
+        syms.push_back(runtime);
+        for (CPUState *cpu = first_cpu; cpu; cpu = cpu->next_cpu) {
+            std::ostringstream name;
+            name << "cpu" << cpu->cpu_index;
+            Symbol s = { name.str(), (uintptr_t) cpu, sizeof(*cpu) };
+            syms.push_back(s);
+        }
+        Symbol self = { TCG_LLVM_CACHE_TB_SYMBOL, (uintptr_t) tb,
+                        sizeof(*tb) };
+        syms.push_back(self);
+        return syms;
+    }
+
+    static const Symbol *findSymbol(const std::vector<Symbol> &syms,
+                                    const std::string &name) {
+        for (size_t i = 0; i < syms.size(); i++) {
+            if (syms[i].name == name) return &syms[i];
+        }
+        return NULL;
+    }
+
+    /* Replaces host addresses inside a symbol in c with offsets from the
+     * symbol's global in M */
+    static Constant *relocate(Constant *c, const std::vector<Symbol> &syms,
+                              Module *M, std::map<Constant*, Constant*> &done) {
+        std::map<Constant*, Constant*>::iterator it = done.find(c);
+        if (it != done.end()) return it->second;
+
+        Constant *r = c;
+        if (ConstantInt *ci = dyn_cast<ConstantInt>(c)) {
+            uint64_t v = ci->getBitWidth() == 64 ? ci->getZExtValue() : 0;
+            for (size_t i = 0; v && i < syms.size(); i++) {
+                if (v >= syms[i].addr && v - syms[i].addr < syms[i].size) {
+                    std::string name = TCG_LLVM_CACHE_SYMBOL_PREFIX
+                            + syms[i].name;
+                    Type *i8 = Type::getInt8Ty(M->getContext());
+                    GlobalVariable *gv = M->getNamedGlobal(name);
+                    if (!gv) {
+                        gv = new GlobalVariable(*M, i8, false,
+                                GlobalValue::ExternalLinkage, NULL, name);
+                    }
+                    Constant *off = ConstantInt::get(ci->getType(),
+                            v - syms[i].addr);
+                    r = ConstantExpr::getPtrToInt(
+                            ConstantExpr::getGetElementPtr(gv, off),
+                            ci->getType());
+                    break;
+                }
+            }
+        } else if (ConstantExpr *ce = dyn_cast<ConstantExpr>(c)) {
+            std::vector<Constant*> ops;
+            bool changed = false;
+            for (unsigned i = 0; i < ce->getNumOperands(); i++) {
+                ops.push_back(relocate(ce->getOperand(i), syms, M, done));
+                changed |= ops.back() != ce->getOperand(i);
+            }
+            if (changed) r = ce->getWithOperands(ops);
+        }
+        done[c] = r;
+        return r;
+    }
+
+    static void collectGlobals(Value *v, std::set<GlobalValue*> &globals,
+                               std::set<Constant*> &seen) {
+        if (GlobalValue *gv = dyn_cast<GlobalValue>(v)) {
+            globals.insert(gv);
+        } else if (Constant *c = dyn_cast<Constant>(v)) {
+            if (!seen.insert(c).second) return;
+            for (unsigned i = 0; i < c->getNumOperands(); i++) {
+                collectGlobals(c->getOperand(i), globals, seen);
+            }
+        }
+    }
+
+    /* A module holding a copy of F with host addresses relocated, and
+     * declarations of everything it uses, or NULL if F uses something
+     * that can't be linked back in by name */
+    Module *extractFunction(Function *F, TranslationBlock *tb) const {
+        std::set<GlobalValue*> globals;
+        std::set<Constant*> seen;
+        for (Function::iterator bb = F->begin(); bb != F->end(); ++bb) {
+            for (BasicBlock::iterator i = bb->begin(); i != bb->end(); ++i) {
+                for (unsigned op = 0; op < i->getNumOperands(); op++) {
+                    collectGlobals(i->getOperand(op), globals, seen);
+                }
+            }
+        }
+
+        Module *M = new Module("tcg-llvm-cached", F->getContext());
+        M->setDataLayout(F->getParent()->getDataLayout());
+        M->setTargetTriple(F->getParent()->getTargetTriple());
+        Function *NF = Function::Create(F->getFunctionType(),
+                F->getLinkage(), "tcg-llvm-tb", M);
+        NF->setAttributes(F->getAttributes());
+
+        ValueToValueMapTy VMap;
+        VMap[F] = NF;
+        for (std::set<GlobalValue*>::iterator it = globals.begin();
+                it != globals.end(); ++it) {
+            GlobalValue *gv = *it;
+            if (gv == F) continue;
+            if (gv->hasLocalLinkage()) {
+                delete M;
+                return NULL;
+            }
+            if (Function *G = dyn_cast<Function>(gv)) {
+                Function *D = Function::Create(G->getFunctionType(),
+                        GlobalValue::ExternalLinkage, G->getName(), M);
+                D->setAttributes(G->getAttributes());
+                VMap[G] = D;
+            } else if (GlobalVariable *G = dyn_cast<GlobalVariable>(gv)) {
+                VMap[G] = new GlobalVariable(*M,
+                        G->getType()->getElementType(), G->isConstant(),
+                        GlobalValue::ExternalLinkage, NULL, G->getName());
+            } else {
+                delete M;
+                return NULL;
+            }
+        }
+
+        Function::arg_iterator dest = NF->arg_begin();
+        for (Function::arg_iterator arg = F->arg_begin();
+                arg != F->arg_end(); ++arg, ++dest) {
+            VMap[arg] = dest;
+        }
+        SmallVector<ReturnInst*, 8> returns;
+        CloneFunctionInto(NF, F, VMap, true, returns);
+
+        /* Case values and intrinsic arguments have to stay plain
+         * constants, and are never addresses */
+        std::vector<Symbol> syms = symbols(tb);
+        std::map<Constant*, Constant*> done;
+        for (Function::iterator bb = NF->begin(); bb != NF->end(); ++bb) {
+            for (BasicBlock::iterator i = bb->begin(); i != bb->end(); ++i) {
+                if (isa<SwitchInst>(i) || isa<IntrinsicInst>(i)) continue;
+                for (unsigned op = 0; op < i->getNumOperands(); op++) {
+                    Constant *c = dyn_cast<Constant>(i->getOperand(op));
+                    if (!c || isa<GlobalValue>(c)) continue;
+                    Constant *r = relocate(c, syms, M, done);
+                    if (r != c) i->setOperand(op, r);
+                }
+            }
+        }
+        return M;
+    }
+
+public:
+    TCGLLVMBlockCache(const std::string &dir)
+        : m_dir(dir), m_configs(0),
+          m_hits(0), m_misses(0), m_stores(0), m_uncacheable(0) {}
+
+    ~TCGLLVMBlockCache() {
+        fprintf(stderr, "tcg-llvm: block cache %s: %" PRIu64 " hits, %"
+                PRIu64 " misses, %" PRIu64 " stored, %" PRIu64
+                " not cacheable\n", m_dir.c_str(), m_hits, m_misses,
+                m_stores, m_uncacheable);
+    }
+
+    void addConfig(const char *name, const void *data, size_t len) {
+        m_config.append(name);
+        m_config.push_back('\0');
+        m_config.append((const char *) data, len);
+        m_configs++;
+    }
+
+    int numConfigs() const { return m_configs; }
+
+    void addSymbol(const char *name, const void *addr, size_t size) {
+        Symbol s = { name, (uintptr_t) addr, size };
+        m_symbols.push_back(s);
+    }
+
+    /* Called right after tb was translated to the TCG ops in s.  Returns
+     * false if tb can't be cached. */
+    bool key(CPUState *env, TCGContext *s, TranslationBlock *tb,
+             TCGLLVMBlockKey &key) {
+        key.h[0] = 0xcbf29ce484222325ULL;
+        key.h[1] = 0;
+        hashBytes(key, TCG_LLVM_CACHE_VERSION,
+                strlen(TCG_LLVM_CACHE_VERSION));
+        hashBytes(key, m_config.data(), m_config.size());
+        hashBytes(key, &tb->pc, sizeof(tb->pc));
+        hashBytes(key, &tb->cs_base, sizeof(tb->cs_base));
+        hashBytes(key, &tb->flags, sizeof(tb->flags));
+        hashBytes(key, &tb->cflags, sizeof(tb->cflags));
+        hashBytes(key, &tb->size, sizeof(tb->size));
+        /* Picks the memory access helpers, which the ops don't show */
+        int memcb = panda_memcb_helpers();
+        hashBytes(key, &memcb, sizeof(memcb));
+        if (!env || !hashGuestCode(key, env, tb)) {
+            m_uncacheable++;
+            return false;
+        }
+        hashOps(key, s, tb);
+        return true;
+    }
+
+    /* Returns the cached function for key, linked into dest under name,
+     * with the objects it refers to mapped to where they are in this run.
+     * Returns NULL on a miss. */
+    Function *load(const TCGLLVMBlockKey &key, const std::string &name,
+                   TranslationBlock *tb, Module *dest, ExecutionEngine *ee) {
+        std::string file = path(key);
+        if (access(file.c_str(), R_OK) != 0) {
+            m_misses++;
+            return NULL;
+        }
+        SMDiagnostic err;
+        Module *M = ParseIRFile(file, err, dest->getContext());
+        Function *CF = NULL;
+        if (M) {
+            for (Module::iterator f = M->begin(); f != M->end(); ++f) {
+                if (!f->isDeclaration()) {
+                    CF = f;
+                    break;
+                }
+            }
+        }
+        if (!CF) {
+            if (!M) err.print("tcg-llvm", llvm::errs());
+            delete M;
+            m_misses++;
+            return NULL;
+        }
+
+        /* Everything CF refers to has to be in dest already, or be
+         * something we can find in this run */
+        std::vector<std::pair<std::string, void*> > mappings;
+        std::vector<Symbol> syms = symbols(tb);
+        const std::string prefix = TCG_LLVM_CACHE_SYMBOL_PREFIX;
+        bool ok = true;
+        for (Module::iterator f = M->begin(); ok && f != M->end(); ++f) {
+            if (&*f == CF || f->isIntrinsic() ||
+                    dest->getFunction(f->getName())) {
+                continue;
+            }
+            void *addr = tcg_llvm_helper_addr(f->getName());
+            if (addr) {
+                mappings.push_back(std::make_pair(f->getName().str(), addr));
+            } else {
+                ok = false;
+            }
+        }
+        for (Module::global_iterator g = M->global_begin();
+                ok && g != M->global_end(); ++g) {
+            std::string gname = g->getName();
+            if (gname.compare(0, prefix.size(), prefix) != 0) {
+                ok = dest->getNamedGlobal(gname) != NULL;
+                continue;
+            }
+            const Symbol *sym = findSymbol(syms, gname.substr(prefix.size()));
+            if (!sym) {
+                ok = false;
+                continue;
+            }
+            if (sym->name == TCG_LLVM_CACHE_TB_SYMBOL) {
+                /* One per block, see freeBlock */
+                g->setName(name + "-tb");
+                gname = g->getName();
+            }
+            mappings.push_back(std::make_pair(gname, (void *) sym->addr));
+        }
+        if (!ok) {
+            delete M;
+            m_misses++;
+            return NULL;
+        }
+
+        CF->setName(name);
+        std::string error;
+        if (Linker::LinkModules(dest, M, Linker::DestroySource, &error)) {
+            std::cerr << "tcg-llvm: could not link cached block "
+                      << file << ": " << error << std::endl;
+            delete M;
+            m_misses++;
+            return NULL;
+        }
+        delete M;
+        for (size_t i = 0; i < mappings.size(); i++) {
+            GlobalValue *gv = dest->getNamedValue(mappings[i].first);
+            if (!ee->getPointerToGlobalIfAvailable(gv)) {
+                ee->addGlobalMapping(gv, mappings[i].second);
+            }
+        }
+        m_hits++;
+        return dest->getFunction(name);
+    }
+
+    /* F is tb's function after all the passes have run on it */
+    void store(const TCGLLVMBlockKey &key, Function *F, TranslationBlock *tb) {
+        Module *M = extractFunction(F, tb);
+        if (!M) {
+            m_uncacheable++;
+            return;
+        }
+        /* Write somewhere else and rename, so that replays sharing a cache
+         * never see half a file */
+        std::string file = path(key);
+        std::ostringstream tmp;
+        tmp << file << ".tmp." << getpid();
+        std::string error;
+        raw_fd_ostream *out = new raw_fd_ostream(tmp.str().c_str(), error,
+                raw_fd_ostream::F_Binary);
+        if (error.empty()) {
+            WriteBitcodeToFile(M, *out);
+        }
+        delete out;
+        delete M;
+        if (!error.empty() || rename(tmp.str().c_str(), file.c_str()) != 0) {
+            unlink(tmp.str().c_str());
+            return;
+        }
+        m_stores++;
+    }
+};
+
 TCGLLVMContextPrivate::TCGLLVMContextPrivate()
     : m_context(getGlobalContext()), m_builder(m_context), m_tbCount(0),
+      m_blockCache(NULL), m_fpmUsers(0), m_instrumentingUsers(0),
+      m_compileThreadStarted(false), m_compileThreadRunning(false),
+      m_stopCompileThread(false),
+      m_traceStepFunction(NULL), m_traceCount(0),
       m_tcgContext(NULL), m_tbFunction(NULL)
 {
+    std::memset(&m_stats, 0, sizeof(m_stats));
+    qemu_mutex_init(&m_lock);
+    qemu_cond_init(&m_queueCond);
+
     std::memset(m_values, 0, sizeof(m_values));
     std::memset(m_memValuesPtr, 0, sizeof(m_memValuesPtr));
     std::memset(m_globalsIdx, 0, sizeof(m_globalsIdx));
@@ -414,6 +1000,30 @@ TCGLLVMContextPrivate::TCGLLVMContextPrivate()
      */
 
     m_functionPassManager->doInitialization();
+
+    if (tcg_llvm_tiered_threshold) {
+        /* Lazy compilation would compile callees on the CPU thread while
+         * the compile thread is using the module */
+        m_executionEngine->DisableLazyCompilation(true);
+    }
+
+    if (tcg_llvm_trace_threshold) {
+        std::vector<Type*> argTypes(2, wordType());
+        m_traceStepFunction = Function::Create(
+                FunctionType::get(intType(32), argTypes, false),
+                Function::ExternalLinkage, "cpu_llvm_trace_step", m_module);
+        m_executionEngine->addGlobalMapping(m_traceStepFunction,
+                (void *) cpu_llvm_trace_step);
+    }
+
+    if (tcg_llvm_cache_dir) {
+        if (mkdir(tcg_llvm_cache_dir, 0755) != 0 && errno != EEXIST) {
+            std::cerr << "tcg-llvm: can't create block cache directory "
+                      << tcg_llvm_cache_dir << ", not caching" << std::endl;
+        } else {
+            m_blockCache = new TCGLLVMBlockCache(tcg_llvm_cache_dir);
+        }
+    }
 }
 
 /* rwhelan: to restart LLVM again, there is either a bug with the
@@ -423,6 +1033,52 @@ TCGLLVMContextPrivate::TCGLLVMContextPrivate()
  */
 TCGLLVMContextPrivate::~TCGLLVMContextPrivate()
 {
+    qemu_mutex_lock(&m_lock);
+    m_stopCompileThread = true;
+    qemu_cond_broadcast(&m_queueCond);
+    while (m_compileThreadRunning) {
+        qemu_cond_wait(&m_queueCond, &m_lock);
+    }
+    m_compileQueue.clear();
+    qemu_mutex_unlock(&m_lock);
+    if (m_compileThreadStarted) {
+        qemu_thread_join(&m_compileThread);
+    }
+
+    if (tcg_llvm_tiered_threshold) {
+        fprintf(stderr, "tcg-llvm: compiled %" PRIu64 " blocks (%" PRIu64
+                " on the compile thread) in %.3f s, max queue depth %" PRIu64
+                ", %" PRIu64 " block runs on TCG\n", m_stats.compiled,
+                m_stats.compiledAsync, m_stats.compileTime / 1e9,
+                m_stats.maxQueueDepth, m_stats.tcgExecs);
+    }
+
+    if (tcg_llvm_trace_threshold) {
+        fprintf(stderr, "tcg-llvm: formed %" PRIu64 " traces of %" PRIu64
+                " blocks, dropped %" PRIu64 "\n", m_stats.traces,
+                m_stats.traceBlocks, m_stats.tracesDropped);
+    }
+    /* The copies aren't in the module, the trace functions go with it */
+    for (std::map<TranslationBlock*, Function*>::iterator it =
+            m_traceSources.begin(); it != m_traceSources.end(); ++it) {
+        delete it->second;
+    }
+    m_traceSources.clear();
+    std::set<TCGLLVMTrace*> traces(m_deadTraces.begin(), m_deadTraces.end());
+    for (std::multimap<TranslationBlock*, TCGLLVMTrace*>::iterator it =
+            m_traceMembers.begin(); it != m_traceMembers.end(); ++it) {
+        traces.insert(it->second);
+    }
+    for (std::set<TCGLLVMTrace*>::iterator it = traces.begin();
+            it != traces.end(); ++it) {
+        delete *it;
+    }
+
+    if (m_blockCache) {
+        delete m_blockCache;
+        m_blockCache = NULL;
+    }
+
     if (m_functionPassManager){
         delete m_functionPassManager;
         m_functionPassManager = NULL;
@@ -438,6 +1094,9 @@ TCGLLVMContextPrivate::~TCGLLVMContextPrivate()
     if (llvm_is_multithreaded()){
         llvm_stop_multithreaded();
     }
+
+    qemu_cond_destroy(&m_queueCond);
+    qemu_mutex_destroy(&m_lock);
 }
 
 Value* TCGLLVMContextPrivate::getPtrForValue(int idx)
@@ -671,7 +1330,7 @@ inline Value* TCGLLVMContextPrivate::generateQemuMemOp(bool ld,
 
     uintptr_t helperFuncAddr;
 
-    if (panda_use_memcb){
+    if (panda_memcb_helpers()){
         helperFuncAddr = ld ? (uint64_t) qemu_panda_ld_helpers[bits>>4]:
                                (uint64_t) qemu_panda_st_helpers[bits>>4];
     }
@@ -702,7 +1361,7 @@ inline Value* TCGLLVMContextPrivate::generateQemuMemOp(bool ld,
     }
 
     char *funcName;
-    if (panda_use_memcb){
+    if (panda_memcb_helpers()){
         funcName = ld ? qemu_panda_ld_helper_names[bits>>4]:
             qemu_panda_st_helper_names[bits>>4];
     }
@@ -1311,19 +1970,10 @@ int TCGLLVMContextPrivate::generateOperation(int opc, const TCGArg *args)
     return nb_args;
 }
 
-void TCGLLVMContextPrivate::generateCode(TCGContext *s, TranslationBlock *tb)
+/* Translates the TCG ops in s into a new function named name */
+void TCGLLVMContextPrivate::generateFunction(TCGContext *s,
+                                             const std::string &name)
 {
-    /* Create new function for current translation block */
-    /* TODO: compute the checksum of the tb to see if we can reuse some code */
-    std::ostringstream fName;
-
-    fName << "tcg-llvm-tb-" << (m_tbCount++) << "-" << std::hex << tb->pc;
-
-#ifdef CONFIG_USER_ONLY
-    const char *symName = lookup_symbol(tb->pc);
-    fName << "-" << symName;
-#endif
-
     /*
     if(m_tbFunction)
         m_tbFunction->eraseFromParent();
@@ -1333,7 +1983,7 @@ void TCGLLVMContextPrivate::generateCode(TCGContext *s, TranslationBlock *tb)
             wordType(),
             std::vector<Type*>(1, intPtrType(64)), false);
     m_tbFunction = Function::Create(tbFunctionType,
-            Function::PrivateLinkage, fName.str(), m_module);
+            Function::PrivateLinkage, name, m_module);
     BasicBlock *basicBlock = BasicBlock::Create(m_context,
             "entry", m_tbFunction);
     m_builder.SetInsertPoint(basicBlock);
@@ -1392,35 +2042,425 @@ void TCGLLVMContextPrivate::generateCode(TCGContext *s, TranslationBlock *tb)
 
     for(int i=0; i<TCG_MAX_LABELS; ++i)
         delLabel(i);
+}
+
+/* Turns the block cache off if a plugin added passes without describing
+ * them, see tcg_llvm_cache_add_config */
+bool TCGLLVMContextPrivate::blockCacheUsable()
+{
+    if (m_blockCache && m_fpmUsers > m_blockCache->numConfigs()) {
+        std::cerr << "tcg-llvm: a plugin added function passes without "
+                     "calling tcg_llvm_cache_add_config, not caching"
+                  << std::endl;
+        delete m_blockCache;
+        m_blockCache = NULL;
+    }
+    return m_blockCache != NULL;
+}
+
+void TCGLLVMContextPrivate::generateCode(TCGContext *s, TranslationBlock *tb)
+{
+    /* Create new function for current translation block */
+    std::ostringstream fName;
+
+    qemu_mutex_lock(&m_lock);
+
+    fName << "tcg-llvm-tb-" << (m_tbCount++) << "-" << std::hex << tb->pc;
+
+#ifdef CONFIG_USER_ONLY
+    const char *symName = lookup_symbol(tb->pc);
+    fName << "-" << symName;
+#endif
+
+    /* With -llvm-cache, a function cached for this block in an earlier run
+     * saves generating one and running the passes on it */
+    Function *cached = NULL;
+    tb->llvm_cache_state = TCG_LLVM_CACHE_NONE;
+    if (blockCacheUsable()) {
+        /* Translation only happens on the CPU thread */
+        TCGLLVMBlockKey key;
+        if (m_blockCache->key(cpu_single_env, s, tb, key)) {
+            std::memcpy(tb->llvm_cache_key, key.h, sizeof(key.h));
+            tb->llvm_cache_state = TCG_LLVM_CACHE_KEYED;
+            cached = m_blockCache->load(key, fName.str(), tb, m_module,
+                    m_executionEngine);
+        }
+    }
+
+    if (cached) {
+        tb->llvm_function = cached;
+        tb->llvm_cache_state = TCG_LLVM_CACHE_LOADED;
+    } else {
+        generateFunction(s, fName.str());
+        tb->llvm_function = m_tbFunction;
+        if (tcg_llvm_trace_threshold) {
+            ValueToValueMapTy VMap;
+            m_traceSources[tb] = CloneFunction(m_tbFunction, VMap, false);
+        }
+    }
+    tb->llvm_exec_count = 0;
+    tb->llvm_tc_ptr = 0;
+    tb->llvm_tc_end = 0;
+
+    if(execute_llvm && tcg_llvm_tiered_threshold && !m_instrumentingUsers) {
+        /* Runs on TCG until it is hot, see blockRanOnTCG */
+    } else if(execute_llvm || qemu_loglevel_mask(CPU_LOG_LLVM_ASM)) {
+        compileBlock(tb);
+    } else {
+        optimizeFunction(tb);
+    }
 
-    // run all specified function passes
-    m_functionPassManager->run(*m_tbFunction);
+    if(qemu_loglevel_mask(CPU_LOG_LLVM_IR)) {
+        std::string fcnString;
+        llvm::raw_string_ostream s(fcnString);
+        s << *tb->llvm_function;
+        qemu_log("OUT (LLVM IR):\n");
+        qemu_log("%s", s.str().c_str());
+        qemu_log("\n");
+        qemu_log_flush();
+    }
+
+    qemu_mutex_unlock(&m_lock);
+}
+
+/* Runs the function passes on tb's function, unless it came from the
+ * block cache, and stores the result there */
+void TCGLLVMContextPrivate::optimizeFunction(TranslationBlock *tb)
+{
+    Function *F = tb->llvm_function;
+
+    if (tb->llvm_cache_state != TCG_LLVM_CACHE_LOADED) {
+        // run all specified function passes
+        m_functionPassManager->run(*F);
+        if (tb->llvm_cache_state == TCG_LLVM_CACHE_KEYED &&
+                blockCacheUsable()) {
+            TCGLLVMBlockKey key;
+            std::memcpy(key.h, tb->llvm_cache_key, sizeof(key.h));
+            m_blockCache->store(key, F, tb);
+        }
+        tb->llvm_cache_state = TCG_LLVM_CACHE_NONE;
+    }
 
 //#ifndef NDEBUG
-    verifyFunction(*m_tbFunction);
+    verifyFunction(*F);
 //#endif
+}
 
-    tb->llvm_function = m_tbFunction;
+static uint64_t tcg_llvm_clock_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-    if(execute_llvm || qemu_loglevel_mask(CPU_LOG_LLVM_ASM)) {
-        tb->llvm_tc_ptr = (uint8_t*)
-                m_executionEngine->getPointerToFunction(m_tbFunction);
-        tb->llvm_tc_end = tb->llvm_tc_ptr +
-                m_jitMemoryManager->getLastFunctionSize();
-    } else {
-        tb->llvm_tc_ptr = 0;
-        tb->llvm_tc_end = 0;
+void TCGLLVMContextPrivate::compileBlock(TranslationBlock *tb)
+{
+    uint64_t start = tcg_llvm_clock_ns();
+
+    optimizeFunction(tb);
+    uint8_t *tc_ptr = (uint8_t*)
+            m_executionEngine->getPointerToFunction(tb->llvm_function);
+
+    /* The CPU thread may be looking at tb right now: it must never see
+     * llvm_tc_ptr before llvm_tc_end */
+    tb->llvm_tc_end = tc_ptr + m_jitMemoryManager->getLastFunctionSize();
+    smp_wmb();
+    tb->llvm_tc_ptr = tc_ptr;
+
+    m_stats.compiled++;
+    m_stats.compileTime += tcg_llvm_clock_ns() - start;
+}
+
+void TCGLLVMContextPrivate::dequeueBlock(TranslationBlock *tb)
+{
+    std::deque<TranslationBlock*>::iterator it = m_compileQueue.begin();
+    while (it != m_compileQueue.end()) {
+        if (*it == tb) {
+            it = m_compileQueue.erase(it);
+            m_stats.queueDepth--;
+        } else {
+            ++it;
+        }
+    }
+}
+
+/* Called from the CPU loop each time tb runs on TCG in tiered mode */
+void TCGLLVMContextPrivate::blockRanOnTCG(TranslationBlock *tb)
+{
+    m_stats.tcgExecs++;
+    if (!tb->llvm_function) {
+        /* Translated before LLVM was turned on */
+        return;
+    }
+
+    if (m_instrumentingUsers) {
+        /* Someone added instrumentation since tb was translated, so it
+         * can't wait */
+        qemu_mutex_lock(&m_lock);
+        if (!tb->llvm_tc_ptr) {
+            dequeueBlock(tb);
+            compileBlock(tb);
+        }
+        qemu_mutex_unlock(&m_lock);
+        return;
+    }
+
+    if (++tb->llvm_exec_count != tcg_llvm_tiered_threshold) {
+        return;
+    }
+
+    qemu_mutex_lock(&m_lock);
+    if (!m_compileThreadRunning && !m_stopCompileThread) {
+        m_compileThreadStarted = true;
+        m_compileThreadRunning = true;
+        qemu_thread_create(&m_compileThread, compileThread, this);
+    }
+    m_compileQueue.push_back(tb);
+    m_stats.queueDepth++;
+    if (m_stats.queueDepth > m_stats.maxQueueDepth) {
+        m_stats.maxQueueDepth = m_stats.queueDepth;
+    }
+    qemu_cond_broadcast(&m_queueCond);
+    qemu_mutex_unlock(&m_lock);
+}
+
+void *TCGLLVMContextPrivate::compileThread(void *opaque)
+{
+    TCGLLVMContextPrivate *p = (TCGLLVMContextPrivate *) opaque;
+
+    qemu_mutex_lock(&p->m_lock);
+    while (true) {
+        while (p->m_compileQueue.empty() && !p->m_stopCompileThread) {
+            qemu_cond_wait(&p->m_queueCond, &p->m_lock);
+        }
+        if (p->m_stopCompileThread) {
+            break;
+        }
+        /* Blocks leave the queue, under m_lock, when they are freed */
+        TranslationBlock *tb = p->m_compileQueue.front();
+        p->m_compileQueue.pop_front();
+        p->m_stats.queueDepth--;
+        if (!tb->llvm_tc_ptr) {
+            p->compileBlock(tb);
+            p->m_stats.compiledAsync++;
+        }
+    }
+    p->m_compileThreadRunning = false;
+    qemu_cond_broadcast(&p->m_queueCond);
+    qemu_mutex_unlock(&p->m_lock);
+    return NULL;
+}
+
+/* Called from the CPU loop when prev, an LLVM block, has jumped through
+ * exit n straight to tb, before tb runs.  No generated code is running. */
+void TCGLLVMContextPrivate::traceLink(TranslationBlock *prev, int n,
+                                      TranslationBlock *tb)
+{
+    if (!m_deadTraces.empty()) {
+        qemu_mutex_lock(&m_lock);
+        for (size_t i = 0; i < m_deadTraces.size(); i++) {
+            freeTrace(m_deadTraces[i]);
+        }
+        m_deadTraces.clear();
+        qemu_mutex_unlock(&m_lock);
+    }
+
+    if (prev->llvm_invalid || !prev->llvm_tc_ptr || !tb->llvm_tc_ptr ||
+            !panda_tb_instrumented(prev)) {
+        return;
+    }
+    prev->llvm_tb_next[n] = tb;
+    prev->llvm_trace_exit = n;
+    if (prev->llvm_trace ||
+            ++prev->llvm_trace_count < tcg_llvm_trace_threshold) {
+        return;
+    }
+    /* Try again later if there is no trace to be had yet */
+    prev->llvm_trace_count = 0;
+
+    qemu_mutex_lock(&m_lock);
+    formTrace(prev);
+    qemu_mutex_unlock(&m_lock);
+}
+
+/* Follows the jumps the blocks from head on took last, and compiles the
+ * blocks into one function.  Where block k jumps to block k+1 (or back to
+ * the head), the function calls cpu_llvm_trace_step and goes on with block
+ * k+1 if it says so.  Every other exit returns to cpu_exec as it would from
+ * block k's own function. */
+bool TCGLLVMContextPrivate::formTrace(TranslationBlock *head)
+{
+    std::vector<TranslationBlock*> tbs;
+    std::vector<Function*> sources;
+    /* What tbs[k] returns when it jumps to the next block */
+    std::vector<uint64_t> links;
+    size_t insts = 0;
+    bool loops = false;
+
+    TranslationBlock *tb = head;
+    while (tb) {
+        /* Blocks from the block cache have no copy */
+        std::map<TranslationBlock*, Function*>::iterator src =
+            m_traceSources.find(tb);
+        if (src == m_traceSources.end()) {
+            break;
+        }
+        size_t n = 0;
+        for (Function::iterator bb = src->second->begin();
+                bb != src->second->end(); ++bb) {
+            n += bb->size();
+        }
+        if (insts + n > TCG_LLVM_TRACE_MAX_INSTS) {
+            break;
+        }
+        insts += n;
+        tbs.push_back(tb);
+        sources.push_back(src->second);
+
+        TranslationBlock *next = tb->llvm_tb_next[tb->llvm_trace_exit];
+        links.push_back((uintptr_t) tb + tb->llvm_trace_exit);
+        if (next == head) {
+            loops = true;
+            break;
+        }
+        /* Blocks after the head are entered without the lookup that
+         * checks the second page of a block */
+        if (!next || tbs.size() == TCG_LLVM_TRACE_MAX_TBS ||
+                next->llvm_invalid || !next->llvm_tc_ptr ||
+                !panda_tb_instrumented(next) || next->page_addr[1] != -1 ||
+                std::find(tbs.begin(), tbs.end(), next) != tbs.end()) {
+            next = NULL;
+        }
+        tb = next;
+    }
+    if (tbs.empty() || (tbs.size() < 2 && !loops)) {
+        return false;
+    }
+    links.resize(loops ? tbs.size() : tbs.size() - 1);
+
+    std::ostringstream fName;
+    fName << "tcg-llvm-trace-" << (m_traceCount++) << "-" << std::hex
+          << head->pc;
+    Function *F = Function::Create(sources[0]->getFunctionType(),
+            Function::PrivateLinkage, fName.str(), m_module);
+    BasicBlock *entry = BasicBlock::Create(m_context, "entry", F);
+
+    std::vector<BasicBlock*> starts;
+    std::vector<SmallVector<ReturnInst*, 8> > rets(tbs.size());
+    std::vector<AllocaInst*> allocas;
+    for (size_t k = 0; k < tbs.size(); k++) {
+        ValueToValueMapTy VMap;
+        VMap[sources[k]->arg_begin()] = F->arg_begin();
+        CloneFunctionInto(F, sources[k], VMap, false, rets[k]);
+        BasicBlock *start = cast<BasicBlock>(
+                (Value *) VMap[&sources[k]->getEntryBlock()]);
+        for (BasicBlock::iterator i = start->begin(); i != start->end(); ++i) {
+            if (AllocaInst *AI = dyn_cast<AllocaInst>(i)) {
+                allocas.push_back(AI);
+            }
+        }
+        starts.push_back(start);
+    }
+    /* Local temps would take more stack on each trip around a loop */
+    BranchInst *toHead = BranchInst::Create(starts[0], entry);
+    for (size_t i = 0; i < allocas.size(); i++) {
+        allocas[i]->moveBefore(toHead);
     }
 
+    MDNode *md = MDNode::get(m_context, MDString::get(m_context, "step"));
+    for (size_t k = 0; k < links.size(); k++) {
+        size_t next = (k + 1) % tbs.size();
+        Constant *link = ConstantInt::get(wordType(), links[k]);
+        BasicBlock *step = BasicBlock::Create(m_context, "", F);
+        BasicBlock *leave = BasicBlock::Create(m_context, "", F);
+        m_builder.SetInsertPoint(step);
+        CallInst *go = m_builder.CreateCall2(m_traceStepFunction, link,
+                ConstantInt::get(wordType(), (uintptr_t) tbs[next]));
+        Value *ok = m_builder.CreateICmpNE(go,
+                ConstantInt::get(intType(32), 0));
+        BranchInst *br = m_builder.CreateCondBr(ok, starts[next], leave);
+        go->setMetadata("trace_step", md);
+        cast<Instruction>(ok)->setMetadata("trace_step", md);
+        br->setMetadata("trace_step", md);
+        ReturnInst::Create(m_context, link, leave);
+
+        for (size_t i = 0; i < rets[k].size(); i++) {
+            ReturnInst *RI = rets[k][i];
+            ConstantInt *C = dyn_cast_or_null<ConstantInt>(
+                    RI->getReturnValue());
+            if (C && C->getZExtValue() == links[k]) {
+                BranchInst::Create(step, RI);
+                RI->eraseFromParent();
+            }
+        }
+    }
+
+    uint64_t start = tcg_llvm_clock_ns();
+    m_functionPassManager->run(*F);
+    verifyFunction(*F);
+    TCGLLVMTrace *trace = new TCGLLVMTrace;
+    trace->function = F;
+    trace->tc_ptr = (uint8_t*) m_executionEngine->getPointerToFunction(F);
+    trace->tc_end = trace->tc_ptr + m_jitMemoryManager->getLastFunctionSize();
+    trace->tbs = tbs;
+    m_stats.compileTime += tcg_llvm_clock_ns() - start;
+
+    for (size_t k = 0; k < tbs.size(); k++) {
+        m_traceMembers.insert(std::make_pair(tbs[k], trace));
+    }
+    head->llvm_trace = trace;
+    m_stats.traces++;
+    m_stats.traceBlocks += tbs.size();
+
     if(qemu_loglevel_mask(CPU_LOG_LLVM_IR)) {
         std::string fcnString;
         llvm::raw_string_ostream s(fcnString);
-        s << *m_tbFunction;
+        s << *F;
         qemu_log("OUT (LLVM IR):\n");
         qemu_log("%s", s.str().c_str());
         qemu_log("\n");
         qemu_log_flush();
     }
+    return true;
+}
+
+/* Unlinks the traces tb is in, and returns them to be freed */
+std::vector<TCGLLVMTrace*> TCGLLVMContextPrivate::detachTraces(
+        TranslationBlock *tb)
+{
+    typedef std::multimap<TranslationBlock*, TCGLLVMTrace*>::iterator It;
+    std::vector<TCGLLVMTrace*> traces;
+    std::pair<It, It> r = m_traceMembers.equal_range(tb);
+    for (It it = r.first; it != r.second; ++it) {
+        traces.push_back(it->second);
+    }
+    for (size_t i = 0; i < traces.size(); i++) {
+        TCGLLVMTrace *trace = traces[i];
+        if (trace->tbs[0]->llvm_trace == trace) {
+            trace->tbs[0]->llvm_trace = NULL;
+        }
+        for (size_t k = 0; k < trace->tbs.size(); k++) {
+            r = m_traceMembers.equal_range(trace->tbs[k]);
+            for (It it = r.first; it != r.second; ) {
+                if (it->second == trace) {
+                    m_traceMembers.erase(it++);
+                } else {
+                    ++it;
+                }
+            }
+        }
+    }
+    return traces;
+}
+
+void TCGLLVMContextPrivate::freeTrace(TCGLLVMTrace *trace)
+{
+    if (tcg_llvm_runtime.trace_tc_ptr == trace->tc_ptr) {
+        tcg_llvm_runtime.trace_tc_ptr = NULL;
+        tcg_llvm_runtime.trace_tc_end = NULL;
+    }
+    trace->function->eraseFromParent();
+    delete trace;
 }
 
 /***********************************/
@@ -1436,11 +2476,122 @@ TCGLLVMContext::~TCGLLVMContext()
     delete m_private;
 }
 
-llvm::FunctionPassManager* TCGLLVMContext::getFunctionPassManager() const
+void TCGLLVMContext::lock()
 {
+    qemu_mutex_lock(&m_private->m_lock);
+}
+
+void TCGLLVMContext::unlock()
+{
+    qemu_mutex_unlock(&m_private->m_lock);
+}
+
+llvm::FunctionPassManager* TCGLLVMContext::getFunctionPassManager(
+        bool instruments) const
+{
+    m_private->m_fpmUsers++;
+    if (instruments) {
+        m_private->m_instrumentingUsers++;
+    }
     return m_private->getFunctionPassManager();
 }
 
+void TCGLLVMContext::addCacheConfig(const char *name, const void *data,
+        size_t len)
+{
+    if (m_private->m_blockCache) {
+        m_private->m_blockCache->addConfig(name, data, len);
+    }
+}
+
+void TCGLLVMContext::addCacheSymbol(const char *name, const void *addr,
+        size_t size)
+{
+    if (m_private->m_blockCache) {
+        m_private->m_blockCache->addSymbol(name, addr, size);
+    }
+}
+
+void TCGLLVMContext::freeBlock(TranslationBlock *tb)
+{
+    /* Waits for the compile thread if it is working on tb */
+    qemu_mutex_lock(&m_private->m_lock);
+    m_private->dequeueBlock(tb);
+    std::string name = tb->llvm_function->getName().str();
+    tb->llvm_function->eraseFromParent();
+    tb->llvm_function = NULL;
+    /* A function from the block cache finds its TB through this */
+    GlobalVariable *self = m_private->m_module->getNamedGlobal(name + "-tb");
+    if (self) {
+        m_private->m_executionEngine->updateGlobalMapping(self, NULL);
+        self->eraseFromParent();
+    }
+    tb->llvm_tc_ptr = NULL;
+    /* Blocks are freed when no generated code will go on running, so
+     * their traces can go right away */
+    std::map<TranslationBlock*, Function*>::iterator src =
+        m_private->m_traceSources.find(tb);
+    if (src != m_private->m_traceSources.end()) {
+        delete src->second;
+        m_private->m_traceSources.erase(src);
+    }
+    std::vector<TCGLLVMTrace*> traces = m_private->detachTraces(tb);
+    for (size_t i = 0; i < traces.size(); i++) {
+        m_private->freeTrace(traces[i]);
+    }
+    qemu_mutex_unlock(&m_private->m_lock);
+}
+
+void TCGLLVMContext::invalidateBlock(TranslationBlock *tb)
+{
+    /* A helper in one of the traces may have done this, so their code
+     * stays until traceLink */
+    std::vector<TCGLLVMTrace*> traces = m_private->detachTraces(tb);
+    m_private->m_stats.tracesDropped += traces.size();
+    m_private->m_deadTraces.insert(m_private->m_deadTraces.end(),
+            traces.begin(), traces.end());
+}
+
+void TCGLLVMContext::traceLink(TranslationBlock *prev, int n,
+                               TranslationBlock *tb)
+{
+    m_private->traceLink(prev, n, tb);
+}
+
+void TCGLLVMContext::blockRanOnTCG(TranslationBlock *tb)
+{
+    m_private->blockRanOnTCG(tb);
+}
+
+std::string TCGLLVMContext::getFunctionName(TranslationBlock *tb)
+{
+    /* The block cache can swap the function on the compile thread */
+    qemu_mutex_lock(&m_private->m_lock);
+    std::string name = tb->llvm_function->getName().str();
+    qemu_mutex_unlock(&m_private->m_lock);
+    return name;
+}
+
+void TCGLLVMContext::dumpInfo(FILE *f,
+        int (*cpu_fprintf)(FILE *f, const char *fmt, ...))
+{
+    TCGLLVMContextPrivate *p = m_private;
+    qemu_mutex_lock(&p->m_lock);
+    cpu_fprintf(f, "LLVM compiled TBs   %" PRIu64 " (%" PRIu64
+                " on the compile thread)\n",
+                p->m_stats.compiled, p->m_stats.compiledAsync);
+    cpu_fprintf(f, "LLVM compile time   %" PRIu64 " ms\n",
+                p->m_stats.compileTime / 1000000);
+    cpu_fprintf(f, "LLVM compile queue  %" PRIu64 " (max %" PRIu64 ")\n",
+                p->m_stats.queueDepth, p->m_stats.maxQueueDepth);
+    cpu_fprintf(f, "TB runs on TCG      %" PRIu64 " (waiting for LLVM)\n",
+                p->m_stats.tcgExecs);
+    cpu_fprintf(f, "LLVM traces         %" PRIu64 " (%" PRIu64 " blocks, %"
+                PRIu64 " dropped)\n", p->m_stats.traces,
+                p->m_stats.traceBlocks, p->m_stats.tracesDropped);
+    qemu_mutex_unlock(&p->m_lock);
+}
+
 void TCGLLVMContext::deleteExecutionEngine()
 {
     m_private->deleteExecutionEngine();
@@ -1471,6 +2622,7 @@ void TCGLLVMContext::generateCode(TCGContext *s, TranslationBlock *tb)
 }
 
 void TCGLLVMContext::writeModule(const char *path){
+    qemu_mutex_lock(&m_private->m_lock);
     std::string Error;
     raw_ostream *outfile;
     outfile = new raw_fd_ostream(path, Error,
@@ -1482,6 +2634,7 @@ void TCGLLVMContext::writeModule(const char *path){
     }
     WriteBitcodeToFile(getModule(), *outfile);
     delete outfile;
+    qemu_mutex_unlock(&m_private->m_lock);
 }
 
 /*****************************/
@@ -1512,14 +2665,54 @@ void tcg_llvm_tb_alloc(TranslationBlock *tb)
 {
     tb->tcg_llvm_context = NULL;
     tb->llvm_function = NULL;
+    tb->llvm_exec_count = 0;
+    tb->llvm_cache_state = 0;
+    tb->llvm_tb_next[0] = NULL;
+    tb->llvm_tb_next[1] = NULL;
+    tb->llvm_trace = NULL;
+    tb->llvm_trace_count = 0;
+    tb->llvm_trace_exit = 0;
+    tb->llvm_invalid = 0;
 }
 
 void tcg_llvm_tb_free(TranslationBlock *tb)
 {
     if(tb->llvm_function) {
-        tb->llvm_function->eraseFromParent();
-        tb->llvm_function = NULL;
-        tb->llvm_tc_ptr = NULL;
+        tcg_llvm_ctx->freeBlock(tb);
+    }
+}
+
+void tcg_llvm_tb_invalidate(TranslationBlock *tb)
+{
+    tb->llvm_invalid = 1;
+    if (tcg_llvm_ctx && tb->llvm_function) {
+        tcg_llvm_ctx->invalidateBlock(tb);
+    }
+}
+
+void tcg_llvm_trace_link(TranslationBlock *prev, int n, TranslationBlock *tb)
+{
+    tcg_llvm_ctx->traceLink(prev, n, tb);
+}
+
+TranslationBlock *tcg_llvm_trace_find_pc(uintptr_t tc_ptr)
+{
+    if (tc_ptr >= (uintptr_t) tcg_llvm_runtime.trace_tc_ptr &&
+            tc_ptr < (uintptr_t) tcg_llvm_runtime.trace_tc_end) {
+        return tcg_llvm_runtime.last_tb;
+    }
+    return NULL;
+}
+
+void tcg_llvm_tb_ran_on_tcg(TranslationBlock *tb)
+{
+    tcg_llvm_ctx->blockRanOnTCG(tb);
+}
+
+void tcg_llvm_dump_info(FILE *f, fprintf_function cpu_fprintf)
+{
+    if (tcg_llvm_ctx) {
+        tcg_llvm_ctx->dumpInfo(f, cpu_fprintf);
     }
 }
 
@@ -1533,7 +2726,7 @@ const char* tcg_llvm_get_func_name(TranslationBlock *tb)
 {
     static char buf[500];
     if(tb->llvm_function) {
-        strncpy(buf, tb->llvm_function->getName().str().c_str(), sizeof(buf));
+        strncpy(buf, tcg_llvm_ctx->getFunctionName(tb).c_str(), sizeof(buf));
     } else {
         buf[0] = 0;
     }
@@ -1546,10 +2739,16 @@ extern CPUState *env;
 
 uintptr_t tcg_llvm_qemu_tb_exec(void *env1, TranslationBlock *tb)
 {
+    /* If tb heads a trace, run that instead.  It moves last_tb along as it
+     * goes from block to block. */
+    TCGLLVMTrace *trace = tb->llvm_trace;
+    uint8_t *tc_ptr = trace ? trace->tc_ptr : tb->llvm_tc_ptr;
+    tcg_llvm_runtime.trace_tc_ptr = trace ? trace->tc_ptr : NULL;
+    tcg_llvm_runtime.trace_tc_end = trace ? trace->tc_end : NULL;
     tcg_llvm_runtime.last_tb = tb;
     env = (CPUState*)env1;
     uintptr_t next_tb;
-    next_tb = ((uintptr_t (*)(void*)) tb->llvm_tc_ptr)(&env);
+    next_tb = ((uintptr_t (*)(void*)) tc_ptr)(&env);
     return next_tb;
 }
 
@@ -1557,3 +2756,18 @@ void tcg_llvm_write_module(TCGLLVMContext *l, const char *path){
     l->writeModule(path);
 }
 
+void tcg_llvm_cache_add_config(const char *name, const void *data, size_t len)
+{
+    if (tcg_llvm_ctx) {
+        tcg_llvm_ctx->addCacheConfig(name, data, len);
+    }
+}
+
+void tcg_llvm_cache_add_symbol(const char *name, const void *addr,
+        size_t size)
+{
+    if (tcg_llvm_ctx) {
+        tcg_llvm_ctx->addCacheSymbol(name, addr, size);
+    }
+}
+
@@ -38,6 +38,8 @@
 #define TCG_LLVM_H
 
 #include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -63,6 +65,10 @@ struct TCGLLVMRuntime {
     TranslationBlock *last_tb;
     uint64_t last_opc_index;
     uint64_t last_pc;
+
+    /* Code of the -llvm-trace trace running now, if any */
+    uint8_t *trace_tc_ptr;
+    uint8_t *trace_tc_end;
 };
 
 extern struct TCGLLVMRuntime tcg_llvm_runtime;
@@ -72,6 +78,7 @@ void tcg_llvm_destroy(void);
 
 void tcg_llvm_tb_alloc(struct TranslationBlock *tb);
 void tcg_llvm_tb_free(struct TranslationBlock *tb);
+void tcg_llvm_tb_invalidate(struct TranslationBlock *tb);
 
 void tcg_llvm_gen_code(struct TCGLLVMContext *l, struct TCGContext *s,
                        struct TranslationBlock *tb);
@@ -83,6 +90,49 @@ int tcg_llvm_search_last_pc(struct TranslationBlock *tb, uintptr_t searched_pc);
 
 void tcg_llvm_write_module(struct TCGLLVMContext *l, const char *path);
 
+/* With -llvm-tiered <n>, in-scope blocks that no pass has to instrument run on
+ * TCG until they have run n times, and are then compiled on a background
+ * thread.  cpu_exec switches to the LLVM code once llvm_tc_ptr is set.  0
+ * compiles every block when it is translated. */
+extern unsigned tcg_llvm_tiered_threshold;
+void tcg_llvm_tb_ran_on_tcg(struct TranslationBlock *tb);
+
+/* With -llvm-trace <n>, once an LLVM block has jumped straight to another
+ * one n times, the chain of blocks it usually runs is compiled into a single
+ * function (a trace) that runs instead of the block.  cpu_exec calls
+ * tcg_llvm_trace_link for each such jump.  0 turns traces off. */
+extern unsigned tcg_llvm_trace_threshold;
+void tcg_llvm_trace_link(struct TranslationBlock *prev, int n,
+                         struct TranslationBlock *tb);
+
+/* Called by a trace where one of its blocks jumps to the next one, tb,
+ * with what the first block returned.  Does what cpu_exec does between two
+ * blocks, and returns 0 if tb can't run now, in which case the trace
+ * returns next_tb.  The call, and the compare and branch on its result,
+ * have "trace_step" metadata since they aren't guest code.  In
+ * cpu-exec.c. */
+int cpu_llvm_trace_step(uintptr_t next_tb, struct TranslationBlock *tb);
+
+/* The block running in the trace that contains tc_ptr, NULL if no trace
+ * running now contains it */
+struct TranslationBlock *tcg_llvm_trace_find_pc(uintptr_t tc_ptr);
+
+/* Directory for the on-disk cache of optimized block functions (-llvm-cache),
+ * NULL to not cache */
+extern const char *tcg_llvm_cache_dir;
+
+/* Everyone who adds passes to the function pass manager must describe the
+ * settings they depend on here, since the cache key only covers the guest
+ * code and what TCG made of it.  Caching is turned off if someone adds passes
+ * without doing this. */
+void tcg_llvm_cache_add_config(const char *name, const void *data, size_t len);
+
+/* Host objects whose addresses passes put into the code.  Cached functions
+ * refer to them by name, and get this run's addresses when they are loaded.
+ * The CPU state and tcg_llvm_runtime are always known. */
+void tcg_llvm_cache_add_symbol(const char *name, const void *addr,
+                               size_t size);
+
 #ifdef __cplusplus
 }
 #endif
@@ -92,6 +142,8 @@ void tcg_llvm_write_module(struct TCGLLVMContext *l, const char *path);
 /***********************************/
 /* External interface for C++ code */
 
+#include <string>
+
 namespace llvm {
     class Function;
     class LLVMContext;
@@ -119,7 +171,30 @@ public:
     llvm::ExecutionEngine* getExecutionEngine();
 
     void deleteExecutionEngine();
-    llvm::FunctionPassManager* getFunctionPassManager() const;
+
+    /* With -llvm-tiered the compile thread uses the module, the JIT and the
+     * function pass manager too.  Hold the lock around anything that changes
+     * them (adding passes, linking in modules, running passes by hand), and
+     * around getFunctionPassManager and addCacheConfig/Symbol.  generateCode,
+     * freeBlock, getFunctionName and writeModule take it themselves, so
+     * don't call them with it held. */
+    void lock();
+    void unlock();
+
+    /* instruments: the passes you add change what the code does, so no
+     * block may run without them (see tcg_llvm_tiered_threshold) */
+    llvm::FunctionPassManager* getFunctionPassManager(
+            bool instruments = true) const;
+    void addCacheConfig(const char *name, const void *data, size_t len);
+    void addCacheSymbol(const char *name, const void *addr, size_t size);
+
+    void freeBlock(struct TranslationBlock *tb);
+    void invalidateBlock(struct TranslationBlock *tb);
+    void traceLink(struct TranslationBlock *prev, int n,
+                   struct TranslationBlock *tb);
+    void blockRanOnTCG(struct TranslationBlock *tb);
+    std::string getFunctionName(struct TranslationBlock *tb);
+    void dumpInfo(FILE *f, int (*cpu_fprintf)(FILE *f, const char *fmt, ...));
 
     void generateCode(struct TCGContext *s,
                       struct TranslationBlock *tb);
@@ -111,7 +111,8 @@ int cpu_gen_code(CPUState *env, TranslationBlock *tb, int *gen_code_size_ptr)
     *gen_code_size_ptr = gen_code_size;
 
 #if defined(CONFIG_LLVM)
-    if(generate_llvm)
+    // PANDA: blocks out of the instrumentation scope just run TCG code
+    if(generate_llvm && panda_tb_in_scope)
         tcg_llvm_gen_code(tcg_llvm_ctx, s, tb);
 #endif
 
@@ -169,6 +170,8 @@ int cpu_restore_state(TranslationBlock *tb,
 #endif
     tcg_func_start(s);
 
+    // PANDA: regenerate exactly what tb_gen_code did
+    panda_tb_in_scope = panda_tb_instrumented(tb);
     gen_intermediate_code_pc(env, tb);
 
     if (use_icount) {
@@ -179,7 +182,12 @@ int cpu_restore_state(TranslationBlock *tb,
     }
 
 #if defined(CONFIG_LLVM)
-    if(execute_llvm) {
+    // PANDA: with -llvm-tiered, the block may have run on TCG, and with
+    // -llvm-trace it may be running as part of a trace
+    if(execute_llvm && panda_tb_in_scope && tb->llvm_tc_ptr &&
+            ((searched_pc >= (uintptr_t) tb->llvm_tc_ptr &&
+              searched_pc < (uintptr_t) tb->llvm_tc_end) ||
+             tcg_llvm_trace_find_pc(searched_pc) == tb)) {
         assert(tb->llvm_function != NULL);
         j = tcg_llvm_search_last_pc(tb, searched_pc);
     } else {
@@ -187,8 +195,10 @@ int cpu_restore_state(TranslationBlock *tb,
 
     /* find opc index corresponding to search_pc */
     tc_ptr = (unsigned long)tb->tc_ptr;
-    if (searched_pc < tc_ptr)
+    if (searched_pc < tc_ptr) {
+        panda_tb_in_scope = true;
         return -1;
+    }
 
     s->tb_next_offset = tb->tb_next_offset;
 #ifdef USE_DIRECT_JUMP
@@ -203,6 +213,7 @@ int cpu_restore_state(TranslationBlock *tb,
 #ifdef CONFIG_LLVM
     }
 #endif
+    panda_tb_in_scope = true;
     if (j < 0)
         return -1;
     /* now find start of instruction before */
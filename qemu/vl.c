@@ -194,6 +194,9 @@ extern struct TCGLLVMContext* tcg_llvm_ctx;
 extern int generate_llvm;
 extern int execute_llvm;
 extern const int has_llvm_engine;
+extern const char *tcg_llvm_cache_dir;
+extern unsigned tcg_llvm_tiered_threshold;
+extern unsigned tcg_llvm_trace_threshold;
 
 
 struct TCGLLVMContext* tcg_llvm_initialize(void);
@@ -1581,6 +1584,14 @@ static void main_loop(void)
             sigprocmask(SIG_SETMASK, &oldset, NULL);
         }
 
+        //mz replay stopped at a checkpoint boundary; save one before it goes on
+        if (rr_checkpoint_requested && rr_in_replay()) {
+            sigprocmask(SIG_BLOCK, &blockset, &oldset);
+            rr_do_checkpoint();
+            rr_checkpoint_requested = 0;
+            sigprocmask(SIG_SETMASK, &oldset, NULL);
+        }
+
         //mz 05.2012 We have the global mutex here, so this should be OK.
         if (rr_end_record_requested && rr_in_record()) {
             rr_do_end_record();
@@ -3223,16 +3234,45 @@ int main(int argc, char **argv, char **envp)
 
                 generate_llvm = 1;
                 break;
+            case QEMU_OPTION_llvm_cache:
+                tcg_llvm_cache_dir = optarg;
+                break;
+            case QEMU_OPTION_llvm_tiered:
+                tcg_llvm_tiered_threshold = strtoul(optarg, NULL, 0);
+                break;
+            case QEMU_OPTION_llvm_trace:
+                tcg_llvm_trace_threshold = strtoul(optarg, NULL, 0);
+                break;
 #endif
             case QEMU_OPTION_record_from:
                 record_name = optarg;
 	            break;
 
+            case QEMU_OPTION_record_fsync:
+                rr_record_fsync_bytes = strtoull(optarg, NULL, 0) << 20;
+                break;
+
             case QEMU_OPTION_replay:
                 display_type = DT_NONE;
                 replay_name = optarg;
                 break;
 
+            case QEMU_OPTION_replay_checkpoint_interval:
+                rr_checkpoint_interval = strtoull(optarg, NULL, 0);
+                break;
+
+            case QEMU_OPTION_replay_from:
+                rr_replay_from = strtoull(optarg, NULL, 0);
+                break;
+
+            case QEMU_OPTION_replay_until:
+                rr_replay_until = strtoull(optarg, NULL, 0);
+                break;
+
+            case QEMU_OPTION_replay_no_chaining:
+                rr_replay_chaining = 0;
+                break;
+
             case QEMU_OPTION_pandalog:
                 pandalog = 1;
                 pandalog_open(optarg, "w");
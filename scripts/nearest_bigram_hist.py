@@ -50,6 +50,11 @@ data = []
 rows = []
 cols = []
 
+# bigrams writes a tap out more than once if it had to flush its
+# histograms partway through; give all of a tap's records the same row, and
+# coo_matrix adds them up.
+tap_rows = {}
+
 print >>sys.stderr, "Parsing file..."
 i = 0
 while True:
@@ -60,12 +65,16 @@ while True:
     if entries.size == 0: continue
     #if len(entries) < 5: continue
     #print >>sys.stderr, "Parsed entry with %d bins, file offset=%d" % (hdr['nbins'],f.tell())
+    tap = (int(hdr['caller'][0]), int(hdr['pc'][0]), int(hdr['cr3'][0]))
+    if tap in tap_rows:
+        row = tap_rows[tap]
+    else:
+        row = tap_rows[tap] = i
+        meta.append(hdr)
+        i += 1
     cols.extend(entries['key'])
-    rows.extend([i]*len(entries))
+    rows.extend([row]*len(entries))
     data.extend(entries['value'])
-    meta.append(hdr)
-
-    i += 1
 
 f.close()
 
@@ -0,0 +1,174 @@
+#!/usr/bin/env python
+
+# Replay one recording as K segments in parallel, one PANDA process per
+# segment, and merge what the plugins wrote.
+#
+# Each segment starts from a replay checkpoint (see -replay-checkpoint-interval
+# and -replay-from in docs/record_replay.md) and stops where the next one
+# begins.  If the recording has no checkpoints yet, one plain replay is run
+# first to make them.  Only plugins that don't carry state from one part of
+# the execution to the next give the same results as a single replay.
+#
+# Every segment runs in its own directory under <outdir>, so files a plugin
+# writes to the current directory don't collide.  Afterwards each file that
+# shows up in the segment directories is concatenated, in segment order, into
+# <outdir>.  The pandalog reader handles several logs back to back, so
+# concatenating pandalogs gives a valid pandalog too.
+#
+# usage: rrparallel.py [options] <qemu> <rr_basename> [-- <qemu args>]
+#
+#   rrparallel.py -j 8 -p "-panda stringsearch" \
+#       x86_64-softmmu/qemu-system-x86_64 foo -- -m 1024
+
+import sys, os
+import struct
+import shlex
+import shutil
+import subprocess
+import multiprocessing
+from optparse import OptionParser
+
+def num_guest_insns(base):
+    with open(base + '-rr-nondet.log', 'rb') as f:
+        # num_guest_insns is 64-bit int at offset 16
+        f.seek(16)
+        return struct.unpack("<Q", f.read(8))[0]
+
+def read_checkpoints(base):
+    # one line per checkpoint: instr pc secondary chunk_offset byte_offset
+    checkpoints = []
+    try:
+        with open(base + '-rr-checkpoints') as f:
+            for line in f:
+                fields = line.split()
+                if len(fields) == 5:
+                    checkpoints.append(int(fields[0]))
+    except EnvironmentError:
+        pass
+    return sorted(set(checkpoints))
+
+def make_checkpoints(qemu, base, qemu_args, interval, total, outdir):
+    print "Making checkpoints every %d instructions..." % interval
+    cmd = [qemu] + qemu_args + ['-replay', base,
+                                '-replay-checkpoint-interval', str(interval),
+                                '-replay-until', str(total + 1)]
+    with open(os.path.join(outdir, 'checkpoints.log'), 'w') as log:
+        subprocess.check_call(cmd, stdout=log, stderr=subprocess.STDOUT)
+
+def split(total, checkpoints, nsegs):
+    # segment boundaries: for each even split point, the last checkpoint at
+    # or before it
+    bounds = [0]
+    for i in range(1, nsegs):
+        target = total * i // nsegs
+        usable = [c for c in checkpoints if bounds[-1] < c <= target]
+        if usable:
+            bounds.append(usable[-1])
+    bounds.append(total + 1)
+    return zip(bounds[:-1], bounds[1:])
+
+def run_segments(qemu, base, qemu_args, segments, jobs, outdir):
+    pending = list(enumerate(segments))
+    running = []
+    failed = []
+    while pending or running:
+        while pending and len(running) < jobs:
+            i, (start, end) = pending.pop(0)
+            segdir = os.path.join(outdir, 'seg-%03d' % i)
+            os.makedirs(segdir)
+            cmd = [qemu] + qemu_args + ['-replay', base, '-replay-until', str(end)]
+            if start:
+                cmd += ['-replay-from', str(start)]
+            print "segment %d: instrs %d - %d" % (i, start, end)
+            log = open(os.path.join(segdir, 'replay.log'), 'w')
+            p = subprocess.Popen(cmd, cwd=segdir, stdout=log, stderr=subprocess.STDOUT)
+            running.append((i, p, log))
+        i, p, log = running.pop(0)
+        if p.wait() != 0:
+            failed.append(i)
+        log.close()
+    return failed
+
+def merge(outdir, nsegs):
+    segdirs = [os.path.join(outdir, 'seg-%03d' % i) for i in range(nsegs)]
+    names = set()
+    for segdir in segdirs:
+        for root, dirs, files in os.walk(segdir):
+            for name in files:
+                names.add(os.path.relpath(os.path.join(root, name), segdir))
+    names.discard('replay.log')
+    for name in sorted(names):
+        outfname = os.path.join(outdir, name)
+        if not os.path.isdir(os.path.dirname(outfname)):
+            os.makedirs(os.path.dirname(outfname))
+        with open(outfname, 'wb') as out:
+            for segdir in segdirs:
+                path = os.path.join(segdir, name)
+                if os.path.exists(path):
+                    with open(path, 'rb') as f:
+                        shutil.copyfileobj(f, out)
+        print "merged", outfname
+
+def main():
+    parser = OptionParser(usage="%prog [options] <qemu> <rr_basename> [-- <qemu args>]")
+    parser.add_option("-j", "--jobs", type="int", default=multiprocessing.cpu_count(),
+                      help="number of segments to run at once [%default]")
+    parser.add_option("-n", "--segments", type="int", default=0,
+                      help="number of segments [same as --jobs]")
+    parser.add_option("-p", "--panda-args", default="",
+                      help="extra qemu args for the segments only, e.g. \"-panda taint2\"")
+    parser.add_option("-l", "--pandalog", default=None,
+                      help="have each segment write a pandalog and merge them into this file")
+    parser.add_option("-o", "--outdir", default=None,
+                      help="where segments run and merged output goes [<rr_basename>-parallel]")
+    parser.add_option("-c", "--checkpoint-interval", type="int", default=0,
+                      help="(re)make checkpoints this many instructions apart first")
+    opts, args = parser.parse_args()
+    if len(args) < 2:
+        parser.print_help()
+        sys.exit(1)
+
+    qemu = os.path.abspath(args[0])
+    base = os.path.abspath(args[1])
+    qemu_args = args[2:]
+    nsegs = opts.segments or opts.jobs
+    outdir = os.path.abspath(opts.outdir or base + '-parallel')
+
+    if os.path.exists(outdir):
+        print >>sys.stderr, "%s already exists; will not overwrite. Aborting." % outdir
+        sys.exit(1)
+    os.makedirs(outdir)
+
+    try:
+        total = num_guest_insns(base)
+    except EnvironmentError:
+        print >>sys.stderr, "Failed to open", base + '-rr-nondet.log. Aborting.'
+        sys.exit(1)
+
+    checkpoints = read_checkpoints(base)
+    if opts.checkpoint_interval or not checkpoints:
+        # a few checkpoints per segment leaves room to even out the split
+        interval = opts.checkpoint_interval or max(total // (4 * nsegs), 1)
+        make_checkpoints(qemu, base, qemu_args, interval, total, outdir)
+        checkpoints = read_checkpoints(base)
+
+    segments = split(total, checkpoints, nsegs)
+    if len(segments) < nsegs:
+        print "Only enough checkpoints for %d segments." % len(segments)
+
+    seg_args = qemu_args + shlex.split(opts.panda_args)
+    if opts.pandalog:
+        seg_args += ['-pandalog', os.path.basename(opts.pandalog)]
+    failed = run_segments(qemu, base, seg_args, segments, opts.jobs, outdir)
+    if failed:
+        print >>sys.stderr, "segments %s failed; see replay.log in their directories." % \
+            ", ".join(str(i) for i in failed)
+        sys.exit(1)
+
+    merge(outdir, len(segments))
+    if opts.pandalog:
+        shutil.move(os.path.join(outdir, os.path.basename(opts.pandalog)), opts.pandalog)
+        print "pandalog in", opts.pandalog
+
+if __name__ == "__main__":
+    main()